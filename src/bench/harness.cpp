@@ -0,0 +1,171 @@
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "harness.hpp"
+
+// operator new runs on every thread of the process, the logger and metrics
+// threads of the server code included.
+std::atomic<uint64_t> allocation_count(0);
+
+static bool json = false;
+static int64_t target = 200 * 1000 * 1000;
+static std::vector<std::string> filters;
+static bool header_printed = false;
+static int failures = 0;
+
+void *operator new(size_t size) {
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    void *p = malloc(size ? size : 1);
+    if (p == nullptr) {
+        abort();
+    }
+    return p;
+}
+
+void *operator new[](size_t size) {
+    return operator new(size);
+}
+
+void *operator new(size_t size, std::align_val_t alignment) {
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    size_t align = (size_t) alignment;
+    void *p = aligned_alloc(align, (size + align - 1) / align * align);
+    if (p == nullptr) {
+        abort();
+    }
+    return p;
+}
+
+void *operator new[](size_t size, std::align_val_t alignment) {
+    return operator new(size, alignment);
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+void operator delete[](void *p) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, std::align_val_t) noexcept {
+    free(p);
+}
+
+void operator delete[](void *p, std::align_val_t) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, size_t, std::align_val_t) noexcept {
+    free(p);
+}
+
+void operator delete[](void *p, size_t, std::align_val_t) noexcept {
+    free(p);
+}
+
+int64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+bool configure(int argc, char *argv[]) {
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--json")) {
+            json = true;
+        } else if (!strncmp(argv[i], "--time=", 7)) {
+            long milliseconds = atol(argv[i] + 7);
+            if (milliseconds <= 0) {
+                return false;
+            }
+            target = (int64_t) milliseconds * 1000 * 1000;
+        } else if (argv[i][0] == '-') {
+            return false;
+        } else {
+            filters.push_back(argv[i]);
+        }
+    }
+    return true;
+}
+
+bool selected(const char *name) {
+    if (filters.empty()) {
+        return true;
+    }
+    for (const std::string &filter : filters) {
+        if (strstr(name, filter.c_str()) != nullptr) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int64_t round_time() {
+    return target;
+}
+
+void report(const measurement &m) {
+    double throughput =
+        m.nanoseconds > 0 ? m.bytes / m.nanoseconds * 1e9 / (1 << 20) : 0;
+    if (json) {
+        printf(
+            "{\"name\":\"%s\",\"iterations\":%llu,\"ns_per_op\":%.2f,"
+            "\"allocs_per_op\":%.2f,\"bytes_per_op\":%.1f,"
+            "\"mib_per_s\":%.1f}\n",
+            m.name.c_str(),
+            (unsigned long long) m.iterations,
+            m.nanoseconds,
+            m.allocations,
+            m.bytes,
+            throughput
+        );
+    } else {
+        if (!header_printed) {
+            printf(
+                "%-28s %12s %10s %10s %12s\n",
+                "benchmark",
+                "ns/op",
+                "allocs/op",
+                "MiB/s",
+                "iterations"
+            );
+            header_printed = true;
+        }
+        printf(
+            "%-28s %12.2f %10.2f %10.1f %12llu\n",
+            m.name.c_str(),
+            m.nanoseconds,
+            m.allocations,
+            throughput,
+            (unsigned long long) m.iterations
+        );
+    }
+    fflush(stdout);
+}
+
+void report_failure(const char *name, const std::string &detail) {
+    ++failures;
+    if (json) {
+        printf("{\"name\":\"%s\",\"error\":\"check failed\"}\n", name);
+    }
+    fprintf(stderr, "Error: %s: %s\n", name, detail.c_str());
+}
+
+int finish() {
+    return failures ? 1 : 0;
+}
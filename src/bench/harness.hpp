@@ -0,0 +1,74 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+extern std::atomic<uint64_t> allocation_count;
+
+struct measurement {
+    std::string name;
+    uint64_t iterations;
+    double nanoseconds;
+    double allocations;
+    double bytes;
+};
+
+template <typename T>
+inline void keep(const T &value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+int64_t now_ns();
+bool configure(int argc, char *argv[]);
+bool selected(const char *name);
+int64_t round_time();
+void report(const measurement &m);
+void report_failure(const char *name, const std::string &detail);
+int finish();
+
+// Runs body(i) for i = 0, 1, ... often enough to fill round_time(), keeps
+// the fastest of several rounds and reports it. bytes is the amount of
+// input (or output) one call handles and only feeds the throughput column.
+template <typename F>
+void run(const char *name, double bytes, F body) {
+    if (!selected(name)) {
+        return;
+    }
+    constexpr int ROUNDS = 5;
+    uint64_t iterations = 1;
+    for (;;) {
+        int64_t start = now_ns();
+        for (uint64_t i = 0; i != iterations; ++i) {
+            body(i);
+        }
+        int64_t elapsed = now_ns() - start;
+        if (elapsed >= round_time() / 4 || iterations >= (1ull << 40)) {
+            if (elapsed < round_time() && elapsed > 0) {
+                iterations = iterations * round_time() / elapsed;
+            }
+            break;
+        }
+        iterations *= 2;
+    }
+    if (iterations == 0) {
+        iterations = 1;
+    }
+    measurement best = {name, iterations, 0, 0, bytes};
+    for (int round = 0; round != ROUNDS; ++round) {
+        uint64_t allocated = allocation_count;
+        int64_t start = now_ns();
+        for (uint64_t i = 0; i != iterations; ++i) {
+            body(i);
+        }
+        int64_t elapsed = now_ns() - start;
+        double nanoseconds = (double) elapsed / iterations;
+        if (round == 0 || nanoseconds < best.nanoseconds) {
+            best.nanoseconds = nanoseconds;
+            best.allocations =
+                (double) (allocation_count - allocated) / iterations;
+        }
+    }
+    report(best);
+}
@@ -0,0 +1,1012 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+extern "C" {
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+}
+
+#include "common.hpp"
+#include "simd.hpp"
+#include "arena.hpp"
+#include "url_encoder.hpp"
+#include "query_parser.hpp"
+#include "request_body.hpp"
+#include "answer_generator.hpp"
+#include "cgi.hpp"
+#include "config_reader.hpp"
+#include "deflate.hpp"
+#include "frame_codec.hpp"
+#include "hpack.hpp"
+#include "timer_wheel.hpp"
+#include "logger.hpp"
+#include "uring.hpp"
+#include "worker.hpp"
+#include "harness.hpp"
+
+// Request targets as they arrive on the wire, taken from typical traffic:
+// plain static files, percent-encoded names and query strings.
+static const std::vector<std::string> encoded_paths = {
+    "index.html",
+    "static/js/app.3f9a1c.min.js",
+    "images/photo%20of%20me.jpg",
+    "docs/%D0%BE%D1%82%D1%87%D1%91%D1%82%202023.pdf",
+    "video/Big%20Buck%20Bunny%20%281080p%29.mkv",
+    "a%2Fb%3Fc%3Dd%26e",
+    "music/Artist%20-%20Album/01%20-%20Track.mp3",
+    "search",
+    "dir/sub/x.txt",
+    "%7Euser/public_html/%5Bdraft%5D%20notes.txt"
+};
+
+static const std::vector<std::string> file_names = {
+    "index.html",
+    "static/css/site.css",
+    "images/photo of me.jpg",
+    "docs/отчёт 2023.pdf",
+    "video/Big Buck Bunny (1080p).mkv",
+    "music/Artist - Album/01 - Track.mp3",
+    "archive.tar.gz",
+    "README",
+    "data/report-2023-10-01.json",
+    "fonts/inter-var.woff2"
+};
+
+static const std::vector<std::string> requests = {
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: example.org\r\n"
+    "Connection: keep-alive\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+    "(KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+    "image/avif,image/webp,*/*;q=0.8\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9,ru;q=0.8\r\n"
+    "Cookie: session=6f1c2b8e9a; theme=dark\r\n"
+    "\r\n",
+    "GET /static/js/app.3f9a1c.min.js HTTP/1.1\r\n"
+    "Host: example.org\r\n"
+    "User-Agent: curl/7.88.1\r\n"
+    "Accept: */*\r\n"
+    "\r\n",
+    "GET /images/photo%20of%20me.jpg HTTP/1.1\r\n"
+    "Host: example.org\r\n"
+    "Accept: image/avif,image/webp,*/*\r\n"
+    "If-None-Match: \"652e9f1a0c3d2-1f4a\"\r\n"
+    "If-Modified-Since: Tue, 17 Oct 2023 12:00:00 GMT\r\n"
+    "Referer: http://example.org/index.html\r\n"
+    "\r\n",
+    "GET /cgi-bin/search?q=http+server&page=2 HTTP/1.0\r\n"
+    "Host: example.org\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n"
+};
+
+static const std::vector<std::string> fields = {
+    "Host: example.org",
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36",
+    "Accept-Encoding: gzip, deflate, br",
+    "If-None-Match: \"652e9f1a0c3d2-1f4a\""
+};
+
+static const std::vector<std::string> cgi_headers = {
+    "Content-Type: text/html; charset=utf-8",
+    "Status: 201 Created\r\n"
+    "Content-Type: application/json\r\n"
+    "X-Request-Id: 4f2a9c\r\n"
+    "Cache-Control: no-store",
+    "Location: /login?next=%2Faccount"
+};
+
+static double average_size(const std::vector<std::string> &corpus) {
+    double total = 0;
+    for (const std::string &s : corpus) {
+        total += s.size();
+    }
+    return total / corpus.size();
+}
+
+static void check_url_codec() {
+    for (size_t i = 0; i != file_names.size(); ++i) {
+        std::string encoded = url_encode(file_names[i]), decoded;
+        if (!url_decode(encoded, decoded) || decoded != file_names[i]) {
+            report_failure("url_encode", "round trip of " + file_names[i]);
+        }
+    }
+    static const struct {
+        const char *encoded;
+        const char *decoded;
+    } cases[] = {
+        {"a%20b", "a b"},
+        {"%e2%82%ac", "\xe2\x82\xac"},
+        {"%C3%a9", "\xc3\xa9"},
+        {"100%", nullptr},
+        {"%4", nullptr},
+        {"%zz", nullptr},
+        {"%%41", nullptr}
+    };
+    for (const auto &c : cases) {
+        std::string decoded;
+        bool valid = url_decode(c.encoded, decoded);
+        if (valid != (c.decoded != nullptr) ||
+            (valid && decoded != c.decoded)) {
+            report_failure("url_decode", c.encoded);
+        }
+    }
+}
+
+// Random inputs mixing plain text, whitespace, valid and broken escapes and
+// raw high bytes, at lengths that cross the vector block boundaries.
+static std::string random_text(std::mt19937 &random) {
+    static const char alphabet[] =
+        "aZ09-_.~/ \t\r\n%%%+?&=#\x01\x7f\x80\xd0\xff" "FfGg";
+    std::string s(random() % 100, ' ');
+    for (char &c : s) {
+        c = alphabet[random() % (sizeof(alphabet) - 1)];
+    }
+    for (size_t i = random() % 4; i < s.size(); i += 1 + random() % 8) {
+        if (random() % 2) {
+            s.replace(i, 1, url_encode(std::string(1, (char) random())));
+        }
+    }
+    return s;
+}
+
+static void check_kernels() {
+    const text_kernels &reference = kernels(ISA::SCALAR);
+    std::mt19937 random(1);
+    for (ISA isa : {ISA::SSE2, ISA::AVX2}) {
+        if (!isa_supported(isa)) {
+            continue;
+        }
+        const text_kernels &tested = kernels(isa);
+        for (int round = 0; round != 100000; ++round) {
+            std::string s = random_text(random);
+            std::string a(3 * s.size() + 1, '\0'), b = a;
+            bool same =
+                reference.decode(s.data(), s.size(), &a[0]) ==
+                    tested.decode(s.data(), s.size(), &b[0]) &&
+                reference.encode(s.data(), s.size(), &a[0]) ==
+                    tested.encode(s.data(), s.size(), &b[0]) && a == b &&
+                reference.span_space(s.data(), s.size()) ==
+                    tested.span_space(s.data(), s.size()) &&
+                reference.span_word(s.data(), s.size()) ==
+                    tested.span_word(s.data(), s.size());
+            if (!same) {
+                report_failure(isa_name(isa), "differs from scalar on " + s);
+                break;
+            }
+        }
+    }
+}
+
+static void check_responses() {
+    static const struct {
+        const char *name;
+        const char *type;
+    } types[] = {
+        {"index.html", "text/html"},
+        {"a.b/c.cpp", "text/x-c++src"},
+        {"notes.md", "text/x-markdown"},
+        {"archive.tar.gz", "application/octet-stream"},
+        {"Makefile", "application/octet-stream"},
+        {"x.", "application/octet-stream"},
+        {"", "application/octet-stream"}
+    };
+    for (const auto &t : types) {
+        if (determine_mime(t.name) != t.type) {
+            report_failure("determine_mime", t.name);
+        }
+    }
+    response error = generate_error(404, "", false);
+    if (error.data.compare(0, 23, "HTTP/1.1 404 Not Found\n") ||
+        error.body.find("<h1>Not Found</h1>") == std::string_view::npos ||
+        error.data.find("Content-Length: " +
+            std::to_string(error.body.size()) + "\n") == std::string::npos) {
+        report_failure("generate_error", "404 page");
+    }
+}
+
+// Text like what is served compressed: the request corpus over and over.
+static std::string sample_text(size_t size) {
+    std::string text;
+    for (size_t i = 0; text.size() < size; ++i) {
+        text += requests[i % requests.size()];
+    }
+    text.resize(size);
+    return text;
+}
+
+static void check_encoding() {
+    static const struct {
+        const char *accept;
+        bool gzip;
+    } offers[] = {
+        {"gzip", true},
+        {"deflate, gzip;q=1.0, br", true},
+        {"GZIP ; q=0.5", true},
+        {"x-gzip", true},
+        {"*", true},
+        {"br, *;q=0.1", true},
+        {"gzip;q=0", false},
+        {"gzip; q=0.000, *", false},
+        {"identity", false},
+        {"br, *;q=0", false},
+        {"", false}
+    };
+    request_parser parser(4096, 8192);
+    for (const auto &o : offers) {
+        parser.reset();
+        std::string head = std::string("GET / HTTP/1.1\r\nAccept-Encoding: ") +
+            o.accept + "\r\n\r\n";
+        if (parser.feed(head) != PARSE::DONE ||
+            parser.result().accepts_gzip() != o.gzip) {
+            report_failure("accepts_gzip", o.accept);
+        }
+    }
+    if (encoded_type("app.js.gz") != "application/javascript" ||
+        encoded_type("image.png.gz") != "" || encoded_type(".gz") != "" ||
+        !compressible("image/svg+xml") || compressible("image/png")) {
+        report_failure("encoded_type", "compressible types");
+    }
+    // A stream that decodes is checked by hand against gzip; here only its
+    // frame and that text gets smaller.
+    std::string text = sample_text(100000);
+    std::string packed = compress_gzip(text);
+    uint32_t size = 0;
+    for (int i = 0; i != 4; ++i) {
+        size |= (uint32_t) (uint8_t) packed[packed.size() - 4 + i] << 8 * i;
+    }
+    if (packed.compare(0, 3, "\x1f\x8b\x08") || size != text.size() ||
+        packed.size() * 4 > text.size()) {
+        report_failure("compress_gzip", "frame or ratio");
+    }
+}
+
+// The first request of RFC 7541 (C.4.1), Huffman codes for every byte, and
+// header sets that go through the encoder and back while the dynamic table
+// fills and evicts.
+static void check_hpack() {
+    static const unsigned char example[] = {
+        0x82, 0x86, 0x84, 0x41, 0x8c, 0xf1, 0xe3, 0xc2, 0xe5, 0xf2, 0x3a,
+        0x6b, 0xa0, 0xab, 0x90, 0xf4, 0xff
+    };
+    hpack_decoder decoder(4096);
+    std::string storage;
+    std::vector<header_pair> fields;
+    if (decoder.decode(
+            std::string_view((const char *) example, sizeof(example)),
+            8192,
+            storage,
+            fields
+        ) != HPACK::DONE || fields.size() != 4 ||
+        fields[3].value != "www.example.com") {
+        report_failure("hpack", "RFC 7541 C.4.1");
+    }
+    std::string all, code, back;
+    for (int c = 0; c != 256; ++c) {
+        all += (char) c;
+        code.clear();
+        back.clear();
+        huffman_encode(code, all);
+        if (code.size() != huffman_size(all) ||
+            !huffman_decode(back, code) || back != all) {
+            report_failure("huffman", "byte " + std::to_string(c));
+            break;
+        }
+    }
+    std::mt19937 random(7);
+    hpack_encoder encoder;
+    encoder.limit(256);
+    std::string block;
+    for (int i = 0; i != 200; ++i) {
+        std::vector<std::pair<std::string, std::string>> sent = {
+            {":status", "200"},
+            {"content-type", i % 3 ? "text/html" : "image/png"},
+            {"x-request", std::to_string(random() % 50)},
+            {"etag", std::to_string(random())}
+        };
+        block.clear();
+        encoder.begin(block);
+        for (const auto &field : sent) {
+            encoder.add(block, field.first, field.second, i % 5 != 0);
+        }
+        bool same = decoder.decode(block, 8192, storage, fields) ==
+            HPACK::DONE && fields.size() == sent.size();
+        for (size_t f = 0; same && f != sent.size(); ++f) {
+            same = fields[f].name == sent[f].first &&
+                fields[f].value == sent[f].second;
+        }
+        if (!same) {
+            report_failure("hpack", "round trip " + std::to_string(i));
+            break;
+        }
+    }
+}
+
+static void check_parser() {
+    request_parser parser(4096, 8192);
+    for (const std::string &r : requests) {
+        parser.reset();
+        if (parser.feed(r) != PARSE::DONE ||
+            parser.result().length != r.size()) {
+            report_failure("request_parser", r.substr(0, r.find('\r')));
+        }
+    }
+}
+
+static int framing_of(const std::string &head, int64_t &length) {
+    request_parser parser(4096, 8192);
+    if (parser.feed(head) != PARSE::DONE) {
+        return -1;
+    }
+    return body_framing(parser.result(), length);
+}
+
+static std::string drain(int descriptor) {
+    std::string out;
+    char buffer[256];
+    ssize_t bytes;
+    while ((bytes = read(descriptor, buffer, sizeof(buffer))) > 0) {
+        out.append(buffer, bytes);
+    }
+    return out;
+}
+
+// A chunked body must come out whole however it is split into reads, and
+// the framing of a request must be refused when it is ambiguous.
+static void check_body_reader() {
+    static const std::string chunked =
+        "5;name=value\r\nhello\r\n7\r\n, world\r\n0\r\n"
+        "Trailer: 1\r\n\r\n";
+    for (size_t piece = 1; piece <= chunked.size(); ++piece) {
+        int ends[2];
+        if (pipe2(ends, O_CLOEXEC | O_NONBLOCK) == -1) {
+            report_failure("body_reader", "pipe");
+            return;
+        }
+        body_reader body;
+        body.start(-1, ends[1]);
+        std::string buffered;
+        BODY state = BODY::MORE;
+        for (size_t offset = 0;
+            state == BODY::MORE && offset < chunked.size();
+            offset += piece) {
+            buffered += chunked.substr(offset, piece);
+            size_t used;
+            state = body.feed(buffered, used);
+            buffered.erase(0, used);
+        }
+        body.stop();
+        std::string out = drain(ends[0]);
+        close(ends[0]);
+        if (state != BODY::DONE || buffered.size() || out != "hello, world") {
+            report_failure(
+                "body_reader",
+                "pieces of " + std::to_string(piece) + ": " + out
+            );
+            break;
+        }
+    }
+    body_reader body;
+    body.start(-1, -1);
+    size_t used;
+    if (body.feed("zz\r\nhello\r\n", used) != BODY::FAILED) {
+        report_failure("body_reader", "bad chunk size");
+    }
+    static const struct {
+        const char *head;
+        int status;
+        int64_t length;
+    } framings[] = {
+        {"POST / HTTP/1.1\r\nContent-Length: 42\r\n\r\n", 0, 42},
+        {"POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n", 0, -1},
+        {"GET / HTTP/1.1\r\n\r\n", 0, 0},
+        {"POST / HTTP/1.1\r\nContent-Length: -1\r\n\r\n", 400, 0},
+        {"POST / HTTP/1.1\r\nContent-Length: 1\r\n"
+            "Content-Length: 2\r\n\r\n", 400, 0},
+        {"POST / HTTP/1.1\r\nContent-Length: 1\r\n"
+            "Transfer-Encoding: chunked\r\n\r\n", 400, 0},
+        {"POST / HTTP/1.1\r\nTransfer-Encoding: gzip\r\n\r\n", 501, 0},
+        {"POST / HTTP/1.1\r\nContent-Length: 99999999999\r\n\r\n", 413, 0}
+    };
+    for (const auto &framing : framings) {
+        int64_t length;
+        int status = framing_of(framing.head, length);
+        if (status != framing.status ||
+            (status == 0 && length != framing.length)) {
+            report_failure("body_framing", framing.head);
+        }
+    }
+}
+
+struct bench_timer : timer {
+    void expired() override {
+        fired = now;
+    }
+
+    int64_t deadline = 0;
+    int64_t fired = -1;
+    static int64_t now;
+};
+
+int64_t bench_timer::now = 0;
+
+// Deadlines spread over all levels of the wheel, some cancelled or moved
+// on the way, must fire at the first advance() at or after them, rounded
+// up to the resolution.
+static void check_timer_wheel() {
+    std::mt19937 random(1);
+    int64_t start = 1000003;
+    timer_wheel wheel(start);
+    std::vector<bench_timer> timers(20000);
+    for (size_t i = 0; i != timers.size(); ++i) {
+        int64_t span = int64_t(1) << (random() % 27);
+        timers[i].deadline = start + random() % span;
+        wheel.arm(timers[i], timers[i].deadline);
+    }
+    for (size_t i = 0; i < timers.size(); i += 7) {
+        timers[i].cancel();
+        timers[i].deadline = -1;
+    }
+    for (size_t i = 3; i < timers.size(); i += 7) {
+        timers[i].deadline += random() % 5000;
+        wheel.arm(timers[i], timers[i].deadline);
+    }
+    for (int64_t now = start; now < start + (1 << 27); now += 1 + now % 97) {
+        bench_timer::now = now;
+        wheel.advance(now);
+    }
+    for (const bench_timer &t : timers) {
+        int64_t due = (t.deadline + timer_wheel::RESOLUTION - 1) /
+            timer_wheel::RESOLUTION * timer_wheel::RESOLUTION;
+        bool right = t.deadline == -1 ?
+            t.fired == -1 :
+            t.fired >= t.deadline && t.fired < due + 98;
+        if (!right) {
+            report_failure(
+                "timer_wheel",
+                "deadline " + std::to_string(t.deadline) + " fired at " +
+                    std::to_string(t.fired)
+            );
+            break;
+        }
+    }
+    if (wheel.timeout(start) != -1) {
+        report_failure("timer_wheel", "timers left after all fired");
+    }
+}
+
+// Requests of one shape, with a temporary larger than a block, must be
+// served from the blocks the arena kept after the first of them.
+static void check_arena() {
+    arena memory;
+    const size_t sizes[] = {100, 3000, 20000, 500};
+    for (int round = 0; round != 2; ++round) {
+        for (size_t size : sizes) {
+            keep(memory.allocate(size, 8));
+        }
+        memory.reset();
+    }
+    uint64_t allocated = allocation_count;
+    for (int round = 0; round != 64; ++round) {
+        for (size_t size : sizes) {
+            char *p = (char *) memory.allocate(size, 8);
+            p[size - 1] = 0;
+        }
+        memory.reset();
+    }
+    if (allocation_count != allocated) {
+        report_failure(
+            "arena",
+            std::to_string(allocation_count - allocated) +
+                " allocations in 64 rounds"
+        );
+    }
+}
+
+// A worker serving one keep-alive connection whose other end is held by
+// the benchmark, so the whole path from read() to write() is measured:
+// parsing, lookup, the response and its transmission.
+class request_cycle {
+public:
+    explicit request_cycle(ENGINE engine) :
+        served(nullptr),
+        client(-1),
+        total(0),
+        ring(engine == ENGINE::URING) {
+        char pattern[] = "/tmp/" PROJECT_NAME "_bench_XXXXXX";
+        if (mkdtemp(pattern) == nullptr ||
+            getcwd(previous, sizeof(previous)) == nullptr ||
+            chdir(pattern) == -1) {
+            report_failure("request_cycle", "cannot create directory");
+            return;
+        }
+        directory = pattern;
+        write_file("small.html", 2048);
+        write_file("large.bin", settings.cache_file_size * 4);
+        // Directories are only cached once they have not changed for a
+        // while, so this one is made to look old.
+        time_t settled = time(nullptr) - 60;
+        struct timespec times[2] = {{settled, 0}, {settled, 0}};
+        utimensat(AT_FDCWD, ".", times, 0);
+        open_access_log("/dev/null");
+        settings.keepalive_requests = ~0u;
+        struct sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        int listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        int pair[2];
+        if (listener == -1 ||
+            bind(listener, (struct sockaddr *) &address, sizeof(address)) ||
+            listen(listener, 1) ||
+            socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, pair)) {
+            report_failure("request_cycle", "cannot create sockets");
+            return;
+        }
+        ENGINE configured = settings.engine;
+        settings.engine = engine;
+        served = new worker(listener);
+        settings.engine = configured;
+        served->adopt(pair[0], address);
+        client = pair[1];
+        peer = address;
+    }
+
+    ~request_cycle() {
+        delete served;
+        if (client != -1) {
+            close(client);
+        }
+        if (!directory.empty()) {
+            unlink("small.html");
+            unlink("large.bin");
+            if (chdir(previous) == 0) {
+                rmdir(directory.c_str());
+            }
+        }
+    }
+
+    bool ready() const {
+        return served != nullptr;
+    }
+
+    bool on_ring() const {
+        return ring;
+    }
+
+    // Replaces the connection with a new one, for a client that starts
+    // over; the worker closes the old one once it sees the end of it.
+    bool reconnect() {
+        int pair[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, pair)) {
+            return false;
+        }
+        close(client);
+        served->adopt(pair[0], peer);
+        client = pair[1];
+        return true;
+    }
+
+    // The length of the last response.
+    size_t received() const {
+        return total;
+    }
+
+    // Sends the request and returns the response once expected bytes of it
+    // have arrived; only the first kilobyte is kept. With expected = 0 the
+    // length is taken from the Content-Length of the response.
+    std::string_view exchange(const std::string &request, size_t expected) {
+        if (write(client, request.data(), request.size()) !=
+            (ssize_t) request.size()) {
+            return {};
+        }
+        size_t received = 0;
+        for (int idle = 0; idle != 100;) {
+            served->loop().run_once(0);
+            char *into = received < sizeof(head) ? head + received : sink;
+            size_t room = received < sizeof(head) ?
+                sizeof(head) - received : sizeof(sink);
+            ssize_t bytes = read(client, into, room);
+            if (bytes <= 0) {
+                ++idle;
+                continue;
+            }
+            idle = 0;
+            received += bytes;
+            if (expected == 0) {
+                expected = announced(received);
+            }
+            if (expected != 0 && received >= expected) {
+                break;
+            }
+        }
+        total = received;
+        return std::string_view(head, std::min(received, sizeof(head)));
+    }
+
+private:
+    void write_file(const char *name, size_t size) {
+        std::string content(size, 'x');
+        int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1 || write(fd, content.data(), size) != (ssize_t) size) {
+            report_failure("request_cycle", name);
+        }
+        close(fd);
+    }
+
+    size_t announced(size_t received) const {
+        std::string_view text(head, std::min(received, sizeof(head)));
+        size_t end = text.find("\n\n");
+        size_t field = text.find("Content-Length: ");
+        if (end == std::string_view::npos || field == std::string_view::npos) {
+            return 0;
+        }
+        return end + 2 + strtoull(head + field + 16, nullptr, 10);
+    }
+
+    worker *served;
+    int client;
+    struct sockaddr_in peer;
+    size_t total;
+    bool ring;
+    std::string directory;
+    char previous[PATH_MAX];
+    char head[1024];
+    char sink[65536];
+};
+
+// ring_name is the same over the io_uring loop; the answer has to contain
+// marker.
+static const struct {
+    const char *name;
+    const char *ring_name;
+    const char *target;
+    const char *fields;
+    const char *status;
+    const char *marker;
+} cycles[] = {
+    {"request/cached", "uring/cached", "/small.html", "", "200", ""},
+    {"request/missing", "uring/missing", "/none.html", "", "404", ""},
+    {"request/uncached", "uring/uncached", "/large.bin", "", "200", ""},
+    {"request/listing", "uring/listing", "/", "", "200", ""},
+    {
+        "request/range",
+        "uring/range",
+        "/large.bin",
+        "Range: bytes=4096-69631\r\n",
+        "206",
+        "Content-Range: bytes 4096-69631/"
+    },
+    {
+        "request/gzip",
+        "uring/gzip",
+        "/small.html",
+        "Accept-Encoding: gzip, br\r\n",
+        "200",
+        "Content-Encoding: gzip"
+    }
+};
+
+static std::string cycle_request(const char *target, const char *fields) {
+    return std::string("GET ") + target + " HTTP/1.1\r\nHost: b\r\n" +
+        fields + "\r\n";
+}
+
+// Once a connection has served a request, the next one like it must not
+// touch the heap: responses reuse their buffers and everything else lives
+// in the connection's arena.
+static void check_request_cycle(request_cycle &cycle) {
+    for (const auto &c : cycles) {
+        const char *name = cycle.on_ring() ? c.ring_name : c.name;
+        std::string request = cycle_request(c.target, c.fields);
+        std::string_view answer = cycle.exchange(request, 0);
+        if (answer.compare(0, 12, std::string("HTTP/1.1 ") + c.status) ||
+            answer.find(c.marker) == std::string_view::npos) {
+            report_failure(name, "unexpected answer");
+            continue;
+        }
+        for (int i = 0; i != 16; ++i) {
+            cycle.exchange(request, 0);
+        }
+        uint64_t allocated = allocation_count;
+        for (int i = 0; i != 64; ++i) {
+            cycle.exchange(request, 0);
+        }
+        if (allocation_count != allocated) {
+            report_failure(
+                name,
+                std::to_string(allocation_count - allocated) +
+                    " allocations in 64 requests"
+            );
+        }
+    }
+}
+
+// Requests of HTTP/2 by prior knowledge on a new connection of the cycle.
+// Each is a HEADERS frame of the next stream, encoded without indexing so
+// that only the stream changes, and a WINDOW_UPDATE that gives back to
+// the connection what the response takes from it.
+class http2_cycle {
+public:
+    http2_cycle() :
+        stream(1) {
+        hpack_encoder encoder;
+        std::string block;
+        encoder.add(block, ":method", "GET", false);
+        encoder.add(block, ":scheme", "http", false);
+        encoder.add(block, ":path", "/small.html", false);
+        encoder.add(block, ":authority", "b", false);
+        append_frame_header(
+            message,
+            block.size(),
+            FRAME::HEADERS,
+            FLAG_END_STREAM | FLAG_END_HEADERS,
+            stream
+        );
+        message += block;
+        append_window_update(message, 0, 2048);
+    }
+
+    // Starts the connection; false if the server does not answer the
+    // preface with its settings and an ACK of those sent.
+    bool start(request_cycle &cycle) {
+        if (!cycle.reconnect()) {
+            return false;
+        }
+        std::string preface(CONNECTION_PREFACE);
+        append_frame_header(preface, 6, FRAME::SETTINGS, 0, 0);
+        append_setting(preface, SETTING::INITIAL_WINDOW_SIZE, MAX_WINDOW);
+        // Room for the increments that come before the responses.
+        append_window_update(preface, 0, (1 << 30) - DEFAULT_WINDOW);
+        std::string_view answer = cycle.exchange(preface, 30);
+        return cycle.received() == 30 &&
+            read_frame_header(answer.data()).type == FRAME::SETTINGS &&
+            read_frame_header(answer.data() + 21).flags == FLAG_ACK;
+    }
+
+    const std::string &next() {
+        message[5] = (char) (stream >> 24);
+        message[6] = (char) (stream >> 16);
+        message[7] = (char) (stream >> 8);
+        message[8] = (char) stream;
+        stream += 2;
+        return message;
+    }
+
+private:
+    std::string message;
+    uint32_t stream;
+};
+
+// The same for streams of HTTP/2: the session recycles them, and the
+// response to each starts with HEADERS carrying :status 200 from the
+// static table.
+static void check_http2_cycle(request_cycle &cycle) {
+    const char *name = cycle.on_ring() ? "uring/h2c" : "request/h2c";
+    http2_cycle streams;
+    if (!streams.start(cycle)) {
+        report_failure(name, "no settings");
+        return;
+    }
+    std::string_view answer = cycle.exchange(streams.next(), 0);
+    if (answer.size() < 10 ||
+        read_frame_header(answer.data()).type != FRAME::HEADERS ||
+        read_frame_header(answer.data()).stream != 1 ||
+        (uint8_t) answer[9] != 0x88) {
+        report_failure(name, "unexpected answer");
+    }
+    for (int i = 0; i != 16; ++i) {
+        cycle.exchange(streams.next(), 0);
+    }
+    size_t length = cycle.received();
+    uint64_t allocated = allocation_count;
+    for (int i = 0; i != 64; ++i) {
+        cycle.exchange(streams.next(), length);
+    }
+    if (allocation_count != allocated) {
+        report_failure(
+            name,
+            std::to_string(allocation_count - allocated) +
+                " allocations in 64 streams"
+        );
+    }
+    if (!cycle.reconnect()) {
+        report_failure(name, "cannot reconnect");
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (!configure(argc, argv)) {
+        fprintf(
+            stderr,
+            "Error: usage: " PROJECT_NAME "_bench [--json] [--time=ms] "
+            "[name...]\n"
+        );
+        return 1;
+    }
+    check_url_codec();
+    check_kernels();
+    check_responses();
+    check_encoding();
+    check_hpack();
+    check_parser();
+    check_body_reader();
+    check_timer_wheel();
+    check_arena();
+    request_cycle cycle(ENGINE::EPOLL);
+    if (cycle.ready()) {
+        check_request_cycle(cycle);
+        check_http2_cycle(cycle);
+    }
+    // Made in a directory of its own, which the first one then also serves
+    // from; the files are the same.
+    std::unique_ptr<request_cycle> ring;
+    if (uring_supported()) {
+        ring.reset(new request_cycle(ENGINE::URING));
+        if (ring->ready()) {
+            check_request_cycle(*ring);
+            check_http2_cycle(*ring);
+        }
+    }
+
+    run("url_decode", average_size(encoded_paths), [](uint64_t i) {
+        std::string decoded;
+        bool valid = url_decode(encoded_paths[i % 10], decoded);
+        keep(valid);
+        keep(decoded);
+    });
+
+    run("url_encode", average_size(file_names), [](uint64_t i) {
+        std::string encoded = url_encode(file_names[i % 10]);
+        keep(encoded);
+    });
+
+    // The kernels on their own, once per instruction set, on a buffer that
+    // is reused so only the scanning is measured.
+    char output[1024];
+    for (ISA isa : {ISA::SCALAR, ISA::SSE2, ISA::AVX2}) {
+        if (!isa_supported(isa)) {
+            continue;
+        }
+        const text_kernels &k = kernels(isa);
+        std::string name = std::string("decode/") + isa_name(isa);
+        run(name.c_str(), average_size(encoded_paths), [&](uint64_t i) {
+            const std::string &s = encoded_paths[i % 10];
+            keep(k.decode(s.data(), s.size(), output));
+        });
+        name = std::string("encode/") + isa_name(isa);
+        run(name.c_str(), average_size(file_names), [&](uint64_t i) {
+            const std::string &s = file_names[i % 10];
+            keep(k.encode(s.data(), s.size(), output));
+        });
+    }
+
+    run("determine_mime", average_size(file_names), [](uint64_t i) {
+        std::string_view type = determine_mime(file_names[i % 10]);
+        keep(type);
+    });
+
+    // The method, target and headers are now parsed in one pass by the
+    // incremental parser, so it replaces the old parse_method benchmark.
+    request_parser parser(4096, 8192);
+    run("request_parser", average_size(requests), [&parser](uint64_t i) {
+        parser.reset();
+        PARSE state = parser.feed(requests[i % requests.size()]);
+        keep(state);
+        keep(parser.result().header_count);
+    });
+
+    run("parse_field", average_size(fields), [](uint64_t i) {
+        std::string name, value;
+        bool valid = parse_field(fields[i % fields.size()], name, value);
+        keep(valid);
+        keep(name);
+    });
+
+    run("parse_cgi_header", average_size(cgi_headers), [](uint64_t i) {
+        std::string status, record;
+        bool valid = parse_cgi_header(
+            cgi_headers[i % cgi_headers.size()],
+            status,
+            record
+        );
+        keep(valid);
+        keep(record);
+    });
+
+    std::string record =
+        "ETag: \"652e9f1a0c3d2-1f4a\"\n"
+        "Last-Modified: Tue, 17 Oct 2023 12:00:00 GMT\n";
+    std::string sample = header(200, record, "text/html", 8010, true);
+    run("header", sample.size(), [&record](uint64_t i) {
+        std::string head =
+            header(200, record, "text/html", 8000 + i % 64, true);
+        keep(head);
+    });
+
+    // The same header written into a buffer that is reused, as responses
+    // do with the buffers recycled from earlier ones.
+    std::string buffer;
+    run("append_header", sample.size(), [&record, &buffer](uint64_t i) {
+        buffer.clear();
+        append_header(buffer, 200, record, "text/html", 8000 + i % 64, true);
+        keep(buffer);
+    });
+
+    // Done once per file and then kept, so only the ratio matters much.
+    std::string text = sample_text(64 << 10);
+    run("compress_gzip", text.size(), [&text](uint64_t) {
+        keep(compress_gzip(text).size());
+    });
+
+    response page = generate_error(404, "", true);
+    run("generate_error", page.buffered(), [](uint64_t i) {
+        response error = generate_error(i & 1 ? 404 : 403, "", true);
+        keep(error.data);
+    });
+
+    // Connections move their deadline on every read and write, so this is
+    // done once or twice per request for each of many armed timers.
+    std::vector<bench_timer> armed(100000);
+    timer_wheel wheel(0);
+    for (size_t i = 0; i != armed.size(); ++i) {
+        wheel.arm(armed[i], 5000 + i % 30000);
+    }
+    run("timer_wheel/arm", 0, [&armed, &wheel](uint64_t i) {
+        wheel.arm(armed[i % armed.size()], 5000 + i % 60000);
+    });
+
+    // Whole requests over the connection, measured as in check_request_cycle
+    // with the response length known in advance.
+    for (request_cycle *served : {&cycle, ring.get()}) {
+        if (served == nullptr || !served->ready()) {
+            continue;
+        }
+        for (const auto &c : cycles) {
+            const char *name = served->on_ring() ? c.ring_name : c.name;
+            if (!selected(name)) {
+                continue;
+            }
+            std::string request = cycle_request(c.target, c.fields);
+            std::string_view answer = served->exchange(request, 0);
+            size_t length = answer.size();
+            size_t end = answer.find("\n\n");
+            size_t field = answer.find("Content-Length: ");
+            if (end != std::string_view::npos &&
+                field != std::string_view::npos) {
+                length = end + 2 +
+                    strtoull(answer.data() + field + 16, nullptr, 10);
+            }
+            run(name, length, [served, &request, length](uint64_t) {
+                keep(served->exchange(request, length).size());
+            });
+        }
+        const char *name = served->on_ring() ? "uring/h2c" : "request/h2c";
+        http2_cycle streams;
+        if (!selected(name) || !streams.start(*served)) {
+            continue;
+        }
+        for (int i = 0; i != 16; ++i) {
+            served->exchange(streams.next(), 0);
+        }
+        size_t length = served->received();
+        run(name, length, [served, &streams, length](uint64_t) {
+            keep(served->exchange(streams.next(), length).size());
+        });
+    }
+
+    return finish();
+}
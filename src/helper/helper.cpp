@@ -1,18 +1,63 @@
+#include <algorithm>
+#include <cerrno>
 #include <climits>
+#include <csignal>
 #include <cstdbool>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <map>
+#include <utility>
 
+#include <fcntl.h>
+#include <grp.h>
 #include <linux/limits.h>
 #include <pwd.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
-static bool find_user_uid(const char *name, uid_t *result) {
+// The helper is started once by the server with root rights, enters the
+// chroot, drops them and then stays as a sandbox that launches scripts on
+// request. A request is one message on the control socket: the limits of
+// the script, then its name and its environment as NUL-terminated strings,
+// with three to five descriptors attached (the reply socket, the script,
+// the pipe for its output, then the one with the request body and
+// cgroup.procs of the cgroup for scripts, if the limits say they are
+// there). The reply is the pid of the started script or -1, with a pidfd
+// of the script attached when there is one.
+
+static constexpr size_t MESSAGE_SIZE = 64 * 1024;
+static constexpr size_t MAX_VARIABLES = 256;
+static constexpr size_t MAX_DESCRIPTORS = 5;
+
+// The same as in cgi.cpp of the server; a limit of 0 means none.
+struct script_limits {
+    uint64_t cpu;
+    uint64_t memory;
+    uint32_t body;
+    uint32_t cgroup;
+};
+
+struct script {
+    struct timespec mtime;
+    off_t size;
+};
+
+// Copies of the scripts inside the chroot, by the identity of the original
+// file; a copy is only made again when the original has changed.
+static std::map<std::pair<dev_t, ino_t>, script> scripts;
+
+static bool find_user(const char *name, uid_t *uid, gid_t *gid) {
     struct passwd *pwd = getpwnam(name);
     if (pwd) {
-        *result = pwd->pw_uid;
+        *uid = pwd->pw_uid;
+        *gid = pwd->pw_gid;
         return true;
     } else {
         return false;
@@ -33,21 +78,277 @@ static bool is_allowed() {
     return !strcmp(allowed_parent, parent_path);
 }
 
+static bool same_time(const struct timespec &a, const struct timespec &b) {
+    return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+// Makes sure the chroot holds the current content of the script and puts
+// the path of the copy into path.
+static bool install(int source, char *path, size_t size) {
+    struct stat info;
+    if (fstat(source, &info) == -1 || !S_ISREG(info.st_mode)) {
+        return false;
+    }
+    unsigned long long device = info.st_dev, inode = info.st_ino;
+    snprintf(path, size, "/" PROJECT_NAME "-%llx-%llx", device, inode);
+    auto key = std::make_pair(info.st_dev, info.st_ino);
+    auto found = scripts.find(key);
+    if (found != scripts.end() &&
+        same_time(found->second.mtime, info.st_mtim) &&
+        found->second.size == info.st_size) {
+        return true;
+    }
+    // Written next to the old copy and renamed over it, so scripts that
+    // are still running keep theirs.
+    char temporary[PATH_MAX];
+    snprintf(
+        temporary,
+        sizeof(temporary),
+        "/" PROJECT_NAME "-%llx-%llx.new",
+        device,
+        inode
+    );
+    int target = open(
+        temporary,
+        O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+        0500
+    );
+    if (target == -1) {
+        fprintf(stderr, "Error: open() failed: %d\n", errno);
+        return false;
+    }
+    off_t offset = 0;
+    while (offset < info.st_size) {
+        ssize_t bytes =
+            sendfile(target, source, &offset, info.st_size - offset);
+        if (bytes <= 0) {
+            if (bytes == -1 && errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Error: sendfile() failed: %d\n", errno);
+            close(target);
+            unlink(temporary);
+            return false;
+        }
+    }
+    close(target);
+    if (rename(temporary, path) == -1) {
+        fprintf(stderr, "Error: rename() failed: %d\n", errno);
+        unlink(temporary);
+        return false;
+    }
+    scripts[key] = {info.st_mtim, info.st_size};
+    return true;
+}
+
+struct script_start {
+    const char *path;
+    char **argv;
+    char **envp;
+    const script_limits *limits;
+    int input;
+    int output;
+    int cgroup;
+    int error;
+};
+
+// The child of clone, which shares the memory of the helper until execve
+// and hands back its errno if that fails. The script is confined before
+// its first instruction and is not run if it cannot join the cgroup.
+static int start_script(void *argument) {
+    script_start &start = *(script_start *) argument;
+    signal(SIGPIPE, SIG_DFL);
+    signal(SIGCHLD, SIG_DFL);
+    if (start.limits->cpu) {
+        struct rlimit limit = {
+            (rlim_t) start.limits->cpu,
+            (rlim_t) start.limits->cpu + 1
+        };
+        setrlimit(RLIMIT_CPU, &limit);
+    }
+    if (start.limits->memory) {
+        struct rlimit limit = {
+            (rlim_t) start.limits->memory,
+            (rlim_t) start.limits->memory
+        };
+        setrlimit(RLIMIT_AS, &limit);
+    }
+    if ((start.cgroup == -1 || write(start.cgroup, "0", 1) == 1) &&
+        (start.input == -1 || dup2(start.input, STDIN_FILENO) != -1) &&
+        dup2(start.output, STDOUT_FILENO) != -1) {
+        execve(start.path, start.argv, start.envp);
+    }
+    start.error = errno;
+    _exit(127);
+}
+
+// Started like posix_spawn does it but with CLONE_PIDFD, so that the pidfd
+// exists before the script can exit and be reaped. process stays -1 on
+// kernels before 5.2, which ignore the flag.
+static pid_t launch(
+    char *message,
+    size_t size,
+    const script_limits &limits,
+    int source,
+    int output,
+    int input,
+    int cgroup,
+    int &process
+) {
+    char path[PATH_MAX];
+    if (!install(source, path, sizeof(path))) {
+        return -1;
+    }
+    char *envp[MAX_VARIABLES + 1];
+    size_t count = 0;
+    char *end = message + size;
+    char *name = message;
+    char *variable = name + strlen(name) + 1;
+    while (variable < end && count != MAX_VARIABLES) {
+        envp[count++] = variable;
+        variable += strlen(variable) + 1;
+    }
+    envp[count] = nullptr;
+    char *argv[] = {name, nullptr};
+    alignas(16) char stack[16384];
+    script_start start = {
+        path,
+        argv,
+        envp,
+        &limits,
+        input,
+        output,
+        cgroup,
+        0
+    };
+    pid_t pid = clone(
+        start_script,
+        stack + sizeof(stack),
+        CLONE_VM | CLONE_VFORK | CLONE_PIDFD | SIGCHLD,
+        &start,
+        &process
+    );
+    if (pid == -1 || start.error) {
+        fprintf(
+            stderr,
+            "Error: can't start %s: %d\n",
+            name,
+            pid == -1 ? errno : start.error
+        );
+        if (process != -1) {
+            close(process);
+            process = -1;
+        }
+        return -1;
+    }
+    return pid;
+}
+
+static void reply(int socket, pid_t pid, int process) {
+    union {
+        char buffer[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec part = {&pid, sizeof(pid)};
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &part;
+    message.msg_iovlen = 1;
+    if (process != -1) {
+        message.msg_control = control.buffer;
+        message.msg_controllen = sizeof(control.buffer);
+        struct cmsghdr *c = CMSG_FIRSTHDR(&message);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(c), &process, sizeof(int));
+    }
+    sendmsg(socket, &message, MSG_NOSIGNAL);
+}
+
+static void serve(int control) {
+    static char message[MESSAGE_SIZE];
+    for (;;) {
+        struct iovec part = {message, sizeof(message) - 1};
+        union {
+            char buffer[CMSG_SPACE(MAX_DESCRIPTORS * sizeof(int))];
+            struct cmsghdr align;
+        } control_data;
+        struct msghdr header;
+        memset(&header, 0, sizeof(header));
+        header.msg_iov = &part;
+        header.msg_iovlen = 1;
+        header.msg_control = control_data.buffer;
+        header.msg_controllen = sizeof(control_data.buffer);
+        ssize_t size = recvmsg(control, &header, MSG_CMSG_CLOEXEC);
+        if (size == -1 && errno == EINTR) {
+            continue;
+        }
+        if (size <= 0) {
+            return;
+        }
+        int descriptors[MAX_DESCRIPTORS];
+        size_t count = 0;
+        struct cmsghdr *c = CMSG_FIRSTHDR(&header);
+        if (c != nullptr && c->cmsg_level == SOL_SOCKET &&
+            c->cmsg_type == SCM_RIGHTS) {
+            count = std::min<size_t>(
+                (c->cmsg_len - CMSG_LEN(0)) / sizeof(int),
+                MAX_DESCRIPTORS
+            );
+            memcpy(descriptors, CMSG_DATA(c), count * sizeof(int));
+        }
+        script_limits limits = {};
+        if ((size_t) size > sizeof(limits)) {
+            memcpy(&limits, message, sizeof(limits));
+        }
+        if ((size_t) size > sizeof(limits) &&
+            count == 3u + (limits.body != 0) + (limits.cgroup != 0) &&
+            !(header.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+            message[size] = '\0';
+            int process = -1;
+            pid_t pid = launch(
+                message + sizeof(limits),
+                size - sizeof(limits),
+                limits,
+                descriptors[1],
+                descriptors[2],
+                limits.body ? descriptors[3] : -1,
+                limits.cgroup ? descriptors[count - 1] : -1,
+                process
+            );
+            reply(descriptors[0], pid, process);
+            if (process != -1) {
+                close(process);
+            }
+        }
+        for (size_t i = 0; i != count; ++i) {
+            close(descriptors[i]);
+        }
+    }
+}
+
 int main(int argc, char *argv[]) {
     uid_t run_uid = 0;
+    gid_t run_gid = 0;
     setuid(0);
     if (argc != 4) {
-        fprintf(stderr, "Error: usage: helper user chroot program\n");
+        fprintf(stderr, "Error: usage: helper user chroot socket\n");
         return 1;
     }
     if (!is_allowed()) {
         fprintf(stderr, "Error: not allowed to run by security reasons\n");
         return 1;
     }
-    if (!find_user_uid(argv[1], &run_uid)) {
+    if (!find_user(argv[1], &run_uid, &run_gid)) {
         fprintf(stderr, "Error: can't find specified user\n");
         return 1;
     }
+    int control = atoi(argv[3]);
+    if (fcntl(control, F_SETFD, FD_CLOEXEC) == -1) {
+        fprintf(stderr, "Error: invalid socket\n");
+        return 1;
+    }
     if (chdir(argv[2])) {
         fprintf(stderr, "Error: can't change directory\n");
         return 1;
@@ -56,9 +357,17 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "Error: can't chroot\n");
         return 1;
     }
-    setuid(run_uid);
-    if (execl(argv[3], argv[3], nullptr)) {
-        fprintf(stderr, "Can't start program\n");
+    if (setgroups(0, nullptr) || setgid(run_gid) || setuid(run_uid) ||
+        (run_uid != 0 && setuid(0) == 0)) {
+        fprintf(stderr, "Error: can't drop privileges\n");
+        return 1;
+    }
+    signal(SIGCHLD, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+    char ready = 1;
+    if (send(control, &ready, 1, MSG_NOSIGNAL) != 1) {
         return 1;
     }
+    serve(control);
+    return 0;
 }
@@ -0,0 +1,530 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <thread>
+
+extern "C" {
+#include <netinet/tcp.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+}
+
+#include "client.hpp"
+#include "http2_client.hpp"
+
+static constexpr size_t MAX_HEADER = 64 << 10;
+
+int64_t clock_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+std::string build_request(
+    const std::string &method,
+    const std::string &target,
+    const std::string &host,
+    bool keep_alive
+) {
+    std::string data =
+        method + " " + target + " HTTP/1.1\r\n"
+        "Host: " + host + "\r\n"
+        "User-Agent: " PROJECT_NAME "_load\r\n";
+    if (!keep_alive) {
+        data += "Connection: close\r\n";
+    }
+    if (method == "POST" || method == "PUT") {
+        data += "Content-Length: 0\r\n";
+    }
+    return data + "\r\n";
+}
+
+response_reader::response_reader() {
+    reset();
+}
+
+void response_reader::reset() {
+    stage = STAGE::HEADER;
+    buffer.clear();
+    remaining = 0;
+    code = 0;
+    closing = false;
+}
+
+int response_reader::status() const {
+    return code;
+}
+
+bool response_reader::close() const {
+    return closing;
+}
+
+bool response_reader::take_line(const char *&data, size_t &size) {
+    const char *newline = (const char *) memchr(data, '\n', size);
+    size_t length = newline == nullptr ? size : newline - data + 1;
+    buffer.append(data, length);
+    data += length;
+    size -= length;
+    if (newline == nullptr) {
+        return false;
+    }
+    buffer.pop_back();
+    if (buffer.size() && buffer.back() == '\r') {
+        buffer.pop_back();
+    }
+    return true;
+}
+
+bool response_reader::parse_header() {
+    if (buffer.compare(0, 5, "HTTP/") || buffer.size() < 12) {
+        return false;
+    }
+    code = atoi(buffer.c_str() + 9);
+    closing = buffer.compare(5, 3, "1.0") == 0;
+    bool chunked = false, sized = false;
+    size_t start = buffer.find('\n');
+    while (start != std::string::npos) {
+        ++start;
+        size_t end = buffer.find('\n', start);
+        std::string line = buffer.substr(start, end - start);
+        start = end;
+        if (line.size() && line.back() == '\r') {
+            line.pop_back();
+        }
+        size_t colon = line.find(':');
+        if (colon == std::string::npos) {
+            continue;
+        }
+        std::string name = line.substr(0, colon);
+        const char *value = line.c_str() + colon + 1;
+        while (*value == ' ' || *value == '\t') {
+            ++value;
+        }
+        if (!strcasecmp(name.c_str(), "Content-Length")) {
+            remaining = strtoull(value, nullptr, 10);
+            sized = true;
+        } else if (!strcasecmp(name.c_str(), "Transfer-Encoding")) {
+            chunked = strcasestr(value, "chunked") != nullptr;
+        } else if (!strcasecmp(name.c_str(), "Connection")) {
+            if (strcasestr(value, "close") != nullptr) {
+                closing = true;
+            } else if (strcasestr(value, "keep-alive") != nullptr) {
+                closing = false;
+            }
+        }
+    }
+    if (code < 200 || code == 204 || code == 304) {
+        stage = STAGE::COMPLETE;
+    } else if (chunked) {
+        stage = STAGE::CHUNK_SIZE;
+    } else if (sized) {
+        stage = remaining ? STAGE::LENGTH : STAGE::COMPLETE;
+    } else {
+        stage = STAGE::UNTIL_CLOSE;
+        closing = true;
+    }
+    return true;
+}
+
+response_reader::STATE response_reader::feed(const char *data, size_t size) {
+    while (size && stage != STAGE::COMPLETE) {
+        switch (stage) {
+        case STAGE::HEADER: {
+            size_t old = buffer.size();
+            buffer.append(data, size);
+            size_t end = buffer.find("\r\n\r\n"), skip = 4;
+            size_t bare = buffer.find("\n\n");
+            if (bare < end) {
+                end = bare;
+                skip = 2;
+            }
+            if (end == std::string::npos) {
+                return buffer.size() > MAX_HEADER ?
+                    STATE::ERROR : STATE::INCOMPLETE;
+            }
+            size_t used = end + skip - old;
+            buffer.resize(end);
+            if (!parse_header()) {
+                return STATE::ERROR;
+            }
+            buffer.clear();
+            data += used;
+            size -= used;
+            break;
+        }
+        case STAGE::LENGTH:
+        case STAGE::CHUNK_DATA: {
+            size_t length = std::min((uint64_t) size, remaining);
+            remaining -= length;
+            data += length;
+            size -= length;
+            if (remaining == 0) {
+                stage = stage == STAGE::LENGTH ?
+                    STAGE::COMPLETE : STAGE::CHUNK_END;
+            }
+            break;
+        }
+        case STAGE::CHUNK_SIZE:
+            if (!take_line(data, size)) {
+                break;
+            }
+            remaining = strtoull(buffer.c_str(), nullptr, 16);
+            buffer.clear();
+            stage = remaining ? STAGE::CHUNK_DATA : STAGE::TRAILER;
+            break;
+        case STAGE::CHUNK_END:
+            if (take_line(data, size)) {
+                buffer.clear();
+                stage = STAGE::CHUNK_SIZE;
+            }
+            break;
+        case STAGE::TRAILER:
+            if (take_line(data, size)) {
+                bool last = buffer.empty();
+                buffer.clear();
+                if (last) {
+                    stage = STAGE::COMPLETE;
+                }
+            }
+            break;
+        default:
+            size = 0;
+        }
+    }
+    return stage == STAGE::COMPLETE ? STATE::DONE : STATE::INCOMPLETE;
+}
+
+response_reader::STATE response_reader::finish() {
+    if (stage == STAGE::UNTIL_CLOSE) {
+        stage = STAGE::COMPLETE;
+    }
+    return stage == STAGE::COMPLETE ? STATE::DONE : STATE::ERROR;
+}
+
+struct client {
+    enum class STATE {
+        WAITING,
+        CONNECTING,
+        SENDING,
+        RECEIVING,
+        FINISHED
+    };
+
+    int socket = -1;
+    STATE state = STATE::WAITING;
+    const planned_request *request = nullptr;
+    size_t sent = 0;
+    int64_t due = -1;
+    int64_t started = 0;
+    bool reused = false;
+    bool received = false;
+    response_reader reader;
+};
+
+class load_worker {
+public:
+    load_worker(
+        const load_options &options,
+        schedule &plan,
+        unsigned connections,
+        load_result &result
+    );
+    ~load_worker();
+    load_worker(const load_worker &) = delete;
+    load_worker &operator=(const load_worker &) = delete;
+
+    void run();
+
+private:
+    void next(client &c);
+    void launch(client &c);
+    void open(client &c);
+    void transmit(client &c);
+    void receive(client &c);
+    void complete(client &c);
+    void fail(client &c);
+    void retry(client &c);
+    void drop(client &c);
+
+    const load_options &options;
+    schedule &plan;
+    load_result &result;
+    int epoll_fd;
+    std::vector<client> clients;
+    unsigned active;
+    bool ready;
+};
+
+load_worker::load_worker(
+    const load_options &options,
+    schedule &plan,
+    unsigned connections,
+    load_result &result
+) :
+    options(options),
+    plan(plan),
+    result(result),
+    epoll_fd(epoll_create1(EPOLL_CLOEXEC)),
+    clients(connections),
+    active(connections),
+    ready(false) {
+}
+
+load_worker::~load_worker() {
+    for (client &c : clients) {
+        drop(c);
+    }
+    close(epoll_fd);
+}
+
+void load_worker::drop(client &c) {
+    if (c.socket != -1) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c.socket, nullptr);
+        close(c.socket);
+        c.socket = -1;
+    }
+    c.reused = false;
+}
+
+void load_worker::next(client &c) {
+    int64_t now = clock_ns();
+    c.request = plan.claim(now, c.due);
+    if (c.request == nullptr) {
+        drop(c);
+        c.state = client::STATE::FINISHED;
+        --active;
+        return;
+    }
+    c.state = client::STATE::WAITING;
+    if (c.due <= now) {
+        ready = true;
+    }
+}
+
+void load_worker::launch(client &c) {
+    c.started = clock_ns();
+    c.sent = 0;
+    c.received = false;
+    c.reader.reset();
+    if (c.socket == -1) {
+        open(c);
+        return;
+    }
+    c.state = client::STATE::SENDING;
+    transmit(c);
+}
+
+void load_worker::open(client &c) {
+    c.socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c.socket == -1) {
+        fprintf(stderr, "Error: socket() failed: %d\n", errno);
+        fail(c);
+        return;
+    }
+    int value = 1;
+    setsockopt(c.socket, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value));
+    ++result.connects;
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = &c;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c.socket, &event);
+    c.state = client::STATE::CONNECTING;
+    if (connect(
+            c.socket,
+            (const struct sockaddr *) &options.address,
+            sizeof(options.address)
+        ) == -1 && errno != EINPROGRESS
+    ) {
+        fail(c);
+    }
+}
+
+void load_worker::transmit(client &c) {
+    const std::string &data = c.request->data;
+    while (c.sent != data.size()) {
+        ssize_t bytes = send(
+            c.socket,
+            data.data() + c.sent,
+            data.size() - c.sent,
+            MSG_NOSIGNAL
+        );
+        if (bytes > 0) {
+            c.sent += bytes;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return;
+        } else {
+            retry(c);
+            return;
+        }
+    }
+    c.state = client::STATE::RECEIVING;
+    receive(c);
+}
+
+void load_worker::receive(client &c) {
+    char buffer[READ_SIZE];
+    for (;;) {
+        ssize_t bytes = read(c.socket, buffer, sizeof(buffer));
+        if (bytes > 0) {
+            result.bytes += bytes;
+            c.received = true;
+            response_reader::STATE state = c.reader.feed(buffer, bytes);
+            if (state == response_reader::STATE::DONE) {
+                complete(c);
+                return;
+            }
+            if (state == response_reader::STATE::ERROR) {
+                fail(c);
+                return;
+            }
+        } else if (bytes == 0) {
+            if (!c.received) {
+                retry(c);
+            } else if (c.reader.finish() == response_reader::STATE::DONE) {
+                complete(c);
+            } else {
+                fail(c);
+            }
+            return;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return;
+        } else {
+            retry(c);
+            return;
+        }
+    }
+}
+
+void load_worker::complete(client &c) {
+    int64_t finished = clock_ns();
+    result.latencies.push_back(finished - (c.due >= 0 ? c.due : c.started));
+    int status = c.reader.status();
+    ++result.statuses[status >= 100 && status < 600 ? status / 100 : 0];
+    if (!options.keep_alive || c.reader.close()) {
+        drop(c);
+    } else {
+        c.reused = true;
+    }
+    next(c);
+}
+
+void load_worker::fail(client &c) {
+    ++result.errors;
+    drop(c);
+    next(c);
+}
+
+// A kept-alive connection may have been closed by the server while idle;
+// that is not the request's fault, so it is sent once more on a new one.
+void load_worker::retry(client &c) {
+    if (!c.reused || c.received) {
+        fail(c);
+        return;
+    }
+    drop(c);
+    c.state = client::STATE::WAITING;
+    ready = true;
+}
+
+void load_worker::run() {
+    for (client &c : clients) {
+        next(c);
+    }
+    struct epoll_event events[MAX_EVENTS];
+    while (active) {
+        int64_t now = clock_ns();
+        int64_t wake = now + (int64_t) MAX_WAIT * 1000 * 1000;
+        ready = false;
+        for (client &c : clients) {
+            if (c.state == client::STATE::WAITING) {
+                if (c.due <= now) {
+                    launch(c);
+                } else {
+                    wake = std::min(wake, c.due);
+                }
+            } else if (c.state != client::STATE::FINISHED &&
+                now - c.started > REQUEST_TIMEOUT) {
+                fail(c);
+            }
+        }
+        if (active == 0) {
+            break;
+        }
+        int timeout = ready ? 0 : (int) ((wake - now + 999999) / 1000000);
+        int count = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+        for (int i = 0; i < count; ++i) {
+            client &c = *static_cast<client *>(events[i].data.ptr);
+            if (c.state == client::STATE::CONNECTING) {
+                int error = 0;
+                socklen_t length = sizeof(error);
+                getsockopt(c.socket, SOL_SOCKET, SO_ERROR, &error, &length);
+                if (error) {
+                    fail(c);
+                    continue;
+                }
+                if (!(events[i].events & EPOLLOUT)) {
+                    continue;
+                }
+                c.state = client::STATE::SENDING;
+                transmit(c);
+            } else if (c.state == client::STATE::SENDING) {
+                transmit(c);
+            } else if (c.state == client::STATE::RECEIVING) {
+                receive(c);
+            }
+        }
+    }
+}
+
+bool run_load(const load_options &options, load_result &result) {
+    if (options.plan.empty() || options.connections == 0) {
+        return false;
+    }
+    unsigned threads =
+        std::max(1u, std::min(options.threads, options.connections));
+    std::vector<load_result> partial(threads);
+    int64_t start = clock_ns();
+    schedule plan(options, start);
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i != threads; ++i) {
+        unsigned connections = options.connections / threads +
+            (i < options.connections % threads ? 1 : 0);
+        workers.emplace_back([&options, &plan, connections, &partial, i] {
+            if (options.http2) {
+                http2_worker w(options, plan, connections, partial[i]);
+                w.run();
+            } else {
+                load_worker w(options, plan, connections, partial[i]);
+                w.run();
+            }
+        });
+    }
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+    result.elapsed = clock_ns() - start;
+    for (load_result &part : partial) {
+        result.latencies.insert(
+            result.latencies.end(),
+            part.latencies.begin(),
+            part.latencies.end()
+        );
+        for (int i = 0; i != 6; ++i) {
+            result.statuses[i] += part.statuses[i];
+        }
+        result.errors += part.errors;
+        result.bytes += part.bytes;
+        result.connects += part.connects;
+    }
+    std::sort(result.latencies.begin(), result.latencies.end());
+    return true;
+}
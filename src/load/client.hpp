@@ -0,0 +1,147 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <netinet/in.h>
+}
+
+struct planned_request {
+    std::string data;
+    int64_t at;
+};
+
+struct load_options {
+    struct sockaddr_in address;
+    std::vector<planned_request> plan;
+    bool replay = false;
+    unsigned connections = 16;
+    unsigned threads = 1;
+    bool keep_alive = false;
+    // HTTP/2 by prior knowledge, with up to streams requests at once on
+    // each connection.
+    bool http2 = false;
+    unsigned streams = 1;
+    double rate = 0;
+    uint64_t total = 0;
+    int64_t duration = 0;
+};
+
+struct load_result {
+    std::vector<int64_t> latencies;
+    uint64_t statuses[6] = {};
+    uint64_t errors = 0;
+    uint64_t bytes = 0;
+    uint64_t connects = 0;
+    int64_t elapsed = 0;
+};
+
+class response_reader {
+public:
+    enum class STATE {
+        INCOMPLETE,
+        DONE,
+        ERROR
+    };
+
+    response_reader();
+
+    void reset();
+    STATE feed(const char *data, size_t size);
+    STATE finish();
+    int status() const;
+    bool close() const;
+
+private:
+    enum class STAGE {
+        HEADER,
+        LENGTH,
+        CHUNK_SIZE,
+        CHUNK_DATA,
+        CHUNK_END,
+        TRAILER,
+        UNTIL_CLOSE,
+        COMPLETE
+    };
+
+    bool parse_header();
+    bool take_line(const char *&data, size_t &size);
+
+    STAGE stage;
+    std::string buffer;
+    uint64_t remaining;
+    int code;
+    bool closing;
+};
+
+constexpr size_t READ_SIZE = 16 << 10;
+constexpr int MAX_EVENTS = 256;
+constexpr int64_t REQUEST_TIMEOUT = 30ll * 1000 * 1000 * 1000;
+constexpr int MAX_WAIT = 1000;
+
+std::string build_request(
+    const std::string &method,
+    const std::string &target,
+    const std::string &host,
+    bool keep_alive
+);
+
+int64_t clock_ns();
+
+// Hands out request numbers to all threads. With a target rate or a replayed
+// log every request has a due time, and latency is measured from that time
+// rather than from the moment a connection was free to send it, so a stalled
+// server is not hidden by the load generator slowing down with it.
+class schedule {
+public:
+    schedule(const load_options &options, int64_t start) :
+        options(options),
+        start(start),
+        next(0),
+        exhausted(false) {
+    }
+
+    const planned_request *claim(int64_t now, int64_t &due) {
+        if (exhausted.load(std::memory_order_relaxed)) {
+            return nullptr;
+        }
+        uint64_t index = next.fetch_add(1, std::memory_order_relaxed);
+        const planned_request *r;
+        if (options.replay) {
+            if (index >= options.plan.size()) {
+                return stop();
+            }
+            r = &options.plan[index];
+            due = r->at < 0 ? -1 : start + r->at;
+        } else {
+            if (options.total && index >= options.total) {
+                return stop();
+            }
+            r = &options.plan[index % options.plan.size()];
+            due = options.rate > 0 ?
+                start + (int64_t) (index * 1e9 / options.rate) : -1;
+        }
+        if (options.duration &&
+            std::max(due, now) >= start + options.duration) {
+            return stop();
+        }
+        return r;
+    }
+
+private:
+    const planned_request *stop() {
+        exhausted.store(true, std::memory_order_relaxed);
+        return nullptr;
+    }
+
+    const load_options &options;
+    int64_t start;
+    std::atomic<uint64_t> next;
+    std::atomic<bool> exhausted;
+};
+bool run_load(const load_options &options, load_result &result);
@@ -0,0 +1,438 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+
+extern "C" {
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+}
+
+#include "http2_client.hpp"
+
+// The windows are opened wide at the start, and the connection window is
+// topped up once half of it has been taken.
+static constexpr uint32_t WINDOW = 1 << 30;
+static constexpr size_t MAX_HEADER_LIST = 64 << 10;
+
+// The HTTP/1.1 request of the plan as the fields of a header block.
+static void encode_request(
+    hpack_encoder &encoder,
+    const std::string &data,
+    std::string &block
+) {
+    std::string_view text(data);
+    size_t space = text.find(' ');
+    size_t second = text.find(' ', space + 1);
+    std::string_view authority;
+    size_t host = text.find("\r\nHost: ");
+    if (host != std::string_view::npos) {
+        host += 8;
+        authority = text.substr(host, text.find("\r\n", host) - host);
+    }
+    block.clear();
+    encoder.begin(block);
+    encoder.add(block, ":method", text.substr(0, space), true);
+    encoder.add(block, ":scheme", "http", true);
+    encoder.add(
+        block,
+        ":path",
+        text.substr(space + 1, second - space - 1),
+        true
+    );
+    encoder.add(block, ":authority", authority, true);
+    encoder.add(block, "user-agent", PROJECT_NAME "_load", true);
+}
+
+http2_worker::http2_worker(
+    const load_options &options,
+    schedule &plan,
+    unsigned connections,
+    load_result &result
+) :
+    options(options),
+    plan(plan),
+    result(result),
+    epoll_fd(epoll_create1(EPOLL_CLOEXEC)),
+    clients(connections),
+    active(connections * options.streams),
+    ready(false) {
+}
+
+http2_worker::~http2_worker() {
+    for (http2_client &c : clients) {
+        drop(c);
+    }
+    close(epoll_fd);
+}
+
+void http2_worker::next(http2_slot &s) {
+    int64_t now = clock_ns();
+    s.request = plan.claim(now, s.due);
+    s.stream = 0;
+    s.status = 0;
+    if (s.request == nullptr) {
+        s.state = http2_slot::STATE::FINISHED;
+        --active;
+        return;
+    }
+    s.state = http2_slot::STATE::WAITING;
+    if (s.due <= now) {
+        ready = true;
+    }
+}
+
+void http2_worker::open(http2_client &c) {
+    c.socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c.socket == -1) {
+        fprintf(stderr, "Error: socket() failed: %d\n", errno);
+        return;
+    }
+    int value = 1;
+    setsockopt(c.socket, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value));
+    ++result.connects;
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = &c;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c.socket, &event);
+    c.output = CONNECTION_PREFACE;
+    append_frame_header(c.output, 12, FRAME::SETTINGS, 0, 0);
+    append_setting(c.output, SETTING::ENABLE_PUSH, 0);
+    append_setting(c.output, SETTING::INITIAL_WINDOW_SIZE, WINDOW);
+    append_window_update(c.output, 0, WINDOW - DEFAULT_WINDOW);
+    if (connect(
+            c.socket,
+            (const struct sockaddr *) &options.address,
+            sizeof(options.address)
+        ) == -1 && errno != EINPROGRESS
+    ) {
+        drop(c);
+    }
+}
+
+// Opens streams for the requests that are due, as many as the server
+// allows.
+void http2_worker::launch(http2_client &c, int64_t now) {
+    if (c.socket == -1) {
+        open(c);
+        return;
+    }
+    if (!c.connected) {
+        return;
+    }
+    for (http2_slot &s : c.slots) {
+        if (c.going_away || c.open >= c.limit) {
+            break;
+        }
+        if (s.state != http2_slot::STATE::WAITING || s.due > now) {
+            continue;
+        }
+        encode_request(c.encoder, s.request->data, c.block);
+        append_header_block(
+            c.output,
+            c.block,
+            c.next_stream,
+            true,
+            DEFAULT_FRAME_SIZE
+        );
+        s.state = http2_slot::STATE::OPEN;
+        s.stream = c.next_stream;
+        s.started = now;
+        c.next_stream += 2;
+        ++c.open;
+    }
+    transmit(c);
+}
+
+void http2_worker::transmit(http2_client &c) {
+    while (c.sent != c.output.size()) {
+        ssize_t bytes = send(
+            c.socket,
+            c.output.data() + c.sent,
+            c.output.size() - c.sent,
+            MSG_NOSIGNAL
+        );
+        if (bytes > 0) {
+            c.sent += bytes;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return;
+        } else {
+            drop(c);
+            return;
+        }
+    }
+    c.output.clear();
+    c.sent = 0;
+}
+
+void http2_worker::receive(http2_client &c) {
+    char buffer[READ_SIZE];
+    for (;;) {
+        ssize_t bytes = read(c.socket, buffer, sizeof(buffer));
+        if (bytes > 0) {
+            result.bytes += bytes;
+            c.input.append(buffer, bytes);
+            if (!parse(c)) {
+                drop(c);
+                return;
+            }
+        } else if (bytes == -1 && errno == EINTR) {
+            continue;
+        } else if (bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else {
+            drop(c);
+            return;
+        }
+    }
+    if (c.output.size()) {
+        transmit(c);
+    }
+    if (c.socket != -1 && c.going_away && c.open == 0) {
+        drop(c);
+    }
+}
+
+bool http2_worker::parse(http2_client &c) {
+    size_t used = 0;
+    while (c.input.size() - used >= FRAME_HEADER_SIZE) {
+        frame_header header = read_frame_header(c.input.data() + used);
+        if (c.input.size() - used - FRAME_HEADER_SIZE < header.length) {
+            break;
+        }
+        std::string_view payload(
+            c.input.data() + used + FRAME_HEADER_SIZE,
+            header.length
+        );
+        used += FRAME_HEADER_SIZE + header.length;
+        if (!handle(c, header, payload)) {
+            return false;
+        }
+    }
+    c.input.erase(0, used);
+    return true;
+}
+
+bool http2_worker::handle(
+    http2_client &c,
+    const frame_header &header,
+    std::string_view payload
+) {
+    switch (header.type) {
+    case FRAME::DATA: {
+        c.consumed += header.length;
+        if (c.consumed >= WINDOW / 2) {
+            append_window_update(c.output, 0, c.consumed);
+            c.consumed = 0;
+        }
+        http2_slot *s = find(c, header.stream);
+        if (s != nullptr && (header.flags & FLAG_END_STREAM)) {
+            complete(c, *s);
+        }
+        return true;
+    }
+    case FRAME::HEADERS:
+        if (!frame_content(header, payload)) {
+            return false;
+        }
+        c.block.assign(payload);
+        c.continuing = header.stream;
+        c.continuing_end = header.flags & FLAG_END_STREAM;
+        return header.flags & FLAG_END_HEADERS ? finish_headers(c) : true;
+    case FRAME::CONTINUATION:
+        c.block += payload;
+        return header.flags & FLAG_END_HEADERS ? finish_headers(c) : true;
+    case FRAME::RST_STREAM: {
+        http2_slot *s = find(c, header.stream);
+        if (s != nullptr && payload.size() == 4) {
+            if ((ERROR_CODE) read_u32(payload.data()) ==
+                ERROR_CODE::REFUSED_STREAM) {
+                retry(c, *s);
+            } else {
+                ++result.errors;
+                --c.open;
+                next(*s);
+            }
+        }
+        return true;
+    }
+    case FRAME::SETTINGS:
+        if (!(header.flags & FLAG_ACK)) {
+            for (size_t i = 0; i + 6 <= payload.size(); i += 6) {
+                if ((uint8_t) payload[i + 1] ==
+                    (uint8_t) SETTING::MAX_CONCURRENT_STREAMS) {
+                    c.limit = read_u32(payload.data() + i + 2);
+                }
+            }
+            append_frame_header(c.output, 0, FRAME::SETTINGS, FLAG_ACK, 0);
+        }
+        return true;
+    case FRAME::PING:
+        if (!(header.flags & FLAG_ACK)) {
+            append_ping(c.output, payload, true);
+        }
+        return true;
+    case FRAME::GOAWAY:
+        if (payload.size() < 8) {
+            return false;
+        }
+        c.going_away = true;
+        c.last_stream = read_u32(payload.data()) & 0x7fffffff;
+        for (http2_slot &s : c.slots) {
+            if (s.state == http2_slot::STATE::OPEN &&
+                s.stream > c.last_stream) {
+                retry(c, s);
+            }
+        }
+        return true;
+    default:
+        return true;
+    }
+}
+
+bool http2_worker::finish_headers(http2_client &c) {
+    if (c.decoder.decode(c.block, MAX_HEADER_LIST, c.storage, c.fields) !=
+        HPACK::DONE) {
+        return false;
+    }
+    http2_slot *s = find(c, c.continuing);
+    if (s == nullptr) {
+        return true;
+    }
+    for (const header_pair &field : c.fields) {
+        if (field.name == ":status" && s->status < 200) {
+            s->status = atoi(std::string(field.value).c_str());
+        }
+    }
+    if (c.continuing_end) {
+        complete(c, *s);
+    }
+    return true;
+}
+
+http2_slot *http2_worker::find(http2_client &c, uint32_t stream) {
+    for (http2_slot &s : c.slots) {
+        if (s.state == http2_slot::STATE::OPEN && s.stream == stream) {
+            return &s;
+        }
+    }
+    return nullptr;
+}
+
+void http2_worker::complete(http2_client &c, http2_slot &s) {
+    int64_t finished = clock_ns();
+    result.latencies.push_back(finished - (s.due >= 0 ? s.due : s.started));
+    int status = s.status;
+    ++result.statuses[status >= 100 && status < 600 ? status / 100 : 0];
+    --c.open;
+    next(s);
+}
+
+// A stream the server did not take is sent again as it was.
+void http2_worker::retry(http2_client &c, http2_slot &s) {
+    --c.open;
+    s.state = http2_slot::STATE::WAITING;
+    s.stream = 0;
+    s.status = 0;
+    ready = true;
+}
+
+// Streams still open on the connection have failed, and so have the
+// requests waiting for it if it could not be made.
+void http2_worker::drop(http2_client &c) {
+    if (c.socket != -1) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c.socket, nullptr);
+        close(c.socket);
+        c.socket = -1;
+    }
+    int64_t now = clock_ns();
+    for (http2_slot &s : c.slots) {
+        if (s.state == http2_slot::STATE::OPEN ||
+            (!c.connected && s.state == http2_slot::STATE::WAITING &&
+                s.due <= now)) {
+            ++result.errors;
+            next(s);
+        }
+    }
+    c.connected = false;
+    c.going_away = false;
+    c.last_stream = 0;
+    c.next_stream = 1;
+    c.open = 0;
+    c.limit = ~0u;
+    c.consumed = 0;
+    c.output.clear();
+    c.sent = 0;
+    c.input.clear();
+    c.encoder = hpack_encoder();
+    c.decoder = hpack_decoder(4096);
+}
+
+void http2_worker::run() {
+    for (http2_client &c : clients) {
+        c.slots.resize(options.streams);
+        for (http2_slot &s : c.slots) {
+            next(s);
+        }
+    }
+    struct epoll_event events[MAX_EVENTS];
+    while (active) {
+        int64_t now = clock_ns();
+        int64_t wake = now + (int64_t) MAX_WAIT * 1000 * 1000;
+        ready = false;
+        for (http2_client &c : clients) {
+            bool due = false;
+            bool late = false;
+            for (http2_slot &s : c.slots) {
+                if (s.state == http2_slot::STATE::WAITING) {
+                    if (s.due <= now) {
+                        due = true;
+                    } else {
+                        wake = std::min(wake, s.due);
+                    }
+                } else if (s.state == http2_slot::STATE::OPEN &&
+                    now - s.started > REQUEST_TIMEOUT) {
+                    late = true;
+                }
+            }
+            if (late) {
+                drop(c);
+            } else if (due) {
+                launch(c, now);
+            }
+        }
+        if (active == 0) {
+            break;
+        }
+        int timeout = ready ? 0 : (int) ((wake - now + 999999) / 1000000);
+        int count = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+        for (int i = 0; i < count; ++i) {
+            http2_client &c = *static_cast<http2_client *>(events[i].data.ptr);
+            if (c.socket == -1) {
+                continue;
+            }
+            if (!c.connected) {
+                int error = 0;
+                socklen_t length = sizeof(error);
+                getsockopt(c.socket, SOL_SOCKET, SO_ERROR, &error, &length);
+                if (error) {
+                    drop(c);
+                    continue;
+                }
+                if (!(events[i].events & EPOLLOUT)) {
+                    continue;
+                }
+                c.connected = true;
+                launch(c, clock_ns());
+            } else if (c.output.size()) {
+                transmit(c);
+            }
+            if (c.socket != -1) {
+                receive(c);
+            }
+        }
+    }
+}
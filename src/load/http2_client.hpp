@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "frame_codec.hpp"
+#include "hpack.hpp"
+#include "client.hpp"
+
+// One request of a connection of HTTP/2, claimed and timed on its own like
+// a connection of HTTP/1.1.
+struct http2_slot {
+    enum class STATE {
+        WAITING,
+        OPEN,
+        FINISHED
+    };
+
+    STATE state = STATE::WAITING;
+    const planned_request *request = nullptr;
+    int64_t due = -1;
+    int64_t started = 0;
+    uint32_t stream = 0;
+    int status = 0;
+};
+
+struct http2_client {
+    int socket = -1;
+    bool connected = false;
+    // After a GOAWAY no stream is opened, those past last_stream are sent
+    // again on a new connection.
+    bool going_away = false;
+    uint32_t last_stream = 0;
+    uint32_t next_stream = 1;
+    unsigned open = 0;
+    unsigned limit = ~0u;
+    size_t consumed = 0;
+    std::string output;
+    size_t sent = 0;
+    std::string input;
+    hpack_encoder encoder;
+    hpack_decoder decoder = hpack_decoder(4096);
+    std::string block;
+    uint32_t continuing = 0;
+    bool continuing_end = false;
+    std::string storage;
+    std::vector<header_pair> fields;
+    std::vector<http2_slot> slots;
+};
+
+// Sends the requests of the plan over HTTP/2 by prior knowledge (h2c),
+// options.streams of them at once on each connection.
+class http2_worker {
+public:
+    http2_worker(
+        const load_options &options,
+        schedule &plan,
+        unsigned connections,
+        load_result &result
+    );
+    ~http2_worker();
+    http2_worker(const http2_worker &) = delete;
+    http2_worker &operator=(const http2_worker &) = delete;
+
+    void run();
+
+private:
+    void next(http2_slot &s);
+    void open(http2_client &c);
+    void launch(http2_client &c, int64_t now);
+    void transmit(http2_client &c);
+    void receive(http2_client &c);
+    bool parse(http2_client &c);
+    bool handle(
+        http2_client &c,
+        const frame_header &header,
+        std::string_view payload
+    );
+    bool finish_headers(http2_client &c);
+    http2_slot *find(http2_client &c, uint32_t stream);
+    void complete(http2_client &c, http2_slot &s);
+    void retry(http2_client &c, http2_slot &s);
+    void drop(http2_client &c);
+
+    const load_options &options;
+    schedule &plan;
+    load_result &result;
+    int epoll_fd;
+    std::vector<http2_client> clients;
+    unsigned active;
+    bool ready;
+};
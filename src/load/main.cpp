@@ -0,0 +1,230 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+extern "C" {
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <sys/socket.h>
+}
+
+#include "client.hpp"
+#include "replay.hpp"
+
+static const char USAGE[] =
+    "Usage: " PROJECT_NAME "_load [options] http://host[:port]/path...\n"
+    "  -c connections   concurrent connections (16)\n"
+    "  -t threads       client threads (1)\n"
+    "  -n requests      stop after this many requests\n"
+    "  -d seconds       stop after this much time\n"
+    "  -r rate          send requests at a fixed rate per second\n"
+    "  -k               reuse connections (keep-alive)\n"
+    "  -2               use HTTP/2 without TLS (h2c), connections are reused\n"
+    "  -m streams       concurrent requests on each HTTP/2 connection (1)\n"
+    "  -l log           replay the request lines of an access log\n"
+    "  -s speed         replay pace relative to the log, 0 for at once (1)\n"
+    "  -j               print the result as JSON\n";
+
+struct target {
+    std::string host;
+    std::string path;
+    struct sockaddr_in address;
+};
+
+static bool parse_url(const std::string &url, target &t) {
+    if (url.compare(0, 7, "http://")) {
+        return false;
+    }
+    size_t slash = url.find('/', 7);
+    t.host = url.substr(7, slash == std::string::npos ? slash : slash - 7);
+    t.path = slash == std::string::npos ? "/" : url.substr(slash);
+    std::string name = t.host, port = "80";
+    size_t colon = t.host.find(':');
+    if (colon != std::string::npos) {
+        name = t.host.substr(0, colon);
+        port = t.host.substr(colon + 1);
+    }
+    struct addrinfo hints = {}, *result;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(name.c_str(), port.c_str(), &hints, &result)) {
+        return false;
+    }
+    memcpy(&t.address, result->ai_addr, sizeof(t.address));
+    freeaddrinfo(result);
+    return true;
+}
+
+static double percentile(const std::vector<int64_t> &sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t index = (size_t) (p * (sorted.size() - 1) + 0.5);
+    return sorted[index] / 1e6;
+}
+
+static void print_result(
+    const load_options &options,
+    const load_result &r,
+    bool json
+) {
+    double seconds = r.elapsed / 1e9;
+    double rate = seconds > 0 ? r.latencies.size() / seconds : 0;
+    double mib = seconds > 0 ? r.bytes / seconds / (1 << 20) : 0;
+    double p50 = percentile(r.latencies, 0.5);
+    double p99 = percentile(r.latencies, 0.99);
+    double p999 = percentile(r.latencies, 0.999);
+    double max = r.latencies.empty() ? 0 : r.latencies.back() / 1e6;
+    if (json) {
+        printf(
+            "{\"requests\":%zu,\"errors\":%llu,\"connections\":%u,"
+            "\"connects\":%llu,\"seconds\":%.3f,\"requests_per_s\":%.1f,"
+            "\"mib_per_s\":%.2f,\"p50_ms\":%.3f,\"p99_ms\":%.3f,"
+            "\"p999_ms\":%.3f,\"max_ms\":%.3f,\"status\":{",
+            r.latencies.size(),
+            (unsigned long long) r.errors,
+            options.connections,
+            (unsigned long long) r.connects,
+            seconds,
+            rate,
+            mib,
+            p50,
+            p99,
+            p999,
+            max
+        );
+        const char *separator = "";
+        for (int i = 0; i != 6; ++i) {
+            if (r.statuses[i]) {
+                printf(
+                    "%s\"%s\":%llu",
+                    separator,
+                    i ? std::to_string(i).append("xx").c_str() : "other",
+                    (unsigned long long) r.statuses[i]
+                );
+                separator = ",";
+            }
+        }
+        printf("}}\n");
+        return;
+    }
+    printf(
+        "requests    %zu (%llu errors, %u connections, %llu connects)\n"
+        "time        %.3f s\n"
+        "throughput  %.1f req/s, %.2f MiB/s\n"
+        "latency     p50 %.3f ms, p99 %.3f ms, p999 %.3f ms, max %.3f ms\n"
+        "status     ",
+        r.latencies.size(),
+        (unsigned long long) r.errors,
+        options.connections,
+        (unsigned long long) r.connects,
+        seconds,
+        rate,
+        mib,
+        p50,
+        p99,
+        p999,
+        max
+    );
+    for (int i = 0; i != 6; ++i) {
+        if (r.statuses[i]) {
+            printf(
+                " %s %llu",
+                i ? std::to_string(i).append("xx").c_str() : "other",
+                (unsigned long long) r.statuses[i]
+            );
+        }
+    }
+    printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+    load_options options;
+    std::string log;
+    double speed = 1;
+    bool json = false;
+    int option;
+    while ((option = getopt(argc, argv, "c:t:n:d:r:k2m:l:s:j")) != -1) {
+        switch (option) {
+        case 'c':
+            options.connections = atoi(optarg);
+            break;
+        case 't':
+            options.threads = atoi(optarg);
+            break;
+        case 'n':
+            options.total = strtoull(optarg, nullptr, 10);
+            break;
+        case 'd':
+            options.duration = (int64_t) (atof(optarg) * 1e9);
+            break;
+        case 'r':
+            options.rate = atof(optarg);
+            break;
+        case 'k':
+            options.keep_alive = true;
+            break;
+        case '2':
+            options.http2 = true;
+            break;
+        case 'm':
+            options.streams = atoi(optarg);
+            break;
+        case 'l':
+            log = optarg;
+            break;
+        case 's':
+            speed = atof(optarg);
+            break;
+        case 'j':
+            json = true;
+            break;
+        default:
+            fputs(USAGE, stderr);
+            return 1;
+        }
+    }
+    if (optind == argc || options.connections == 0 ||
+        options.streams == 0 || speed < 0) {
+        fputs(USAGE, stderr);
+        return 1;
+    }
+    target t;
+    for (int i = optind; i != argc; ++i) {
+        if (!parse_url(argv[i], t)) {
+            fprintf(stderr, "Error: can't resolve %s\n", argv[i]);
+            return 1;
+        }
+        if (log.empty()) {
+            options.plan.push_back({
+                build_request("GET", t.path, t.host, options.keep_alive),
+                0
+            });
+        }
+    }
+    options.address = t.address;
+    if (log.size()) {
+        options.replay = true;
+        if (!load_replay(
+                log,
+                t.host,
+                options.keep_alive,
+                speed,
+                options.plan
+            )
+        ) {
+            fprintf(stderr, "Error: nothing to replay in %s\n", log.c_str());
+            return 1;
+        }
+    } else if (options.total == 0 && options.duration == 0) {
+        options.total = 1000;
+    }
+    load_result result;
+    if (!run_load(options, result)) {
+        return 1;
+    }
+    print_result(options, result, json);
+    return result.errors ? 2 : 0;
+}
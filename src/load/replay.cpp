@@ -0,0 +1,96 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+
+#include "replay.hpp"
+
+struct logged_request {
+    time_t time;
+    std::string method;
+    std::string target;
+};
+
+// Accepts the lines written by the server's access log:
+// 127.0.0.1 - - [17/Oct/2023:12:00:00 +0000] "GET / HTTP/1.1" 200 512 87
+static bool parse_line(const std::string &line, logged_request &r) {
+    size_t open = line.find('[');
+    size_t close = line.find(']', open);
+    if (open == std::string::npos || close == std::string::npos) {
+        return false;
+    }
+    struct tm date = {};
+    const char *end = strptime(
+        line.c_str() + open + 1,
+        "%d/%b/%Y:%H:%M:%S",
+        &date
+    );
+    if (end == nullptr) {
+        return false;
+    }
+    r.time = timegm(&date);
+    size_t first = line.find('"', close);
+    size_t last = line.rfind('"');
+    if (first == std::string::npos || last <= first) {
+        return false;
+    }
+    std::string request = line.substr(first + 1, last - first - 1);
+    size_t space = request.find(' ');
+    if (space == std::string::npos || space == 0) {
+        return false;
+    }
+    size_t next = request.find(' ', space + 1);
+    r.method = request.substr(0, space);
+    r.target = request.substr(space + 1, next - space - 1);
+    return r.target.size() && r.target[0] == '/';
+}
+
+bool load_replay(
+    const std::string &path,
+    const std::string &host,
+    bool keep_alive,
+    double speed,
+    std::vector<planned_request> &plan
+) {
+    std::ifstream input(path);
+    if (!input) {
+        fprintf(stderr, "Error: open() failed: %d\n", errno);
+        return false;
+    }
+    std::vector<logged_request> requests;
+    std::string line;
+    logged_request r;
+    while (std::getline(input, line)) {
+        if (parse_line(line, r)) {
+            requests.push_back(r);
+        }
+    }
+    if (requests.empty()) {
+        return false;
+    }
+    // The log has a resolution of one second, so requests that share a
+    // second are spread evenly over it instead of arriving as a burst.
+    time_t origin = requests.front().time;
+    for (size_t i = 0; i != requests.size();) {
+        size_t j = i;
+        while (j != requests.size() && requests[j].time == requests[i].time) {
+            ++j;
+        }
+        for (size_t k = i; k != j; ++k) {
+            double offset = (requests[k].time - origin) * 1e9 +
+                1e9 * (k - i) / (j - i);
+            plan.push_back({
+                build_request(
+                    requests[k].method,
+                    requests[k].target,
+                    host,
+                    keep_alive
+                ),
+                speed > 0 ? (int64_t) (offset / speed) : -1
+            });
+        }
+        i = j;
+    }
+    return true;
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "client.hpp"
+
+// Turns the request lines of an access log into a plan. speed scales the
+// recorded pace (2 replays twice as fast); 0 sends everything at once.
+bool load_replay(
+    const std::string &path,
+    const std::string &host,
+    bool keep_alive,
+    double speed,
+    std::vector<planned_request> &plan
+);
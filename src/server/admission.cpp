@@ -0,0 +1,104 @@
+#include <atomic>
+#include <string>
+
+extern "C" {
+#include <sys/socket.h>
+#include <unistd.h>
+}
+
+#include "common.hpp"
+#include "answer_generator.hpp"
+#include "metrics.hpp"
+#include "admission.hpp"
+
+// Clients are counted in slots chosen by a hash of their address; clients
+// sharing a slot share its limit, which only ever errs on the strict side.
+static constexpr unsigned CLIENT_BITS = 16;
+static constexpr int DISCARD_ROUNDS = 4;
+
+struct admission_area {
+    std::atomic<unsigned> total;
+    std::atomic<unsigned> clients[1 << CLIENT_BITS];
+};
+
+static admission_area *area = nullptr;
+static unsigned total_limit = 0;
+static unsigned client_limit = 0;
+static std::string unavailable;
+static std::string too_many;
+
+static std::atomic<unsigned> &client_slot(const struct in_addr &address) {
+    uint32_t hash = address.s_addr * 2654435761u;
+    return area->clients[hash >> (32 - CLIENT_BITS)];
+}
+
+static std::string refusal(int status) {
+    response answer = generate_error(status, "Retry-After: 1\n", false);
+    return answer.data + std::string(answer.body);
+}
+
+bool init_admission(unsigned total, unsigned per_client) {
+    unavailable = refusal(503);
+    too_many = refusal(429);
+    if (total == 0 && per_client == 0) {
+        return true;
+    }
+    area = new admission_area();
+    total_limit = total;
+    client_limit = per_client;
+    return true;
+}
+
+int admit(const struct in_addr &address) {
+    if (area == nullptr) {
+        return 0;
+    }
+    if (total_limit &&
+        area->total.fetch_add(1, std::memory_order_relaxed) >= total_limit) {
+        area->total.fetch_sub(1, std::memory_order_relaxed);
+        return 503;
+    }
+    if (client_limit) {
+        std::atomic<unsigned> &slot = client_slot(address);
+        if (slot.fetch_add(1, std::memory_order_relaxed) >= client_limit) {
+            slot.fetch_sub(1, std::memory_order_relaxed);
+            if (total_limit) {
+                area->total.fetch_sub(1, std::memory_order_relaxed);
+            }
+            return 429;
+        }
+    }
+    return 0;
+}
+
+void release(const struct in_addr &address) {
+    if (area == nullptr) {
+        return;
+    }
+    if (total_limit) {
+        area->total.fetch_sub(1, std::memory_order_relaxed);
+    }
+    if (client_limit) {
+        client_slot(address).fetch_sub(1, std::memory_order_relaxed);
+    }
+}
+
+void leave_admission() {
+    area = nullptr;
+}
+
+void refuse(int socket, int status) {
+    // Unread input would make close() reset the connection before the
+    // client has read the answer, so what has already arrived is dropped.
+    char discard[BUFFER_SIZE];
+    for (int i = 0; i != DISCARD_ROUNDS; ++i) {
+        if (recv(socket, discard, sizeof(discard), MSG_DONTWAIT) <= 0) {
+            break;
+        }
+    }
+    const std::string &page = status == 429 ? too_many : unavailable;
+    ssize_t sent =
+        send(socket, page.data(), page.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+    close(socket);
+    count_response(status, sent > 0 ? sent : 0);
+}
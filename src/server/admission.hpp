@@ -0,0 +1,20 @@
+#pragma once
+
+extern "C" {
+#include <netinet/in.h>
+}
+
+// Limits on open client connections, shared by all workers. Under the fork
+// engine the parent admits the connections and gives them back once the
+// child serving one is gone, however it ended. Without init_admission()
+// every connection is admitted.
+bool init_admission(unsigned total, unsigned per_client);
+// Returns 0 if a connection from address may be served, otherwise the
+// status it is refused with: 503 over the total limit, 429 over the limit
+// for one client.
+int admit(const struct in_addr &address);
+void release(const struct in_addr &address);
+// Called in a forked child, whose connection the parent gives back.
+void leave_admission();
+// Answers a refused connection with a page built in advance and closes it.
+void refuse(int socket, int status);
@@ -1,12 +1,18 @@
 #include <algorithm>
-#include <unordered_map>
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <utility>
 #include <vector>
 
 extern "C" {
-#include <dirent.h>
 #include <fcntl.h>
+#include <linux/limits.h>
+#include <strings.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/utsname.h>
 #include <sys/wait.h>
 #include <unistd.h>
 }
@@ -14,145 +20,865 @@ extern "C" {
 #include "common.hpp"
 #include "url_encoder.hpp"
 #include "query_parser.hpp"
+#include "config_reader.hpp"
+#include "cgi.hpp"
+#include "fastcgi.hpp"
+#include "metrics.hpp"
 #include "answer_generator.hpp"
 
 static const std::string NAME = PROJECT_NAME "/" PROJECT_VERSION;
 
-static const std::string HTML_HEAD =
-    "<!DOCTYPE html>\n"
-    "<html>\n"
-    "    <head>\n"
-    "        <title>" PROJECT_NAME "</title>\n"
-    "        <meta charset=\"utf-8\">\n"
+#define HTML_HEAD_TEXT \
+    "<!DOCTYPE html>\n" \
+    "<html>\n" \
+    "    <head>\n" \
+    "        <title>" PROJECT_NAME "</title>\n" \
+    "        <meta charset=\"utf-8\">\n" \
     "        <meta name=\"viewport\" content=\"width=device-width, initial-sca\
-le=1.0\">\n"
-    "    </head>\n";
-
-static const std::unordered_map<int, std::string> error_codes = {
-    {200, "OK"},
-    {301, "Moved Permanently"},
-    {400, "Bad Request"},
-    {403, "Forbidden"},
-    {404, "Not Found"},
-    {405, "Method Not Allowed"},
-    {431, "Request Header Fields Too Large"},
-    {500, "Internal Server Error"}
+le=1.0\">\n" \
+    "    </head>\n"
+
+const std::string_view HTML_HEAD = HTML_HEAD_TEXT;
+
+struct status_entry {
+    int code;
+    std::string_view line;
+    std::string_view reason;
+    std::string_view page;
+};
+
+// Status lines and error pages are assembled by the preprocessor, so a
+// response only has to point at them.
+#define STATUS(code, text) { \
+    code, \
+    "HTTP/1.1 " #code " " text "\n", \
+    text, \
+    HTML_HEAD_TEXT \
+    "    <body>\n" \
+    "        <h1>" text "</h1>\n" \
+    "        <h3>Error code: " #code "</h3>\n" \
+    "    </body>\n" \
+    "</html>\n" \
+}
+
+static constexpr status_entry statuses[] = {
+    STATUS(100, "Continue"),
+    STATUS(101, "Switching Protocols"),
+    STATUS(200, "OK"),
+    STATUS(201, "Created"),
+    STATUS(202, "Accepted"),
+    STATUS(204, "No Content"),
+    STATUS(206, "Partial Content"),
+    STATUS(301, "Moved Permanently"),
+    STATUS(302, "Found"),
+    STATUS(303, "See Other"),
+    STATUS(304, "Not Modified"),
+    STATUS(307, "Temporary Redirect"),
+    STATUS(308, "Permanent Redirect"),
+    STATUS(400, "Bad Request"),
+    STATUS(401, "Unauthorized"),
+    STATUS(403, "Forbidden"),
+    STATUS(404, "Not Found"),
+    STATUS(405, "Method Not Allowed"),
+    STATUS(406, "Not Acceptable"),
+    STATUS(408, "Request Timeout"),
+    STATUS(409, "Conflict"),
+    STATUS(410, "Gone"),
+    STATUS(411, "Length Required"),
+    STATUS(412, "Precondition Failed"),
+    STATUS(413, "Content Too Large"),
+    STATUS(414, "URI Too Long"),
+    STATUS(415, "Unsupported Media Type"),
+    STATUS(416, "Range Not Satisfiable"),
+    STATUS(429, "Too Many Requests"),
+    STATUS(431, "Request Header Fields Too Large"),
+    STATUS(500, "Internal Server Error"),
+    STATUS(501, "Not Implemented"),
+    STATUS(502, "Bad Gateway"),
+    STATUS(503, "Service Unavailable"),
+    STATUS(504, "Gateway Timeout"),
+    STATUS(505, "HTTP Version Not Supported")
+};
+
+#undef STATUS
+
+struct status_index {
+    constexpr status_index() : slot() {
+        for (size_t i = 0; i != sizeof(statuses) / sizeof(*statuses); ++i) {
+            slot[statuses[i].code - 100] = i + 1;
+        }
+    }
+
+    uint8_t slot[500];
 };
 
+static constexpr status_index status_slots;
+
+static const status_entry *find_status(int code) {
+    if (code < 100 || code > 599 || !status_slots.slot[code - 100]) {
+        return nullptr;
+    }
+    return &statuses[status_slots.slot[code - 100] - 1];
+}
+
+static constexpr std::string_view SERVER_LINE =
+    "Server: " PROJECT_NAME "/" PROJECT_VERSION "\n";
+
+static constexpr std::string_view CONNECTION_LINE[2] = {
+    "Connection: close\n\n",
+    "Connection: keep-alive\n\n"
+};
+
+// Room for the fixed part of a header, so appending it does not reallocate.
+static constexpr size_t HEADER_RESERVE = 160;
+
+// Header buffers of finished responses are reused by the next responses of
+// the same worker thread, so building a header does not allocate once the
+// pool is warm.
+static constexpr size_t SPARE_BUFFERS = 64;
+static constexpr size_t SPARE_CAPACITY = 16 << 10;
+
+static thread_local std::vector<std::string> spare_buffers;
+
+static std::string take_buffer() {
+    if (spare_buffers.empty()) {
+        return std::string();
+    }
+    std::string buffer = std::move(spare_buffers.back());
+    spare_buffers.pop_back();
+    return buffer;
+}
+
+static void recycle_buffer(std::string &buffer) {
+    if (buffer.capacity() >= HEADER_RESERVE &&
+        buffer.capacity() <= SPARE_CAPACITY &&
+        spare_buffers.size() < SPARE_BUFFERS) {
+        buffer.clear();
+        spare_buffers.push_back(std::move(buffer));
+    }
+}
+
+template <typename String>
+static void append_number(String &out, uint64_t n) {
+    char digits[24];
+    char *end = std::to_chars(digits, digits + sizeof(digits), n).ptr;
+    out.append(digits, end - digits);
+}
+
+template <typename String>
+static void append_status_line(String &out, int code) {
+    const status_entry *status = find_status(code);
+    if (status != nullptr) {
+        out += status->line;
+        return;
+    }
+    out += "HTTP/1.1 ";
+    append_number(out, code);
+    out += " Unknown\n";
+}
+
+response::response() :
+    data(take_buffer()),
+    sent(0),
+    file(-1),
+    borrowed_file(false),
+    offset(0),
+    length(0),
+    next_piece(0),
+    upload(-1),
+    close(false) {
+}
+
+response::response(std::string data) :
+    data(std::move(data)),
+    sent(0),
+    file(-1),
+    borrowed_file(false),
+    offset(0),
+    length(0),
+    next_piece(0),
+    upload(-1),
+    close(false) {
+}
+
+response::response(response &&other) :
+    data(std::move(other.data)),
+    body(other.body),
+    keeper(std::move(other.keeper)),
+    sent(other.sent),
+    file(other.file),
+    borrowed_file(other.borrowed_file),
+    offset(other.offset),
+    length(other.length),
+    pieces(std::move(other.pieces)),
+    next_piece(other.next_piece),
+    stream(std::move(other.stream)),
+    upload(other.upload),
+    close(other.close),
+    journal(other.journal) {
+    other.file = -1;
+    other.upload = -1;
+}
+
+response &response::operator=(response &&other) {
+    if (this != &other) {
+        if (file != -1 && !borrowed_file) {
+            ::close(file);
+        }
+        if (upload != -1) {
+            ::close(upload);
+        }
+        recycle_buffer(data);
+        data = std::move(other.data);
+        body = other.body;
+        keeper = std::move(other.keeper);
+        sent = other.sent;
+        file = other.file;
+        borrowed_file = other.borrowed_file;
+        offset = other.offset;
+        length = other.length;
+        pieces = std::move(other.pieces);
+        next_piece = other.next_piece;
+        stream = std::move(other.stream);
+        upload = other.upload;
+        close = other.close;
+        journal = other.journal;
+        other.file = -1;
+        other.upload = -1;
+    }
+    return *this;
+}
+
+response::~response() {
+    if (file != -1 && !borrowed_file) {
+        ::close(file);
+    }
+    if (upload != -1) {
+        ::close(upload);
+    }
+    recycle_buffer(data);
+}
+
+size_t response::buffered() const {
+    return data.size() + body.size();
+}
+
+bool response::more_pieces() const {
+    return next_piece != pieces.size();
+}
+
+bool response::advance() {
+    if (!more_pieces()) {
+        return false;
+    }
+    piece &next = pieces[next_piece++];
+    recycle_buffer(data);
+    data = std::move(next.data);
+    body = next.body;
+    sent = 0;
+    offset = next.offset;
+    length = next.length;
+    return true;
+}
+
+std::string_view reason(int code) {
+    const status_entry *status = find_status(code);
+    return status == nullptr ? "Unknown" : status->reason;
+}
+
+template <typename String>
+static void build_header(
+    String &out,
+    int code,
+    std::string_view record,
+    std::string_view type,
+    size_t size,
+    bool keep_alive
+) {
+    out.reserve(out.size() + HEADER_RESERVE + record.size() + type.size());
+    append_status_line(out, code);
+    out += SERVER_LINE;
+    out += "Content-Type: ";
+    out += type;
+    out += "\nContent-Length: ";
+    append_number(out, size);
+    out += '\n';
+    out += record;
+    out += CONNECTION_LINE[keep_alive];
+}
+
+void append_header(
+    std::string &out,
+    int code,
+    std::string_view record,
+    std::string_view type,
+    size_t size,
+    bool keep_alive
+) {
+    build_header(out, code, record, type, size, keep_alive);
+}
+
+void append_header(
+    std::pmr::string &out,
+    int code,
+    std::string_view record,
+    std::string_view type,
+    size_t size,
+    bool keep_alive
+) {
+    build_header(out, code, record, type, size, keep_alive);
+}
+
+void append_status(
+    std::string &out,
+    std::string_view status,
+    std::string_view record,
+    bool keep_alive
+) {
+    out.reserve(out.size() + HEADER_RESERVE + status.size() + record.size());
+    out += "HTTP/1.1 ";
+    out += status;
+    out += '\n';
+    out += SERVER_LINE;
+    out += record;
+    out += CONNECTION_LINE[keep_alive];
+}
+
+std::string status_header(
+    std::string_view status,
+    std::string_view record,
+    bool keep_alive
+) {
+    std::string out;
+    append_status(out, status, record, keep_alive);
+    return out;
+}
+
 std::string header(
     int code,
-    const std::string &record,
-    const std::string &type,
-    size_t size
-) {
-    return
-        "HTTP/1.1 " + std::to_string(code) + " " + error_codes.at(code) + "\n"
-        "Server: " + NAME + "\n"
-        "Content-Type: " + type + "\n"
-        "Content-Length: " + std::to_string(size) + "\n"
-        + record +
-        "Connection: close\n\n";
-}
-
-std::string generate_error(int code, const std::string &record) {
-    std::string page =
-        HTML_HEAD +
-        "    <body>\n"
-        "        <h1>" + error_codes.at(code) + "</h1>\n"
-        "        <h3>Error code: " + std::to_string(code) + "</h3>\n"
-        "    </body>\n"
-        "</html>\n";
-    return header(code, record, "text/html", page.size()) + page;
-}
-
-std::string from_file(
-    const std::string &file_name,
-    uint16_t port,
-    const std::string &query,
-    const std::string &chroot
+    std::string_view record,
+    std::string_view type,
+    size_t size,
+    bool keep_alive
+) {
+    std::string out;
+    append_header(out, code, record, type, size, keep_alive);
+    return out;
+}
+
+static size_t format_etag(const struct stat &info, char *out, size_t size) {
+    int length = snprintf(
+        out,
+        size,
+        "\"%llx%05llx-%llx\"",
+        (unsigned long long) info.st_mtim.tv_sec,
+        (unsigned long long) info.st_mtim.tv_nsec >> 10,
+        (unsigned long long) info.st_size
+    );
+    return length < 0 ? 0 : std::min((size_t) length, size - 1);
+}
+
+std::pmr::string validators(
+    const struct stat &info,
+    std::pmr::memory_resource *memory
 ) {
-    struct stat info;
-    if (access(file_name.c_str(), R_OK)) {
-        return generate_error(403, "");
+    char etag[64], date[64];
+    size_t etag_length = format_etag(info, etag, sizeof(etag));
+    struct tm parts;
+    gmtime_r(&info.st_mtime, &parts);
+    size_t date_length = strftime(
+        date,
+        sizeof(date),
+        "%a, %d %b %Y %H:%M:%S GMT",
+        &parts
+    );
+    std::pmr::string record(memory);
+    record.reserve(32 + etag_length + date_length);
+    record += "ETag: ";
+    record.append(etag, etag_length);
+    record += "\nLast-Modified: ";
+    record.append(date, date_length);
+    record += '\n';
+    return record;
+}
+
+std::pmr::string representation(
+    const struct stat &info,
+    std::string_view type,
+    bool encoded,
+    std::pmr::memory_resource *memory
+) {
+    std::pmr::string record = validators(info, memory);
+    record += "Accept-Ranges: bytes\n";
+    if (encoded) {
+        record += "Content-Encoding: gzip\n";
     }
-    stat(file_name.c_str(), &info);
-    if (info.st_mode & S_IXUSR) {
-        std::string s0, s1, s2, s3, s4, s5;
-        const char *envp[] = {
-            (s0 = ("SERVER_SOFTWARE=" + NAME)).c_str(),
-            (s1 = ("SERVER_NAME=" + hostname())).c_str(),
-            "GATEWAY_INTERFACE=CGI/1.1",
-            "SERVER_PROTOCOL=HTTP/1.1",
-            (s2 = ("SERVER_PORT=" + std::to_string(port))).c_str(),
-            "REQUEST_METHOD=GET",
-            "PATH_INFO=",
-            (s3 = ("PATH_TRANSLATED=" + pwd())).c_str(),
-            (s4 = (std::string("SCRIPT_NAME=/") + file_name)).c_str(),
-            (s5 = ("QUERY_STRING=" + query)).c_str(),
-            nullptr
-        };
-        std::string message = get_output(file_name, envp, chroot);
-        size_t newline = message.find("\n\n");
-        std::string content_type = message.substr(0, newline), a, b;
-        if (parse_field(content_type, a, b)) {
-            return header(
-                200,
-                "",
-                b,
-                message.size() - newline - 2
-            ) + message.substr(newline + 2);
-        } else {
-            return generate_error(500, "");
+    if (compressible(type) &&
+        (settings.gzip_static || settings.gzip_cache_size)) {
+        record += "Vary: Accept-Encoding\n";
+    }
+    return record;
+}
+
+bool is_fresh(
+    const struct stat &info,
+    std::string_view if_none_match,
+    std::string_view if_modified_since
+) {
+    if (if_none_match.size()) {
+        if (if_none_match == "*") {
+            return true;
+        }
+        char etag[64];
+        size_t length = format_etag(info, etag, sizeof(etag));
+        return if_none_match.find(std::string_view(etag, length)) !=
+            std::string_view::npos;
+    }
+    if (if_modified_since.size()) {
+        char date[64];
+        if (if_modified_since.size() >= sizeof(date)) {
+            return false;
+        }
+        memcpy(date, if_modified_since.data(), if_modified_since.size());
+        date[if_modified_since.size()] = '\0';
+        struct tm since;
+        memset(&since, 0, sizeof(since));
+        const char *end = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &since);
+        return end != nullptr && info.st_mtime <= timegm(&since);
+    }
+    return false;
+}
+
+std::string not_modified(std::string_view record, bool keep_alive) {
+    std::string out;
+    append_status_line(out, 304);
+    out += SERVER_LINE;
+    out += record;
+    out += CONNECTION_LINE[keep_alive];
+    return out;
+}
+
+// A client may ask for any number of ranges, but more than this many are
+// not worth the parts; the whole file is sent instead.
+static constexpr size_t MAX_RANGES = 16;
+
+struct byte_range {
+    uint64_t first;
+    uint64_t last;
+};
+
+static std::string_view trim(std::string_view s) {
+    size_t first = s.find_first_not_of(" \t");
+    if (first == std::string_view::npos) {
+        return std::string_view();
+    }
+    return s.substr(first, s.find_last_not_of(" \t") - first + 1);
+}
+
+static bool parse_position(std::string_view text, uint64_t &n) {
+    const char *end = text.data() + text.size();
+    auto [last, error] = std::from_chars(text.data(), end, n);
+    return text.size() && error == std::errc() && last == end;
+}
+
+// The ranges of a file of size bytes a Range header asks for, cut to the
+// file; those that start past its end are left out. -1 when the header does
+// not count: another unit, a malformed range or too many of them.
+static int parse_ranges(
+    std::string_view header,
+    uint64_t size,
+    byte_range *ranges
+) {
+    header = trim(header);
+    if (header.size() < 6 || strncasecmp(header.data(), "bytes=", 6)) {
+        return -1;
+    }
+    header.remove_prefix(6);
+    int count = 0;
+    size_t listed = 0;
+    for (;;) {
+        size_t comma = header.find(',');
+        std::string_view item = trim(header.substr(0, comma));
+        if (item.size()) {
+            size_t dash = item.find('-');
+            if (++listed > MAX_RANGES || dash == std::string_view::npos) {
+                return -1;
+            }
+            std::string_view from = trim(item.substr(0, dash));
+            std::string_view to = trim(item.substr(dash + 1));
+            uint64_t first, last;
+            if (from.empty()) {
+                // The last bytes of the file.
+                if (!parse_position(to, last)) {
+                    return -1;
+                }
+                if (last != 0 && size != 0) {
+                    ranges[count++] = {size - std::min(last, size), size - 1};
+                }
+            } else {
+                if (!parse_position(from, first)) {
+                    return -1;
+                }
+                last = UINT64_MAX;
+                if (to.size() && (!parse_position(to, last) || last < first)) {
+                    return -1;
+                }
+                if (first < size) {
+                    ranges[count++] = {first, std::min(last, size - 1)};
+                }
+            }
         }
+        if (comma == std::string_view::npos) {
+            break;
+        }
+        header.remove_prefix(comma + 1);
+    }
+    return listed ? count : -1;
+}
+
+// If-Range holds when it is the strong ETag of the file or exactly its
+// modification date; otherwise the file has changed and goes whole.
+static bool range_holds(std::string_view if_range, const struct stat &info) {
+    if_range = trim(if_range);
+    if (if_range.empty()) {
+        return true;
+    }
+    if (if_range[0] == '"') {
+        char etag[64];
+        size_t length = format_etag(info, etag, sizeof(etag));
+        return if_range == std::string_view(etag, length);
+    }
+    char date[64];
+    if (if_range.size() >= sizeof(date) || if_range.compare(0, 2, "W/") == 0) {
+        return false;
+    }
+    memcpy(date, if_range.data(), if_range.size());
+    date[if_range.size()] = '\0';
+    struct tm since;
+    memset(&since, 0, sizeof(since));
+    const char *end = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &since);
+    return end != nullptr && *end == '\0' && info.st_mtime == timegm(&since);
+}
+
+// Boundaries only have to be unlikely in the file; they differ per response.
+static std::string_view next_boundary(char *out, size_t size) {
+    static thread_local uint64_t state = monotonic_us() ^ (uintptr_t) &state;
+    uint64_t z = state += 0x9e3779b97f4a7c15ull;
+    z = (z ^ z >> 30) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ z >> 27) * 0x94d049bb133111ebull;
+    z ^= z >> 31;
+    int length = snprintf(out, size, "%016llx", (unsigned long long) z);
+    return std::string_view(out, length < 0 ? 0 : length);
+}
+
+template <typename String>
+static void append_content_range(
+    String &out,
+    const byte_range &range,
+    uint64_t size
+) {
+    out += "Content-Range: bytes ";
+    append_number(out, range.first);
+    out += '-';
+    append_number(out, range.last);
+    out += '/';
+    append_number(out, size);
+}
+
+static void append_part_heading(
+    std::string &out,
+    std::string_view boundary,
+    std::string_view type,
+    const byte_range &range,
+    uint64_t size
+) {
+    out += "\r\n--";
+    out += boundary;
+    out += "\r\nContent-Type: ";
+    out += type;
+    out += "\r\n";
+    append_content_range(out, range, size);
+    out += "\r\n\r\n";
+}
+
+// Where the bytes of a range come from: the body in memory, or the file.
+static void place(
+    std::string_view &body,
+    off_t &offset,
+    size_t &length,
+    std::string_view whole,
+    off_t start,
+    const byte_range &range
+) {
+    size_t count = range.last - range.first + 1;
+    if (whole.size()) {
+        body = whole.substr(range.first, count);
+        length = 0;
     } else {
-        size_t length = info.st_size;
-        int file = open(file_name.c_str(), O_RDONLY);
-        std::string content;
-        content.resize(length);
-        if (read(file, &content[0], length) == -1) {
-            return generate_error(500, "");
+        body = std::string_view();
+        offset = start + range.first;
+        length = count;
+    }
+}
+
+void narrow_to_range(
+    response &answer,
+    const request &message,
+    const struct stat &info,
+    std::string_view record,
+    std::string_view type,
+    bool keep_alive
+) {
+    if (message.range.empty() || message.method != "GET" ||
+        !range_holds(message.if_range, info)) {
+        return;
+    }
+    byte_range ranges[MAX_RANGES];
+    uint64_t size = info.st_size;
+    int count = parse_ranges(message.range, size, ranges);
+    if (count < 0) {
+        return;
+    }
+    if (count == 0) {
+        char unsatisfied[64];
+        int length = snprintf(
+            unsatisfied,
+            sizeof(unsatisfied),
+            "Content-Range: bytes */%llu\n",
+            (unsigned long long) size
+        );
+        answer = generate_error(
+            416,
+            std::string_view(unsatisfied, length < 0 ? 0 : length),
+            keep_alive
+        );
+        return;
+    }
+    std::string_view whole = answer.body;
+    off_t start = answer.offset;
+    answer.data.clear();
+    if (count == 1) {
+        const byte_range &range = ranges[0];
+        answer.data.reserve(HEADER_RESERVE + record.size() + type.size() + 64);
+        append_status_line(answer.data, 206);
+        answer.data += SERVER_LINE;
+        answer.data += "Content-Type: ";
+        answer.data += type;
+        answer.data += '\n';
+        append_content_range(answer.data, range, size);
+        answer.data += "\nContent-Length: ";
+        append_number(answer.data, range.last - range.first + 1);
+        answer.data += '\n';
+        answer.data += record;
+        answer.data += CONNECTION_LINE[keep_alive];
+        place(answer.body, answer.offset, answer.length, whole, start, range);
+        return;
+    }
+    // Each part is headed by a boundary with its type and range, and the
+    // last one is followed by the closing boundary. The first part goes
+    // with the header, the others are pieces.
+    char mark[24];
+    std::string_view boundary = next_boundary(mark, sizeof(mark));
+    std::string heading;
+    append_part_heading(heading, boundary, type, ranges[0], size);
+    uint64_t total = heading.size() + ranges[0].last - ranges[0].first + 1;
+    answer.pieces.resize(count);
+    for (int i = 1; i != count; ++i) {
+        response::piece &p = answer.pieces[i - 1];
+        append_part_heading(p.data, boundary, type, ranges[i], size);
+        total += p.data.size() + ranges[i].last - ranges[i].first + 1;
+        place(p.body, p.offset, p.length, whole, start, ranges[i]);
+    }
+    std::string &closing = answer.pieces.back().data;
+    closing += "\r\n--";
+    closing += boundary;
+    closing += "--\r\n";
+    total += closing.size();
+    std::string multipart = "multipart/byteranges; boundary=";
+    multipart += boundary;
+    build_header(answer.data, 206, record, multipart, total, keep_alive);
+    answer.data += heading;
+    place(answer.body, answer.offset, answer.length, whole, start, ranges[0]);
+}
+
+static std::string_view error_page(int code) {
+    const status_entry *status = find_status(code);
+    return status == nullptr ? find_status(500)->page : status->page;
+}
+
+void append_error(
+    std::string &out,
+    int code,
+    std::string_view record,
+    bool keep_alive
+) {
+    std::string_view page = error_page(code);
+    append_header(out, code, record, "text/html", page.size(), keep_alive);
+    out += page;
+}
+
+response generate_error(int code, std::string_view record, bool keep_alive) {
+    response answer;
+    answer.body = error_page(code);
+    append_header(
+        answer.data,
+        code,
+        record,
+        "text/html",
+        answer.body.size(),
+        keep_alive
+    );
+    return answer;
+}
+
+static std::pmr::vector<std::pmr::string> cgi_environment(
+    const std::string &file_name,
+    const request &message,
+    std::pmr::memory_resource *memory
+) {
+    struct utsname host;
+    uname(&host);
+    char directory[PATH_MAX];
+    if (getcwd(directory, sizeof(directory)) == nullptr) {
+        directory[0] = '\0';
+    }
+    char port[8];
+    *std::to_chars(port, port + sizeof(port) - 1, settings.port).ptr = '\0';
+    const std::string_view variables[][3] = {
+        {"SERVER_SOFTWARE=", NAME, ""},
+        {"SERVER_NAME=", host.nodename, ""},
+        {"GATEWAY_INTERFACE=CGI/1.1", "", ""},
+        {"SERVER_PROTOCOL=", message.version, ""},
+        {"SERVER_PORT=", port, ""},
+        {"REQUEST_METHOD=", message.method, ""},
+        {"PATH_INFO=", "", ""},
+        {"PATH_TRANSLATED=", directory, ""},
+        {"SCRIPT_NAME=/", file_name, ""},
+        {"QUERY_STRING=", message.query, ""}
+    };
+    std::pmr::vector<std::pmr::string> environment(memory);
+    environment.reserve(sizeof(variables) / sizeof(*variables));
+    for (const auto &parts : variables) {
+        std::pmr::string &variable = environment.emplace_back();
+        variable.reserve(parts[0].size() + parts[1].size() + parts[2].size());
+        for (std::string_view part : parts) {
+            variable += part;
         }
-        return header(200, "", determine_mime(file_name), length) + content;
-    }
-}
-
-std::string generate_listing(const std::string &directory) {
-    if (access(directory.c_str(), R_OK)) {
-        return generate_error(403, "");
-    }
-    DIR *dir;
-    struct dirent *entry;
-    std::string page =
-        HTML_HEAD +
-        "    <body>\n"
-        "        <h1>Directory listing</h1>\n"
-        "        <ul>\n";
-    std::vector<std::string> files;
-    if ((dir = opendir(directory.c_str())) != nullptr) {
-        while ((entry = readdir(dir)) != nullptr) {
-            std::string file = entry->d_name;
-            files.push_back(file);
+    }
+    return environment;
+}
+
+// A chunked body has no length known in advance, the script reads it up to
+// the end of its input.
+static void describe_body(
+    std::pmr::vector<std::pmr::string> &environment,
+    const request &message
+) {
+    if (message.content_length.size()) {
+        environment.emplace_back("CONTENT_LENGTH=");
+        environment.back() += message.content_length;
+    }
+    if (message.content_type.size()) {
+        environment.emplace_back("CONTENT_TYPE=");
+        environment.back() += message.content_type;
+    }
+}
+
+response from_file(
+    const std::string &file_name,
+    const struct stat &info,
+    const request &message,
+    bool keep_alive,
+    bool encoded,
+    std::pmr::memory_resource *memory
+) {
+    if (info.st_mode & S_IXUSR) {
+        std::pmr::vector<std::pmr::string> environment =
+            cgi_environment(file_name, message, memory);
+        describe_body(environment, message);
+        std::pmr::vector<const char *> envp(memory);
+        envp.reserve(environment.size() + 1);
+        for (const std::pmr::string &variable : environment) {
+            envp.push_back(variable.c_str());
         }
-        std::sort(files.begin(), files.end());
-        for (std::string &file : files) {
-            if (file_type(directory + file) == STAT::DIRECTORY) {
-                file += "/";
-            }
-            if (file != "./" && file != "../") {
-                page +=
-                    "            <li>\n"
-                    "                <a href=" + url_encode(file) + ">" + file +
-                    "</a>\n"
-                    "            </li>\n";
+        envp.push_back(nullptr);
+        int body[2] = {-1, -1};
+        if (message.has_body()) {
+            if (pipe2(body, O_CLOEXEC) == -1) {
+                return generate_error(500, "", keep_alive);
             }
+            fcntl(body[1], F_SETFL, O_NONBLOCK);
+        }
+        bool chunked = message.version == "HTTP/1.1";
+        bool close = !keep_alive || !chunked;
+        std::unique_ptr<cgi_stream> stream(
+            new cgi_stream(file_name, envp.data(), body[0], chunked, !close)
+        );
+        response answer;
+        answer.upload = body[1];
+        if (stream->failed()) {
+            return generate_error(500, "", keep_alive);
         }
-        closedir(dir);
+        answer.close = close;
+        answer.stream = std::move(stream);
+        return answer;
     } else {
-        return generate_error(403, "");
+        response answer;
+        struct stat opened;
+        answer.file = open(file_name.c_str(), O_RDONLY | O_CLOEXEC);
+        if (answer.file == -1 || fstat(answer.file, &opened) == -1) {
+            return generate_error(500, "", keep_alive);
+        }
+        answer.length = opened.st_size;
+        std::string_view type =
+            encoded ? encoded_type(file_name) : determine_mime(file_name);
+        std::pmr::string record =
+            representation(opened, type, encoded, memory);
+        append_header(
+            answer.data,
+            200,
+            record,
+            type,
+            answer.length,
+            keep_alive
+        );
+        narrow_to_range(answer, message, opened, record, type, keep_alive);
+        return answer;
+    }
+}
+
+response from_fastcgi(
+    fastcgi_pool &pool,
+    event_loop &loop,
+    const std::string &file_name,
+    const request &message,
+    bool keep_alive,
+    std::pmr::memory_resource *memory
+) {
+    std::pmr::vector<std::pmr::string> environment =
+        cgi_environment(file_name, message, memory);
+    describe_body(environment, message);
+    int body[2] = {-1, -1};
+    if (message.has_body() &&
+        pipe2(body, O_CLOEXEC | O_NONBLOCK) == -1) {
+        return generate_error(500, "", keep_alive);
+    }
+    bool chunked = message.version == "HTTP/1.1";
+    bool close = !keep_alive || !chunked;
+    std::unique_ptr<fastcgi_stream> stream(new fastcgi_stream(
+        pool,
+        loop,
+        environment,
+        body[0],
+        chunked,
+        !close
+    ));
+    response answer;
+    answer.upload = body[1];
+    if (stream->failed()) {
+        return generate_error(500, "", keep_alive);
     }
-    page +=
-        "        </ul>\n"
-        "    </body>\n"
-        "</html>\n";
-    return header(200, "", "text/html", page.size()) + page;
+    answer.close = close;
+    answer.stream = std::move(stream);
+    return answer;
 }
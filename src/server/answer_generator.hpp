@@ -2,22 +2,201 @@
 
 #include <cstddef>
 #include <cstdint>
+#include <memory>
+#include <memory_resource>
 #include <string>
+#include <string_view>
+#include <vector>
+
+extern "C" {
+#include <sys/stat.h>
+#include <sys/types.h>
+}
+
+#include "logger.hpp"
+
+class event_loop;
+class fastcgi_pool;
+struct request;
+
+extern const std::string_view HTML_HEAD;
+
+enum class STREAM {
+    MORE,
+    AGAIN,
+    DONE,
+    FAILED
+};
+
+class body_stream {
+public:
+    virtual ~body_stream() = default;
+    virtual int descriptor() const = 0;
+    virtual STREAM produce(std::string &out) = 0;
+    // When expire() has to be called (a monotonic_ms() time), 0 if never.
+    virtual int64_t expires() const {
+        return 0;
+    }
+    virtual void expire() {
+    }
+    // The whole request body has been passed to the stream, limits on the
+    // time it takes to answer start from now.
+    virtual void input_complete() {
+    }
+};
+
+struct response {
+    response();
+    response(std::string data);
+    response(response &&other);
+    response &operator=(response &&other);
+    ~response();
+    response(const response &) = delete;
+    response &operator=(const response &) = delete;
+
+    size_t buffered() const;
+    bool more_pieces() const;
+    // Moves on to the next piece, false when there is none.
+    bool advance();
+
+    // A part of a multipart body, sent like the response itself: its data,
+    // its body and then length bytes of file from offset.
+    struct piece {
+        std::string data;
+        std::string_view body;
+        off_t offset;
+        size_t length;
+    };
+
+    // data is sent first, then body, which is not copied: it points to
+    // static storage or to something kept alive by keeper.
+    std::string data;
+    std::string_view body;
+    std::shared_ptr<const void> keeper;
+    size_t sent;
+    // length bytes of file from offset follow; the descriptor is closed
+    // with the response unless it is borrowed from what keeper holds.
+    int file;
+    bool borrowed_file;
+    off_t offset;
+    size_t length;
+    // What follows once the above has been sent.
+    std::vector<piece> pieces;
+    size_t next_piece;
+    std::unique_ptr<body_stream> stream;
+    // Write end of the pipe the request body goes to, -1 if the response
+    // does not take one. The connection takes it over.
+    int upload;
+    bool close;
+    access_record journal;
+};
+
+void append_header(
+    std::string &out,
+    int code,
+    std::string_view record,
+    std::string_view type,
+    size_t size,
+    bool keep_alive
+);
+
+void append_header(
+    std::pmr::string &out,
+    int code,
+    std::string_view record,
+    std::string_view type,
+    size_t size,
+    bool keep_alive
+);
+
+void append_status(
+    std::string &out,
+    std::string_view status,
+    std::string_view record,
+    bool keep_alive
+);
 
 std::string header(
     int code,
-    const std::string &record,
-    const std::string &type,
-    size_t size
+    std::string_view record,
+    std::string_view type,
+    size_t size,
+    bool keep_alive
 );
 
-std::string generate_error(int code, const std::string &record);
+std::string_view reason(int code);
 
-std::string from_file(
+std::string status_header(
+    std::string_view status,
+    std::string_view record,
+    bool keep_alive
+);
+
+std::pmr::string validators(
+    const struct stat &info,
+    std::pmr::memory_resource *memory
+);
+
+// Validators of a file sent as type, that ranges of it may be asked for
+// and, when that type is also sent compressed, whether this is the gzip
+// encoding and that it depends on Accept-Encoding.
+std::pmr::string representation(
+    const struct stat &info,
+    std::string_view type,
+    bool encoded,
+    std::pmr::memory_resource *memory
+);
+
+bool is_fresh(
+    const struct stat &info,
+    std::string_view if_none_match,
+    std::string_view if_modified_since
+);
+
+std::string not_modified(std::string_view record, bool keep_alive);
+
+// answer is the 200 for the file info describes, its data the header made
+// from record and type and then the whole file in body or from the file.
+// A Range in a GET that still holds after If-Range turns it into a 206 for
+// those ranges (multipart/byteranges for more than one), or a 416 when none
+// of them is in the file.
+void narrow_to_range(
+    response &answer,
+    const request &message,
+    const struct stat &info,
+    std::string_view record,
+    std::string_view type,
+    bool keep_alive
+);
+
+void append_error(
+    std::string &out,
+    int code,
+    std::string_view record,
+    bool keep_alive
+);
+
+response generate_error(int code, std::string_view record, bool keep_alive);
+
+// info is what stat() says about the file, which has to be readable. An
+// encoded file is the .gz next to the one that was asked for, and is sent
+// as its gzip encoding.
+response from_file(
     const std::string &file_name,
-    uint16_t port,
-    const std::string &query,
-    const std::string &chroot
+    const struct stat &info,
+    const request &message,
+    bool keep_alive,
+    bool encoded,
+    std::pmr::memory_resource *memory
 );
 
-std::string generate_listing(const std::string &directory);
+// The answer streams from the application as it comes, like that of a CGI
+// script; the request body goes to it through answer.upload.
+response from_fastcgi(
+    fastcgi_pool &pool,
+    event_loop &loop,
+    const std::string &file_name,
+    const request &message,
+    bool keep_alive,
+    std::pmr::memory_resource *memory
+);
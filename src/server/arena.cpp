@@ -0,0 +1,88 @@
+#include <cstdint>
+#include <new>
+
+#include "arena.hpp"
+
+static constexpr size_t HEADER = sizeof(std::max_align_t);
+
+arena::arena(size_t block_size) :
+    block_size(block_size),
+    first(nullptr),
+    current(nullptr),
+    offset(HEADER) {
+}
+
+arena::~arena() {
+    while (first != nullptr) {
+        block *next = first->next;
+        ::operator delete(first);
+        first = next;
+    }
+}
+
+// Of the blocks bigger than the usual size only the biggest is kept, in
+// its place, so that a connection which keeps serving large requests of
+// one shape does not allocate one for each of them.
+void arena::reset() {
+    block *kept = nullptr;
+    for (block *b = first; b != nullptr; b = b->next) {
+        if (b->size > block_size && (kept == nullptr || b->size > kept->size)) {
+            kept = b;
+        }
+    }
+    block **link = &first;
+    while (*link != nullptr) {
+        block *b = *link;
+        if (b->size > block_size && b != kept) {
+            *link = b->next;
+            ::operator delete(b);
+        } else {
+            link = &b->next;
+        }
+    }
+    current = first;
+    offset = HEADER;
+}
+
+void *arena::do_allocate(size_t bytes, size_t alignment) {
+    for (;;) {
+        if (current != nullptr) {
+            uintptr_t base = (uintptr_t) current;
+            size_t start =
+                ((base + offset + alignment - 1) & ~(alignment - 1)) - base;
+            if (start + bytes <= current->size) {
+                offset = start + bytes;
+                return (char *) current + start;
+            }
+            if (current->next != nullptr) {
+                current = current->next;
+                offset = HEADER;
+                continue;
+            }
+        }
+        size_t size = HEADER + bytes + alignment;
+        if (size < block_size) {
+            size = block_size;
+        }
+        block *b = (block *) ::operator new(size);
+        b->size = size;
+        if (current == nullptr) {
+            b->next = first;
+            first = b;
+        } else {
+            b->next = current->next;
+            current->next = b;
+        }
+        current = b;
+        offset = HEADER;
+    }
+}
+
+void arena::do_deallocate(void *, size_t, size_t) {
+}
+
+bool arena::do_is_equal(
+    const std::pmr::memory_resource &other
+) const noexcept {
+    return this == &other;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstddef>
+#include <memory_resource>
+
+// Bump allocator for the temporaries of one request. reset() makes all of
+// its memory free again but keeps the blocks, so once a connection has
+// served a request of some shape the next one like it does not touch the
+// global heap. Of the blocks bigger than the usual size, reset keeps only
+// the biggest. Blocks come from operator new.
+class arena : public std::pmr::memory_resource {
+public:
+    explicit arena(size_t block_size = 4096);
+    ~arena();
+    arena(const arena &) = delete;
+    arena &operator=(const arena &) = delete;
+
+    void reset();
+
+private:
+    struct block {
+        block *next;
+        size_t size;
+    };
+
+    void *do_allocate(size_t bytes, size_t alignment) override;
+    void do_deallocate(void *p, size_t bytes, size_t alignment) override;
+    bool do_is_equal(
+        const std::pmr::memory_resource &other
+    ) const noexcept override;
+
+    size_t block_size;
+    block *first;
+    block *current;
+    size_t offset;
+};
@@ -0,0 +1,653 @@
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+extern "C" {
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <strings.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+}
+
+#include "common.hpp"
+#include "config_reader.hpp"
+#include "metrics.hpp"
+#include "cgi.hpp"
+
+static constexpr size_t STREAM_BUFFER = 4 * BUFFER_SIZE;
+static constexpr char HELPER[] = "/usr/bin/helper";
+
+static bool equal_nocase(std::string_view a, const char *b) {
+    return a.size() == strlen(b) && !strncasecmp(a.data(), b, a.size());
+}
+
+static std::string_view trim(std::string_view s) {
+    size_t first = s.find_first_not_of(" \t\r");
+    if (first == std::string_view::npos) {
+        return std::string_view();
+    }
+    return s.substr(first, s.find_last_not_of(" \t\r") - first + 1);
+}
+
+size_t header_end(const std::string &buffer, size_t &skip) {
+    size_t lf = buffer.find("\n\n"), crlf = buffer.find("\r\n\r\n");
+    if (crlf != std::string::npos && (lf == std::string::npos || crlf < lf)) {
+        skip = 4;
+        return crlf;
+    }
+    skip = 2;
+    return lf;
+}
+
+// Control socket of the sandbox (see helper.cpp), -1 when scripts are run
+// outside of a chroot.
+static int sandbox = -1;
+
+bool start_sandbox(const std::string &chroot) {
+    int ends[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, ends) == -1) {
+        fprintf(stderr, "Error: socketpair() failed: %d\n", errno);
+        return false;
+    }
+    std::string descriptor = std::to_string(ends[1]);
+    pid_t pid = fork();
+    if (pid == 0) {
+        fcntl(ends[1], F_SETFD, 0);
+        execl(HELPER, HELPER, PROJECT_NAME, chroot.c_str(),
+            descriptor.c_str(), nullptr);
+        _exit(1);
+    }
+    close(ends[1]);
+    char ready;
+    if (pid == -1 || recv(ends[0], &ready, 1, 0) != 1) {
+        fprintf(stderr, "Error: sandbox in %s failed to start\n",
+            chroot.c_str());
+        close(ends[0]);
+        return false;
+    }
+    sandbox = ends[0];
+    return true;
+}
+
+static int cgroup_procs = -1;
+
+// Sent to the sandbox in front of each request (see helper.cpp); body and
+// cgroup say whether the pipe with the body and cgroup_procs are attached.
+struct script_limits {
+    uint64_t cpu;
+    uint64_t memory;
+    uint32_t body;
+    uint32_t cgroup;
+};
+
+// Arguments of start_script, which hands back the errno of a failed
+// execve in error.
+struct script_start {
+    const char *path;
+    char *const *argv;
+    const char *const *envp;
+    int input;
+    int output;
+    sigset_t mask;
+    int error;
+};
+
+// The child of clone, run in the memory of this process on a stack of its
+// own until execve, so it only makes async-signal-safe calls. Signals stay
+// blocked until their handlers are back to the default, which also runs
+// SIGPIPE and SIGCHLD; the script is confined before its first
+// instruction, and is not run if it cannot be put into the cgroup.
+static int start_script(void *argument) {
+    script_start &start = *(script_start *) argument;
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = SIG_DFL;
+    for (int number = 1; number < NSIG; ++number) {
+        struct sigaction current;
+        if (sigaction(number, nullptr, &current) == 0 &&
+            current.sa_handler != SIG_DFL &&
+            (current.sa_handler != SIG_IGN ||
+                number == SIGPIPE ||
+                number == SIGCHLD)) {
+            sigaction(number, &action, nullptr);
+        }
+    }
+    sigprocmask(SIG_SETMASK, &start.mask, nullptr);
+    if (settings.cgi_cpu_limit) {
+        struct rlimit limit = {
+            settings.cgi_cpu_limit,
+            settings.cgi_cpu_limit + 1
+        };
+        setrlimit(RLIMIT_CPU, &limit);
+    }
+    if (settings.cgi_memory_limit) {
+        struct rlimit limit = {
+            settings.cgi_memory_limit,
+            settings.cgi_memory_limit
+        };
+        setrlimit(RLIMIT_AS, &limit);
+    }
+    if ((cgroup_procs == -1 || write(cgroup_procs, "0", 1) == 1) &&
+        (start.input == -1 || dup2(start.input, STDIN_FILENO) != -1) &&
+        dup2(start.output, STDOUT_FILENO) != -1) {
+        execve(start.path, start.argv, (char *const *) start.envp);
+    }
+    start.error = errno;
+    _exit(127);
+}
+
+// Started the way posix_spawn does it, with CLONE_VM and CLONE_VFORK, but
+// with CLONE_PIDFD: the pidfd exists before the script can exit and be
+// reaped (SIGCHLD is ignored), so a late kill never hits a process that
+// got its pid. The child runs on a part of this thread's stack, which is
+// suspended until execve. Kernels before 5.2 ignore CLONE_PIDFD and leave
+// process at -1.
+static pid_t spawn_local(
+    const std::string &program,
+    const char *const envp[],
+    int input,
+    int output,
+    int &process
+) {
+    alignas(16) char stack[16384];
+    char *const argv[] = {(char *) program.c_str(), nullptr};
+    script_start start = {program.c_str(), argv, envp, input, output, {}, 0};
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &start.mask);
+    pid_t pid = clone(
+        start_script,
+        stack + sizeof(stack),
+        CLONE_VM | CLONE_VFORK | CLONE_PIDFD | SIGCHLD,
+        &start,
+        &process
+    );
+    pthread_sigmask(SIG_SETMASK, &start.mask, nullptr);
+    if (pid == -1 || start.error) {
+        if (process != -1) {
+            close(process);
+            process = -1;
+        }
+        return -1;
+    }
+    return pid;
+}
+
+// The script is passed to the sandbox as an open descriptor together with
+// the output pipe (and the input one if there is a body) and a socket of
+// its own for the answer, so requests from several threads or processes
+// never wait for each other's replies. The answer is the pid with the
+// pidfd of the script attached.
+static pid_t receive_pid(int socket, int &process) {
+    pid_t pid = -1;
+    union {
+        char buffer[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec part = {&pid, sizeof(pid)};
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &part;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+    ssize_t size = recvmsg(socket, &message, MSG_CMSG_CLOEXEC);
+    struct cmsghdr *c = size > 0 ? CMSG_FIRSTHDR(&message) : nullptr;
+    if (c != nullptr && c->cmsg_level == SOL_SOCKET &&
+        c->cmsg_type == SCM_RIGHTS && c->cmsg_len == CMSG_LEN(sizeof(int))) {
+        memcpy(&process, CMSG_DATA(c), sizeof(int));
+    }
+    if (size != sizeof(pid) || pid == -1) {
+        if (process != -1) {
+            close(process);
+            process = -1;
+        }
+        return -1;
+    }
+    return pid;
+}
+
+static pid_t spawn_sandboxed(
+    const std::string &program,
+    const char *const envp[],
+    int input,
+    int output,
+    int &process
+) {
+    int script = open(program.c_str(), O_RDONLY | O_CLOEXEC);
+    if (script == -1) {
+        return -1;
+    }
+    int reply[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, reply) == -1) {
+        close(script);
+        return -1;
+    }
+    script_limits limits = {
+        settings.cgi_cpu_limit,
+        settings.cgi_memory_limit,
+        input != -1,
+        cgroup_procs != -1
+    };
+    std::string request((const char *) &limits, sizeof(limits));
+    request += basename(program);
+    request += '\0';
+    for (const char *const *variable = envp; *variable; ++variable) {
+        request.append(*variable, strlen(*variable) + 1);
+    }
+    int descriptors[5] = {reply[1], script, output};
+    size_t count = 3;
+    if (input != -1) {
+        descriptors[count++] = input;
+    }
+    if (cgroup_procs != -1) {
+        descriptors[count++] = cgroup_procs;
+    }
+    union {
+        char buffer[CMSG_SPACE(sizeof(descriptors))];
+        struct cmsghdr align;
+    } control;
+    struct iovec part = {request.data(), request.size()};
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &part;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = CMSG_SPACE(count * sizeof(int));
+    struct cmsghdr *c = CMSG_FIRSTHDR(&message);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(count * sizeof(int));
+    memcpy(CMSG_DATA(c), descriptors, count * sizeof(int));
+    ssize_t sent = sendmsg(sandbox, &message, MSG_NOSIGNAL);
+    close(reply[1]);
+    close(script);
+    pid_t pid = -1;
+    if (sent == -1) {
+        fprintf(stderr, "Error: sendmsg() failed: %d\n", errno);
+    } else {
+        pid = receive_pid(reply[0], process);
+    }
+    close(reply[0]);
+    return pid;
+}
+
+pid_t spawn_cgi(
+    const std::string &program,
+    const char *const envp[],
+    int input,
+    int &output,
+    int &process
+) {
+    process = -1;
+    int fd[2];
+    if (pipe2(fd, O_CLOEXEC) == -1) {
+        return -1;
+    }
+    pid_t pid = sandbox == -1 ?
+        spawn_local(program, envp, input, fd[1], process) :
+        spawn_sandboxed(program, envp, input, fd[1], process);
+    close(fd[1]);
+    if (pid == -1) {
+        close(fd[0]);
+        return -1;
+    }
+    fcntl(fd[0], F_SETFL, fcntl(fd[0], F_GETFL) | O_NONBLOCK);
+    output = fd[0];
+    return pid;
+}
+
+bool parse_cgi_header(
+    std::string_view block,
+    std::string &status,
+    std::string &record
+) {
+    bool typed = false, located = false;
+    status.clear();
+    record.clear();
+    while (block.size()) {
+        size_t newline = block.find('\n');
+        std::string_view line = block.substr(0, newline);
+        block.remove_prefix(
+            newline == std::string_view::npos ? block.size() : newline + 1
+        );
+        line = trim(line);
+        if (line.empty()) {
+            continue;
+        }
+        size_t colon = line.find(':');
+        if (colon == std::string_view::npos || colon == 0) {
+            return false;
+        }
+        std::string_view name = trim(line.substr(0, colon));
+        std::string_view value = trim(line.substr(colon + 1));
+        if (equal_nocase(name, "Status")) {
+            int code = atoi(std::string(value.substr(0, 3)).c_str());
+            if (code < 100 || code > 999) {
+                return false;
+            }
+            if (value.size() > 4) {
+                status = value;
+            } else {
+                status = std::to_string(code) + " ";
+                status += reason(code);
+            }
+            continue;
+        }
+        if (equal_nocase(name, "Content-Length") ||
+            equal_nocase(name, "Transfer-Encoding") ||
+            equal_nocase(name, "Connection")) {
+            continue;
+        }
+        if (equal_nocase(name, "Content-Type")) {
+            typed = true;
+        } else if (equal_nocase(name, "Location")) {
+            located = true;
+        }
+        record.append(name);
+        record.append(": ");
+        record.append(value);
+        record += '\n';
+    }
+    if (status.empty()) {
+        status = located ? "302 Found" : "200 OK";
+    }
+    return typed || located;
+}
+
+// Free CGI slots as an eventfd semaphore shared by all workers and forked
+// children, -1 without a limit. Streams waiting for a slot watch a
+// descriptor of their own for it: epoll can hold the same descriptor only
+// once, and it has to stay open until the connection stops watching it.
+static int free_slots = -1;
+
+bool init_cgi_limits() {
+    if (settings.max_cgi_processes) {
+        free_slots = eventfd(
+            settings.max_cgi_processes,
+            EFD_SEMAPHORE | EFD_NONBLOCK | EFD_CLOEXEC
+        );
+        if (free_slots == -1) {
+            fprintf(stderr, "Error: eventfd() failed: %d\n", errno);
+            return false;
+        }
+    }
+    if (settings.cgi_cgroup.size()) {
+        std::string path = settings.cgi_cgroup + "/cgroup.procs";
+        cgroup_procs = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+        if (cgroup_procs == -1) {
+            fprintf(stderr, "Error: can't open %s: %d\n", path.c_str(),
+                errno);
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool take_slot() {
+    uint64_t value;
+    return free_slots == -1 ||
+        read(free_slots, &value, sizeof(value)) == sizeof(value);
+}
+
+static void give_slot() {
+    uint64_t one = 1;
+    if (free_slots != -1 && write(free_slots, &one, sizeof(one)) == -1) {
+        fprintf(stderr, "Error: write() failed: %d\n", errno);
+    }
+}
+
+cgi_stream::cgi_stream(
+    const std::string &program,
+    const char *const envp[],
+    int input,
+    bool chunked,
+    bool keep_alive
+) :
+    program(program),
+    pid(-1),
+    process(-1),
+    input(input),
+    output(-1),
+    waiter(-1),
+    holding(false),
+    queued(false),
+    ended(false),
+    chunked(chunked),
+    keep_alive(keep_alive),
+    header_sent(false),
+    timed_out(false),
+    started(monotonic_us()),
+    deadline(monotonic_ms() + settings.cgi_timeout) {
+    if (take_slot()) {
+        holding = true;
+        launch(envp);
+        return;
+    }
+    for (const char *const *variable = envp; *variable; ++variable) {
+        environment.append(*variable, strlen(*variable) + 1);
+    }
+    queued = true;
+    waiter = fcntl(free_slots, F_DUPFD_CLOEXEC, 0);
+}
+
+cgi_stream::~cgi_stream() {
+    stop();
+    if (holding) {
+        give_slot();
+    }
+    if (process != -1) {
+        close(process);
+    }
+    if (input != -1) {
+        close(input);
+    }
+    if (output != -1) {
+        close(output);
+    }
+    if (waiter != -1) {
+        close(waiter);
+    }
+}
+
+bool cgi_stream::failed() const {
+    return output == -1 && waiter == -1;
+}
+
+// Once the output is over the pidfd is watched until the script is gone.
+int cgi_stream::descriptor() const {
+    if (output == -1) {
+        return waiter;
+    }
+    return ended && process != -1 ? process : output;
+}
+
+int64_t cgi_stream::expires() const {
+    return pid != -1 || queued ? deadline : 0;
+}
+
+void cgi_stream::expire() {
+    if ((pid != -1 || queued) && monotonic_ms() >= deadline) {
+        stop();
+        timed_out = true;
+        count_cgi_timeout();
+    }
+}
+
+void cgi_stream::input_complete() {
+    if (pid != -1 || queued) {
+        deadline = monotonic_ms() + settings.cgi_timeout;
+    }
+}
+
+void cgi_stream::launch(const char *const envp[]) {
+    int64_t now = monotonic_us();
+    pid = spawn_cgi(program, envp, input, output, process);
+    record_stage(STAGE::CGI_SPAWN, monotonic_us() - now);
+    if (pid == -1) {
+        return;
+    }
+    // The script has its own copy now; without this one writing the body
+    // fails once the script is gone instead of filling the pipe.
+    if (input != -1) {
+        close(input);
+        input = -1;
+    }
+    started = now;
+    deadline = now / 1000 + settings.cgi_timeout;
+}
+
+void cgi_stream::stop() {
+    if (pid == -1) {
+        return;
+    }
+    // Without a pidfd the script was gone before one could be opened, and
+    // its pid may belong to another process by now.
+#ifdef SYS_pidfd_send_signal
+    if (process != -1) {
+        syscall(SYS_pidfd_send_signal, process, SIGKILL, nullptr, 0);
+    }
+#endif
+    pid = -1;
+}
+
+// The slot is only given back once the script has exited: one that closes
+// its output and goes on running still counts, and is killed when it runs
+// out of time. Without a pidfd there is no telling, the end of the output
+// has to do.
+STREAM cgi_stream::finish(std::string &out) {
+    if (pid != -1 && process != -1) {
+        struct pollfd exited = {process, POLLIN, 0};
+        if (poll(&exited, 1, 0) == 0) {
+            return STREAM::AGAIN;
+        }
+    }
+    pid = -1;
+    if (holding) {
+        holding = false;
+        give_slot();
+    }
+    record_stage(STAGE::CGI_RUN, monotonic_us() - started);
+    if (!header_sent) {
+        return fail(out);
+    }
+    if (chunked) {
+        out += "0\r\n\r\n";
+    }
+    return STREAM::DONE;
+}
+
+// Scripts that never got a slot are answered with 503, the ones that were
+// started and failed with 500.
+STREAM cgi_stream::fail(std::string &out) {
+    stop();
+    if (header_sent) {
+        return STREAM::FAILED;
+    }
+    header_sent = true;
+    out.clear();
+    append_error(out, queued ? 503 : 500, "", keep_alive);
+    return STREAM::DONE;
+}
+
+void cgi_stream::append_chunk(
+    std::string &out,
+    const char *data,
+    size_t size
+) {
+    if (size == 0) {
+        return;
+    }
+    if (chunked) {
+        char length[32];
+        snprintf(length, sizeof(length), "%zx\r\n", size);
+        out += length;
+    }
+    out.append(data, size);
+    if (chunked) {
+        out += "\r\n";
+    }
+}
+
+STREAM cgi_stream::produce(std::string &out) {
+    if (timed_out) {
+        return fail(out);
+    }
+    if (ended) {
+        return finish(out);
+    }
+    if (queued) {
+        if (!take_slot()) {
+            return STREAM::AGAIN;
+        }
+        holding = true;
+        std::vector<const char *> envp;
+        for (size_t i = 0; i < environment.size();) {
+            envp.push_back(environment.data() + i);
+            i += strlen(environment.data() + i) + 1;
+        }
+        envp.push_back(nullptr);
+        queued = false;
+        launch(envp.data());
+        if (pid == -1) {
+            return fail(out);
+        }
+        environment.clear();
+        environment.shrink_to_fit();
+        return STREAM::MORE;
+    }
+    char buffer[STREAM_BUFFER];
+    ssize_t bytes = read(output, buffer, sizeof(buffer));
+    if (bytes == -1) {
+        if (errno == EINTR) {
+            return STREAM::MORE;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return STREAM::AGAIN;
+        }
+        return fail(out);
+    }
+    if (bytes == 0) {
+        ended = true;
+        return process != -1 ? STREAM::MORE : finish(out);
+    }
+    if (header_sent) {
+        append_chunk(out, buffer, bytes);
+        return STREAM::MORE;
+    }
+    pending.append(buffer, bytes);
+    size_t skip;
+    size_t end = header_end(pending, skip);
+    if (end == std::string::npos) {
+        if (pending.size() > settings.max_header_size) {
+            return fail(out);
+        }
+        return STREAM::MORE;
+    }
+    std::string status, record;
+    if (!parse_cgi_header(
+            std::string_view(pending).substr(0, end),
+            status,
+            record
+        )
+    ) {
+        return fail(out);
+    }
+    if (chunked) {
+        record += "Transfer-Encoding: chunked\n";
+    }
+    out = status_header(status, record, keep_alive);
+    header_sent = true;
+    append_chunk(out, pending.data() + end + skip, pending.size() - end - skip);
+    pending.clear();
+    pending.shrink_to_fit();
+    return STREAM::MORE;
+}
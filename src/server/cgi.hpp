@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+extern "C" {
+#include <sys/types.h>
+}
+
+#include "answer_generator.hpp"
+
+// Starts the sandbox that runs scripts inside chroot; without it they are
+// started directly.
+bool start_sandbox(const std::string &chroot);
+// Sets up the limit on running scripts and the cgroup they are put in.
+bool init_cgi_limits();
+
+// input becomes the standard input of the script if it is not -1. process
+// is set to a pidfd of the script, or -1 if none could be had; the script
+// must then never be signalled by its pid.
+pid_t spawn_cgi(
+    const std::string &program,
+    const char *const envp[],
+    int input,
+    int &output,
+    int &process
+);
+
+// Where the header block a script starts its output with ends, npos while
+// it has not; skip is the length of the empty line after it.
+size_t header_end(const std::string &buffer, size_t &skip);
+
+bool parse_cgi_header(
+    std::string_view block,
+    std::string &status,
+    std::string &record
+);
+
+// Output of a script. The script is started at once if there is a free
+// slot, otherwise the stream waits for one (until cgi_timeout) and keeps a
+// copy of the environment meanwhile. input is the read end of the pipe
+// with the request body or -1; the stream owns it until the script does.
+class cgi_stream : public body_stream {
+public:
+    cgi_stream(
+        const std::string &program,
+        const char *const envp[],
+        int input,
+        bool chunked,
+        bool keep_alive
+    );
+    ~cgi_stream();
+    cgi_stream(const cgi_stream &) = delete;
+    cgi_stream &operator=(const cgi_stream &) = delete;
+
+    bool failed() const;
+    int descriptor() const override;
+    STREAM produce(std::string &out) override;
+    int64_t expires() const override;
+    void expire() override;
+    void input_complete() override;
+
+private:
+    void launch(const char *const envp[]);
+    void stop();
+    STREAM finish(std::string &out);
+    STREAM fail(std::string &out);
+    void append_chunk(std::string &out, const char *data, size_t size);
+
+    std::string program;
+    std::string environment;
+    pid_t pid;
+    int process;
+    int input;
+    int output;
+    int waiter;
+    bool holding;
+    bool queued;
+    bool ended;
+    bool chunked;
+    bool keep_alive;
+    bool header_sent;
+    bool timed_out;
+    int64_t started;
+    int64_t deadline;
+    std::string pending;
+};
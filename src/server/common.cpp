@@ -1,23 +1,25 @@
 #include <algorithm>
+#include <cerrno>
 #include <cstring>
+#include <ctime>
+#include <deque>
 #include <unordered_map>
 
 extern "C" {
 #include <linux/limits.h>
-#include <sys/stat.h>
-#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/utsname.h>
-#include <sys/wait.h>
 #include <unistd.h>
 }
 
 #include "common.hpp"
-#include "answer_generator.hpp"
 
-static bool not_responding;
+struct mime_type {
+    std::string_view extension;
+    std::string_view type;
+};
 
-static const std::unordered_map<std::string, std::string> mime_types = {
+static constexpr mime_type mime_types[] = {
     {"html", "text/html"},
     {"css", "text/css"},
     {"js", "application/javascript"},
@@ -37,95 +39,133 @@ static const std::unordered_map<std::string, std::string> mime_types = {
     {"md", "text/x-markdown"}
 };
 
-std::string determine_mime(const std::string &file_name) {
-    size_t length = file_name.size();
-    size_t last_point = length - 1;
-    while (last_point != 0 && file_name[last_point] != '.') {
-        --last_point;
+static constexpr size_t MIME_COUNT = sizeof(mime_types) / sizeof(*mime_types);
+static constexpr size_t MIME_SLOTS = 64;
+
+static constexpr size_t mime_hash(std::string_view extension, uint32_t seed) {
+    uint32_t hash = seed;
+    for (char c : extension) {
+        hash = (hash ^ (uint8_t) c) * 16777619u;
     }
-    if (file_name[last_point] == '.') {
-        ++last_point;
-        std::string extension = std::string(
-            &file_name[last_point],
-            length - last_point
-        );
-        if (mime_types.find(extension) != mime_types.end()) {
-            return mime_types.at(extension);
+    return (hash ^ hash >> 16) & (MIME_SLOTS - 1);
+}
+
+// The built-in table is placed with a perfect hash: the compiler tries seeds
+// until every extension lands in its own slot, so a lookup is one hash and
+// one comparison.
+static constexpr uint32_t mime_seed() {
+    for (uint32_t seed = 2166136261u;; ++seed) {
+        bool taken[MIME_SLOTS] = {};
+        bool unique = true;
+        for (size_t i = 0; i != MIME_COUNT && unique; ++i) {
+            size_t slot = mime_hash(mime_types[i].extension, seed);
+            unique = !taken[slot];
+            taken[slot] = true;
+        }
+        if (unique) {
+            return seed;
         }
     }
-    return "application/octet-stream";
 }
 
-STAT file_type(const std::string &path) {
-    struct stat path_stat;
-    if (stat(path.c_str(), &path_stat) == -1) {
-        return STAT::NOT_EXIST;
+static constexpr uint32_t MIME_SEED = mime_seed();
+
+struct mime_index {
+    constexpr mime_index() : slot() {
+        for (size_t i = 0; i != MIME_COUNT; ++i) {
+            slot[mime_hash(mime_types[i].extension, MIME_SEED)] = i + 1;
+        }
     }
-    if (S_ISREG(path_stat.st_mode)) {
-        return STAT::REGULAR;
+
+    uint8_t slot[MIME_SLOTS];
+};
+
+static constexpr mime_index mime_slots;
+
+// Types added with mime= in the configuration take precedence; the strings
+// live in a deque so the views in the map stay valid.
+static std::deque<std::string> configured_names;
+static std::unordered_map<std::string_view, std::string_view> configured_types;
+
+bool add_mime_type(const std::string &definition) {
+    size_t space = definition.find_first_of(" \t");
+    size_t start = definition.find_first_not_of(" \t", space);
+    if (space == 0 || start == std::string::npos) {
+        return false;
     }
-    if (S_ISDIR(path_stat.st_mode)) {
-        return STAT::DIRECTORY;
+    std::string extension = definition.substr(0, space);
+    if (extension[0] == '.') {
+        extension.erase(0, 1);
     }
-    return STAT::UNKNOWN;
-}
-
-static void timer_handler(int) {
-    not_responding = true;
-}
-
-std::string get_output(
-    const std::string &program,
-    const char *envp[],
-    const std::string &chroot
-) {
-    std::string output;
-    int fd[2];
-    pipe(fd);
-    pid_t pid = fork();
-    if (pid == 0) {
-        close(fd[0]);
-        dup2(fd[1], STDOUT_FILENO);
-        close(fd[1]);
-        if (chroot.size()) {
-            execl("/bin/cp", "/bin/cp", program.c_str(),
-            (chroot + "/" + basename(program)).c_str(), nullptr);
-            execle("/usr/bin/helper", "/usr/bin/helper", PROJECT_NAME,
-            chroot.c_str(), basename(program).c_str(), nullptr, envp);
-        } else {
-            execle(program.c_str(), program.c_str(), nullptr, envp);
-        }
-        exit(0);
-    } else {
-        close(fd[1]);
-        struct itimerval itv;
-        itv.it_interval.tv_sec = 0;
-        itv.it_interval.tv_usec = 0;
-        itv.it_value.tv_sec = 1;
-        itv.it_value.tv_usec = 0;
-        struct sigaction act;
-        memset(&act, 0, sizeof(act));
-        act.sa_handler = timer_handler;
-        act.sa_flags = !SA_RESTART;
-        sigaction(SIGALRM, &act, nullptr);
-        setitimer(ITIMER_REAL, &itv, nullptr);
-        char buffer[BUFFER_SIZE];
-        for (;;) {
-            ssize_t count = read(fd[0], buffer, sizeof(buffer));
-            if (not_responding) {
-                kill(pid, SIGKILL);
-                return generate_error(500, "");
-            }
-            if (count == 0) {
-                break;
-            } else {
-                output += std::string(buffer, count);
+    if (extension.empty()) {
+        return false;
+    }
+    configured_names.push_back(extension);
+    std::string_view key = configured_names.back();
+    configured_names.push_back(definition.substr(start));
+    configured_types[key] = configured_names.back();
+    return true;
+}
+
+std::string_view determine_mime(std::string_view file_name) {
+    size_t point = file_name.rfind('.');
+    if (point != std::string_view::npos) {
+        std::string_view extension = file_name.substr(point + 1);
+        if (configured_types.size()) {
+            auto it = configured_types.find(extension);
+            if (it != configured_types.end()) {
+                return it->second;
             }
         }
-        close(fd[0]);
-        wait(0);
+        uint8_t slot = mime_slots.slot[mime_hash(extension, MIME_SEED)];
+        if (slot && mime_types[slot - 1].extension == extension) {
+            return mime_types[slot - 1].type;
+        }
     }
-    return output;
+    return "application/octet-stream";
+}
+
+static bool ends_with(std::string_view s, std::string_view suffix) {
+    return s.size() >= suffix.size() &&
+        s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// Text, and the scripts, data and images that are written as text.
+bool compressible(std::string_view type) {
+    return type.compare(0, 5, "text/") == 0 ||
+        type == "application/javascript" || type == "application/json" ||
+        ends_with(type, "+xml") || ends_with(type, "+json");
+}
+
+// The type of the file whose gzip encoding file_name holds, when it is the
+// .gz next to one that is sent compressed; empty for any other file.
+std::string_view encoded_type(std::string_view file_name) {
+    if (file_name.size() <= 3 || !ends_with(file_name, ".gz")) {
+        return std::string_view();
+    }
+    std::string_view type =
+        determine_mime(file_name.substr(0, file_name.size() - 3));
+    return compressible(type) ? type : std::string_view();
+}
+
+int64_t monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int64_t monotonic_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+std::string http_date(time_t t) {
+    struct tm parts;
+    char buffer[64];
+    gmtime_r(&t, &parts);
+    strftime(buffer, sizeof(buffer), "%a, %d %b %Y %H:%M:%S GMT", &parts);
+    return buffer;
 }
 
 std::string hostname() {
@@ -140,7 +180,8 @@ std::string pwd() {
     return buffer;
 }
 
-bool from_string(const std::string &s, uint16_t *n) {
+template <typename T>
+static bool parse_number(const std::string &s, T *n) {
     if (s.size() == 0) {
         return false;
     }
@@ -148,12 +189,24 @@ bool from_string(const std::string &s, uint16_t *n) {
     char *endptr;
     long res = strtol(s.c_str(), &endptr, 10);
     *n = res;
-    if (errno || *endptr || res < 0 || res != *n) {
+    if (errno || *endptr || res < 0 || res != (long) *n) {
         return false;
     }
     return true;
 }
 
+bool from_string(const std::string &s, uint16_t *n) {
+    return parse_number(s, n);
+}
+
+bool from_string(const std::string &s, unsigned *n) {
+    return parse_number(s, n);
+}
+
+bool from_string(const std::string &s, size_t *n) {
+    return parse_number(s, n);
+}
+
 std::string basename(const std::string &path) {
     return std::string(
         std::find(path.rbegin(), path.rend(), '/').base(),
@@ -2,7 +2,9 @@
 
 #include <cstddef>
 #include <cstdint>
+#include <ctime>
 #include <string>
+#include <string_view>
 
 constexpr ssize_t BUFFER_SIZE = 4096;
 
@@ -13,16 +15,17 @@ enum class STAT {
     UNKNOWN
 };
 
-std::string determine_mime(const std::string &file_name);
-STAT file_type(const std::string &path);
-
-std::string get_output(
-    const std::string &program,
-    const char *envp[],
-    const std::string &chroot
-);
+bool add_mime_type(const std::string &definition);
+std::string_view determine_mime(std::string_view file_name);
+bool compressible(std::string_view type);
+std::string_view encoded_type(std::string_view file_name);
 
+int64_t monotonic_ms();
+int64_t monotonic_us();
+std::string http_date(time_t t);
 std::string hostname();
 std::string pwd();
 bool from_string(const std::string &s, uint16_t *n);
+bool from_string(const std::string &s, unsigned *n);
+bool from_string(const std::string &s, size_t *n);
 std::string basename(const std::string &path);
@@ -5,6 +5,8 @@
 
 #include "config_reader.hpp"
 
+server_settings settings;
+
 static bool isnotspace(char c) {
     return !isspace(c);
 }
@@ -1,9 +1,55 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
 #include <string>
 #include <utility>
 #include <vector>
 
+enum class ENGINE {
+    EPOLL,
+    FORK,
+    URING
+};
+
+struct server_settings {
+    uint16_t port = 0;
+    std::string chroot;
+    std::string log;
+    ENGINE engine = ENGINE::EPOLL;
+    unsigned workers = 0;
+    unsigned keepalive_timeout = 5;
+    unsigned header_timeout = 10;
+    unsigned send_timeout = 30;
+    unsigned body_timeout = 30;
+    unsigned cgi_timeout = 1000;
+    unsigned max_cgi_processes = 0;
+    unsigned cgi_cpu_limit = 0;
+    size_t cgi_memory_limit = 0;
+    std::string cgi_cgroup;
+    unsigned keepalive_requests = 100;
+    size_t max_request_line = 4096;
+    size_t max_header_size = 8192;
+    size_t max_body_size = 1 << 20;
+    size_t cache_size = 16 << 20;
+    size_t cache_file_size = 64 << 10;
+    size_t open_file_cache = 256;
+    size_t listing_cache_size = 16 << 20;
+    unsigned gzip_static = 1;
+    size_t gzip_cache_size = 16 << 20;
+    size_t gzip_file_size = 1 << 20;
+    unsigned http2 = 1;
+    unsigned http2_streams = 128;
+    std::string fastcgi_sockets = "/tmp";
+    uint16_t metrics_port = 0;
+    unsigned backlog = 511;
+    unsigned defer_accept = 1;
+    unsigned max_connections = 0;
+    unsigned max_client_connections = 0;
+};
+
+extern server_settings settings;
+
 std::vector<std::pair<std::string, std::string>> read_config(
     const std::string &path
 );
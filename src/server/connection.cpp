@@ -0,0 +1,1203 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+extern "C" {
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+}
+
+#include "common.hpp"
+#include "admission.hpp"
+#include "url_encoder.hpp"
+#include "answer_generator.hpp"
+#include "config_reader.hpp"
+#include "fastcgi.hpp"
+#include "file_cache.hpp"
+#include "http2.hpp"
+#include "listing.hpp"
+#include "logger.hpp"
+#include "metrics.hpp"
+#include "request_body.hpp"
+#include "worker.hpp"
+#include "connection.hpp"
+
+static constexpr std::string_view CONTINUE = "HTTP/1.1 100 Continue\n\n";
+// Clients that upgrade parse it strictly, so its lines end in CRLF.
+static constexpr std::string_view SWITCHING =
+    "HTTP/1.1 101 Switching Protocols\r\n"
+    "Connection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+
+static response cached_answer(
+    const file_cache::entry &hit,
+    const request &message,
+    bool keep_alive,
+    bool encoded
+) {
+    const file_cache::headers &sent = encoded ? hit.as_gzip : hit.as_is;
+    if (is_fresh(
+            hit.info,
+            message.if_none_match,
+            message.if_modified_since
+        )
+    ) {
+        response answer;
+        answer.data = sent.unchanged[keep_alive];
+        return answer;
+    }
+    response answer;
+    answer.data = sent.head[keep_alive];
+    answer.body = *hit.body;
+    answer.keeper = hit.body;
+    narrow_to_range(
+        answer,
+        message,
+        hit.info,
+        sent.record,
+        sent.type,
+        keep_alive
+    );
+    return answer;
+}
+
+// A file too big for the content cache, sent from the descriptor the cache
+// keeps open for it.
+static response opened_answer(
+    const file_cache::metadata &known,
+    const request &message,
+    bool keep_alive,
+    bool encoded
+) {
+    const file_cache::headers &sent = encoded ? known.as_gzip : known.as_is;
+    response answer;
+    if (is_fresh(
+            known.info,
+            message.if_none_match,
+            message.if_modified_since
+        )
+    ) {
+        answer.data = sent.unchanged[keep_alive];
+        return answer;
+    }
+    answer.data = sent.head[keep_alive];
+    answer.file = known.file->descriptor();
+    answer.borrowed_file = true;
+    answer.keeper = known.file;
+    answer.length = known.info.st_size;
+    narrow_to_range(
+        answer,
+        message,
+        known.info,
+        sent.record,
+        sent.type,
+        keep_alive
+    );
+    return answer;
+}
+
+static bool sendable(const file_cache::metadata &known) {
+    return known.type == STAT::REGULAR && known.readable &&
+        !(known.info.st_mode & S_IXUSR);
+}
+
+static bool not_older(const struct stat &a, const struct stat &b) {
+    return a.st_mtim.tv_sec != b.st_mtim.tv_sec ?
+        a.st_mtim.tv_sec > b.st_mtim.tv_sec :
+        a.st_mtim.tv_nsec >= b.st_mtim.tv_nsec;
+}
+
+// The .gz next to a file, sent as its gzip encoding unless it is older.
+// resource is lengthened for it and then put back, which allocates nothing
+// once it has had the room.
+static bool sibling_answer(
+    file_cache &cache,
+    std::string &resource,
+    const struct stat &info,
+    const request &message,
+    bool keep_alive,
+    std::pmr::memory_resource *memory,
+    response &answer
+) {
+    size_t length = resource.size();
+    resource += ".gz";
+    bool found = false;
+    const file_cache::entry *hit = cache.find(resource);
+    if (hit != nullptr) {
+        if (not_older(hit->info, info)) {
+            answer = cached_answer(*hit, message, keep_alive, true);
+            found = true;
+        }
+    } else {
+        const file_cache::metadata &packed = cache.lookup(resource);
+        if (sendable(packed) && not_older(packed.info, info)) {
+            found = true;
+            if (packed.file) {
+                answer = opened_answer(packed, message, keep_alive, true);
+            } else if ((hit = cache.load(resource)) != nullptr) {
+                answer = cached_answer(*hit, message, keep_alive, true);
+            } else {
+                answer = from_file(
+                    resource,
+                    packed.info,
+                    message,
+                    keep_alive,
+                    true,
+                    memory
+                );
+            }
+        }
+    }
+    resource.resize(length);
+    return found;
+}
+
+// The gzip encoding of a static file: the .gz next to it, otherwise the
+// file compressed by the cache.
+static bool encoded_answer(
+    file_cache &cache,
+    std::string &resource,
+    const request &message,
+    bool keep_alive,
+    std::pmr::memory_resource *memory,
+    response &answer
+) {
+    const file_cache::metadata &known = cache.lookup(resource);
+    if (!sendable(known)) {
+        return false;
+    }
+    struct stat info = known.info;
+    if (settings.gzip_static &&
+        sibling_answer(
+            cache,
+            resource,
+            info,
+            message,
+            keep_alive,
+            memory,
+            answer
+        )
+    ) {
+        return true;
+    }
+    const file_cache::entry *hit = cache.compressed(resource, info);
+    if (hit == nullptr) {
+        return false;
+    }
+    answer = cached_answer(*hit, message, keep_alive, true);
+    return true;
+}
+
+// Collects the unsent parts of a response: its own data, then the body it
+// shares with a cache or static storage.
+static int gather(response &answer, struct iovec *parts) {
+    int count = 0;
+    size_t skip = answer.sent;
+    if (skip < answer.data.size()) {
+        parts[count].iov_base = &answer.data[skip];
+        parts[count].iov_len = answer.data.size() - skip;
+        ++count;
+        skip = 0;
+    } else {
+        skip -= answer.data.size();
+    }
+    if (skip < answer.body.size()) {
+        parts[count].iov_base = const_cast<char *>(answer.body.data() + skip);
+        parts[count].iov_len = answer.body.size() - skip;
+        ++count;
+    }
+    return count;
+}
+
+static void open_journal(
+    response &answer,
+    const request &message,
+    const struct sockaddr_in &address,
+    int64_t started
+) {
+    access_record &journal = answer.journal;
+    journal.time = time(nullptr);
+    journal.address = address.sin_addr;
+    journal.started = started;
+    journal.queued = monotonic_us();
+    journal.length = std::min(message.line.size(), access_record::LINE_LIMIT);
+    memcpy(journal.line, message.line.data(), journal.length);
+}
+
+// A stream may be preceded by 100 Continue, the final status replaces it.
+static void note_status(response &answer) {
+    const std::string &data = answer.data;
+    if (answer.journal.status < 200 && answer.sent == 0 &&
+        data.size() > 12 && data.compare(0, 5, "HTTP/") == 0) {
+        answer.journal.status =
+            (data[9] - '0') * 100 + (data[10] - '0') * 10 + (data[11] - '0');
+    }
+}
+
+// Whether input starts with the preface of HTTP/2: 1 if it does, -1 if
+// it may once more has arrived, 0 if it does not.
+static int match_preface(std::string_view input) {
+    size_t compared = std::min(input.size(), CONNECTION_PREFACE.size());
+    if (input.substr(0, compared) != CONNECTION_PREFACE.substr(0, compared)) {
+        return 0;
+    }
+    return compared == CONNECTION_PREFACE.size() ? 1 : -1;
+}
+
+// resource is a buffer kept by the connection, and memory holds whatever
+// else the request needs only until its response has been built.
+static response process_request(
+    const request &message,
+    bool keep_alive,
+    worker &owner,
+    std::string &resource,
+    std::pmr::memory_resource *memory
+) {
+    if (message.method != "GET" && message.method != "POST" &&
+        message.method != "PUT") {
+        return generate_error(405, "Allow: GET, POST, PUT\n", keep_alive);
+    }
+    if (!url_decode(message.path, resource) ||
+        resource.find('\0') != std::string::npos) {
+        return generate_error(400, "", keep_alive);
+    }
+    if (resource == "") {
+        return generate_listing(
+            owner.listings(),
+            "./",
+            message,
+            keep_alive,
+            memory
+        );
+    }
+    int64_t started = monotonic_us();
+    fastcgi_pool *pool = find_fastcgi(resource);
+    if (pool != nullptr) {
+        return from_fastcgi(
+            *pool,
+            owner.loop(),
+            resource,
+            message,
+            keep_alive,
+            memory
+        );
+    }
+    file_cache &cache = owner.cache();
+    if (message.accept_encoding.size() &&
+        compressible(determine_mime(resource)) && message.accepts_gzip()) {
+        response answer;
+        if (encoded_answer(
+                cache,
+                resource,
+                message,
+                keep_alive,
+                memory,
+                answer
+            )
+        ) {
+            record_stage(STAGE::LOOKUP, monotonic_us() - started);
+            return answer;
+        }
+    }
+    const file_cache::entry *hit = cache.find(resource);
+    if (hit != nullptr) {
+        record_stage(STAGE::LOOKUP, monotonic_us() - started);
+        return cached_answer(*hit, message, keep_alive, false);
+    }
+    const file_cache::metadata &known = cache.lookup(resource);
+    record_stage(STAGE::LOOKUP, monotonic_us() - started);
+    if (known.type == STAT::REGULAR) {
+        if (!known.readable) {
+            return generate_error(403, "", keep_alive);
+        }
+        if (known.file) {
+            return opened_answer(known, message, keep_alive, false);
+        }
+        hit = cache.load(resource);
+        if (hit != nullptr) {
+            return cached_answer(*hit, message, keep_alive, false);
+        }
+        return from_file(
+            resource,
+            known.info,
+            message,
+            keep_alive,
+            false,
+            memory
+        );
+    } else if (known.type == STAT::DIRECTORY) {
+        if (resource[resource.size() - 1] != '/') {
+            return generate_error(
+                301,
+                "Location: /" + resource + "/\n",
+                keep_alive
+            );
+        }
+        return generate_listing(
+            owner.listings(),
+            resource,
+            message,
+            keep_alive,
+            memory
+        );
+    }
+    return generate_error(404, "", keep_alive);
+}
+
+connection::connection(
+    int socket,
+    const struct sockaddr_in &address,
+    worker &owner
+) :
+    socket(socket),
+    address(address),
+    owner(owner),
+    parser(settings.max_request_line, settings.max_header_size),
+    consumed(0),
+    output(&queue_memory),
+    source(*this),
+    sink(*this),
+    timeout(*this),
+    watched(-1),
+    requested(0),
+    reading(false),
+    sending(false),
+    blocked(false),
+    stalled(false),
+    served(0),
+    request_started(monotonic_ms()),
+    last_active(request_started),
+    peer_closed(false),
+    closing(false),
+    closed(false),
+    corked(false),
+    held(false),
+    paused(false) {
+    count_connection(1);
+    // The last segment of a response would otherwise wait for the ACK of
+    // the one before it, which the client delays.
+    int value = 1;
+    setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value));
+    if (owner.loop().completions()) {
+        // The ring reads the socket itself, it is only polled for room to
+        // write after a sendfile() or a send that came back short.
+        owner.loop().add(socket, EPOLLOUT | EPOLLRDHUP | EPOLLET, this);
+        receive();
+    } else {
+        owner.loop().add(
+            socket,
+            EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+            this
+        );
+    }
+    schedule();
+}
+
+connection::~connection() {
+    count_connection(-1);
+    release(address.sin_addr);
+    close(socket);
+}
+
+int connection::descriptor() const {
+    return socket;
+}
+
+bool connection::busy() const {
+    return reading || sending;
+}
+
+connection::source_watcher::source_watcher(connection &owner) :
+    owner(owner) {
+}
+
+void connection::source_watcher::handle(uint32_t) {
+    owner.advance();
+    owner.schedule();
+}
+
+connection::sink_watcher::sink_watcher(connection &owner) :
+    owner(owner) {
+}
+
+void connection::sink_watcher::handle(uint32_t) {
+    owner.resume();
+}
+
+connection::deadline_timer::deadline_timer(connection &owner) :
+    owner(owner) {
+}
+
+void connection::deadline_timer::expired() {
+    owner.expire();
+}
+
+void connection::handle(uint32_t events) {
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        // During an upload the socket is read by upload(), only as fast as
+        // the script takes the body.
+        if (!body.active() && !receive()) {
+            finish();
+            return;
+        }
+    }
+    resume();
+}
+
+// Input from the receive running on the ring, which takes the place of
+// receive() reading the socket.
+void connection::received(const char *data, int result) {
+    if (result <= 0) {
+        reading = false;
+    }
+    if (closed) {
+        return;
+    }
+    if (result > 0) {
+        last_active = monotonic_ms();
+        if (input.empty() && served) {
+            request_started = last_active;
+        }
+        if (!discarding()) {
+            input.append(data, result);
+        }
+    } else if (result == 0) {
+        peer_closed = true;
+    } else if (result != -ECANCELED) {
+        finish();
+        return;
+    }
+    resume();
+}
+
+// The answer goes on from where the send on the ring has left it.
+void connection::sent(int result) {
+    sending = false;
+    if (result >= 0) {
+        account(result);
+    }
+    if (closed) {
+        // finish() has left the response of the send alone.
+        if (output.size() && output.front().journal.bytes) {
+            complete();
+        }
+        return;
+    }
+    if (result < 0) {
+        if (result == -EAGAIN || result == -EINTR) {
+            blocked = stalled = true;
+            schedule();
+            return;
+        }
+        if (result != -EPIPE && result != -ECONNRESET) {
+            fprintf(stderr, "Error: write() failed: %d\n", -result);
+        }
+        finish();
+        return;
+    }
+    resume();
+}
+
+void connection::resume() {
+    if (!process()) {
+        finish();
+        return;
+    }
+    advance();
+    schedule();
+}
+
+void connection::advance() {
+    if (closed) {
+        return;
+    }
+    for (;;) {
+        if (!transmit()) {
+            finish();
+            return;
+        }
+        // Requests held back while the queue was full, now that there is
+        // room for their answers.
+        if (!held || output.size() >= MAX_QUEUED) {
+            break;
+        }
+        if (!process()) {
+            finish();
+            return;
+        }
+    }
+    throttle();
+    // The rest of a body is read even if nothing takes it, closing with
+    // unread data would reset the connection before the client has the
+    // answer.
+    if (output.size() || body.active()) {
+        return;
+    }
+    if (session != nullptr) {
+        if (session->busy() && !peer_closed) {
+            return;
+        }
+        closing |= session->closing();
+    }
+    if (closing || peer_closed) {
+        finish();
+    }
+}
+
+// The deadline of the connection itself, apart from that of a stream: the
+// rest of the request has to arrive within header_timeout (counted from
+// accept for the first request), the next one within keepalive_timeout
+// of the last answer, and a client that stops reading has send_timeout,
+// also while a send on the ring waits for it. A request body has to keep
+// moving within body_timeout. On HTTP/2 the connection is idle while no
+// stream is open, and a peer that keeps its window shut has send_timeout.
+int64_t connection::deadline() const {
+    if (body.active()) {
+        return last_active + settings.body_timeout * 1000ll;
+    }
+    if (session != nullptr) {
+        if (stalled || sending || session->blocked()) {
+            return last_active + settings.send_timeout * 1000ll;
+        }
+        if (output.empty() && !session->busy()) {
+            return last_active + settings.keepalive_timeout * 1000ll;
+        }
+        return 0;
+    }
+    if (output.empty()) {
+        if (input.empty() && served) {
+            return last_active + settings.keepalive_timeout * 1000ll;
+        }
+        return request_started + settings.header_timeout * 1000ll;
+    }
+    if (stalled || sending) {
+        return last_active + settings.send_timeout * 1000ll;
+    }
+    return 0;
+}
+
+// The stream whose deadline counts: that of the first response, unless
+// the request body is still going to it (the last response is the one of
+// the request being uploaded).
+body_stream *connection::timed_stream() const {
+    if (output.empty() || (body.active() && output.size() == 1)) {
+        return nullptr;
+    }
+    return output.front().stream.get();
+}
+
+void connection::schedule() {
+    if (closed) {
+        timeout.cancel();
+        return;
+    }
+    int64_t next = deadline();
+    body_stream *stream = timed_stream();
+    if (stream != nullptr) {
+        int64_t expires = stream->expires();
+        if (expires && (next == 0 || expires < next)) {
+            next = expires;
+        }
+    }
+    if (session != nullptr) {
+        int64_t expires = session->expires();
+        if (expires && (next == 0 || expires < next)) {
+            next = expires;
+        }
+    }
+    if (next) {
+        owner.timers().arm(timeout, next);
+    } else {
+        timeout.cancel();
+    }
+}
+
+void connection::expire() {
+    body_stream *stream = timed_stream();
+    if (stream != nullptr) {
+        stream->expire();
+        advance();
+    }
+    if (session != nullptr) {
+        session->expire();
+        advance();
+    }
+    int64_t limit = deadline();
+    if (!closed && limit && monotonic_ms() >= limit) {
+        finish();
+    }
+    schedule();
+}
+
+bool connection::receive() {
+    if (owner.loop().completions()) {
+        if (!reading && !peer_closed && !paused) {
+            owner.loop().receive(socket, this);
+            reading = true;
+        }
+        return true;
+    }
+    char buffer[BUFFER_SIZE];
+    while (!paused) {
+        // The rest stays in the socket, epoll reports it again once
+        // reading goes on.
+        if (!discarding() && input.size() >= input_limit()) {
+            pause(true);
+            break;
+        }
+        ssize_t bytes = read(socket, buffer, sizeof(buffer));
+        if (bytes > 0) {
+            last_active = monotonic_ms();
+            if (input.empty() && served) {
+                request_started = last_active;
+            }
+            if (!discarding()) {
+                input.append(buffer, bytes);
+            }
+        } else if (bytes == 0) {
+            peer_closed = true;
+            return true;
+        } else if (errno == EINTR) {
+            continue;
+        } else {
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+    }
+    return true;
+}
+
+// The most input kept: a whole request head, and room for requests sent
+// ahead of their answers.
+size_t connection::input_limit() const {
+    return std::max<size_t>(
+        MAX_BUFFERED,
+        settings.max_request_line + settings.max_header_size
+    );
+}
+
+// Once the connection is closing nothing that arrives is used any more.
+// It is still read, so that the close does not reset the connection with
+// unread data before the client has the last answer; the send timeout
+// ends a client that never takes it.
+bool connection::discarding() const {
+    return closing && !body.active();
+}
+
+// Reading stops while too many answers are queued (on HTTP/2 while the
+// client does not take them) and while the input is at its limit; it goes
+// on once that is over. epoll stops reporting input meanwhile, and the
+// ring stops receiving. The body of a request is read by upload() as fast
+// as the script takes it, and a closing connection discards its input.
+void connection::throttle() {
+    bool backlog = session != nullptr ? stalled : output.size() >= MAX_QUEUED;
+    pause(
+        !body.active() && !closing &&
+            (backlog || input.size() >= input_limit())
+    );
+}
+
+void connection::pause(bool on) {
+    bool completions = owner.loop().completions();
+    if (on != paused && !completions) {
+        uint32_t events = EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        owner.loop().modify(socket, on ? events : events | EPOLLIN, this);
+    }
+    paused = on;
+    // A receive stopped before may only now have ended.
+    if (completions) {
+        if (paused && reading) {
+            owner.loop().stop_receiving(socket);
+        } else if (!paused) {
+            receive();
+        }
+    }
+}
+
+// Passes on the body of the last request: first what was read together
+// with it, then from the socket. Returns false if the connection has to be
+// dropped: the client went away or sent a malformed or too large body.
+bool connection::upload() {
+    bool completions = owner.loop().completions();
+    for (;;) {
+        std::string_view pending(input);
+        pending.remove_prefix(consumed);
+        size_t used;
+        BODY state = body.feed(pending, used);
+        if (used) {
+            consumed += used;
+            last_active = monotonic_ms();
+        }
+        if (consumed == input.size()) {
+            input.clear();
+            consumed = 0;
+        }
+        // On the ring the body comes in through the input; receiving stops
+        // while the pipe is full, which holds the client back the same way.
+        if (completions) {
+            if (state == BODY::AGAIN && reading) {
+                owner.loop().stop_receiving(socket);
+            }
+            if (state == BODY::MORE) {
+                if (peer_closed) {
+                    return false;
+                }
+                receive();
+            }
+            return state != BODY::FAILED;
+        }
+        if (state != BODY::MORE) {
+            return state != BODY::FAILED;
+        }
+        if (body.framing()) {
+            char buffer[BUFFER_SIZE];
+            ssize_t bytes = read(socket, buffer, sizeof(buffer));
+            if (bytes > 0) {
+                last_active = monotonic_ms();
+                input.append(buffer, bytes);
+                continue;
+            }
+            if (bytes == -1 && errno == EINTR) {
+                continue;
+            }
+            return bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+        }
+        state = body.pump(socket);
+        if (state == BODY::AGAIN) {
+            return true;
+        }
+        if (state == BODY::FAILED) {
+            return false;
+        }
+        last_active = monotonic_ms();
+    }
+}
+
+// The body goes to the script if the response takes one and is dropped
+// otherwise. A client waiting for 100 Continue is only asked for a body
+// the script will read; for any other answer the connection is closed
+// instead.
+void connection::start_upload(int64_t length, const request &message) {
+    response &answer = output.back();
+    int target = answer.upload;
+    answer.upload = -1;
+    if (message.expects_continue()) {
+        if (target == -1) {
+            closing = true;
+            return;
+        }
+        answer.data.insert(0, CONTINUE);
+    }
+    body.start(length, target);
+    if (target != -1) {
+        owner.loop().add(target, EPOLLOUT | EPOLLET, &sink);
+    }
+}
+
+void connection::stop_upload() {
+    if (body.sink() != -1) {
+        owner.loop().remove(body.sink());
+    }
+    body.stop();
+}
+
+bool connection::process() {
+    held = false;
+    if (session != nullptr) {
+        return session->feed(input);
+    }
+    for (;;) {
+        if (body.active()) {
+            if (!upload()) {
+                return false;
+            }
+            if (!body.done()) {
+                break;
+            }
+            stop_upload();
+            if (output.size() && output.back().stream) {
+                output.back().stream->input_complete();
+            }
+            // The socket was left alone during the upload, what follows the
+            // body may be waiting there.
+            if (!receive()) {
+                return false;
+            }
+        }
+        if (closing) {
+            break;
+        }
+        if (output.size() >= MAX_QUEUED) {
+            held = true;
+            break;
+        }
+        std::string_view pending(input);
+        pending.remove_prefix(consumed);
+        // HTTP/2 by prior knowledge: the first request is the preface.
+        if (settings.http2 && served == 0 && consumed == 0) {
+            int preface = match_preface(pending);
+            if (preface < 0) {
+                break;
+            }
+            if (preface > 0) {
+                session = std::make_unique<http2_session>(*this);
+                break;
+            }
+        }
+        int64_t started = monotonic_us();
+        PARSE state = parser.feed(pending);
+        if (state == PARSE::INCOMPLETE) {
+            break;
+        }
+        int64_t parsed = monotonic_us();
+        record_stage(STAGE::PARSE, parsed - started);
+        if (state == PARSE::ERROR) {
+            output.emplace_back(
+                generate_error(parser.result().error, "", false)
+            );
+            open_journal(output.back(), parser.result(), address, parsed);
+            closing = true;
+            break;
+        }
+        const request &message = parser.result();
+        if (settings.http2 && output.empty() && message.upgrades_to_h2c()) {
+            consumed += message.length;
+            if (upgrade(message)) {
+                open_journal(output.front(), message, address, parsed);
+                break;
+            }
+            consumed -= message.length;
+        }
+        ++served;
+        int64_t length;
+        int refused = body_framing(message, length);
+        if (refused) {
+            output.emplace_back(generate_error(refused, "", false));
+            open_journal(output.back(), message, address, parsed);
+            closing = true;
+            break;
+        }
+        bool keep_alive =
+            settings.keepalive_timeout != 0 &&
+            served < settings.keepalive_requests &&
+            !peer_closed &&
+            message.keep_alive();
+        output.push_back(process_request(
+            message,
+            keep_alive,
+            owner,
+            resource,
+            &scratch
+        ));
+        scratch.reset();
+        open_journal(output.back(), message, address, parsed);
+        record_stage(STAGE::HANDLER, output.back().journal.queued - parsed);
+        consumed += message.length;
+        if (length) {
+            start_upload(length, message);
+        }
+        parser.reset();
+        if (!keep_alive || output.back().close) {
+            closing = true;
+        }
+    }
+    if (consumed) {
+        input.erase(0, consumed);
+        consumed = 0;
+        parser.reset();
+        if (input.size()) {
+            request_started = monotonic_ms();
+        }
+    }
+    if (session != nullptr) {
+        return session->feed(input);
+    }
+    return true;
+}
+
+// Upgrade: h2c for a request without a body. The request becomes stream 1
+// of the session, answered after 101 Switching Protocols.
+bool connection::upgrade(const request &message) {
+    int64_t length;
+    if (body_framing(message, length) || length) {
+        return false;
+    }
+    std::unique_ptr<http2_session> next =
+        std::make_unique<http2_session>(*this);
+    request upgraded = message;
+    upgraded.version = "HTTP/2.0";
+    output.emplace_back(std::string(SWITCHING));
+    if (!next->upgrade(upgraded, message.find("http2-settings"))) {
+        output.pop_back();
+        return false;
+    }
+    session = std::move(next);
+    return true;
+}
+
+// The response of a stream of the session, refused with that status if
+// it is not 0.
+response connection::serve(const request &message, int refused) {
+    ++served;
+    int64_t started = monotonic_us();
+    response answer = refused ?
+        generate_error(refused, "", true) :
+        process_request(message, true, owner, resource, &scratch);
+    scratch.reset();
+    open_journal(answer, message, address, started);
+    record_stage(STAGE::HANDLER, answer.journal.queued - started);
+    return answer;
+}
+
+bool connection::transmit() {
+    if (sending) {
+        return true;
+    }
+    blocked = false;
+    stalled = false;
+    while (!blocked) {
+        if (output.empty() && (session == nullptr || !produce())) {
+            break;
+        }
+        response &answer = output.front();
+        if (answer.sent != answer.buffered()) {
+            if (!transmit_data()) {
+                return false;
+            }
+        } else if (answer.length) {
+            if (!transmit_file(answer)) {
+                return false;
+            }
+        } else if (answer.advance()) {
+            continue;
+        } else if (answer.stream) {
+            if (!transmit_stream(answer)) {
+                return false;
+            }
+        } else {
+            complete();
+        }
+    }
+    if (corked) {
+        cork(false);
+    }
+    return true;
+}
+
+// The next frames of the session. Each frame of a file is a write of its
+// own that would end in a short segment; a batch with such frames goes
+// out corked and is flushed as soon as transmit() stops, without waiting
+// for an ACK. The ring sends later than this, so there it is not corked.
+bool connection::produce() {
+    if (!session->produce(output)) {
+        return false;
+    }
+    if (!corked && !owner.loop().completions()) {
+        for (const response &frame : output) {
+            if (frame.length) {
+                cork(true);
+                break;
+            }
+        }
+    }
+    return true;
+}
+
+void connection::cork(bool on) {
+    int value = on;
+    setsockopt(socket, IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
+    corked = on;
+}
+
+bool connection::transmit_data() {
+    int count = 0;
+    requested = 0;
+    bool more = false;
+    for (response &answer : output) {
+        if (count > MAX_PARTS - 2) {
+            more = true;
+            break;
+        }
+        if (answer.sent != answer.buffered()) {
+            note_status(answer);
+            int added = gather(answer, parts + count);
+            for (int i = count; i != count + added; ++i) {
+                requested += parts[i].iov_len;
+            }
+            count += added;
+        }
+        if (answer.length || answer.more_pieces()) {
+            more = true;
+            break;
+        }
+        if (answer.stream) {
+            break;
+        }
+    }
+    memset(&outgoing, 0, sizeof(outgoing));
+    outgoing.msg_iov = parts;
+    outgoing.msg_iovlen = count;
+    int flags = more ? MSG_MORE : 0;
+    if (owner.loop().completions()) {
+        owner.loop().send(socket, &outgoing, flags, this);
+        sending = blocked = true;
+        return true;
+    }
+    ssize_t bytes = sendmsg(socket, &outgoing, MSG_NOSIGNAL | flags);
+    if (bytes == -1) {
+        if (errno == EINTR) {
+            return true;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            blocked = stalled = true;
+            return true;
+        }
+        if (errno != EPIPE && errno != ECONNRESET) {
+            fprintf(stderr, "Error: write() failed: %d\n", errno);
+        }
+        return false;
+    }
+    account(bytes);
+    return true;
+}
+
+// Moves the responses the data last gathered came from on by bytes.
+void connection::account(size_t bytes) {
+    last_active = monotonic_ms();
+    if (bytes < requested) {
+        blocked = stalled = true;
+    }
+    for (response &answer : output) {
+        if (bytes == 0) {
+            break;
+        }
+        size_t taken = std::min(answer.buffered() - answer.sent, bytes);
+        answer.sent += taken;
+        answer.journal.bytes += taken;
+        bytes -= taken;
+        if (answer.length || answer.more_pieces() || answer.stream) {
+            break;
+        }
+    }
+    while (output.size() &&
+        output.front().sent == output.front().buffered() &&
+        output.front().length == 0 && !output.front().more_pieces() &&
+        !output.front().stream) {
+        complete();
+    }
+}
+
+bool connection::transmit_file(response &answer) {
+    ssize_t bytes = sendfile(socket, answer.file, &answer.offset, answer.length);
+    if (bytes == -1 && (errno == EINVAL || errno == ENOSYS)) {
+        char buffer[BUFFER_SIZE];
+        bytes = pread(
+            answer.file,
+            buffer,
+            std::min(answer.length, sizeof(buffer)),
+            answer.offset
+        );
+        if (bytes > 0) {
+            bytes = send(socket, buffer, bytes, MSG_NOSIGNAL);
+            if (bytes > 0) {
+                answer.offset += bytes;
+            }
+        }
+    }
+    if (bytes == -1) {
+        if (errno == EINTR) {
+            return true;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            blocked = stalled = true;
+            return true;
+        }
+        if (errno != EPIPE && errno != ECONNRESET) {
+            fprintf(stderr, "Error: sendfile() failed: %d\n", errno);
+        }
+        return false;
+    }
+    if (bytes == 0) {
+        return false;
+    }
+    last_active = monotonic_ms();
+    answer.length -= bytes;
+    answer.journal.bytes += bytes;
+    return true;
+}
+
+bool connection::transmit_stream(response &answer) {
+    int descriptor = answer.stream->descriptor();
+    if (watched != descriptor && descriptor != -1) {
+        unwatch();
+        owner.loop().add(descriptor, EPOLLIN | EPOLLET, &source);
+        watched = descriptor;
+    }
+    answer.data.clear();
+    answer.sent = 0;
+    switch (answer.stream->produce(answer.data)) {
+    case STREAM::MORE:
+        return true;
+    case STREAM::AGAIN:
+        blocked = true;
+        return true;
+    case STREAM::DONE:
+        unwatch();
+        answer.stream.reset();
+        return true;
+    default:
+        unwatch();
+        return false;
+    }
+}
+
+void connection::unwatch() {
+    if (watched != -1) {
+        owner.loop().remove(watched);
+        watched = -1;
+    }
+}
+
+void connection::complete() {
+    access_record &journal = output.front().journal;
+    // Of the frames of HTTP/2 only those that end a stream have a record.
+    if (session == nullptr || journal.status) {
+        log(journal);
+    }
+    output.pop_front();
+}
+
+void connection::log(access_record &journal) {
+    int64_t now = monotonic_us();
+    journal.duration = now - journal.started;
+    record_stage(STAGE::SEND, now - journal.queued);
+    count_response(journal.status, journal.bytes);
+    log_access(journal);
+}
+
+void connection::finish() {
+    if (closed) {
+        return;
+    }
+    closed = true;
+    // The data of a send still running on the ring stays until it ends.
+    if (output.size() && output.front().journal.bytes && !sending) {
+        complete();
+    }
+    stop_upload();
+    unwatch();
+    if (session != nullptr) {
+        session->close();
+    }
+    owner.loop().remove(socket);
+    if (owner.loop().completions()) {
+        owner.loop().cancel(socket);
+    }
+    owner.retire(this);
+}
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <memory_resource>
+#include <string>
+
+extern "C" {
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+}
+
+#include "arena.hpp"
+#include "event_loop.hpp"
+#include "query_parser.hpp"
+#include "request_body.hpp"
+#include "timer_wheel.hpp"
+#include "answer_generator.hpp"
+
+class worker;
+class http2_session;
+
+class connection : public event_handler {
+public:
+    connection(int socket, const struct sockaddr_in &address, worker &owner);
+    ~connection();
+    connection(const connection &) = delete;
+    connection &operator=(const connection &) = delete;
+
+    void handle(uint32_t events) override;
+    void received(const char *data, int result) override;
+    void sent(int result) override;
+    int descriptor() const;
+    // Operations on the socket are still running on the ring.
+    bool busy() const;
+
+private:
+    friend class http2_session;
+
+    class source_watcher : public event_handler {
+    public:
+        explicit source_watcher(connection &owner);
+        void handle(uint32_t events) override;
+
+    private:
+        connection &owner;
+    };
+
+    class sink_watcher : public event_handler {
+    public:
+        explicit sink_watcher(connection &owner);
+        void handle(uint32_t events) override;
+
+    private:
+        connection &owner;
+    };
+
+    class deadline_timer : public timer {
+    public:
+        explicit deadline_timer(connection &owner);
+        void expired() override;
+
+    private:
+        connection &owner;
+    };
+
+    bool receive();
+    size_t input_limit() const;
+    bool discarding() const;
+    void throttle();
+    void pause(bool on);
+    bool upload();
+    void start_upload(int64_t length, const request &message);
+    void stop_upload();
+    bool transmit();
+    bool produce();
+    void cork(bool on);
+    bool transmit_data();
+    void account(size_t bytes);
+    bool transmit_file(response &answer);
+    bool transmit_stream(response &answer);
+    void unwatch();
+    void complete();
+    void log(access_record &journal);
+    bool upgrade(const request &message);
+    response serve(const request &message, int refused);
+    void advance();
+    void resume();
+    bool process();
+    void finish();
+    int64_t deadline() const;
+    body_stream *timed_stream() const;
+    void schedule();
+    void expire();
+
+    static constexpr int MAX_PARTS = 64;
+    // Answers queued before no more requests are taken, and the input
+    // kept meanwhile if the limits of the request head are lower.
+    static constexpr size_t MAX_QUEUED = 32;
+    static constexpr size_t MAX_BUFFERED = 64 << 10;
+
+    int socket;
+    struct sockaddr_in address;
+    worker &owner;
+    std::string input;
+    request_parser parser;
+    size_t consumed;
+    std::string resource;
+    arena scratch;
+    std::pmr::unsynchronized_pool_resource queue_memory;
+    std::pmr::deque<response> output;
+    body_reader body;
+    std::unique_ptr<http2_session> session;
+    source_watcher source;
+    sink_watcher sink;
+    deadline_timer timeout;
+    int watched;
+    struct iovec parts[MAX_PARTS];
+    struct msghdr outgoing;
+    size_t requested;
+    bool reading;
+    bool sending;
+    bool blocked;
+    bool stalled;
+    unsigned served;
+    int64_t request_started;
+    int64_t last_active;
+    bool peer_closed;
+    bool closing;
+    bool closed;
+    bool corked;
+    // Requests wait in the input for room in the queue.
+    bool held;
+    bool paused;
+};
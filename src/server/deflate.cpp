@@ -0,0 +1,480 @@
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "deflate.hpp"
+
+// Matching as gzip -6 does it: chains of up to 128 earlier positions with
+// the same three bytes, a match of 128 is taken at once, and one shorter
+// than 16 is dropped when the next position has a longer one.
+static constexpr size_t WINDOW = 32768;
+static constexpr size_t MIN_MATCH = 3;
+static constexpr size_t MAX_MATCH = 258;
+static constexpr int HASH_BITS = 15;
+static constexpr size_t MAX_CHAIN = 128;
+static constexpr size_t NICE_MATCH = 128;
+static constexpr size_t LAZY_MATCH = 16;
+static constexpr size_t NONE = SIZE_MAX;
+
+static constexpr size_t BLOCK_SYMBOLS = 16384;
+static constexpr int LITERALS = 286;
+static constexpr int DISTANCES = 30;
+static constexpr int CODE_LENGTHS = 19;
+static constexpr int END_OF_BLOCK = 256;
+static constexpr int MAX_BITS = 15;
+static constexpr int MAX_CODE_LENGTH_BITS = 7;
+
+static constexpr uint16_t LENGTH_BASE[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59,
+    67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+
+static constexpr uint8_t LENGTH_EXTRA[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4,
+    5, 5, 5, 5, 0
+};
+
+static constexpr uint16_t DISTANCE_BASE[DISTANCES] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513,
+    769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+
+static constexpr uint8_t DISTANCE_EXTRA[DISTANCES] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10,
+    11, 11, 12, 12, 13, 13
+};
+
+// The order the lengths of the code length code are sent in.
+static constexpr uint8_t CODE_LENGTH_ORDER[CODE_LENGTHS] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+struct length_codes {
+    constexpr length_codes() : code() {
+        for (int c = 0; c != 29; ++c) {
+            for (int l = LENGTH_BASE[c];
+                l < LENGTH_BASE[c] + (1 << LENGTH_EXTRA[c]) &&
+                    l <= (int) MAX_MATCH;
+                ++l) {
+                code[l] = c;
+            }
+        }
+    }
+
+    uint8_t code[MAX_MATCH + 1];
+};
+
+static constexpr length_codes length_code;
+
+struct crc_table {
+    constexpr crc_table() : entry() {
+        for (uint32_t i = 0; i != 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k != 8; ++k) {
+                c = c & 1 ? 0xedb88320u ^ c >> 1 : c >> 1;
+            }
+            entry[i] = c;
+        }
+    }
+
+    uint32_t entry[256];
+};
+
+static constexpr crc_table crc_entries;
+
+static uint32_t crc32(std::string_view data) {
+    uint32_t crc = 0xffffffffu;
+    for (char c : data) {
+        crc = crc_entries.entry[(crc ^ (uint8_t) c) & 0xff] ^ crc >> 8;
+    }
+    return crc ^ 0xffffffffu;
+}
+
+static int distance_code(size_t distance) {
+    return std::upper_bound(
+        DISTANCE_BASE,
+        DISTANCE_BASE + DISTANCES,
+        distance
+    ) - DISTANCE_BASE - 1;
+}
+
+static void append_le32(std::string &out, uint32_t n) {
+    for (int i = 0; i != 4; ++i) {
+        out += (char) (n >> 8 * i);
+    }
+}
+
+// Deflate fills bytes from their lowest bit up.
+class bit_writer {
+public:
+    explicit bit_writer(std::string &out) :
+        out(out),
+        bits(0),
+        count(0) {
+    }
+
+    void put(uint32_t value, int length) {
+        bits |= (uint64_t) value << count;
+        count += length;
+        while (count >= 8) {
+            out += (char) bits;
+            bits >>= 8;
+            count -= 8;
+        }
+    }
+
+    void flush() {
+        if (count > 0) {
+            out += (char) bits;
+        }
+        bits = 0;
+        count = 0;
+    }
+
+private:
+    std::string &out;
+    uint64_t bits;
+    int count;
+};
+
+// A literal byte when distance is 0, a match otherwise.
+struct symbol {
+    uint16_t length;
+    uint16_t distance;
+};
+
+// Earlier positions by the three bytes found there, newest first.
+class matcher {
+public:
+    explicit matcher(std::string_view data) :
+        data(data),
+        head(1 << HASH_BITS, NONE),
+        previous(WINDOW, NONE) {
+    }
+
+    void insert(size_t i) {
+        if (i + MIN_MATCH > data.size()) {
+            return;
+        }
+        size_t h = hash(i);
+        previous[i & (WINDOW - 1)] = head[h];
+        head[h] = i;
+    }
+
+    // The length of the longest match for what starts at i, 0 if there is
+    // none worth a match.
+    size_t longest(size_t i, size_t &distance) const {
+        if (i + MIN_MATCH > data.size()) {
+            return 0;
+        }
+        size_t limit = std::min(MAX_MATCH, data.size() - i);
+        size_t best = 0;
+        size_t candidate = head[hash(i)];
+        for (size_t chain = MAX_CHAIN; chain != 0; --chain) {
+            if (candidate == NONE || candidate >= i ||
+                i - candidate > WINDOW) {
+                break;
+            }
+            if (data[candidate + best] == data[i + best]) {
+                size_t length = 0;
+                while (length < limit &&
+                    data[candidate + length] == data[i + length]) {
+                    ++length;
+                }
+                if (length > best) {
+                    best = length;
+                    distance = i - candidate;
+                    if (length >= NICE_MATCH || length == limit) {
+                        break;
+                    }
+                }
+            }
+            candidate = previous[candidate & (WINDOW - 1)];
+        }
+        return best >= MIN_MATCH ? best : 0;
+    }
+
+private:
+    size_t hash(size_t i) const {
+        uint32_t v = (uint8_t) data[i] | (uint8_t) data[i + 1] << 8 |
+            (uint8_t) data[i + 2] << 16;
+        return (v * 2654435761u) >> (32 - HASH_BITS);
+    }
+
+    std::string_view data;
+    std::vector<size_t> head;
+    std::vector<size_t> previous;
+};
+
+// Huffman code lengths of at most limit bits. The lengths of the tree are
+// counted per depth, those too deep are moved up and the counts evened out
+// again (as miniz does), then the longest go to the rarest symbols.
+static void build_lengths(
+    const uint32_t *frequency,
+    int count,
+    int limit,
+    uint8_t *lengths
+) {
+    std::fill(lengths, lengths + count, 0);
+    std::vector<int> used;
+    for (int s = 0; s != count; ++s) {
+        if (frequency[s]) {
+            used.push_back(s);
+        }
+    }
+    if (used.size() < 2) {
+        for (int s : used) {
+            lengths[s] = 1;
+        }
+        return;
+    }
+    std::stable_sort(used.begin(), used.end(), [frequency](int a, int b) {
+        return frequency[a] < frequency[b];
+    });
+    // Leaves come first, then the inner nodes in the order they are made,
+    // which is also the order of their weights.
+    size_t n = used.size();
+    std::vector<uint64_t> weight(2 * n - 1);
+    std::vector<size_t> parent(2 * n - 1);
+    for (size_t i = 0; i != n; ++i) {
+        weight[i] = frequency[used[i]];
+    }
+    size_t leaf = 0, inner = n;
+    for (size_t next = n; next != 2 * n - 1; ++next) {
+        size_t pick[2];
+        for (size_t &p : pick) {
+            if (leaf < n && (inner == next || weight[leaf] <= weight[inner])) {
+                p = leaf++;
+            } else {
+                p = inner++;
+            }
+        }
+        weight[next] = weight[pick[0]] + weight[pick[1]];
+        parent[pick[0]] = parent[pick[1]] = next;
+    }
+    std::vector<int> depth(2 * n - 1, 0);
+    std::vector<int> at_length(std::max<size_t>(n, limit) + 1, 0);
+    for (size_t i = 2 * n - 2; i-- != 0;) {
+        depth[i] = depth[parent[i]] + 1;
+        if (i < n) {
+            ++at_length[depth[i]];
+        }
+    }
+    for (size_t l = limit + 1; l < at_length.size(); ++l) {
+        at_length[limit] += at_length[l];
+        at_length[l] = 0;
+    }
+    uint64_t total = 0;
+    for (int l = 1; l <= limit; ++l) {
+        total += (uint64_t) at_length[l] << (limit - l);
+    }
+    while (total != (uint64_t) 1 << limit) {
+        --at_length[limit];
+        for (int l = limit - 1; l > 0; --l) {
+            if (at_length[l]) {
+                --at_length[l];
+                at_length[l + 1] += 2;
+                break;
+            }
+        }
+        --total;
+    }
+    size_t next = 0;
+    for (int l = limit; l >= 1; --l) {
+        for (int k = 0; k != at_length[l]; ++k) {
+            lengths[used[next++]] = l;
+        }
+    }
+}
+
+// Canonical codes, bit-reversed since they are sent from their top bit.
+static void assign_codes(const uint8_t *lengths, int count, uint16_t *codes) {
+    uint16_t at_length[MAX_BITS + 1] = {};
+    for (int s = 0; s != count; ++s) {
+        ++at_length[lengths[s]];
+    }
+    at_length[0] = 0;
+    uint16_t next[MAX_BITS + 1] = {};
+    uint16_t code = 0;
+    for (int l = 1; l <= MAX_BITS; ++l) {
+        code = (code + at_length[l - 1]) << 1;
+        next[l] = code;
+    }
+    for (int s = 0; s != count; ++s) {
+        int length = lengths[s];
+        if (length == 0) {
+            continue;
+        }
+        uint16_t value = next[length]++, reversed = 0;
+        for (int b = 0; b != length; ++b) {
+            reversed = reversed << 1 | (value >> b & 1);
+        }
+        codes[s] = reversed;
+    }
+}
+
+// Some decoders take a code with a single symbol for a broken one.
+static void use_two(uint32_t *frequency, int count) {
+    int used = 0;
+    for (int s = 0; s != count; ++s) {
+        used += frequency[s] != 0;
+    }
+    for (int s = 0; used < 2 && s != count; ++s) {
+        if (!frequency[s]) {
+            frequency[s] = 1;
+            ++used;
+        }
+    }
+}
+
+static void write_block(
+    bit_writer &out,
+    const std::vector<symbol> &symbols,
+    bool last
+) {
+    uint32_t literal_frequency[LITERALS] = {};
+    uint32_t distance_frequency[DISTANCES] = {};
+    for (const symbol &s : symbols) {
+        if (s.distance == 0) {
+            ++literal_frequency[s.length];
+        } else {
+            ++literal_frequency[257 + length_code.code[s.length]];
+            ++distance_frequency[distance_code(s.distance)];
+        }
+    }
+    ++literal_frequency[END_OF_BLOCK];
+    use_two(literal_frequency, LITERALS);
+    use_two(distance_frequency, DISTANCES);
+    uint8_t lengths[LITERALS + DISTANCES];
+    uint8_t *literal_lengths = lengths;
+    uint8_t distance_lengths[DISTANCES];
+    uint16_t literal_codes[LITERALS], distance_codes[DISTANCES];
+    build_lengths(literal_frequency, LITERALS, MAX_BITS, literal_lengths);
+    build_lengths(distance_frequency, DISTANCES, MAX_BITS, distance_lengths);
+    assign_codes(literal_lengths, LITERALS, literal_codes);
+    assign_codes(distance_lengths, DISTANCES, distance_codes);
+    int literal_count = LITERALS, distance_count = DISTANCES;
+    while (literal_count > 257 && !literal_lengths[literal_count - 1]) {
+        --literal_count;
+    }
+    while (distance_count > 1 && !distance_lengths[distance_count - 1]) {
+        --distance_count;
+    }
+    // Both sets of lengths go out as one sequence, with runs of a repeated
+    // length (16) and of zeros (17, 18) shortened.
+    std::copy(
+        distance_lengths,
+        distance_lengths + distance_count,
+        lengths + literal_count
+    );
+    size_t total = literal_count + distance_count;
+    std::vector<symbol> runs;
+    uint32_t run_frequency[CODE_LENGTHS] = {};
+    for (size_t i = 0; i < total;) {
+        uint8_t l = lengths[i];
+        size_t run = 1;
+        while (i + run < total && lengths[i + run] == l) {
+            ++run;
+        }
+        if (l == 0 && run >= 3) {
+            size_t take = std::min<size_t>(run, 138);
+            if (take >= 11) {
+                runs.push_back({18, (uint16_t) (take - 11)});
+            } else {
+                runs.push_back({17, (uint16_t) (take - 3)});
+            }
+            i += take;
+        } else if (l != 0 && i > 0 && lengths[i - 1] == l && run >= 3) {
+            size_t take = std::min<size_t>(run, 6);
+            runs.push_back({16, (uint16_t) (take - 3)});
+            i += take;
+        } else {
+            runs.push_back({l, 0});
+            ++i;
+        }
+        ++run_frequency[runs.back().length];
+    }
+    uint8_t run_lengths[CODE_LENGTHS];
+    uint16_t run_codes[CODE_LENGTHS];
+    build_lengths(
+        run_frequency,
+        CODE_LENGTHS,
+        MAX_CODE_LENGTH_BITS,
+        run_lengths
+    );
+    assign_codes(run_lengths, CODE_LENGTHS, run_codes);
+    int order_count = CODE_LENGTHS;
+    while (order_count > 4 &&
+        !run_lengths[CODE_LENGTH_ORDER[order_count - 1]]) {
+        --order_count;
+    }
+
+    out.put(last, 1);
+    out.put(2, 2);
+    out.put(literal_count - 257, 5);
+    out.put(distance_count - 1, 5);
+    out.put(order_count - 4, 4);
+    for (int i = 0; i != order_count; ++i) {
+        out.put(run_lengths[CODE_LENGTH_ORDER[i]], 3);
+    }
+    static constexpr int RUN_EXTRA[3] = {2, 3, 7};
+    for (const symbol &r : runs) {
+        out.put(run_codes[r.length], run_lengths[r.length]);
+        if (r.length >= 16) {
+            out.put(r.distance, RUN_EXTRA[r.length - 16]);
+        }
+    }
+    for (const symbol &s : symbols) {
+        if (s.distance == 0) {
+            out.put(literal_codes[s.length], literal_lengths[s.length]);
+            continue;
+        }
+        int c = length_code.code[s.length];
+        out.put(literal_codes[257 + c], literal_lengths[257 + c]);
+        out.put(s.length - LENGTH_BASE[c], LENGTH_EXTRA[c]);
+        int d = distance_code(s.distance);
+        out.put(distance_codes[d], distance_lengths[d]);
+        out.put(s.distance - DISTANCE_BASE[d], DISTANCE_EXTRA[d]);
+    }
+    out.put(literal_codes[END_OF_BLOCK], literal_lengths[END_OF_BLOCK]);
+}
+
+std::string compress_gzip(std::string_view data) {
+    // No name or time, made on Unix.
+    std::string out("\x1f\x8b\x08\x00\x00\x00\x00\x00\x00\x03", 10);
+    out.reserve(data.size() / 3 + 64);
+    bit_writer bits(out);
+    matcher match(data);
+    std::vector<symbol> symbols;
+    symbols.reserve(BLOCK_SYMBOLS);
+    for (size_t i = 0; i < data.size();) {
+        size_t distance = 0;
+        size_t length = match.longest(i, distance);
+        match.insert(i);
+        if (length != 0 && length < LAZY_MATCH) {
+            size_t later;
+            if (match.longest(i + 1, later) > length) {
+                length = 0;
+            }
+        }
+        if (length != 0) {
+            symbols.push_back({(uint16_t) length, (uint16_t) distance});
+            for (size_t k = 1; k != length; ++k) {
+                match.insert(i + k);
+            }
+            i += length;
+        } else {
+            symbols.push_back({(uint8_t) data[i], 0});
+            ++i;
+        }
+        if (symbols.size() == BLOCK_SYMBOLS) {
+            write_block(bits, symbols, false);
+            symbols.clear();
+        }
+    }
+    write_block(bits, symbols, true);
+    bits.flush();
+    append_le32(out, crc32(data));
+    append_le32(out, data.size());
+    return out;
+}
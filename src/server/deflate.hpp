@@ -0,0 +1,9 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+// The gzip format (RFC 1952) around a deflate stream (RFC 1951) of blocks
+// with their own Huffman codes, for files that are compressed once and then
+// kept; it aims at what gzip -6 gives, not at speed.
+std::string compress_gzip(std::string_view data);
@@ -0,0 +1,362 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+
+extern "C" {
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <unistd.h>
+}
+
+#include "uring.hpp"
+#include "event_loop.hpp"
+
+// user_data of an operation: its kind, the generation of a poll and the
+// descriptor. Housekeeping entries are IGNORED, they only report failures.
+static uint64_t operation(uint8_t kind, uint32_t generation, int fd) {
+    return (uint64_t) kind << 56 | (uint64_t) (generation & 0xffffff) << 32 |
+        (uint32_t) fd;
+}
+
+event_loop::event_loop(bool completions) :
+    epoll_fd(-1) {
+    if (completions) {
+        ring.reset(new uring);
+        if (!ring->init(RING_ENTRIES) ||
+            !ring->provide_buffers(RECEIVE_BUFFERS, RECEIVE_BUFFER_SIZE)) {
+            fprintf(stderr, "Error: io_uring unavailable, using epoll\n");
+            ring.reset();
+        }
+    }
+    if (ring) {
+        struct rlimit limit;
+        unsigned count = MAX_FIXED_FILES;
+        if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < count) {
+            count = limit.rlim_cur;
+        }
+        if (ring->register_files(count)) {
+            slots.assign(count, -1);
+        }
+        return;
+    }
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1) {
+        fprintf(stderr, "Error: epoll_create1() failed: %d\n", errno);
+    }
+}
+
+event_loop::~event_loop() {
+    if (epoll_fd != -1) {
+        close(epoll_fd);
+    }
+}
+
+bool event_loop::add(int fd, uint32_t events, event_handler *handler) {
+    if (ring) {
+        registration &r = find(fd);
+        if (r.handler != nullptr) {
+            return false;
+        }
+        r.handler = handler;
+        r.events = events;
+        arm_poll(fd);
+        return true;
+    }
+    struct epoll_event event;
+    event.events = events;
+    event.data.ptr = handler;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == 0;
+}
+
+bool event_loop::modify(int fd, uint32_t events, event_handler *handler) {
+    if (ring) {
+        registration &r = find(fd);
+        if (r.handler == nullptr) {
+            return false;
+        }
+        disarm_poll(fd);
+        r.handler = handler;
+        r.events = events;
+        arm_poll(fd);
+        return true;
+    }
+    struct epoll_event event;
+    event.events = events;
+    event.data.ptr = handler;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event) == 0;
+}
+
+void event_loop::remove(int fd) {
+    if (ring) {
+        if ((size_t) fd < registrations.size() &&
+            registrations[fd].handler != nullptr) {
+            disarm_poll(fd);
+            registrations[fd].handler = nullptr;
+        }
+        return;
+    }
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+void event_loop::run_once(int timeout) {
+    if (ring) {
+        ring->submit(timeout);
+        while (const struct io_uring_cqe *entry = ring->next()) {
+            uint64_t data = entry->user_data;
+            int result = entry->res;
+            uint32_t flags = entry->flags;
+            ring->seen();
+            complete(data, result, flags);
+        }
+        return;
+    }
+    struct epoll_event events[MAX_EVENTS];
+    int count = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+    if (count == -1 && errno != EINTR) {
+        fprintf(stderr, "Error: epoll_wait() failed: %d\n", errno);
+    }
+    for (int i = 0; i < count; ++i) {
+        static_cast<event_handler *>(events[i].data.ptr)->handle(
+            events[i].events
+        );
+    }
+}
+
+bool event_loop::completions() const {
+    return ring != nullptr;
+}
+
+// Multishot: one accept keeps delivering connections as they come.
+void event_loop::accept(int fd, event_handler *handler) {
+    find(fd).reader = handler;
+    arm_accept(fd);
+}
+
+// The first receive on a socket installs it into the descriptor table,
+// linked so that the receive only starts once the slot is filled.
+void event_loop::receive(int fd, event_handler *handler) {
+    registration &r = find(fd);
+    r.reader = handler;
+    r.stopping = false;
+    if (!r.fixed && (size_t) fd < slots.size()) {
+        install(fd);
+    }
+    arm_receive(fd);
+}
+
+void event_loop::stop_receiving(int fd) {
+    registration &r = find(fd);
+    if (r.reader == nullptr || r.stopping) {
+        return;
+    }
+    r.stopping = true;
+    struct io_uring_sqe *entry = ring->prepare();
+    entry->opcode = IORING_OP_ASYNC_CANCEL;
+    entry->addr = operation((uint8_t) KIND::RECEIVE, 0, fd);
+    entry->flags = IOSQE_CQE_SKIP_SUCCESS;
+}
+
+void event_loop::send(
+    int fd,
+    const struct msghdr *message,
+    int flags,
+    event_handler *handler
+) {
+    registration &r = find(fd);
+    r.writer = handler;
+    struct io_uring_sqe *entry = ring->prepare();
+    entry->opcode = IORING_OP_SENDMSG;
+    entry->fd = fd;
+    if (r.fixed) {
+        entry->flags = IOSQE_FIXED_FILE;
+    }
+    entry->addr = (uintptr_t) message;
+    entry->len = 1;
+    entry->msg_flags = flags | MSG_NOSIGNAL;
+    entry->user_data = operation((uint8_t) KIND::SEND, 0, fd);
+}
+
+void event_loop::cancel(int fd) {
+    registration &r = find(fd);
+    if (r.reader != nullptr || r.writer != nullptr) {
+        r.stopping = true;
+        // Requests are matched by the file, whether they use the slot or
+        // the descriptor.
+        struct io_uring_sqe *entry = ring->prepare();
+        entry->opcode = IORING_OP_ASYNC_CANCEL;
+        entry->fd = fd;
+        entry->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+        entry->flags = IOSQE_CQE_SKIP_SUCCESS;
+    }
+    if (r.fixed) {
+        uninstall(fd);
+    }
+}
+
+event_loop::registration &event_loop::find(int fd) {
+    if ((size_t) fd >= registrations.size()) {
+        registrations.resize(
+            std::max<size_t>(fd + 1, registrations.size() * 2)
+        );
+    }
+    return registrations[fd];
+}
+
+void event_loop::arm_poll(int fd) {
+    registration &r = registrations[fd];
+    struct io_uring_sqe *entry = ring->prepare();
+    entry->opcode = IORING_OP_POLL_ADD;
+    entry->fd = fd;
+    entry->poll32_events = r.events & ~(EPOLLET | EPOLLONESHOT);
+    entry->len = IORING_POLL_ADD_MULTI;
+    entry->user_data = operation((uint8_t) KIND::POLL, r.generation, fd);
+}
+
+// Polls that are gone are told apart by the generation, so the completions
+// a removed one may still have are dropped.
+void event_loop::disarm_poll(int fd) {
+    registration &r = registrations[fd];
+    struct io_uring_sqe *entry = ring->prepare();
+    entry->opcode = IORING_OP_POLL_REMOVE;
+    entry->addr = operation((uint8_t) KIND::POLL, r.generation, fd);
+    entry->flags = IOSQE_CQE_SKIP_SUCCESS;
+    ++r.generation;
+}
+
+void event_loop::arm_accept(int fd) {
+    struct io_uring_sqe *entry = ring->prepare();
+    entry->opcode = IORING_OP_ACCEPT;
+    entry->fd = fd;
+    entry->ioprio = IORING_ACCEPT_MULTISHOT;
+    entry->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    entry->user_data = operation((uint8_t) KIND::ACCEPT, 0, fd);
+}
+
+void event_loop::arm_receive(int fd) {
+    struct io_uring_sqe *entry = ring->prepare();
+    entry->opcode = IORING_OP_RECV;
+    entry->fd = fd;
+    entry->flags = IOSQE_BUFFER_SELECT;
+    if (registrations[fd].fixed) {
+        entry->flags |= IOSQE_FIXED_FILE;
+    }
+    entry->ioprio = IORING_RECV_MULTISHOT;
+    entry->buf_group = 0;
+    entry->user_data = operation((uint8_t) KIND::RECEIVE, 0, fd);
+}
+
+// The slot of a socket is its descriptor, which is unique while it is open.
+void event_loop::install(int fd) {
+    slots[fd] = fd;
+    registrations[fd].fixed = true;
+    struct io_uring_sqe *entry = ring->prepare();
+    entry->opcode = IORING_OP_FILES_UPDATE;
+    entry->fd = -1;
+    entry->addr = (uintptr_t) &slots[fd];
+    entry->len = 1;
+    entry->off = fd;
+    entry->flags = IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+    entry->user_data = operation((uint8_t) KIND::INSTALL, 0, fd);
+}
+
+// The table holds a reference to the socket, which would otherwise stay
+// open after close().
+void event_loop::uninstall(int fd) {
+    slots[fd] = -1;
+    registrations[fd].fixed = false;
+    struct io_uring_sqe *entry = ring->prepare();
+    entry->opcode = IORING_OP_FILES_UPDATE;
+    entry->fd = -1;
+    entry->addr = (uintptr_t) &slots[fd];
+    entry->len = 1;
+    entry->off = fd;
+    entry->flags = IOSQE_CQE_SKIP_SUCCESS;
+}
+
+// Handlers may add descriptors, which moves the registrations, so none is
+// used after a handler has been called.
+void event_loop::complete(uint64_t data, int result, uint32_t flags) {
+    KIND kind = (KIND) (data >> 56);
+    uint32_t generation = data >> 32 & 0xffffff;
+    int fd = (uint32_t) data;
+    bool more = flags & IORING_CQE_F_MORE;
+    if (kind == KIND::IGNORED) {
+        return;
+    }
+    registration &r = registrations[fd];
+    event_handler *handler;
+    switch (kind) {
+    case KIND::POLL:
+        handler = r.handler;
+        if (handler == nullptr || generation != (r.generation & 0xffffff)) {
+            return;
+        }
+        if (result < 0) {
+            handler->handle(EPOLLERR);
+            return;
+        }
+        // A multishot poll ends when the completion queue overflows.
+        if (!more) {
+            arm_poll(fd);
+        }
+        handler->handle(result);
+        return;
+    case KIND::ACCEPT:
+        handler = r.reader;
+        if (handler == nullptr) {
+            return;
+        }
+        if (!more) {
+            arm_accept(fd);
+        }
+        handler->accepted(result);
+        return;
+    case KIND::RECEIVE:
+        handler = r.reader;
+        if (result > 0 && (flags & IORING_CQE_F_BUFFER)) {
+            unsigned id = flags >> IORING_CQE_BUFFER_SHIFT;
+            if (handler != nullptr) {
+                handler->received(ring->buffer(id), result);
+            }
+            ring->recycle(id);
+        }
+        if (more) {
+            return;
+        }
+        {
+            // The receive also ends when the buffers run out; unless it was
+            // stopped it just goes on.
+            registration &current = registrations[fd];
+            handler = current.reader;
+            if (handler == nullptr) {
+                return;
+            }
+            if (result > 0 || result == -ENOBUFS || result == -ECANCELED) {
+                if (!current.stopping) {
+                    arm_receive(fd);
+                    return;
+                }
+                result = -ECANCELED;
+            }
+            current.reader = nullptr;
+            current.stopping = false;
+        }
+        handler->received(nullptr, result);
+        return;
+    case KIND::SEND:
+        handler = r.writer;
+        r.writer = nullptr;
+        if (handler != nullptr) {
+            handler->sent(result);
+        }
+        return;
+    case KIND::INSTALL:
+        // The slot could not be filled: the linked receive is cancelled and
+        // comes back through the descriptor.
+        slots[fd] = -1;
+        r.fixed = false;
+        return;
+    default:
+        return;
+    }
+}
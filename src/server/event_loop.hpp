@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+extern "C" {
+#include <sys/socket.h>
+}
+
+class uring;
+
+class event_handler {
+public:
+    virtual ~event_handler() = default;
+    virtual void handle(uint32_t events) = 0;
+    // Completions of the operations a loop on io_uring runs for sockets.
+    // accepted() gets a new connection or -errno.
+    virtual void accepted(int) {}
+    // Data from receive(); 0 is the end of input and -errno an error, after
+    // which nothing more comes (-ECANCELED once receiving was stopped).
+    virtual void received(const char *, int) {}
+    // The result of send(), that of sendmsg() with -errno for an error.
+    virtual void sent(int) {}
+};
+
+// Dispatches readiness events from epoll or, when asked for completions
+// and the kernel has it, from io_uring. There add() and modify() set up
+// multishot polls, which always behave as edge-triggered, and sockets can
+// also be accepted from, read and written by the ring itself: a receive
+// fills buffers the kernel picks from a registered ring, and a socket that
+// is read that way is installed into the table of registered descriptors,
+// so no operation on it has to look the descriptor up.
+class event_loop {
+public:
+    explicit event_loop(bool completions = false);
+    ~event_loop();
+    event_loop(const event_loop &) = delete;
+    event_loop &operator=(const event_loop &) = delete;
+
+    bool add(int fd, uint32_t events, event_handler *handler);
+    bool modify(int fd, uint32_t events, event_handler *handler);
+    void remove(int fd);
+    void run_once(int timeout);
+
+    // Whether the loop runs on io_uring and takes the calls below, each
+    // for at most one operation of a kind per descriptor at a time.
+    bool completions() const;
+    void accept(int fd, event_handler *handler);
+    void receive(int fd, event_handler *handler);
+    void stop_receiving(int fd);
+    // message has to stay as it is until sent() is called.
+    void send(
+        int fd,
+        const struct msghdr *message,
+        int flags,
+        event_handler *handler
+    );
+    // Ends whatever still runs on fd, before it may be closed once the
+    // handlers have had their last completions.
+    void cancel(int fd);
+
+private:
+    enum class KIND : uint8_t {
+        IGNORED,
+        POLL,
+        ACCEPT,
+        RECEIVE,
+        SEND,
+        INSTALL
+    };
+
+    struct registration {
+        event_handler *handler = nullptr;
+        uint32_t events = 0;
+        uint32_t generation = 0;
+        event_handler *reader = nullptr;
+        event_handler *writer = nullptr;
+        bool stopping = false;
+        bool fixed = false;
+    };
+
+    registration &find(int fd);
+    void arm_poll(int fd);
+    void disarm_poll(int fd);
+    void arm_accept(int fd);
+    void arm_receive(int fd);
+    void install(int fd);
+    void uninstall(int fd);
+    void complete(uint64_t data, int result, uint32_t flags);
+
+    static constexpr int MAX_EVENTS = 256;
+    static constexpr unsigned RING_ENTRIES = 1024;
+    static constexpr unsigned RECEIVE_BUFFERS = 256;
+    static constexpr size_t RECEIVE_BUFFER_SIZE = 16 << 10;
+    static constexpr unsigned MAX_FIXED_FILES = 65536;
+
+    int epoll_fd;
+    std::unique_ptr<uring> ring;
+    std::vector<registration> registrations;
+    // What the slots of the descriptor table are set to, read by the kernel
+    // when an update runs.
+    std::vector<int> slots;
+};
@@ -0,0 +1,1181 @@
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <string_view>
+#include <thread>
+
+extern "C" {
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+}
+
+#include "common.hpp"
+#include "config_reader.hpp"
+#include "event_loop.hpp"
+#include "metrics.hpp"
+#include "cgi.hpp"
+#include "fastcgi.hpp"
+
+enum RECORD : uint8_t {
+    BEGIN_REQUEST = 1,
+    ABORT_REQUEST = 2,
+    END_REQUEST = 3,
+    PARAMS = 4,
+    STDIN = 5,
+    STDOUT = 6,
+    STDERR = 7,
+    GET_VALUES = 9,
+    GET_VALUES_RESULT = 10
+};
+
+enum PROTOCOL_STATUS : uint8_t {
+    REQUEST_COMPLETE = 0,
+    CANT_MPX_CONN = 1,
+    OVERLOADED = 2,
+    UNKNOWN_ROLE = 3
+};
+
+constexpr uint8_t VERSION = 1;
+constexpr uint8_t RESPONDER = 1;
+constexpr uint8_t KEEP_CONN = 1;
+constexpr size_t HEADER_SIZE = 8;
+constexpr size_t MAX_CONTENT = 65535;
+constexpr size_t MAX_ID = 65535;
+constexpr size_t STREAM_BUFFER = 4 * BUFFER_SIZE;
+// Requests run at once on a connection to an application that takes more
+// than one, and bytes of records queued for it before request bodies are
+// no longer read.
+constexpr size_t MAX_MULTIPLEXED = 64;
+constexpr size_t MAX_PENDING = 256 << 10;
+
+static std::vector<std::unique_ptr<fastcgi_pool>> &pools =
+    *new std::vector<std::unique_ptr<fastcgi_pool>>;
+
+static void append_record(
+    std::string &out,
+    uint8_t type,
+    uint16_t id,
+    const char *data,
+    size_t length
+) {
+    do {
+        size_t part = length < MAX_CONTENT ? length : MAX_CONTENT;
+        uint8_t padding = (8 - part % 8) % 8;
+        const char header[HEADER_SIZE] = {
+            (char) VERSION,
+            (char) type,
+            (char) (id >> 8),
+            (char) (id & 0xff),
+            (char) (part >> 8),
+            (char) (part & 0xff),
+            (char) padding,
+            0
+        };
+        out.append(header, HEADER_SIZE);
+        out.append(data, part);
+        out.append(padding, '\0');
+        data += part;
+        length -= part;
+    } while (length);
+}
+
+static void append_length(std::string &out, size_t length) {
+    if (length < 128) {
+        out += (char) length;
+    } else {
+        out += (char) ((length >> 24) | 0x80);
+        out += (char) ((length >> 16) & 0xff);
+        out += (char) ((length >> 8) & 0xff);
+        out += (char) (length & 0xff);
+    }
+}
+
+static void append_pair(
+    std::string &out,
+    std::string_view name,
+    std::string_view value
+) {
+    append_length(out, name.size());
+    append_length(out, value.size());
+    out.append(name);
+    out.append(value);
+}
+
+static bool read_length(std::string_view &data, size_t &length) {
+    const unsigned char *bytes = (const unsigned char *) data.data();
+    if (data.size() && bytes[0] < 128) {
+        length = bytes[0];
+        data.remove_prefix(1);
+        return true;
+    }
+    if (data.size() < 4) {
+        return false;
+    }
+    length = (size_t) (bytes[0] & 0x7f) << 24 | bytes[1] << 16 |
+        bytes[2] << 8 | bytes[3];
+    data.remove_prefix(4);
+    return true;
+}
+
+static bool read_pair(
+    std::string_view &data,
+    std::string_view &name,
+    std::string_view &value
+) {
+    size_t name_length, value_length;
+    if (!read_length(data, name_length) ||
+        !read_length(data, value_length) ||
+        data.size() < name_length + value_length) {
+        return false;
+    }
+    name = data.substr(0, name_length);
+    value = data.substr(name_length, value_length);
+    data.remove_prefix(name_length + value_length);
+    return true;
+}
+
+// Without a body the empty FCGI_STDIN follows at once, otherwise it ends
+// the body once that has been sent.
+static void encode(
+    std::string &records,
+    uint16_t id,
+    const std::pmr::vector<std::pmr::string> &environment,
+    bool body
+) {
+    records.clear();
+    const char begin[] = {0, RESPONDER, KEEP_CONN, 0, 0, 0, 0, 0};
+    append_record(records, BEGIN_REQUEST, id, begin, sizeof(begin));
+    std::string params;
+    for (std::string_view variable : environment) {
+        size_t equals = variable.find('=');
+        append_pair(
+            params,
+            variable.substr(0, equals),
+            variable.substr(equals + 1)
+        );
+    }
+    if (params.size()) {
+        append_record(records, PARAMS, id, params.data(), params.size());
+    }
+    append_record(records, PARAMS, id, nullptr, 0);
+    if (!body) {
+        append_record(records, STDIN, id, nullptr, 0);
+    }
+}
+
+class fastcgi_link;
+
+// A request on a connection to an application, under the id that is its
+// place in the list of the connection plus one. The place is taken again
+// once the stream has let go of the request and the application has ended
+// it, which it also does after an abort.
+struct fastcgi_request {
+    class body_watcher : public event_handler {
+    public:
+        explicit body_watcher(fastcgi_request &owner);
+        void handle(uint32_t events) override;
+
+    private:
+        fastcgi_request &owner;
+    };
+
+    fastcgi_request(fastcgi_link &link, uint16_t id);
+    ~fastcgi_request();
+    fastcgi_request(const fastcgi_request &) = delete;
+    fastcgi_request &operator=(const fastcgi_request &) = delete;
+
+    fastcgi_link &link;
+    uint16_t id;
+    // eventfd the stream watches, written when there is something for it.
+    int wakeup;
+    int input;
+    body_watcher body;
+    // BEGIN_REQUEST and PARAMS, kept to be sent once more on a new
+    // connection until the application answers.
+    std::string records;
+    std::string output;
+    int64_t started;
+    uint8_t status;
+    bool owned;
+    bool open;
+    bool aborted;
+    bool answered;
+    bool forwarded;
+    bool retried;
+    bool waiting;
+    bool failed;
+    bool signalled;
+};
+
+// A connection of a worker to an application of a pool, driven by the
+// event loop of the worker. Once it is gone the requests on it fail, or
+// are sent once more on a new connection if the application had answered
+// others before: it may close a connection it kept at any time it is
+// idle. The object stays with the worker for the next connection, epoll
+// may still have events for it.
+class fastcgi_link : public event_handler {
+public:
+    fastcgi_link(fastcgi_pool &pool, event_loop &loop);
+    ~fastcgi_link();
+    fastcgi_link(const fastcgi_link &) = delete;
+    fastcgi_link &operator=(const fastcgi_link &) = delete;
+
+    bool serves(const fastcgi_pool &p, const event_loop &l) const;
+    bool connected() const;
+    size_t load() const;
+    bool full() const;
+    // Takes over body (the read end of the pipe with the request body, -1
+    // without one) unless it returns nullptr.
+    fastcgi_request *begin(
+        const std::pmr::vector<std::pmr::string> &environment,
+        int body
+    );
+    void forward(fastcgi_request &r);
+    void abort(fastcgi_request &r);
+    void release(fastcgi_request &r);
+    void handle(uint32_t events) override;
+
+private:
+    bool connect();
+    void disconnect();
+    bool flush();
+    bool receive();
+    bool dispatch();
+    void learn(std::string_view content);
+    void take(fastcgi_request &r, std::string_view content);
+    void end(fastcgi_request &r, uint8_t status);
+    void fail();
+    void drop(fastcgi_request &r);
+    void notify(fastcgi_request &r);
+    void stop_input(fastcgi_request &r);
+
+    fastcgi_pool &pool;
+    event_loop &loop;
+    int socket;
+    std::string output;
+    size_t sent;
+    std::string input;
+    std::vector<std::unique_ptr<fastcgi_request>> requests;
+    size_t capacity;
+    size_t completed;
+};
+
+fastcgi_request::body_watcher::body_watcher(fastcgi_request &owner) :
+    owner(owner) {
+}
+
+void fastcgi_request::body_watcher::handle(uint32_t) {
+    owner.link.forward(owner);
+}
+
+fastcgi_request::fastcgi_request(fastcgi_link &link, uint16_t id) :
+    link(link),
+    id(id),
+    wakeup(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+    input(-1),
+    body(*this),
+    started(0),
+    status(REQUEST_COMPLETE),
+    owned(false),
+    open(false),
+    aborted(false),
+    answered(false),
+    forwarded(false),
+    retried(false),
+    waiting(false),
+    failed(false),
+    signalled(false) {
+}
+
+fastcgi_request::~fastcgi_request() {
+    if (wakeup != -1) {
+        close(wakeup);
+    }
+    if (input != -1) {
+        close(input);
+    }
+}
+
+fastcgi_link::fastcgi_link(fastcgi_pool &pool, event_loop &loop) :
+    pool(pool),
+    loop(loop),
+    socket(-1),
+    sent(0),
+    capacity(1),
+    completed(0) {
+}
+
+fastcgi_link::~fastcgi_link() {
+    if (socket != -1) {
+        close(socket);
+    }
+}
+
+bool fastcgi_link::serves(const fastcgi_pool &p, const event_loop &l) const {
+    return &pool == &p && &loop == &l;
+}
+
+bool fastcgi_link::connected() const {
+    return socket != -1;
+}
+
+size_t fastcgi_link::load() const {
+    size_t running = 0;
+    for (const std::unique_ptr<fastcgi_request> &r : requests) {
+        running += r->open;
+    }
+    return running;
+}
+
+bool fastcgi_link::full() const {
+    return load() >= capacity;
+}
+
+// The application is asked first whether it takes more than one request
+// on a connection; until it answers it gets one at a time.
+bool fastcgi_link::connect() {
+    socket = pool.connect_next();
+    if (socket == -1) {
+        fprintf(stderr, "Error: FastCGI connect() failed: %d\n", errno);
+        return false;
+    }
+    loop.add(socket, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, this);
+    capacity = 1;
+    completed = 0;
+    std::string values;
+    append_pair(values, "FCGI_MPXS_CONNS", "");
+    append_pair(values, "FCGI_MAX_REQS", "");
+    append_record(output, GET_VALUES, 0, values.data(), values.size());
+    return true;
+}
+
+void fastcgi_link::disconnect() {
+    if (socket == -1) {
+        return;
+    }
+    loop.remove(socket);
+    close(socket);
+    socket = -1;
+    output.clear();
+    sent = 0;
+    input.clear();
+}
+
+fastcgi_request *fastcgi_link::begin(
+    const std::pmr::vector<std::pmr::string> &environment,
+    int body
+) {
+    if (socket == -1 && !connect()) {
+        return nullptr;
+    }
+    fastcgi_request *r = nullptr;
+    for (std::unique_ptr<fastcgi_request> &slot : requests) {
+        if (!slot->owned && !slot->open) {
+            r = slot.get();
+            break;
+        }
+    }
+    if (r == nullptr) {
+        if (requests.size() == MAX_ID) {
+            return nullptr;
+        }
+        requests.push_back(
+            std::make_unique<fastcgi_request>(*this, requests.size() + 1)
+        );
+        r = requests.back().get();
+    }
+    if (r->wakeup == -1) {
+        fprintf(stderr, "Error: eventfd() failed: %d\n", errno);
+        return nullptr;
+    }
+    // Left over from the stream that had the place before.
+    if (r->signalled) {
+        uint64_t value;
+        if (read(r->wakeup, &value, sizeof(value)) == -1) {
+            fprintf(stderr, "Error: read() failed: %d\n", errno);
+        }
+    }
+    r->output.clear();
+    r->started = monotonic_us();
+    r->status = REQUEST_COMPLETE;
+    r->owned = r->open = true;
+    r->aborted = r->answered = r->forwarded = r->retried = false;
+    r->waiting = r->failed = r->signalled = false;
+    encode(r->records, r->id, environment, body != -1);
+    output += r->records;
+    if (body != -1) {
+        r->input = body;
+        loop.add(body, EPOLLIN | EPOLLET, &r->body);
+        forward(*r);
+    } else if (!flush()) {
+        fail();
+    }
+    return r;
+}
+
+// The body goes on as FCGI_STDIN as long as the application takes the
+// records before it; a slow application holds back the client through
+// the pipe the same way a CGI script does.
+void fastcgi_link::forward(fastcgi_request &r) {
+    if (socket == -1) {
+        return;
+    }
+    char buffer[STREAM_BUFFER];
+    while (r.input != -1) {
+        if (output.size() - sent >= MAX_PENDING) {
+            if (!flush()) {
+                fail();
+                return;
+            }
+            if (output.size() - sent >= MAX_PENDING) {
+                r.waiting = true;
+                return;
+            }
+        }
+        ssize_t bytes = read(r.input, buffer, sizeof(buffer));
+        if (bytes == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        r.forwarded = true;
+        if (bytes > 0) {
+            append_record(output, STDIN, r.id, buffer, bytes);
+            continue;
+        }
+        stop_input(r);
+        append_record(output, STDIN, r.id, nullptr, 0);
+    }
+    if (!flush()) {
+        fail();
+    }
+}
+
+void fastcgi_link::abort(fastcgi_request &r) {
+    if (!r.open || r.aborted) {
+        return;
+    }
+    r.aborted = true;
+    r.output.clear();
+    stop_input(r);
+    if (socket == -1) {
+        return;
+    }
+    append_record(output, ABORT_REQUEST, r.id, nullptr, 0);
+    if (!flush()) {
+        fail();
+    }
+}
+
+// The stream is done with the request. One the application still runs is
+// aborted, and the place is free once the application has ended it.
+void fastcgi_link::release(fastcgi_request &r) {
+    r.owned = false;
+    r.output.clear();
+    abort(r);
+}
+
+void fastcgi_link::handle(uint32_t events) {
+    if (socket == -1) {
+        return;
+    }
+    if ((events & EPOLLOUT) && !flush()) {
+        fail();
+        return;
+    }
+    if ((events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) &&
+        !receive()) {
+        fail();
+        return;
+    }
+    // Bodies held back while the records before them were queued.
+    for (std::unique_ptr<fastcgi_request> &r : requests) {
+        if (socket == -1 || output.size() - sent >= MAX_PENDING) {
+            break;
+        }
+        if (r->waiting) {
+            r->waiting = false;
+            forward(*r);
+        }
+    }
+}
+
+bool fastcgi_link::flush() {
+    while (sent != output.size()) {
+        ssize_t bytes = send(
+            socket,
+            output.data() + sent,
+            output.size() - sent,
+            MSG_NOSIGNAL
+        );
+        if (bytes > 0) {
+            sent += bytes;
+        } else if (bytes == -1 && errno == EINTR) {
+            continue;
+        } else if (bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            output.erase(0, sent);
+            sent = 0;
+            return true;
+        } else {
+            return false;
+        }
+    }
+    output.clear();
+    sent = 0;
+    return true;
+}
+
+bool fastcgi_link::receive() {
+    char buffer[STREAM_BUFFER];
+    for (;;) {
+        ssize_t bytes = read(socket, buffer, sizeof(buffer));
+        if (bytes > 0) {
+            input.append(buffer, bytes);
+            if (!dispatch()) {
+                return false;
+            }
+        } else if (bytes == -1 && errno == EINTR) {
+            continue;
+        } else {
+            return bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+        }
+    }
+}
+
+bool fastcgi_link::dispatch() {
+    size_t position = 0;
+    while (input.size() - position >= HEADER_SIZE) {
+        const unsigned char *header =
+            (const unsigned char *) input.data() + position;
+        if (header[0] != VERSION) {
+            return false;
+        }
+        size_t length = header[4] << 8 | header[5];
+        size_t total = HEADER_SIZE + length + header[6];
+        if (input.size() - position < total) {
+            break;
+        }
+        uint16_t id = header[2] << 8 | header[3];
+        std::string_view content(
+            input.data() + position + HEADER_SIZE,
+            length
+        );
+        position += total;
+        if (id == 0) {
+            if (header[1] == GET_VALUES_RESULT) {
+                learn(content);
+            }
+            continue;
+        }
+        if (id > requests.size() || !requests[id - 1]->open) {
+            continue;
+        }
+        fastcgi_request &r = *requests[id - 1];
+        if (header[1] == STDOUT) {
+            take(r, content);
+        } else if (header[1] == STDERR) {
+            fprintf(stderr, "%.*s", (int) length, content.data());
+        } else if (header[1] == END_REQUEST) {
+            uint8_t status = UNKNOWN_ROLE;
+            if (length >= 5) {
+                status = content[4];
+            }
+            end(r, status);
+        }
+    }
+    input.erase(0, position);
+    return true;
+}
+
+void fastcgi_link::learn(std::string_view content) {
+    bool multiplexed = false;
+    size_t most = MAX_MULTIPLEXED;
+    std::string_view name, value;
+    while (read_pair(content, name, value)) {
+        if (name == "FCGI_MPXS_CONNS") {
+            multiplexed = value == "1";
+        } else if (name == "FCGI_MAX_REQS") {
+            size_t count = 0;
+            std::from_chars(value.data(), value.data() + value.size(), count);
+            if (count) {
+                most = std::min(count, MAX_MULTIPLEXED);
+            }
+        }
+    }
+    capacity = multiplexed ? most : 1;
+}
+
+void fastcgi_link::take(fastcgi_request &r, std::string_view content) {
+    if (!r.answered) {
+        r.answered = true;
+        r.records.clear();
+    }
+    if (r.owned && !r.aborted && content.size()) {
+        r.output.append(content);
+        notify(r);
+    }
+}
+
+void fastcgi_link::end(fastcgi_request &r, uint8_t status) {
+    if (!r.aborted) {
+        record_stage(STAGE::FASTCGI, monotonic_us() - r.started);
+    }
+    r.status = status;
+    r.open = false;
+    r.records.clear();
+    stop_input(r);
+    ++completed;
+    if (status == CANT_MPX_CONN) {
+        capacity = 1;
+    }
+    notify(r);
+}
+
+void fastcgi_link::fail() {
+    bool kept = completed != 0;
+    disconnect();
+    std::vector<fastcgi_request *> again;
+    for (std::unique_ptr<fastcgi_request> &r : requests) {
+        if (!r->open) {
+            continue;
+        }
+        if (kept && !r->aborted && !r->answered && !r->forwarded &&
+            !r->retried) {
+            r->retried = true;
+            again.push_back(r.get());
+        } else {
+            drop(*r);
+        }
+    }
+    if (again.empty()) {
+        return;
+    }
+    if (!connect()) {
+        for (fastcgi_request *r : again) {
+            drop(*r);
+        }
+        return;
+    }
+    for (fastcgi_request *r : again) {
+        output += r->records;
+    }
+    if (!flush()) {
+        fail();
+        return;
+    }
+    for (fastcgi_request *r : again) {
+        forward(*r);
+    }
+}
+
+void fastcgi_link::drop(fastcgi_request &r) {
+    r.open = false;
+    r.failed = true;
+    r.records.clear();
+    stop_input(r);
+    notify(r);
+}
+
+void fastcgi_link::notify(fastcgi_request &r) {
+    if (!r.owned || r.signalled) {
+        return;
+    }
+    uint64_t one = 1;
+    if (write(r.wakeup, &one, sizeof(one)) == sizeof(one)) {
+        r.signalled = true;
+    }
+}
+
+void fastcgi_link::stop_input(fastcgi_request &r) {
+    r.waiting = false;
+    if (r.input != -1) {
+        loop.remove(r.input);
+        close(r.input);
+        r.input = -1;
+    }
+}
+
+// Connections of the worker running on this thread.
+static thread_local std::vector<std::unique_ptr<fastcgi_link>> links;
+
+// A request goes to the connection running the fewest, as long as the
+// application takes it there; each application of a pool gets a
+// connection before any of them gets two requests at once.
+static fastcgi_link *choose_link(fastcgi_pool &pool, event_loop &loop) {
+    fastcgi_link *least = nullptr;
+    fastcgi_link *spare = nullptr;
+    size_t connected = 0;
+    for (std::unique_ptr<fastcgi_link> &link : links) {
+        if (!link->serves(pool, loop)) {
+            continue;
+        }
+        if (!link->connected()) {
+            if (spare == nullptr) {
+                spare = link.get();
+            }
+            continue;
+        }
+        ++connected;
+        if (least == nullptr || link->load() < least->load()) {
+            least = link.get();
+        }
+    }
+    if (least != nullptr && (least->load() == 0 ||
+            (connected >= pool.targets() && !least->full()))) {
+        return least;
+    }
+    if (spare == nullptr) {
+        links.push_back(std::make_unique<fastcgi_link>(pool, loop));
+        spare = links.back().get();
+    }
+    return spare;
+}
+
+fastcgi_stream::fastcgi_stream(
+    fastcgi_pool &pool,
+    event_loop &loop,
+    const std::pmr::vector<std::pmr::string> &environment,
+    int input,
+    bool chunked,
+    bool keep_alive
+) :
+    exchange(choose_link(pool, loop)->begin(environment, input)),
+    chunked(chunked),
+    keep_alive(keep_alive),
+    header_sent(false),
+    timed_out(false),
+    deadline(monotonic_ms() + settings.cgi_timeout) {
+    if (exchange == nullptr && input != -1) {
+        close(input);
+    }
+}
+
+fastcgi_stream::~fastcgi_stream() {
+    if (exchange != nullptr) {
+        exchange->link.release(*exchange);
+    }
+}
+
+bool fastcgi_stream::failed() const {
+    return exchange == nullptr;
+}
+
+int fastcgi_stream::descriptor() const {
+    return exchange->wakeup;
+}
+
+int64_t fastcgi_stream::expires() const {
+    return exchange->open && !timed_out ? deadline : 0;
+}
+
+void fastcgi_stream::expire() {
+    if (expires() && monotonic_ms() >= deadline) {
+        exchange->link.abort(*exchange);
+        timed_out = true;
+        count_cgi_timeout();
+    }
+}
+
+void fastcgi_stream::input_complete() {
+    if (exchange->open) {
+        deadline = monotonic_ms() + settings.cgi_timeout;
+    }
+}
+
+// Requests the application could not take are answered with 503, those
+// it failed or that ran out of time with 500.
+STREAM fastcgi_stream::fail(std::string &out) {
+    exchange->link.abort(*exchange);
+    if (header_sent) {
+        return STREAM::FAILED;
+    }
+    header_sent = true;
+    out.clear();
+    bool refused = !exchange->failed && !timed_out &&
+        (exchange->status == OVERLOADED || exchange->status == CANT_MPX_CONN);
+    append_error(out, refused ? 503 : 500, "", keep_alive);
+    return STREAM::DONE;
+}
+
+void fastcgi_stream::append_chunk(
+    std::string &out,
+    const char *data,
+    size_t size
+) {
+    if (size == 0) {
+        return;
+    }
+    if (chunked) {
+        char length[32];
+        snprintf(length, sizeof(length), "%zx\r\n", size);
+        out += length;
+    }
+    out.append(data, size);
+    if (chunked) {
+        out += "\r\n";
+    }
+}
+
+STREAM fastcgi_stream::produce(std::string &out) {
+    if (timed_out) {
+        return fail(out);
+    }
+    fastcgi_request &r = *exchange;
+    if (r.signalled) {
+        uint64_t value;
+        if (read(r.wakeup, &value, sizeof(value)) == -1 && errno != EAGAIN) {
+            fprintf(stderr, "Error: read() failed: %d\n", errno);
+        }
+        r.signalled = false;
+    }
+    if (r.output.size()) {
+        if (header_sent) {
+            append_chunk(out, r.output.data(), r.output.size());
+            r.output.clear();
+            return STREAM::MORE;
+        }
+        pending += r.output;
+        r.output.clear();
+        size_t skip;
+        size_t end = header_end(pending, skip);
+        if (end == std::string::npos) {
+            if (pending.size() > settings.max_header_size) {
+                return fail(out);
+            }
+            return STREAM::MORE;
+        }
+        std::string status, record;
+        if (!parse_cgi_header(
+                std::string_view(pending).substr(0, end),
+                status,
+                record
+            )
+        ) {
+            return fail(out);
+        }
+        if (chunked) {
+            record += "Transfer-Encoding: chunked\n";
+        }
+        out = status_header(status, record, keep_alive);
+        header_sent = true;
+        append_chunk(
+            out,
+            pending.data() + end + skip,
+            pending.size() - end - skip
+        );
+        pending.clear();
+        pending.shrink_to_fit();
+        return STREAM::MORE;
+    }
+    if (r.open) {
+        return STREAM::AGAIN;
+    }
+    if (r.failed || r.status != REQUEST_COMPLETE || !header_sent) {
+        return fail(out);
+    }
+    if (chunked) {
+        out += "0\r\n\r\n";
+    }
+    return STREAM::DONE;
+}
+
+fastcgi_pool::fastcgi_pool(const std::string &script) :
+    name(script),
+    processes(0),
+    next(0) {
+}
+
+const std::string &fastcgi_pool::script() const {
+    return name;
+}
+
+size_t fastcgi_pool::targets() const {
+    return sockets.size();
+}
+
+void fastcgi_pool::add_socket(const std::string &path) {
+    sockets.push_back(path);
+}
+
+void fastcgi_pool::set_processes(unsigned count) {
+    processes = count;
+}
+
+bool fastcgi_pool::spawns() const {
+    return processes != 0;
+}
+
+// Sockets of spawned applications are put in a directory of their own
+// that only this user can enter, under a name no one knows in advance, so
+// no one else can put a socket of theirs in place of one. It is removed
+// by stop_fastcgi().
+static std::string socket_directory;
+static pid_t directory_owner = -1;
+
+static bool make_socket_directory(const std::string &parent) {
+    if (socket_directory.size()) {
+        return true;
+    }
+    std::string path = parent + "/" PROJECT_NAME ".XXXXXX";
+    if (mkdtemp(path.data()) == nullptr) {
+        fprintf(stderr, "Error: can't create a directory in %s: %d\n",
+            parent.c_str(), errno);
+        return false;
+    }
+    socket_directory = path;
+    directory_owner = getpid();
+    return true;
+}
+
+bool fastcgi_pool::start(const std::string &directory) {
+    if (processes == 0) {
+        return sockets.size() != 0;
+    }
+    if (!make_socket_directory(directory)) {
+        return false;
+    }
+    std::string file = name;
+    for (char &c : file) {
+        if (c == '/') {
+            c = '_';
+        }
+    }
+    for (unsigned i = 0; i != processes; ++i) {
+        sockets.push_back(
+            socket_directory + "/" + file + "." + std::to_string(i) + ".sock"
+        );
+    }
+    pids.assign(processes, -1);
+    pidfds.assign(processes, -1);
+    started.assign(processes, 0);
+    for (unsigned i = 0; i != processes; ++i) {
+        if (!spawn(i)) {
+            return false;
+        }
+    }
+    std::thread(&fastcgi_pool::supervise, this).detach();
+    return true;
+}
+
+void fastcgi_pool::stop() {
+    if (processes == 0) {
+        return;
+    }
+    for (const std::string &socket : sockets) {
+        unlink(socket.c_str());
+    }
+}
+
+// Arguments of start_application.
+struct application_start {
+    const char *path;
+    int listener;
+};
+
+// The child of clone, with a copy of the memory of this process as after
+// fork. The listening socket becomes FCGI_LISTENSOCK_FILENO.
+static int start_application(void *argument) {
+    application_start &start = *(application_start *) argument;
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    signal(SIGPIPE, SIG_DFL);
+    if (dup2(start.listener, STDIN_FILENO) != -1) {
+        execl(start.path, start.path, nullptr);
+    }
+    _exit(1);
+}
+
+// Started with CLONE_PIDFD, so the pidfd exists before the application can
+// exit and be reaped (SIGCHLD is ignored). On kernels before 5.2, which
+// ignore the flag, there is none and the application is not restarted.
+bool fastcgi_pool::spawn(size_t target) {
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener == -1) {
+        fprintf(stderr, "Error: socket() failed: %d\n", errno);
+        return false;
+    }
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (sockets[target].size() >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Error: FastCGI socket path too long\n");
+        close(listener);
+        return false;
+    }
+    strcpy(address.sun_path, sockets[target].c_str());
+    unlink(address.sun_path);
+    if (bind(listener, (struct sockaddr *) &address, sizeof(address)) == -1 ||
+        listen(listener, SOMAXCONN) == -1) {
+        fprintf(stderr, "Error: bind() failed: %d\n", errno);
+        close(listener);
+        return false;
+    }
+    alignas(16) char stack[16384];
+    application_start start = {name.c_str(), listener};
+    int process = -1;
+    pid_t pid = clone(
+        start_application,
+        stack + sizeof(stack),
+        CLONE_PIDFD | SIGCHLD,
+        &start,
+        &process
+    );
+    close(listener);
+    if (pid == -1) {
+        fprintf(stderr, "Error: clone() failed: %d\n", errno);
+        return false;
+    }
+    pids[target] = pid;
+    pidfds[target] = process;
+    started[target] = monotonic_ms();
+    return true;
+}
+
+// Waits for the pidfds of the applications and starts one again as soon
+// as it is gone. One that exits within a second of its start, or could not
+// be started at all, is tried again a second later.
+void fastcgi_pool::supervise() {
+    std::vector<struct pollfd> watched(pids.size());
+    for (;;) {
+        bool missing = false;
+        for (size_t target = 0; target != pids.size(); ++target) {
+            watched[target] = {pidfds[target], POLLIN, 0};
+            missing |= pids[target] == -1;
+        }
+        if (poll(watched.data(), watched.size(), missing ? 1000 : -1) == -1) {
+            if (errno != EINTR) {
+                fprintf(stderr, "Error: poll() failed: %d\n", errno);
+                return;
+            }
+            continue;
+        }
+        int64_t now = monotonic_ms();
+        for (size_t target = 0; target != pids.size(); ++target) {
+            if (pids[target] != -1 && watched[target].revents) {
+                fprintf(stderr, "FastCGI process %s exited, restarting\n",
+                    name.c_str());
+                close(pidfds[target]);
+                pidfds[target] = -1;
+                pids[target] = -1;
+                if (now - started[target] < 1000) {
+                    continue;
+                }
+            } else if (pids[target] != -1 ||
+                now - started[target] < 1000) {
+                continue;
+            }
+            if (!spawn(target)) {
+                started[target] = now;
+            }
+        }
+    }
+}
+
+int fastcgi_pool::connect_next() {
+    if (sockets.empty()) {
+        errno = ENOENT;
+        return -1;
+    }
+    size_t target = next++ % sockets.size();
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, sockets[target].c_str(),
+        sizeof(address.sun_path) - 1);
+    if (connect(fd, (struct sockaddr *) &address, sizeof(address)) == -1) {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    return fd;
+}
+
+bool add_fastcgi(const std::string &specification) {
+    std::vector<std::string> parts;
+    size_t start = specification.find_first_not_of(" \t");
+    while (start != std::string::npos) {
+        size_t finish = specification.find_first_of(" \t", start);
+        parts.push_back(specification.substr(start, finish - start));
+        start = specification.find_first_not_of(" \t", finish);
+    }
+    if (parts.empty()) {
+        return false;
+    }
+    size_t slash = parts[0].find_first_not_of('/');
+    if (slash == std::string::npos) {
+        return false;
+    }
+    std::unique_ptr<fastcgi_pool> pool(
+        new fastcgi_pool(parts[0].substr(slash))
+    );
+    unsigned count = 1;
+    if (parts.size() == 2 && from_string(parts[1], &count)) {
+        pool->set_processes(count);
+    } else if (parts.size() == 1) {
+        pool->set_processes(count);
+    } else {
+        for (size_t i = 1; i != parts.size(); ++i) {
+            pool->add_socket(parts[i]);
+        }
+    }
+    pools.push_back(std::move(pool));
+    return true;
+}
+
+bool fastcgi_spawns() {
+    for (std::unique_ptr<fastcgi_pool> &pool : pools) {
+        if (pool->spawns()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool start_fastcgi(const std::string &directory) {
+    for (std::unique_ptr<fastcgi_pool> &pool : pools) {
+        if (!pool->start(directory)) {
+            fprintf(stderr, "Error: can't start FastCGI pool %s\n",
+                pool->script().c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+// Called from the handler of SIGTERM and SIGINT, so only unlink and rmdir
+// are used; forked children leave the directory to the server.
+void stop_fastcgi() {
+    if (socket_directory.empty() || getpid() != directory_owner) {
+        return;
+    }
+    for (std::unique_ptr<fastcgi_pool> &pool : pools) {
+        pool->stop();
+    }
+    rmdir(socket_directory.c_str());
+}
+
+fastcgi_pool *find_fastcgi(const std::string &resource) {
+    for (std::unique_ptr<fastcgi_pool> &pool : pools) {
+        if (pool->script() == resource) {
+            return pool.get();
+        }
+    }
+    return nullptr;
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory_resource>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <sys/types.h>
+}
+
+#include "answer_generator.hpp"
+
+class event_loop;
+struct fastcgi_request;
+
+class fastcgi_pool {
+public:
+    explicit fastcgi_pool(const std::string &script);
+    fastcgi_pool(const fastcgi_pool &) = delete;
+    fastcgi_pool &operator=(const fastcgi_pool &) = delete;
+
+    const std::string &script() const;
+    size_t targets() const;
+    void add_socket(const std::string &path);
+    void set_processes(unsigned count);
+    bool spawns() const;
+    // Spawns the applications, with their sockets in a private directory
+    // made in directory, and keeps them running.
+    bool start(const std::string &directory);
+    // Removes the sockets of spawned applications.
+    void stop();
+    // A non-blocking connection to the next socket of the pool in turn, -1
+    // if it can't be made.
+    int connect_next();
+
+private:
+    bool spawn(size_t target);
+    void supervise();
+
+    std::string name;
+    std::vector<std::string> sockets;
+    // Of the spawned applications, -1 for one that is not running.
+    std::vector<pid_t> pids;
+    std::vector<int> pidfds;
+    std::vector<int64_t> started;
+    unsigned processes;
+    std::atomic<size_t> next;
+};
+
+// Answer of a FastCGI application. Each worker keeps its own connections
+// to the applications of a pool and runs the requests of many streams on
+// one of them at a time if the application says it can take that. input
+// is the read end of the pipe with the request body or -1; it is sent as
+// FCGI_STDIN as it comes. A request that runs out of cgi_timeout is
+// aborted on its own.
+class fastcgi_stream : public body_stream {
+public:
+    fastcgi_stream(
+        fastcgi_pool &pool,
+        event_loop &loop,
+        const std::pmr::vector<std::pmr::string> &environment,
+        int input,
+        bool chunked,
+        bool keep_alive
+    );
+    ~fastcgi_stream();
+    fastcgi_stream(const fastcgi_stream &) = delete;
+    fastcgi_stream &operator=(const fastcgi_stream &) = delete;
+
+    bool failed() const;
+    int descriptor() const override;
+    STREAM produce(std::string &out) override;
+    int64_t expires() const override;
+    void expire() override;
+    void input_complete() override;
+
+private:
+    STREAM fail(std::string &out);
+    void append_chunk(std::string &out, const char *data, size_t size);
+
+    fastcgi_request *exchange;
+    bool chunked;
+    bool keep_alive;
+    bool header_sent;
+    bool timed_out;
+    int64_t deadline;
+    std::string pending;
+};
+
+bool add_fastcgi(const std::string &specification);
+// Whether some pool starts its applications itself; they would run outside
+// of the chroot and the limits of scripts.
+bool fastcgi_spawns();
+bool start_fastcgi(const std::string &directory);
+void stop_fastcgi();
+fastcgi_pool *find_fastcgi(const std::string &resource);
@@ -0,0 +1,479 @@
+#include <cerrno>
+#include <cstdio>
+
+extern "C" {
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+}
+
+#include "common.hpp"
+#include "answer_generator.hpp"
+#include "config_reader.hpp"
+#include "deflate.hpp"
+#include "file_cache.hpp"
+
+static constexpr uint32_t WATCH_MASK =
+    IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+    IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+static bool is_canonical(const std::string &path) {
+    size_t start = 0;
+    for (;;) {
+        size_t finish = path.find('/', start);
+        std::string part = path.substr(start, finish - start);
+        if (part == "" || part == "." || part == "..") {
+            return false;
+        }
+        if (finish == std::string::npos) {
+            return true;
+        }
+        start = finish + 1;
+    }
+}
+
+// Smaller files gain too little from compression.
+static constexpr off_t MIN_COMPRESSED_SIZE = 128;
+
+static size_t footprint(const file_cache::entry &e) {
+    size_t size = sizeof(e) + e.path.size();
+    if (e.body) {
+        size += e.body->size();
+    }
+    for (const file_cache::headers *h : {&e.as_is, &e.as_gzip}) {
+        for (int i = 0; i != 2; ++i) {
+            size += h->head[i].size() + h->unchanged[i].size();
+        }
+        size += h->record.size();
+    }
+    return size;
+}
+
+static void prepare(
+    file_cache::headers &h,
+    const struct stat &info,
+    std::string_view type,
+    bool encoded
+) {
+    std::pmr::string record = representation(
+        info,
+        type,
+        encoded,
+        std::pmr::get_default_resource()
+    );
+    for (int keep_alive = 0; keep_alive != 2; ++keep_alive) {
+        h.head[keep_alive] =
+            header(200, record, type, info.st_size, keep_alive);
+        h.unchanged[keep_alive] = not_modified(record, keep_alive);
+    }
+    h.record = record;
+    h.type = type;
+}
+
+// Both forms of a file: as it is, and as the gzip encoding of the one next
+// to it when it is a .gz of a file that is sent compressed.
+static void prepare_both(
+    file_cache::headers &as_is,
+    file_cache::headers &as_gzip,
+    const std::string &path,
+    const struct stat &info
+) {
+    prepare(as_is, info, determine_mime(path), false);
+    std::string_view original = encoded_type(path);
+    if (original.size()) {
+        prepare(as_gzip, info, original, true);
+    }
+}
+
+static bool same_time(const struct stat &a, const struct stat &b) {
+    return a.st_mtim.tv_sec == b.st_mtim.tv_sec &&
+        a.st_mtim.tv_nsec == b.st_mtim.tv_nsec;
+}
+
+static bool read_all(int file, std::string &content) {
+    size_t done = 0;
+    while (done != content.size()) {
+        ssize_t bytes = read(file, &content[done], content.size() - done);
+        if (bytes == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes <= 0) {
+            return false;
+        }
+        done += bytes;
+    }
+    return true;
+}
+
+shared_file::shared_file(int fd) :
+    fd(fd) {
+}
+
+shared_file::~shared_file() {
+    close(fd);
+}
+
+int shared_file::descriptor() const {
+    return fd;
+}
+
+file_cache::file_cache(
+    event_loop &loop,
+    size_t capacity,
+    size_t file_limit,
+    size_t metadata_limit,
+    size_t compressed_capacity
+) :
+    loop(loop),
+    capacity(capacity),
+    file_limit(file_limit),
+    metadata_limit(metadata_limit),
+    compressed_capacity(compressed_capacity),
+    used(0),
+    compressed_used(0),
+    notify_fd(-1) {
+    if (!holds_content() && metadata_limit == 0 &&
+        compressed_capacity == 0) {
+        return;
+    }
+    notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (notify_fd == -1) {
+        fprintf(stderr, "Error: inotify_init1() failed: %d\n", errno);
+        return;
+    }
+    loop.add(notify_fd, EPOLLIN | EPOLLET, this);
+}
+
+file_cache::~file_cache() {
+    if (notify_fd != -1) {
+        loop.remove(notify_fd);
+        close(notify_fd);
+    }
+}
+
+bool file_cache::holds_content() const {
+    return capacity != 0 && file_limit != 0;
+}
+
+const file_cache::entry *file_cache::find(const std::string &path) {
+    if (notify_fd == -1 || !holds_content()) {
+        return nullptr;
+    }
+    auto it = index.find(path);
+    if (it == index.end()) {
+        return nullptr;
+    }
+    entries.splice(entries.begin(), entries, it->second);
+    return &*it->second;
+}
+
+const file_cache::entry *file_cache::load(const std::string &path) {
+    if (notify_fd == -1 || !holds_content() || !is_canonical(path)) {
+        return nullptr;
+    }
+    // Files that will not be cached are turned away before anything is
+    // allocated for them, since they come back on every request.
+    struct stat info;
+    if (stat(path.c_str(), &info) == -1 || !S_ISREG(info.st_mode) ||
+        (info.st_mode & S_IXUSR) || (size_t) info.st_size > file_limit) {
+        return nullptr;
+    }
+    if (!watch_parents(path)) {
+        return nullptr;
+    }
+    int file = open(path.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (file == -1) {
+        return nullptr;
+    }
+    entry e;
+    e.path = path;
+    if (fstat(file, &e.info) == -1 || !S_ISREG(e.info.st_mode) ||
+        (e.info.st_mode & S_IXUSR) || (size_t) e.info.st_size > file_limit) {
+        close(file);
+        return nullptr;
+    }
+    std::shared_ptr<std::string> body =
+        std::make_shared<std::string>(e.info.st_size, '\0');
+    bool complete = read_all(file, *body);
+    close(file);
+    if (!complete) {
+        return nullptr;
+    }
+    e.body = std::move(body);
+    prepare_both(e.as_is, e.as_gzip, path, e.info);
+    drop(path);
+    used += footprint(e);
+    entries.push_front(std::move(e));
+    index[path] = entries.begin();
+    evict();
+    auto it = index.find(path);
+    return it == index.end() ? nullptr : &*it->second;
+}
+
+const file_cache::metadata &file_cache::lookup(const std::string &path) {
+    auto it = known_index.find(path);
+    if (it != known_index.end()) {
+        known.splice(known.begin(), known, it->second);
+        return *it->second;
+    }
+    // The directories are watched first, a change made while the path is
+    // looked at is then not missed.
+    bool keep = notify_fd != -1 && metadata_limit != 0 &&
+        is_canonical(path) && watch_parents(path);
+    if (!describe(path, uncached) || !keep) {
+        return uncached;
+    }
+    known.push_front(std::move(uncached));
+    known_index[path] = known.begin();
+    uncached = metadata();
+    if (known.size() > metadata_limit) {
+        known_index.erase(known.back().path);
+        known.pop_back();
+    }
+    return known.front();
+}
+
+// Returns false for a symbolic link: its target can change without an
+// event in the directories that are watched for it.
+bool file_cache::describe(const std::string &path, metadata &m) {
+    m.path = path;
+    m.readable = false;
+    m.file.reset();
+    if (lstat(path.c_str(), &m.info) == -1) {
+        m.type = STAT::NOT_EXIST;
+        return true;
+    }
+    bool link = S_ISLNK(m.info.st_mode);
+    if (link && stat(path.c_str(), &m.info) == -1) {
+        m.type = STAT::NOT_EXIST;
+        return false;
+    }
+    if (S_ISDIR(m.info.st_mode)) {
+        m.type = STAT::DIRECTORY;
+        return !link;
+    }
+    if (!S_ISREG(m.info.st_mode)) {
+        m.type = STAT::UNKNOWN;
+        return !link;
+    }
+    m.type = STAT::REGULAR;
+    m.readable = access(path.c_str(), R_OK) == 0;
+    // Scripts are run and small files are read into the content cache.
+    if (link || !m.readable || (m.info.st_mode & S_IXUSR) ||
+        (holds_content() && (size_t) m.info.st_size <= file_limit)) {
+        return !link;
+    }
+    int file = open(path.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (file == -1) {
+        return true;
+    }
+    struct stat info;
+    if (fstat(file, &info) == -1 || !S_ISREG(info.st_mode) ||
+        (info.st_mode & S_IXUSR)) {
+        close(file);
+        return true;
+    }
+    m.info = info;
+    m.file = std::make_shared<shared_file>(file);
+    prepare_both(m.as_is, m.as_gzip, path, m.info);
+    return true;
+}
+
+const file_cache::entry *file_cache::compressed(
+    const std::string &path,
+    const struct stat &info
+) {
+    if (notify_fd == -1 || compressed_capacity == 0) {
+        return nullptr;
+    }
+    auto it = packed_index.find(path);
+    if (it != packed_index.end()) {
+        if (same_time(it->second->info, info)) {
+            packed.splice(packed.begin(), packed, it->second);
+            return it->second->body ? &*it->second : nullptr;
+        }
+        discard(path);
+    }
+    if (info.st_size < MIN_COMPRESSED_SIZE ||
+        (size_t) info.st_size > settings.gzip_file_size ||
+        !is_canonical(path) || !watch_parents(path)) {
+        return nullptr;
+    }
+    int file = open(path.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (file == -1) {
+        return nullptr;
+    }
+    // What is read has to be the file the caller knows, otherwise it would
+    // be kept under a time it does not have.
+    entry e;
+    e.path = path;
+    if (fstat(file, &e.info) == -1 || !S_ISREG(e.info.st_mode) ||
+        !same_time(e.info, info) || e.info.st_size != info.st_size) {
+        close(file);
+        return nullptr;
+    }
+    std::string content(e.info.st_size, '\0');
+    bool complete = read_all(file, content);
+    close(file);
+    if (!complete) {
+        return nullptr;
+    }
+    // A file that does not get smaller is remembered without a body, so it
+    // is not compressed again. The size in info is that of the encoding,
+    // which gives it an ETag of its own.
+    std::string encoding = compress_gzip(content);
+    if (encoding.size() < content.size()) {
+        e.info.st_size = encoding.size();
+        e.body = std::make_shared<std::string>(std::move(encoding));
+        prepare(e.as_gzip, e.info, determine_mime(path), true);
+    }
+    compressed_used += footprint(e);
+    packed.push_front(std::move(e));
+    packed_index[path] = packed.begin();
+    while (compressed_used > compressed_capacity && packed.size()) {
+        discard(packed.back().path);
+    }
+    it = packed_index.find(path);
+    return it == packed_index.end() || !it->second->body ?
+        nullptr : &*it->second;
+}
+
+// A path is only as current as the directories leading to it are watched.
+// Watching stops at the first that does not exist: creating it is seen in
+// its parent, and drops what is known below it.
+bool file_cache::watch_parents(const std::string &path) {
+    if (!watch(".")) {
+        return false;
+    }
+    for (size_t slash = path.find('/'); slash != std::string::npos;
+        slash = path.find('/', slash + 1)) {
+        if (!watch(path.substr(0, slash))) {
+            return errno == ENOENT || errno == ENOTDIR;
+        }
+    }
+    return true;
+}
+
+bool file_cache::watch(const std::string &path) {
+    if (watched.count(path)) {
+        return true;
+    }
+    int wd = inotify_add_watch(notify_fd, path.c_str(), WATCH_MASK);
+    if (wd == -1) {
+        return false;
+    }
+    watches[wd] = path;
+    watched[path] = wd;
+    return true;
+}
+
+void file_cache::drop(const std::string &path) {
+    auto it = index.find(path);
+    if (it != index.end()) {
+        const entry &e = *it->second;
+        used -= footprint(e);
+        entries.erase(it->second);
+        index.erase(it);
+    }
+}
+
+void file_cache::discard(const std::string &path) {
+    auto it = packed_index.find(path);
+    if (it != packed_index.end()) {
+        compressed_used -= footprint(*it->second);
+        packed.erase(it->second);
+        packed_index.erase(it);
+    }
+}
+
+// With tree, path is a directory: everything below it goes, and what is
+// known about the directory itself.
+void file_cache::invalidate(const std::string &path, bool tree) {
+    auto found = known_index.find(path);
+    if (found != known_index.end()) {
+        known.erase(found->second);
+        known_index.erase(found);
+    }
+    if (!tree) {
+        drop(path);
+        discard(path);
+        return;
+    }
+    std::string prefix = path == "." ? "" : path + "/";
+    for (auto it = entries.begin(); it != entries.end();) {
+        if (it->path.compare(0, prefix.size(), prefix) == 0) {
+            used -= footprint(*it);
+            index.erase(it->path);
+            it = entries.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    for (auto it = packed.begin(); it != packed.end();) {
+        if (it->path.compare(0, prefix.size(), prefix) == 0) {
+            compressed_used -= footprint(*it);
+            packed_index.erase(it->path);
+            it = packed.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    for (auto it = known.begin(); it != known.end();) {
+        if (it->path.compare(0, prefix.size(), prefix) == 0) {
+            known_index.erase(it->path);
+            it = known.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void file_cache::evict() {
+    while (used > capacity && entries.size()) {
+        drop(entries.back().path);
+    }
+}
+
+void file_cache::handle(uint32_t) {
+    alignas(struct inotify_event) char buffer[BUFFER_SIZE];
+    for (;;) {
+        ssize_t bytes = read(notify_fd, buffer, sizeof(buffer));
+        if (bytes == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes <= 0) {
+            return;
+        }
+        for (char *p = buffer; p < buffer + bytes;) {
+            const struct inotify_event *event =
+                reinterpret_cast<const struct inotify_event *>(p);
+            p += sizeof(struct inotify_event) + event->len;
+            if (event->mask & IN_Q_OVERFLOW) {
+                invalidate(".", true);
+                continue;
+            }
+            auto it = watches.find(event->wd);
+            if (it == watches.end()) {
+                continue;
+            }
+            const std::string directory = it->second;
+            if (event->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+                invalidate(directory, true);
+                if (!(event->mask & IN_IGNORED)) {
+                    inotify_rm_watch(notify_fd, event->wd);
+                }
+                watched.erase(directory);
+                watches.erase(it);
+                continue;
+            }
+            if (event->len == 0) {
+                continue;
+            }
+            std::string name = event->name;
+            std::string path =
+                directory == "." ? name : directory + "/" + name;
+            invalidate(path, (event->mask & IN_ISDIR) != 0);
+        }
+    }
+}
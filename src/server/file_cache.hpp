@@ -0,0 +1,122 @@
+#pragma once
+
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+extern "C" {
+#include <sys/stat.h>
+}
+
+#include "common.hpp"
+#include "event_loop.hpp"
+
+// A descriptor closed once the cache and the responses sending from it
+// have all let it go.
+class shared_file {
+public:
+    explicit shared_file(int fd);
+    ~shared_file();
+    shared_file(const shared_file &) = delete;
+    shared_file &operator=(const shared_file &) = delete;
+
+    int descriptor() const;
+
+private:
+    int fd;
+};
+
+// Keeps small static files in memory, and what stat() says about other
+// paths (also that they do not exist) together with a descriptor for files
+// too big to keep, so that answering them takes no lookups by path. Files
+// of a compressible type are also kept compressed. All of it is dropped
+// when inotify reports a change in a directory on the path.
+class file_cache : public event_handler {
+public:
+    // The 200 header of a file and the 304 sent instead of it, for a
+    // connection that is closed (0) or kept alive (1). A file is sent
+    // as_gzip when it is the .gz next to one that is sent compressed, or
+    // that file compressed by the cache.
+    // record and type are what the headers were made from, for a 206.
+    struct headers {
+        std::string head[2];
+        std::string unchanged[2];
+        std::string record;
+        std::string_view type;
+    };
+
+    struct metadata {
+        std::string path;
+        STAT type;
+        struct stat info;
+        bool readable;
+        // Open on a regular file that is sent as it is and does not fit the
+        // content cache, with the headers to send before it.
+        std::shared_ptr<const shared_file> file;
+        headers as_is;
+        headers as_gzip;
+    };
+
+    struct entry {
+        std::string path;
+        struct stat info;
+        headers as_is;
+        headers as_gzip;
+        // Shared with the responses that are still sending it, so an entry
+        // can be evicted or invalidated while a slow client reads it.
+        std::shared_ptr<const std::string> body;
+    };
+
+    file_cache(
+        event_loop &loop,
+        size_t capacity,
+        size_t file_limit,
+        size_t metadata_limit,
+        size_t compressed_capacity
+    );
+    ~file_cache();
+    file_cache(const file_cache &) = delete;
+    file_cache &operator=(const file_cache &) = delete;
+
+    const entry *find(const std::string &path);
+    const entry *load(const std::string &path);
+    // Valid until the next call.
+    const metadata &lookup(const std::string &path);
+    // The gzip encoding of the file info describes, made once and kept
+    // while the file has the same modification time; nullptr when it is
+    // not made, also if it would not be smaller than the file.
+    const entry *compressed(const std::string &path, const struct stat &info);
+    void handle(uint32_t events) override;
+
+private:
+    bool holds_content() const;
+    bool watch(const std::string &path);
+    bool watch_parents(const std::string &path);
+    bool describe(const std::string &path, metadata &m);
+    void drop(const std::string &path);
+    void discard(const std::string &path);
+    void invalidate(const std::string &path, bool tree);
+    void evict();
+
+    event_loop &loop;
+    size_t capacity;
+    size_t file_limit;
+    size_t metadata_limit;
+    size_t compressed_capacity;
+    size_t used;
+    size_t compressed_used;
+    int notify_fd;
+    std::list<entry> entries;
+    std::unordered_map<std::string, std::list<entry>::iterator> index;
+    std::list<entry> packed;
+    std::unordered_map<std::string, std::list<entry>::iterator> packed_index;
+    std::list<metadata> known;
+    std::unordered_map<std::string, std::list<metadata>::iterator> known_index;
+    // What lookup() returns for a path that cannot be kept.
+    metadata uncached;
+    std::unordered_map<int, std::string> watches;
+    std::unordered_map<std::string, int> watched;
+};
@@ -0,0 +1,116 @@
+#include <algorithm>
+
+#include "frame_codec.hpp"
+
+static void append_u32(std::string &out, uint32_t n) {
+    out += (char) (n >> 24);
+    out += (char) (n >> 16);
+    out += (char) (n >> 8);
+    out += (char) n;
+}
+
+uint32_t read_u32(const char *data) {
+    const uint8_t *p = (const uint8_t *) data;
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 |
+        (uint32_t) p[2] << 8 | p[3];
+}
+
+frame_header read_frame_header(const char *data) {
+    const uint8_t *p = (const uint8_t *) data;
+    frame_header header;
+    header.length = (uint32_t) p[0] << 16 | (uint32_t) p[1] << 8 | p[2];
+    header.type = (FRAME) p[3];
+    header.flags = p[4];
+    header.stream = read_u32(data + 5) & 0x7fffffff;
+    return header;
+}
+
+bool frame_content(const frame_header &header, std::string_view &payload) {
+    size_t padding = 0;
+    if (header.flags & FLAG_PADDED) {
+        if (payload.empty()) {
+            return false;
+        }
+        padding = (uint8_t) payload[0];
+        payload.remove_prefix(1);
+    }
+    if (header.type == FRAME::HEADERS && (header.flags & FLAG_PRIORITY)) {
+        if (payload.size() < 5) {
+            return false;
+        }
+        payload.remove_prefix(5);
+    }
+    if (padding > payload.size()) {
+        return false;
+    }
+    payload.remove_suffix(padding);
+    return true;
+}
+
+void append_frame_header(
+    std::string &out,
+    uint32_t length,
+    FRAME type,
+    uint8_t flags,
+    uint32_t stream
+) {
+    out += (char) (length >> 16);
+    out += (char) (length >> 8);
+    out += (char) length;
+    out += (char) type;
+    out += (char) flags;
+    append_u32(out, stream);
+}
+
+void append_setting(std::string &out, SETTING id, uint32_t value) {
+    out += (char) ((uint16_t) id >> 8);
+    out += (char) id;
+    append_u32(out, value);
+}
+
+void append_window_update(
+    std::string &out,
+    uint32_t stream,
+    uint32_t increment
+) {
+    append_frame_header(out, 4, FRAME::WINDOW_UPDATE, 0, stream);
+    append_u32(out, increment);
+}
+
+void append_rst_stream(std::string &out, uint32_t stream, ERROR_CODE code) {
+    append_frame_header(out, 4, FRAME::RST_STREAM, 0, stream);
+    append_u32(out, (uint32_t) code);
+}
+
+void append_goaway(std::string &out, uint32_t last_stream, ERROR_CODE code) {
+    append_frame_header(out, 8, FRAME::GOAWAY, 0, 0);
+    append_u32(out, last_stream);
+    append_u32(out, (uint32_t) code);
+}
+
+void append_ping(std::string &out, std::string_view payload, bool ack) {
+    append_frame_header(out, 8, FRAME::PING, ack ? FLAG_ACK : 0, 0);
+    out += payload.substr(0, 8);
+}
+
+void append_header_block(
+    std::string &out,
+    std::string_view block,
+    uint32_t stream,
+    bool end_stream,
+    uint32_t frame_size
+) {
+    FRAME type = FRAME::HEADERS;
+    uint8_t flags = end_stream ? FLAG_END_STREAM : 0;
+    do {
+        size_t length = std::min<size_t>(block.size(), frame_size);
+        if (length == block.size()) {
+            flags |= FLAG_END_HEADERS;
+        }
+        append_frame_header(out, length, type, flags, stream);
+        out += block.substr(0, length);
+        block.remove_prefix(length);
+        type = FRAME::CONTINUATION;
+        flags = 0;
+    } while (block.size());
+}
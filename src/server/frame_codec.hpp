@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// Frames of HTTP/2 (RFC 9113). Like hpack, it stands on its own and is
+// built into the load generator as well.
+
+constexpr std::string_view CONNECTION_PREFACE =
+    "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+constexpr size_t FRAME_HEADER_SIZE = 9;
+constexpr uint32_t DEFAULT_FRAME_SIZE = 16384;
+constexpr uint32_t MAX_FRAME_SIZE = (1 << 24) - 1;
+constexpr int64_t DEFAULT_WINDOW = 65535;
+constexpr int64_t MAX_WINDOW = 0x7fffffff;
+
+enum class FRAME : uint8_t {
+    DATA,
+    HEADERS,
+    PRIORITY,
+    RST_STREAM,
+    SETTINGS,
+    PUSH_PROMISE,
+    PING,
+    GOAWAY,
+    WINDOW_UPDATE,
+    CONTINUATION
+};
+
+constexpr uint8_t FLAG_END_STREAM = 0x1;
+constexpr uint8_t FLAG_ACK = 0x1;
+constexpr uint8_t FLAG_END_HEADERS = 0x4;
+constexpr uint8_t FLAG_PADDED = 0x8;
+constexpr uint8_t FLAG_PRIORITY = 0x20;
+
+enum class ERROR_CODE : uint32_t {
+    NO_ERROR,
+    PROTOCOL_ERROR,
+    INTERNAL_ERROR,
+    FLOW_CONTROL_ERROR,
+    SETTINGS_TIMEOUT,
+    STREAM_CLOSED,
+    FRAME_SIZE_ERROR,
+    REFUSED_STREAM,
+    CANCEL,
+    COMPRESSION_ERROR,
+    CONNECT_ERROR,
+    ENHANCE_YOUR_CALM,
+    INADEQUATE_SECURITY,
+    HTTP_1_1_REQUIRED
+};
+
+enum class SETTING : uint16_t {
+    HEADER_TABLE_SIZE = 1,
+    ENABLE_PUSH,
+    MAX_CONCURRENT_STREAMS,
+    INITIAL_WINDOW_SIZE,
+    MAX_FRAME_SIZE,
+    MAX_HEADER_LIST_SIZE
+};
+
+struct frame_header {
+    uint32_t length;
+    FRAME type;
+    uint8_t flags;
+    uint32_t stream;
+};
+
+uint32_t read_u32(const char *data);
+// data has to hold FRAME_HEADER_SIZE bytes.
+frame_header read_frame_header(const char *data);
+// What a DATA, HEADERS or PUSH_PROMISE frame carries without its padding,
+// and for HEADERS without the priority fields; false if they do not fit.
+bool frame_content(const frame_header &header, std::string_view &payload);
+
+void append_frame_header(
+    std::string &out,
+    uint32_t length,
+    FRAME type,
+    uint8_t flags,
+    uint32_t stream
+);
+void append_setting(std::string &out, SETTING id, uint32_t value);
+void append_window_update(
+    std::string &out,
+    uint32_t stream,
+    uint32_t increment
+);
+void append_rst_stream(std::string &out, uint32_t stream, ERROR_CODE code);
+void append_goaway(std::string &out, uint32_t last_stream, ERROR_CODE code);
+void append_ping(std::string &out, std::string_view payload, bool ack);
+// A header block cut into a HEADERS frame and as many CONTINUATION frames
+// as frame_size asks for.
+void append_header_block(
+    std::string &out,
+    std::string_view block,
+    uint32_t stream,
+    bool end_stream,
+    uint32_t frame_size
+);
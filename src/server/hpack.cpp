@@ -0,0 +1,540 @@
+#include <algorithm>
+
+#include "hpack.hpp"
+
+static constexpr header_pair static_table[] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""}
+};
+
+static constexpr size_t STATIC_COUNT =
+    sizeof(static_table) / sizeof(*static_table);
+static constexpr size_t NAME_SLOTS = 256;
+
+static constexpr size_t name_hash(std::string_view name, uint32_t seed) {
+    uint32_t hash = seed;
+    for (char c : name) {
+        hash = (hash ^ (uint8_t) c) * 16777619u;
+    }
+    return (hash ^ hash >> 16) & (NAME_SLOTS - 1);
+}
+
+// Names of the static table are placed with a perfect hash, as the MIME
+// types are: each distinct name has a slot of its own, holding the index
+// of its first entry.
+static constexpr uint32_t name_seed() {
+    for (uint32_t seed = 2166136261u;; ++seed) {
+        bool taken[NAME_SLOTS] = {};
+        bool unique = true;
+        for (size_t i = 0; i != STATIC_COUNT && unique; ++i) {
+            if (i && static_table[i].name == static_table[i - 1].name) {
+                continue;
+            }
+            size_t slot = name_hash(static_table[i].name, seed);
+            unique = !taken[slot];
+            taken[slot] = true;
+        }
+        if (unique) {
+            return seed;
+        }
+    }
+}
+
+static constexpr uint32_t NAME_SEED = name_seed();
+
+struct name_index {
+    constexpr name_index() : slot() {
+        for (size_t i = STATIC_COUNT; i != 0; --i) {
+            slot[name_hash(static_table[i - 1].name, NAME_SEED)] = i;
+        }
+    }
+
+    uint8_t slot[NAME_SLOTS];
+};
+
+static constexpr name_index static_names;
+
+// Index of the first static entry named name, 0 if there is none.
+static size_t find_static_name(std::string_view name) {
+    uint8_t index = static_names.slot[name_hash(name, NAME_SEED)];
+    return index && static_table[index - 1].name == name ? index : 0;
+}
+
+// Bit lengths of the Huffman code of RFC 7541 Appendix B for the 256
+// octets and EOS. The code is canonical, so the codes themselves follow
+// from the lengths.
+static constexpr uint8_t CODE_LENGTH[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30
+};
+
+static constexpr int SYMBOLS = 257;
+static constexpr int EOS = 256;
+static constexpr int MAX_CODE_BITS = 30;
+
+// Codes for encoding, and for decoding the first code and the position in
+// symbol of each length, with limit the first code past that length
+// shifted to the top of 32 bits: a window of the next 32 bits holds a code
+// of the shortest length whose limit it is below.
+struct huffman_code {
+    constexpr huffman_code() :
+        code(),
+        first(),
+        base(),
+        limit(),
+        symbol() {
+        uint32_t next = 0;
+        int sorted = 0;
+        for (int length = 1; length <= MAX_CODE_BITS; ++length) {
+            first[length] = next;
+            base[length] = sorted;
+            for (int s = 0; s != SYMBOLS; ++s) {
+                if (CODE_LENGTH[s] == length) {
+                    code[s] = next++;
+                    symbol[sorted++] = s;
+                }
+            }
+            limit[length] = (uint64_t) next << (32 - length);
+            next <<= 1;
+        }
+    }
+
+    uint32_t code[SYMBOLS];
+    uint32_t first[MAX_CODE_BITS + 1];
+    int base[MAX_CODE_BITS + 1];
+    uint64_t limit[MAX_CODE_BITS + 1];
+    uint16_t symbol[SYMBOLS];
+};
+
+static constexpr huffman_code huffman;
+
+size_t huffman_size(std::string_view text) {
+    size_t bits = 0;
+    for (char c : text) {
+        bits += CODE_LENGTH[(uint8_t) c];
+    }
+    return (bits + 7) / 8;
+}
+
+void huffman_encode(std::string &out, std::string_view text) {
+    uint64_t bits = 0;
+    int count = 0;
+    for (char c : text) {
+        int length = CODE_LENGTH[(uint8_t) c];
+        bits = bits << length | huffman.code[(uint8_t) c];
+        count += length;
+        while (count >= 8) {
+            count -= 8;
+            out += (char) (bits >> count);
+        }
+    }
+    // The last octet is filled up with the start of EOS, which is all ones.
+    if (count) {
+        out += (char) (bits << (8 - count) | (0xff >> count));
+    }
+}
+
+bool huffman_decode(std::string &out, std::string_view code) {
+    const uint8_t *p = (const uint8_t *) code.data();
+    const uint8_t *end = p + code.size();
+    uint64_t bits = 0;
+    int count = 0;
+    for (;;) {
+        while (count <= 56 && p != end) {
+            bits = bits << 8 | *p++;
+            count += 8;
+        }
+        if (count == 0) {
+            return true;
+        }
+        // What is left at the end may only be the padding: fewer than 8
+        // bits of EOS.
+        if (p == end && count < 8 &&
+            (bits & ((1u << count) - 1)) == (1u << count) - 1) {
+            return true;
+        }
+        uint64_t window = count >= 32 ?
+            bits >> (count - 32) & 0xffffffffu : bits << (32 - count);
+        int length = 5;
+        while (length != MAX_CODE_BITS && window >= huffman.limit[length]) {
+            ++length;
+        }
+        if (length > count || window >= huffman.limit[length]) {
+            return false;
+        }
+        uint32_t value = window >> (32 - length);
+        int s = huffman.symbol[huffman.base[length] + value -
+            huffman.first[length]];
+        if (s == EOS) {
+            return false;
+        }
+        out += (char) s;
+        count -= length;
+        bits &= (1ull << count) - 1;
+    }
+}
+
+void append_integer(std::string &out, uint8_t first, int prefix, uint64_t n) {
+    uint64_t mask = (1u << prefix) - 1;
+    if (n < mask) {
+        out += (char) (first | n);
+        return;
+    }
+    out += (char) (first | mask);
+    n -= mask;
+    while (n >= 128) {
+        out += (char) (n % 128 + 128);
+        n /= 128;
+    }
+    out += (char) n;
+}
+
+// Integers past 2^28 are refused, nothing in a header needs them.
+static bool read_integer(
+    const uint8_t *&p,
+    const uint8_t *end,
+    int prefix,
+    uint64_t &n
+) {
+    uint64_t mask = (1u << prefix) - 1;
+    n = *p++ & mask;
+    if (n < mask) {
+        return true;
+    }
+    for (int shift = 0; shift <= 21; shift += 7) {
+        if (p == end) {
+            return false;
+        }
+        uint8_t octet = *p++;
+        n += (uint64_t) (octet & 127) << shift;
+        if (!(octet & 128)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool read_string(
+    const uint8_t *&p,
+    const uint8_t *end,
+    std::string &out
+) {
+    if (p == end) {
+        return false;
+    }
+    bool coded = *p & 0x80;
+    uint64_t length;
+    if (!read_integer(p, end, 7, length) || length > (uint64_t) (end - p)) {
+        return false;
+    }
+    std::string_view text((const char *) p, length);
+    p += length;
+    if (coded) {
+        return huffman_decode(out, text);
+    }
+    out += text;
+    return true;
+}
+
+static void append_string(std::string &out, std::string_view text) {
+    size_t coded = huffman_size(text);
+    if (coded < text.size()) {
+        append_integer(out, 0x80, 7, coded);
+        huffman_encode(out, text);
+    } else {
+        append_integer(out, 0, 7, text.size());
+        out += text;
+    }
+}
+
+hpack_table::hpack_table(size_t capacity) :
+    limit(capacity),
+    size(0) {
+}
+
+size_t hpack_table::capacity() const {
+    return limit;
+}
+
+void hpack_table::resize(size_t capacity) {
+    limit = capacity;
+    evict(0);
+}
+
+size_t hpack_table::count() const {
+    return entries.size();
+}
+
+header_pair hpack_table::get(size_t index) const {
+    const entry &e = entries[index];
+    std::string_view text = e.text;
+    return {text.substr(0, e.name_size), text.substr(e.name_size)};
+}
+
+// A field bigger than the whole table empties it and is not kept.
+void hpack_table::insert(std::string_view name, std::string_view value) {
+    size_t needed = field_size(name, value);
+    if (needed > limit) {
+        entries.clear();
+        size = 0;
+        return;
+    }
+    evict(needed);
+    entry added;
+    added.text.reserve(name.size() + value.size());
+    added.text += name;
+    added.text += value;
+    added.name_size = name.size();
+    entries.push_front(std::move(added));
+    size += needed;
+}
+
+void hpack_table::evict(size_t room) {
+    while (entries.size() && size + room > limit) {
+        const entry &oldest = entries.back();
+        size -= oldest.text.size() + 32;
+        entries.pop_back();
+    }
+}
+
+hpack_decoder::hpack_decoder(size_t capacity) :
+    table(capacity),
+    capacity(capacity) {
+}
+
+HPACK hpack_decoder::decode(
+    std::string_view block,
+    size_t limit,
+    std::string &storage,
+    std::vector<header_pair> &fields
+) {
+    storage.clear();
+    fields.clear();
+    spans.clear();
+    const uint8_t *p = (const uint8_t *) block.data();
+    const uint8_t *end = p + block.size();
+    size_t total = 0;
+    while (p != end) {
+        uint8_t octet = *p;
+        span field;
+        uint64_t index;
+        if (octet & 0x80) {
+            if (!read_integer(p, end, 7, index) || index == 0) {
+                return HPACK::MALFORMED;
+            }
+            header_pair pair;
+            if (index <= STATIC_COUNT) {
+                pair = static_table[index - 1];
+            } else if (index - STATIC_COUNT - 1 < table.count()) {
+                pair = table.get(index - STATIC_COUNT - 1);
+            } else {
+                return HPACK::MALFORMED;
+            }
+            field.name = storage.size();
+            storage += pair.name;
+            field.value = storage.size();
+            storage += pair.value;
+        } else if ((octet & 0xe0) == 0x20) {
+            // A change of the table size comes before the fields.
+            if (!read_integer(p, end, 5, index) || index > capacity ||
+                spans.size()) {
+                return HPACK::MALFORMED;
+            }
+            table.resize(index);
+            continue;
+        } else {
+            bool indexed = octet & 0x40;
+            if (!read_integer(p, end, indexed ? 6 : 4, index)) {
+                return HPACK::MALFORMED;
+            }
+            field.name = storage.size();
+            if (index == 0) {
+                if (!read_string(p, end, storage)) {
+                    return HPACK::MALFORMED;
+                }
+            } else if (index <= STATIC_COUNT) {
+                storage += static_table[index - 1].name;
+            } else if (index - STATIC_COUNT - 1 < table.count()) {
+                storage += table.get(index - STATIC_COUNT - 1).name;
+            } else {
+                return HPACK::MALFORMED;
+            }
+            field.value = storage.size();
+            if (!read_string(p, end, storage)) {
+                return HPACK::MALFORMED;
+            }
+            if (indexed) {
+                std::string_view text(storage);
+                table.insert(
+                    text.substr(field.name, field.value - field.name),
+                    text.substr(field.value)
+                );
+            }
+        }
+        field.name_size = field.value - field.name;
+        field.value_size = storage.size() - field.value;
+        total += field.name_size + field.value_size + 32;
+        if (total > limit) {
+            return HPACK::TOO_LARGE;
+        }
+        spans.push_back(field);
+    }
+    std::string_view text(storage);
+    for (const span &s : spans) {
+        fields.push_back({
+            text.substr(s.name, s.name_size),
+            text.substr(s.value, s.value_size)
+        });
+    }
+    return HPACK::DONE;
+}
+
+static constexpr size_t DEFAULT_TABLE_SIZE = 4096;
+
+hpack_encoder::hpack_encoder() :
+    table(DEFAULT_TABLE_SIZE),
+    wanted(DEFAULT_TABLE_SIZE),
+    smallest(DEFAULT_TABLE_SIZE),
+    resized(false) {
+}
+
+// The table is kept at the default size at most, however much the peer
+// allows.
+void hpack_encoder::limit(size_t capacity) {
+    wanted = std::min(capacity, DEFAULT_TABLE_SIZE);
+    smallest = std::min(smallest, wanted);
+    table.resize(wanted);
+    resized = true;
+}
+
+// After changes of the size between two blocks, the peer is told the
+// smallest of them and then the last.
+void hpack_encoder::begin(std::string &out) {
+    if (!resized) {
+        return;
+    }
+    if (smallest < wanted) {
+        append_integer(out, 0x20, 5, smallest);
+    }
+    append_integer(out, 0x20, 5, wanted);
+    smallest = wanted;
+    resized = false;
+}
+
+void hpack_encoder::add(
+    std::string &out,
+    std::string_view name,
+    std::string_view value,
+    bool indexed
+) {
+    size_t name_at = find_static_name(name);
+    if (name_at) {
+        for (size_t i = name_at;
+            i <= STATIC_COUNT && static_table[i - 1].name == name;
+            ++i) {
+            if (static_table[i - 1].value == value) {
+                append_integer(out, 0x80, 7, i);
+                return;
+            }
+        }
+    }
+    for (size_t i = 0; i != table.count(); ++i) {
+        header_pair pair = table.get(i);
+        if (pair.name != name) {
+            continue;
+        }
+        if (pair.value == value) {
+            append_integer(out, 0x80, 7, STATIC_COUNT + 1 + i);
+            return;
+        }
+        if (!name_at) {
+            name_at = STATIC_COUNT + 1 + i;
+        }
+    }
+    if (indexed) {
+        append_integer(out, 0x40, 6, name_at);
+    } else {
+        append_integer(out, 0, 4, name_at);
+    }
+    if (!name_at) {
+        append_string(out, name);
+    }
+    append_string(out, value);
+    if (indexed) {
+        table.insert(name, value);
+    }
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Header compression for HTTP/2 (RFC 7541). It depends on nothing else in
+// the server, so the load generator builds it in as well.
+
+struct header_pair {
+    std::string_view name;
+    std::string_view value;
+};
+
+enum class HPACK {
+    DONE,
+    TOO_LARGE,
+    MALFORMED
+};
+
+// The size HPACK counts for a field: its name and value and 32 more.
+constexpr size_t field_size(std::string_view name, std::string_view value) {
+    return name.size() + value.size() + 32;
+}
+
+// The dynamic table of one direction of a connection. Fields are added
+// in front (index 0 is the newest) and the oldest are evicted once the
+// sizes of all of them pass the capacity.
+class hpack_table {
+public:
+    explicit hpack_table(size_t capacity);
+
+    size_t capacity() const;
+    void resize(size_t capacity);
+    size_t count() const;
+    header_pair get(size_t index) const;
+    void insert(std::string_view name, std::string_view value);
+
+private:
+    struct entry {
+        std::string text;
+        size_t name_size;
+    };
+
+    void evict(size_t room);
+
+    std::deque<entry> entries;
+    size_t limit;
+    size_t size;
+};
+
+// Decodes the header blocks a peer sends with its own dynamic table, of
+// at most capacity (the SETTINGS_HEADER_TABLE_SIZE sent to it).
+class hpack_decoder {
+public:
+    explicit hpack_decoder(size_t capacity);
+
+    // Fields of a whole block, their names and values kept in storage
+    // until the next call. Decoding stops with TOO_LARGE once their sizes
+    // pass limit; the table is then out of step with the peer's.
+    HPACK decode(
+        std::string_view block,
+        size_t limit,
+        std::string &storage,
+        std::vector<header_pair> &fields
+    );
+
+private:
+    struct span {
+        size_t name;
+        size_t name_size;
+        size_t value;
+        size_t value_size;
+    };
+
+    hpack_table table;
+    size_t capacity;
+    std::vector<span> spans;
+};
+
+// Encodes header blocks for a peer: a field found in the static or
+// dynamic table is sent as an index, others as literals, Huffman coded
+// when that is shorter, and added to the dynamic table if indexed is set.
+class hpack_encoder {
+public:
+    hpack_encoder();
+
+    // The SETTINGS_HEADER_TABLE_SIZE of the peer; the table is resized at
+    // the start of the next block.
+    void limit(size_t capacity);
+    // Starts a block, with the update of the table size it may need.
+    void begin(std::string &out);
+    // name has to be in lower case.
+    void add(
+        std::string &out,
+        std::string_view name,
+        std::string_view value,
+        bool indexed
+    );
+
+private:
+    hpack_table table;
+    size_t wanted;
+    size_t smallest;
+    bool resized;
+};
+
+void append_integer(std::string &out, uint8_t first, int prefix, uint64_t n);
+size_t huffman_size(std::string_view text);
+void huffman_encode(std::string &out, std::string_view text);
+bool huffman_decode(std::string &out, std::string_view code);
@@ -0,0 +1,1103 @@
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+
+extern "C" {
+#include <sys/epoll.h>
+#include <unistd.h>
+}
+
+#include "common.hpp"
+#include "config_reader.hpp"
+#include "file_cache.hpp"
+#include "metrics.hpp"
+#include "worker.hpp"
+#include "connection.hpp"
+#include "http2.hpp"
+
+static constexpr size_t TABLE_SIZE = 4096;
+
+static bool has_upper(std::string_view name) {
+    for (char c : name) {
+        if (c >= 'A' && c <= 'Z') {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Fields that only make sense for one HTTP/1.1 connection: a request with
+// them is malformed, and they are left out of responses.
+static bool connection_specific(std::string_view name) {
+    return name == "connection" || name == "keep-alive" ||
+        name == "proxy-connection" || name == "transfer-encoding" ||
+        name == "upgrade";
+}
+
+// Values that change from one response to the next would only push the
+// others out of the table of the peer.
+static bool worth_indexing(std::string_view name) {
+    return name != "content-length" && name != "content-range" &&
+        name != "etag" && name != "last-modified" && name != "location" &&
+        name != "date" && name != "set-cookie";
+}
+
+static int base64url_value(char c) {
+    if (c >= 'A' && c <= 'Z') {
+        return c - 'A';
+    }
+    if (c >= 'a' && c <= 'z') {
+        return c - 'a' + 26;
+    }
+    if (c >= '0' && c <= '9') {
+        return c - '0' + 52;
+    }
+    if (c == '-' || c == '+') {
+        return 62;
+    }
+    if (c == '_' || c == '/') {
+        return 63;
+    }
+    return -1;
+}
+
+static bool decode_base64url(std::string_view text, std::string &out) {
+    while (text.size() && text.back() == '=') {
+        text.remove_suffix(1);
+    }
+    uint32_t bits = 0;
+    int count = 0;
+    for (char c : text) {
+        int value = base64url_value(c);
+        if (value < 0) {
+            return false;
+        }
+        bits = bits << 6 | value;
+        count += 6;
+        if (count >= 8) {
+            count -= 8;
+            out += (char) (bits >> count);
+        }
+    }
+    return count < 6;
+}
+
+// Where the header of an HTTP/1.1 response ends, with the empty line;
+// npos while it is not all there.
+static size_t head_length(std::string_view data) {
+    size_t bare = data.find("\n\n");
+    size_t crlf = data.find("\r\n\r\n");
+    if (crlf != std::string_view::npos && crlf < bare) {
+        return crlf + 4;
+    }
+    return bare == std::string_view::npos ? bare : bare + 2;
+}
+
+http2_session::source_watcher::source_watcher(
+    http2_session &owner,
+    stream &s
+) :
+    owner(owner),
+    s(s) {
+}
+
+void http2_session::source_watcher::handle(uint32_t) {
+    s.waiting = false;
+    owner.wake();
+}
+
+http2_session::sink_watcher::sink_watcher(http2_session &owner, stream &s) :
+    owner(owner),
+    s(s) {
+}
+
+void http2_session::sink_watcher::handle(uint32_t) {
+    owner.write_upload(s);
+    owner.wake();
+}
+
+http2_session::stream::stream(http2_session &owner) :
+    source(owner, *this),
+    sink(owner, *this) {
+}
+
+http2_session::http2_session(connection &owner) :
+    owner(owner),
+    decoder(TABLE_SIZE),
+    turn(0),
+    queued(0),
+    continuing(0),
+    continuing_end(false),
+    continuing_opens(false),
+    preface_seen(false),
+    settings_seen(false),
+    last_stream(0),
+    last_accepted(0x7fffffff),
+    going_away(false),
+    failed(false),
+    window(DEFAULT_WINDOW),
+    receive_window(DEFAULT_WINDOW),
+    initial_window(DEFAULT_WINDOW),
+    frame_size(DEFAULT_FRAME_SIZE) {
+    append_frame_header(control, 12, FRAME::SETTINGS, 0, 0);
+    append_setting(
+        control,
+        SETTING::MAX_CONCURRENT_STREAMS,
+        settings.http2_streams
+    );
+    append_setting(
+        control,
+        SETTING::MAX_HEADER_LIST_SIZE,
+        settings.max_header_size
+    );
+}
+
+http2_session::~http2_session() {
+    close();
+}
+
+bool http2_session::upgrade(const request &message, std::string_view encoded) {
+    std::string payload;
+    if (!decode_base64url(encoded, payload) || payload.size() % 6) {
+        return false;
+    }
+    for (size_t i = 0; i != payload.size(); i += 6) {
+        SETTING id = (SETTING) ((uint8_t) payload[i] << 8 |
+            (uint8_t) payload[i + 1]);
+        if (!apply_setting(id, read_u32(payload.data() + i + 2))) {
+            return false;
+        }
+    }
+    last_stream = 1;
+    stream &s = open(1);
+    start(s, message, 0, true);
+    return true;
+}
+
+bool http2_session::feed(std::string &input) {
+    size_t used = 0;
+    if (!preface_seen) {
+        size_t compared = std::min(input.size(), CONNECTION_PREFACE.size());
+        if (input.compare(0, compared, CONNECTION_PREFACE, 0, compared)) {
+            return false;
+        }
+        if (compared != CONNECTION_PREFACE.size()) {
+            return true;
+        }
+        preface_seen = true;
+        used = compared;
+    }
+    while (!failed && input.size() - used >= FRAME_HEADER_SIZE) {
+        frame_header header = read_frame_header(input.data() + used);
+        if (header.length > DEFAULT_FRAME_SIZE) {
+            fail(ERROR_CODE::FRAME_SIZE_ERROR);
+            break;
+        }
+        if (input.size() - used - FRAME_HEADER_SIZE < header.length) {
+            break;
+        }
+        std::string_view payload(
+            input.data() + used + FRAME_HEADER_SIZE,
+            header.length
+        );
+        used += FRAME_HEADER_SIZE + header.length;
+        // The preface of the peer ends with its settings.
+        if (!settings_seen &&
+            (header.type != FRAME::SETTINGS || (header.flags & FLAG_ACK))) {
+            fail(ERROR_CODE::PROTOCOL_ERROR);
+            break;
+        }
+        settings_seen = true;
+        handle_frame(header, payload);
+    }
+    // Nothing more is read once the connection has failed.
+    if (failed) {
+        input.clear();
+    } else {
+        input.erase(0, used);
+    }
+    return true;
+}
+
+bool http2_session::handle_frame(
+    const frame_header &header,
+    std::string_view payload
+) {
+    if (continuing &&
+        (header.type != FRAME::CONTINUATION || header.stream != continuing)) {
+        return fail(ERROR_CODE::PROTOCOL_ERROR);
+    }
+    switch (header.type) {
+    case FRAME::DATA:
+        return handle_data(header, payload);
+    case FRAME::HEADERS:
+        return handle_headers(header, payload);
+    case FRAME::PRIORITY:
+        if (header.stream == 0) {
+            return fail(ERROR_CODE::PROTOCOL_ERROR);
+        }
+        if (payload.size() != 5) {
+            stream *s = find(header.stream);
+            if (s == nullptr) {
+                append_rst_stream(
+                    control,
+                    header.stream,
+                    ERROR_CODE::FRAME_SIZE_ERROR
+                );
+            } else {
+                reset(*s, ERROR_CODE::FRAME_SIZE_ERROR);
+                release(*s);
+            }
+        }
+        return true;
+    case FRAME::RST_STREAM: {
+        if (header.stream == 0 || header.stream > last_stream) {
+            return fail(ERROR_CODE::PROTOCOL_ERROR);
+        }
+        if (payload.size() != 4) {
+            return fail(ERROR_CODE::FRAME_SIZE_ERROR);
+        }
+        stream *s = find(header.stream);
+        if (s != nullptr) {
+            discard(*s);
+            release(*s);
+        }
+        return true;
+    }
+    case FRAME::SETTINGS:
+        return handle_settings(header, payload);
+    case FRAME::PUSH_PROMISE:
+        return fail(ERROR_CODE::PROTOCOL_ERROR);
+    case FRAME::PING:
+        if (header.stream) {
+            return fail(ERROR_CODE::PROTOCOL_ERROR);
+        }
+        if (payload.size() != 8) {
+            return fail(ERROR_CODE::FRAME_SIZE_ERROR);
+        }
+        if (!(header.flags & FLAG_ACK)) {
+            append_ping(control, payload, true);
+        }
+        return true;
+    case FRAME::GOAWAY:
+        if (header.stream) {
+            return fail(ERROR_CODE::PROTOCOL_ERROR);
+        }
+        // The peer opens no more streams, the connection ends once those
+        // it has opened are answered.
+        if (!going_away) {
+            going_away = true;
+            last_accepted = last_stream;
+        }
+        return true;
+    case FRAME::WINDOW_UPDATE:
+        return handle_window_update(header, payload);
+    case FRAME::CONTINUATION:
+        if (!continuing) {
+            return fail(ERROR_CODE::PROTOCOL_ERROR);
+        }
+        block += payload;
+        if (block.size() > settings.max_header_size * 2) {
+            return fail(ERROR_CODE::ENHANCE_YOUR_CALM);
+        }
+        return header.flags & FLAG_END_HEADERS ? finish_headers() : true;
+    default:
+        return true;
+    }
+}
+
+bool http2_session::handle_data(
+    const frame_header &header,
+    std::string_view payload
+) {
+    if (header.stream == 0 || header.stream > last_stream) {
+        return fail(ERROR_CODE::PROTOCOL_ERROR);
+    }
+    // The connection window is given back at once, how fast a body goes
+    // is left to the window of its stream.
+    receive_window -= header.length;
+    if (receive_window < 0) {
+        return fail(ERROR_CODE::FLOW_CONTROL_ERROR);
+    }
+    if (receive_window <= DEFAULT_WINDOW / 2) {
+        append_window_update(control, 0, DEFAULT_WINDOW - receive_window);
+        receive_window = DEFAULT_WINDOW;
+    }
+    if (!frame_content(header, payload)) {
+        return fail(ERROR_CODE::PROTOCOL_ERROR);
+    }
+    stream *s = find(header.stream);
+    if (s == nullptr) {
+        return true;
+    }
+    if (s->remote_closed) {
+        reset(*s, ERROR_CODE::STREAM_CLOSED);
+        release(*s);
+        return true;
+    }
+    s->receive_window -= header.length;
+    s->received += payload.size();
+    if (s->receive_window < 0) {
+        reset(*s, ERROR_CODE::FLOW_CONTROL_ERROR);
+        release(*s);
+        return true;
+    }
+    if (settings.max_body_size && s->received > settings.max_body_size) {
+        reset(*s, ERROR_CODE::CANCEL);
+        release(*s);
+        return true;
+    }
+    if (header.flags & FLAG_END_STREAM) {
+        s->remote_closed = true;
+    }
+    if (s->upload == -1) {
+        credit(*s, header.length);
+        return true;
+    }
+    credit(*s, header.length - payload.size());
+    s->incoming += payload;
+    write_upload(*s);
+    return true;
+}
+
+bool http2_session::handle_headers(
+    const frame_header &header,
+    std::string_view payload
+) {
+    if (header.stream == 0 || !(header.stream & 1)) {
+        return fail(ERROR_CODE::PROTOCOL_ERROR);
+    }
+    if (!frame_content(header, payload)) {
+        return fail(ERROR_CODE::PROTOCOL_ERROR);
+    }
+    // A block for a stream that is open already holds its trailers, one
+    // for a stream that has ended is only decoded; the table of the
+    // decoder has to take in every block.
+    continuing_opens = header.stream > last_stream;
+    if (continuing_opens) {
+        last_stream = header.stream;
+    }
+    continuing = header.stream;
+    continuing_end = header.flags & FLAG_END_STREAM;
+    block.assign(payload);
+    return header.flags & FLAG_END_HEADERS ? finish_headers() : true;
+}
+
+bool http2_session::finish_headers() {
+    uint32_t id = continuing;
+    continuing = 0;
+    int64_t started = monotonic_us();
+    HPACK result = decoder.decode(
+        block,
+        settings.max_header_size,
+        fields_storage,
+        fields
+    );
+    if (result == HPACK::MALFORMED) {
+        return fail(ERROR_CODE::COMPRESSION_ERROR);
+    }
+    if (result == HPACK::TOO_LARGE) {
+        return fail(ERROR_CODE::ENHANCE_YOUR_CALM);
+    }
+    record_stage(STAGE::PARSE, monotonic_us() - started);
+    if (!continuing_opens) {
+        stream *s = find(id);
+        if (s == nullptr) {
+            return true;
+        }
+        if (!continuing_end || s->remote_closed) {
+            reset(*s, ERROR_CODE::PROTOCOL_ERROR);
+            release(*s);
+            return true;
+        }
+        s->remote_closed = true;
+        if (s->upload != -1) {
+            write_upload(*s);
+        }
+        return true;
+    }
+    if ((going_away && id > last_accepted) ||
+        streams.size() >= settings.http2_streams) {
+        append_rst_stream(control, id, ERROR_CODE::REFUSED_STREAM);
+        return true;
+    }
+    request message = request();
+    int refused = 0;
+    if (!make_request(message, refused)) {
+        append_rst_stream(control, id, ERROR_CODE::PROTOCOL_ERROR);
+        return true;
+    }
+    start(open(id), message, refused, continuing_end);
+    return true;
+}
+
+// The request the fields decoded last stand for, with views into them and
+// into line. Returns false if it is malformed; refused is set to the
+// status to answer it with when it is well formed but cannot be served.
+bool http2_session::make_request(request &message, int &refused) {
+    message.header_count = 0;
+    message.length = 0;
+    message.error = 0;
+    std::string_view method, scheme, path, authority;
+    bool regular = false;
+    for (const header_pair &field : fields) {
+        if (field.name.size() && field.name[0] == ':') {
+            std::string_view *pseudo = nullptr;
+            if (field.name == ":method") {
+                pseudo = &method;
+            } else if (field.name == ":scheme") {
+                pseudo = &scheme;
+            } else if (field.name == ":path") {
+                pseudo = &path;
+            } else if (field.name == ":authority") {
+                pseudo = &authority;
+            }
+            if (regular || pseudo == nullptr || pseudo->size()) {
+                return false;
+            }
+            *pseudo = field.value;
+            continue;
+        }
+        regular = true;
+        if (field.name.empty() || has_upper(field.name) ||
+            connection_specific(field.name) ||
+            (field.name == "te" && field.value != "trailers")) {
+            return false;
+        }
+        if (message.header_count == request::MAX_HEADERS) {
+            refused = 431;
+            continue;
+        }
+        message.headers[message.header_count++] = {field.name, field.value};
+    }
+    if (method.empty() || scheme.empty() || path.empty() || path[0] != '/') {
+        return false;
+    }
+    if (authority.size() && message.find("host").empty()) {
+        if (message.header_count == request::MAX_HEADERS) {
+            refused = 431;
+        } else {
+            message.headers[message.header_count++] = {"host", authority};
+        }
+    }
+    line.clear();
+    line += method;
+    line += ' ';
+    line += path;
+    line += " HTTP/2.0";
+    message.line = line;
+    message.method = method;
+    message.target = path;
+    size_t question_mark = path.find('?');
+    message.path = path.substr(1, question_mark - 1);
+    if (question_mark != std::string_view::npos) {
+        message.query = path.substr(question_mark + 1);
+    }
+    message.version = "HTTP/2.0";
+    index_headers(message);
+    if (message.content_length.size()) {
+        uint64_t size;
+        const char *end =
+            message.content_length.data() + message.content_length.size();
+        auto [last, error] =
+            std::from_chars(message.content_length.data(), end, size);
+        if (error != std::errc() || last != end ||
+            (continuing_end && size)) {
+            return false;
+        }
+        if (settings.max_body_size && size > settings.max_body_size) {
+            refused = 413;
+        }
+    } else if (!continuing_end) {
+        // DATA frames frame the body, has_body() knows that as chunked.
+        message.transfer_encoding = "chunked";
+    }
+    return true;
+}
+
+bool http2_session::handle_settings(
+    const frame_header &header,
+    std::string_view payload
+) {
+    if (header.stream) {
+        return fail(ERROR_CODE::PROTOCOL_ERROR);
+    }
+    if (header.flags & FLAG_ACK) {
+        return payload.empty() ? true : fail(ERROR_CODE::FRAME_SIZE_ERROR);
+    }
+    if (payload.size() % 6) {
+        return fail(ERROR_CODE::FRAME_SIZE_ERROR);
+    }
+    for (size_t i = 0; i != payload.size(); i += 6) {
+        SETTING id = (SETTING) ((uint8_t) payload[i] << 8 |
+            (uint8_t) payload[i + 1]);
+        if (!apply_setting(id, read_u32(payload.data() + i + 2))) {
+            return false;
+        }
+    }
+    append_frame_header(control, 0, FRAME::SETTINGS, FLAG_ACK, 0);
+    return true;
+}
+
+bool http2_session::apply_setting(SETTING id, uint32_t value) {
+    switch (id) {
+    case SETTING::HEADER_TABLE_SIZE:
+        encoder.limit(value);
+        return true;
+    case SETTING::ENABLE_PUSH:
+        return value <= 1 ? true : fail(ERROR_CODE::PROTOCOL_ERROR);
+    case SETTING::INITIAL_WINDOW_SIZE: {
+        if (value > MAX_WINDOW) {
+            return fail(ERROR_CODE::FLOW_CONTROL_ERROR);
+        }
+        int64_t change = (int64_t) value - initial_window;
+        for (const std::unique_ptr<stream> &s : streams) {
+            s->window += change;
+            if (s->window > MAX_WINDOW) {
+                return fail(ERROR_CODE::FLOW_CONTROL_ERROR);
+            }
+        }
+        initial_window = value;
+        return true;
+    }
+    case SETTING::MAX_FRAME_SIZE:
+        if (value < DEFAULT_FRAME_SIZE || value > MAX_FRAME_SIZE) {
+            return fail(ERROR_CODE::PROTOCOL_ERROR);
+        }
+        frame_size = value;
+        return true;
+    default:
+        return true;
+    }
+}
+
+bool http2_session::handle_window_update(
+    const frame_header &header,
+    std::string_view payload
+) {
+    if (payload.size() != 4) {
+        return fail(ERROR_CODE::FRAME_SIZE_ERROR);
+    }
+    uint32_t increment = read_u32(payload.data()) & 0x7fffffff;
+    if (header.stream == 0) {
+        if (increment == 0) {
+            return fail(ERROR_CODE::PROTOCOL_ERROR);
+        }
+        window += increment;
+        return window > MAX_WINDOW ?
+            fail(ERROR_CODE::FLOW_CONTROL_ERROR) : true;
+    }
+    stream *s = find(header.stream);
+    if (s == nullptr) {
+        return true;
+    }
+    s->window += increment;
+    if (increment == 0 || s->window > MAX_WINDOW) {
+        reset(
+            *s,
+            increment ?
+                ERROR_CODE::FLOW_CONTROL_ERROR : ERROR_CODE::PROTOCOL_ERROR
+        );
+        release(*s);
+    }
+    return true;
+}
+
+http2_session::stream &http2_session::open(uint32_t id) {
+    std::unique_ptr<stream> added;
+    if (spare.size()) {
+        added = std::move(spare.back());
+        spare.pop_back();
+    } else {
+        added.reset(new stream(*this));
+    }
+    stream &s = *added;
+    s.id = id;
+    s.window = initial_window;
+    s.receive_window = DEFAULT_WINDOW;
+    s.unacknowledged = 0;
+    s.received = 0;
+    s.status = 0;
+    s.bytes = 0;
+    s.head_sent = false;
+    s.remote_closed = false;
+    s.waiting = false;
+    s.ended = false;
+    s.upload = -1;
+    s.sink_watched = false;
+    s.watched = -1;
+    streams.push_back(std::move(added));
+    return s;
+}
+
+void http2_session::start(
+    stream &s,
+    const request &message,
+    int refused,
+    bool end_stream
+) {
+    s.answer = owner.serve(message, refused);
+    s.remote_closed = end_stream;
+    if (s.answer.upload != -1) {
+        s.upload = s.answer.upload;
+        s.answer.upload = -1;
+    }
+    // DATA frames of the file share it through the keeper, they may still
+    // be queued when the stream has gone.
+    if (s.answer.file != -1 && !s.answer.borrowed_file) {
+        s.answer.keeper = std::make_shared<shared_file>(s.answer.file);
+        s.answer.borrowed_file = true;
+    }
+    if (!going_away && owner.served >= settings.keepalive_requests) {
+        going_away = true;
+        last_accepted = s.id;
+        append_goaway(control, s.id, ERROR_CODE::NO_ERROR);
+    }
+}
+
+http2_session::stream *http2_session::find(uint32_t id) {
+    for (const std::unique_ptr<stream> &s : streams) {
+        if (s->id == id) {
+            return s.get();
+        }
+    }
+    return nullptr;
+}
+
+// The stream ends before its response: it is logged with what it has
+// sent, and taken out once nothing refers to it.
+void http2_session::discard(stream &s) {
+    if (s.head_sent) {
+        access_record &journal = s.answer.journal;
+        journal.status = s.status;
+        journal.bytes = s.bytes;
+        owner.log(journal);
+    }
+    s.ended = true;
+}
+
+void http2_session::reset(stream &s, ERROR_CODE code) {
+    append_rst_stream(control, s.id, code);
+    discard(s);
+}
+
+bool http2_session::fail(ERROR_CODE code) {
+    if (!failed) {
+        append_goaway(control, last_stream, code);
+        failed = true;
+        while (streams.size()) {
+            discard(*streams.back());
+            release(*streams.back());
+        }
+    }
+    return false;
+}
+
+void http2_session::release(stream &s) {
+    unwatch(s);
+    if (s.upload != -1) {
+        if (s.sink_watched) {
+            owner.owner.loop().remove(s.upload);
+        }
+        ::close(s.upload);
+        s.upload = -1;
+    }
+    s.answer = response();
+    s.incoming.clear();
+    s.chunk.clear();
+    for (size_t i = 0; i != streams.size(); ++i) {
+        if (streams[i].get() == &s) {
+            spare.push_back(std::move(streams[i]));
+            streams[i] = std::move(streams.back());
+            streams.pop_back();
+            break;
+        }
+    }
+}
+
+// Body bytes that have been taken are given back to the peer in a
+// WINDOW_UPDATE once they add up to half of the window.
+void http2_session::credit(stream &s, size_t bytes) {
+    if (s.remote_closed) {
+        return;
+    }
+    s.unacknowledged += bytes;
+    if (s.unacknowledged >= DEFAULT_WINDOW / 2) {
+        append_window_update(control, s.id, s.unacknowledged);
+        s.receive_window += s.unacknowledged;
+        s.unacknowledged = 0;
+    }
+}
+
+// The body is written to the script as fast as it reads it; a script
+// that stops reading has the rest dropped.
+void http2_session::write_upload(stream &s) {
+    while (s.upload != -1 && s.incoming.size()) {
+        ssize_t bytes = write(s.upload, s.incoming.data(), s.incoming.size());
+        if (bytes > 0) {
+            s.incoming.erase(0, bytes);
+            credit(s, bytes);
+            continue;
+        }
+        if (bytes == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (!s.sink_watched) {
+                owner.owner.loop().add(s.upload, EPOLLOUT | EPOLLET, &s.sink);
+                s.sink_watched = true;
+            }
+            return;
+        }
+        credit(s, s.incoming.size());
+        s.incoming.clear();
+        end_upload(s);
+    }
+    if (s.remote_closed) {
+        end_upload(s);
+    }
+}
+
+void http2_session::end_upload(stream &s) {
+    if (s.upload == -1) {
+        return;
+    }
+    if (s.sink_watched) {
+        owner.owner.loop().remove(s.upload);
+        s.sink_watched = false;
+    }
+    ::close(s.upload);
+    s.upload = -1;
+    if (s.answer.stream) {
+        s.answer.stream->input_complete();
+    }
+}
+
+void http2_session::watch(stream &s) {
+    int descriptor = s.answer.stream->descriptor();
+    if (s.watched != descriptor && descriptor != -1) {
+        unwatch(s);
+        owner.owner.loop().add(descriptor, EPOLLIN | EPOLLET, &s.source);
+        s.watched = descriptor;
+    }
+}
+
+void http2_session::unwatch(stream &s) {
+    if (s.watched != -1) {
+        owner.owner.loop().remove(s.watched);
+        s.watched = -1;
+    }
+}
+
+void http2_session::wake() {
+    owner.advance();
+    owner.schedule();
+}
+
+// Frames go into the data of the last response queued as long as it has
+// nothing else; one that carries a body, a file or the record of a
+// stream is followed by a new one.
+response &http2_session::frame(std::pmr::deque<response> &output) {
+    if (output.size()) {
+        response &last = output.back();
+        if (last.body.empty() && last.length == 0 &&
+            last.journal.status == 0) {
+            return last;
+        }
+    }
+    output.emplace_back();
+    return output.back();
+}
+
+bool http2_session::produce(std::pmr::deque<response> &output) {
+    if (control.size()) {
+        frame(output).data += control;
+        control.clear();
+    }
+    queued = 0;
+    bool progress = true;
+    while (progress && output.size() < MAX_FRAMES && queued < SEND_BUDGET) {
+        progress = false;
+        // One frame from each stream in turn.
+        for (size_t count = streams.size(); count && streams.size();
+            --count) {
+            if (turn >= streams.size()) {
+                turn = 0;
+            }
+            stream &s = *streams[turn];
+            if (step(s, output)) {
+                progress = true;
+            }
+            if (s.ended) {
+                release(s);
+            } else {
+                ++turn;
+            }
+            if (output.size() >= MAX_FRAMES || queued >= SEND_BUDGET) {
+                break;
+            }
+        }
+    }
+    if (control.size()) {
+        frame(output).data += control;
+        control.clear();
+    }
+    return output.size();
+}
+
+bool http2_session::finished(const stream &s) const {
+    const response &answer = s.answer;
+    return answer.sent == answer.data.size() && answer.body.empty() &&
+        answer.length == 0 && !answer.more_pieces() && !answer.stream;
+}
+
+// The response is complete with the frame that ends it, which takes the
+// record of the stream to the log once it has been sent.
+void http2_session::end(stream &s, response &carrier) {
+    carrier.journal = s.answer.journal;
+    carrier.journal.status = s.status;
+    carrier.journal.bytes = s.bytes;
+    // A body still coming is not wanted any more.
+    if (!s.remote_closed) {
+        append_rst_stream(control, s.id, ERROR_CODE::NO_ERROR);
+    }
+    s.ended = true;
+}
+
+// More output of the script; false if it has none yet.
+bool http2_session::pull(stream &s) {
+    response &answer = s.answer;
+    watch(s);
+    if (!s.head_sent) {
+        s.chunk.clear();
+    } else {
+        answer.data.clear();
+        answer.sent = 0;
+    }
+    std::string &out = s.head_sent ? answer.data : s.chunk;
+    switch (answer.stream->produce(out)) {
+    case STREAM::MORE:
+        break;
+    case STREAM::AGAIN:
+        s.waiting = true;
+        break;
+    case STREAM::DONE:
+        unwatch(s);
+        answer.stream.reset();
+        break;
+    default:
+        unwatch(s);
+        reset(s, ERROR_CODE::INTERNAL_ERROR);
+        return false;
+    }
+    if (!s.head_sent) {
+        answer.data += s.chunk;
+        return s.chunk.size();
+    }
+    return answer.data.size();
+}
+
+void http2_session::encode_head(std::string_view head) {
+    encoded.clear();
+    encoder.begin(encoded);
+    encoder.add(encoded, ":status", head.substr(9, 3), true);
+    size_t start = head.find('\n');
+    while (start != std::string_view::npos && start + 1 < head.size()) {
+        ++start;
+        size_t end = head.find('\n', start);
+        std::string_view field = head.substr(start, end - start);
+        start = end;
+        if (field.size() && field.back() == '\r') {
+            field.remove_suffix(1);
+        }
+        size_t colon = field.find(':');
+        if (colon == std::string_view::npos || colon == 0) {
+            continue;
+        }
+        name.assign(field, 0, colon);
+        for (char &c : name) {
+            if (c >= 'A' && c <= 'Z') {
+                c += 'a' - 'A';
+            }
+        }
+        if (connection_specific(name)) {
+            continue;
+        }
+        std::string_view value = field.substr(colon + 1);
+        size_t first = value.find_first_not_of(" \t");
+        value = first == std::string_view::npos ?
+            std::string_view() : value.substr(first);
+        encoder.add(encoded, name, value, worth_indexing(name));
+    }
+}
+
+// The header the handler wrote, once it is all there, as a HEADERS frame.
+bool http2_session::send_head(stream &s, std::pmr::deque<response> &output) {
+    response &answer = s.answer;
+    size_t length = head_length(answer.data);
+    while (length == std::string_view::npos) {
+        if (!answer.stream) {
+            reset(s, ERROR_CODE::INTERNAL_ERROR);
+            return true;
+        }
+        if (s.waiting) {
+            return false;
+        }
+        bool more = pull(s);
+        if (s.ended) {
+            return true;
+        }
+        if (!more) {
+            return !s.waiting;
+        }
+        length = head_length(answer.data);
+    }
+    std::string_view head(answer.data.data(), length);
+    if (length < 13 || head.compare(0, 5, "HTTP/") ||
+        std::from_chars(head.data() + 9, head.data() + 12, s.status).ptr !=
+            head.data() + 12) {
+        reset(s, ERROR_CODE::INTERNAL_ERROR);
+        return true;
+    }
+    encode_head(head);
+    answer.sent = length;
+    s.head_sent = true;
+    bool last = finished(s);
+    response &carrier = frame(output);
+    append_header_block(carrier.data, encoded, s.id, last, frame_size);
+    queued += encoded.size();
+    if (last) {
+        end(s, carrier);
+    }
+    return true;
+}
+
+// Sends the next frame of the body, as much of it as the windows and the
+// frame size allow. A part in memory is copied into the frame, the body
+// is pointed to and the file is sent from.
+bool http2_session::step(stream &s, std::pmr::deque<response> &output) {
+    if (!s.head_sent) {
+        return send_head(s, output);
+    }
+    response &answer = s.answer;
+    while (answer.sent == answer.data.size() && answer.body.empty() &&
+        answer.length == 0) {
+        if (answer.advance()) {
+            continue;
+        }
+        if (!answer.stream) {
+            response &carrier = frame(output);
+            append_frame_header(
+                carrier.data,
+                0,
+                FRAME::DATA,
+                FLAG_END_STREAM,
+                s.id
+            );
+            end(s, carrier);
+            return true;
+        }
+        if (s.waiting) {
+            return false;
+        }
+        bool more = pull(s);
+        if (s.ended) {
+            return true;
+        }
+        if (!more) {
+            return !s.waiting;
+        }
+    }
+    int64_t allowed = std::min<int64_t>({window, s.window, frame_size});
+    if (allowed <= 0) {
+        return false;
+    }
+    response &carrier = frame(output);
+    size_t length;
+    std::string_view copied;
+    if (answer.sent != answer.data.size()) {
+        length = std::min<size_t>(answer.data.size() - answer.sent, allowed);
+        copied = std::string_view(answer.data).substr(answer.sent, length);
+        answer.sent += length;
+    } else if (answer.body.size()) {
+        length = std::min<size_t>(answer.body.size(), allowed);
+        carrier.body = answer.body.substr(0, length);
+        carrier.keeper = answer.keeper;
+        answer.body.remove_prefix(length);
+    } else {
+        length = std::min<size_t>(answer.length, allowed);
+        carrier.file = answer.file;
+        carrier.borrowed_file = true;
+        carrier.offset = answer.offset;
+        carrier.length = length;
+        carrier.keeper = answer.keeper;
+        answer.offset += length;
+        answer.length -= length;
+    }
+    bool last = finished(s);
+    append_frame_header(
+        carrier.data,
+        length,
+        FRAME::DATA,
+        last ? FLAG_END_STREAM : 0,
+        s.id
+    );
+    carrier.data += copied;
+    window -= length;
+    s.window -= length;
+    queued += length;
+    if (last) {
+        end(s, carrier);
+    }
+    s.bytes += length;
+    return true;
+}
+
+bool http2_session::busy() const {
+    return streams.size();
+}
+
+bool http2_session::closing() const {
+    return failed || (going_away && streams.empty());
+}
+
+bool http2_session::blocked() const {
+    for (const std::unique_ptr<stream> &s : streams) {
+        if (s->head_sent && !s->waiting && (window <= 0 || s->window <= 0)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int64_t http2_session::expires() const {
+    int64_t next = 0;
+    for (const std::unique_ptr<stream> &s : streams) {
+        if (s->answer.stream) {
+            int64_t expires = s->answer.stream->expires();
+            if (expires && (next == 0 || expires < next)) {
+                next = expires;
+            }
+        }
+    }
+    return next;
+}
+
+void http2_session::expire() {
+    int64_t now = monotonic_ms();
+    for (const std::unique_ptr<stream> &s : streams) {
+        if (s->answer.stream) {
+            int64_t expires = s->answer.stream->expires();
+            if (expires && expires <= now) {
+                s->answer.stream->expire();
+                s->waiting = false;
+            }
+        }
+    }
+}
+
+void http2_session::close() {
+    while (streams.size()) {
+        release(*streams.back());
+    }
+}
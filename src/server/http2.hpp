@@ -0,0 +1,184 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "event_loop.hpp"
+#include "frame_codec.hpp"
+#include "hpack.hpp"
+#include "query_parser.hpp"
+#include "answer_generator.hpp"
+
+class connection;
+
+// HTTP/2 without TLS (h2c) on a connection that starts with the preface or
+// asks for it with Upgrade: h2c. Each stream is answered by the handlers
+// HTTP/1.1 requests go to: the header of the response they build is sent
+// as a HEADERS frame and what follows it (data, a body shared with the
+// cache, ranges of a file or the output of a script) in DATA frames, as
+// far as the windows of the peer allow. Frames are queued on the output
+// of the connection as responses of their own, so a DATA frame of a file
+// is still written by sendfile().
+class http2_session {
+public:
+    explicit http2_session(connection &owner);
+    ~http2_session();
+    http2_session(const http2_session &) = delete;
+    http2_session &operator=(const http2_session &) = delete;
+
+    // Makes message, which asked for the upgrade, stream 1, as if sent
+    // with the settings in the HTTP2-Settings header; false if these are
+    // malformed.
+    bool upgrade(const request &message, std::string_view encoded);
+    // Handles the frames at the start of input and erases them. False if
+    // the connection has to be dropped at once: it does not start with
+    // the preface.
+    bool feed(std::string &input);
+    // Queues the next frames, false if there is nothing to send now.
+    bool produce(std::pmr::deque<response> &output);
+    // Streams are still being answered.
+    bool busy() const;
+    // The connection ends once the frames queued have been sent: after a
+    // GOAWAY, when no stream is left.
+    bool closing() const;
+    // Something is ready to be sent but waits for the peer to open its
+    // window.
+    bool blocked() const;
+    int64_t expires() const;
+    void expire();
+    // Stops watching the descriptors of the streams.
+    void close();
+
+private:
+    struct stream;
+
+    class source_watcher : public event_handler {
+    public:
+        source_watcher(http2_session &owner, stream &s);
+        void handle(uint32_t events) override;
+
+    private:
+        http2_session &owner;
+        stream &s;
+    };
+
+    class sink_watcher : public event_handler {
+    public:
+        sink_watcher(http2_session &owner, stream &s);
+        void handle(uint32_t events) override;
+
+    private:
+        http2_session &owner;
+        stream &s;
+    };
+
+    struct stream {
+        stream(http2_session &owner);
+
+        uint32_t id;
+        response answer;
+        // What the peer lets be sent and what it may still send.
+        int64_t window;
+        int64_t receive_window;
+        // Body bytes taken but not yet given back with a WINDOW_UPDATE.
+        uint32_t unacknowledged;
+        uint64_t received;
+        int status;
+        uint64_t bytes;
+        bool head_sent;
+        bool remote_closed;
+        bool waiting;
+        // Taken out of streams after the round that ended it.
+        bool ended;
+        // The request body goes to upload, buffered until it can be
+        // written.
+        int upload;
+        std::string incoming;
+        bool sink_watched;
+        int watched;
+        std::string chunk;
+        source_watcher source;
+        sink_watcher sink;
+    };
+
+    bool handle_frame(const frame_header &header, std::string_view payload);
+    bool handle_data(const frame_header &header, std::string_view payload);
+    bool handle_headers(const frame_header &header, std::string_view payload);
+    bool handle_settings(
+        const frame_header &header,
+        std::string_view payload
+    );
+    bool handle_window_update(
+        const frame_header &header,
+        std::string_view payload
+    );
+    bool apply_setting(SETTING id, uint32_t value);
+    bool finish_headers();
+    bool make_request(request &message, int &refused);
+    stream &open(uint32_t id);
+    void start(
+        stream &s,
+        const request &message,
+        int refused,
+        bool end_stream
+    );
+    stream *find(uint32_t id);
+    void discard(stream &s);
+    void reset(stream &s, ERROR_CODE code);
+    // Sends a GOAWAY with code and drops every stream; returns false.
+    bool fail(ERROR_CODE code);
+    void release(stream &s);
+    void credit(stream &s, size_t bytes);
+    void write_upload(stream &s);
+    void end_upload(stream &s);
+    void watch(stream &s);
+    void unwatch(stream &s);
+    bool step(stream &s, std::pmr::deque<response> &output);
+    bool send_head(stream &s, std::pmr::deque<response> &output);
+    bool pull(stream &s);
+    bool finished(const stream &s) const;
+    response &frame(std::pmr::deque<response> &output);
+    void end(stream &s, response &carrier);
+    void encode_head(std::string_view head);
+    void wake();
+
+    static constexpr size_t SEND_BUDGET = 256 << 10;
+    static constexpr size_t MAX_FRAMES = 32;
+
+    connection &owner;
+    hpack_decoder decoder;
+    hpack_encoder encoder;
+    std::vector<std::unique_ptr<stream>> streams;
+    std::vector<std::unique_ptr<stream>> spare;
+    size_t turn;
+    size_t queued;
+    // Frames other than those of responses, sent before anything else.
+    std::string control;
+    // The header block being received and the one being sent.
+    std::string block;
+    std::string encoded;
+    std::string fields_storage;
+    std::vector<header_pair> fields;
+    std::string line;
+    std::string name;
+    uint32_t continuing;
+    bool continuing_end;
+    bool continuing_opens;
+    bool preface_seen;
+    bool settings_seen;
+    uint32_t last_stream;
+    // Streams past this one are refused once a GOAWAY has been sent.
+    uint32_t last_accepted;
+    bool going_away;
+    bool failed;
+    int64_t window;
+    int64_t receive_window;
+    int64_t initial_window;
+    uint32_t frame_size;
+};
@@ -0,0 +1,428 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <utility>
+
+extern "C" {
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+}
+
+#include "common.hpp"
+#include "url_encoder.hpp"
+#include "query_parser.hpp"
+#include "listing.hpp"
+
+static constexpr size_t INLINE_ITEMS = 1024;
+static constexpr size_t PIECE_SIZE = 4 * BUFFER_SIZE;
+
+enum class FORMAT {
+    HTML,
+    JSON
+};
+
+struct page {
+    FORMAT format;
+    size_t offset;
+    size_t limit;
+    size_t first;
+    size_t last;
+};
+
+std::string_view listing_cache::listing::name(size_t i) const {
+    return std::string_view(names).substr(items[i].start, items[i].length);
+}
+
+static bool same_version(const struct stat &a, const struct stat &b) {
+    return
+        a.st_dev == b.st_dev &&
+        a.st_ino == b.st_ino &&
+        a.st_mtim.tv_sec == b.st_mtim.tv_sec &&
+        a.st_mtim.tv_nsec == b.st_mtim.tv_nsec;
+}
+
+static size_t footprint(const listing_cache::listing &l) {
+    return
+        sizeof(l) + l.directory.size() + l.names.capacity() +
+        l.items.capacity() * sizeof(listing_cache::item);
+}
+
+static std::shared_ptr<listing_cache::listing> scan(
+    const std::string &directory,
+    const struct stat &info
+) {
+    DIR *dir = opendir(directory.c_str());
+    if (dir == nullptr) {
+        return nullptr;
+    }
+    std::shared_ptr<listing_cache::listing> result =
+        std::make_shared<listing_cache::listing>();
+    result->directory = directory;
+    result->info = info;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        const char *name = entry->d_name;
+        if (!strcmp(name, ".") || !strcmp(name, "..")) {
+            continue;
+        }
+        bool is_directory = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK) {
+            struct stat target;
+            is_directory =
+                fstatat(dirfd(dir), name, &target, 0) == 0 &&
+                S_ISDIR(target.st_mode);
+        }
+        size_t length = strlen(name);
+        result->items.push_back({result->names.size(), length, is_directory});
+        result->names.append(name, length);
+    }
+    closedir(dir);
+    const std::string &names = result->names;
+    std::sort(
+        result->items.begin(),
+        result->items.end(),
+        [&names](const listing_cache::item &a, const listing_cache::item &b) {
+            return
+                names.compare(a.start, a.length, names, b.start, b.length) < 0;
+        }
+    );
+    result->names.shrink_to_fit();
+    result->items.shrink_to_fit();
+    return result;
+}
+
+listing_cache::listing_cache(size_t capacity) :
+    capacity(capacity),
+    used(0) {
+}
+
+std::shared_ptr<const listing_cache::listing> listing_cache::get(
+    const std::string &directory,
+    const struct stat &info
+) {
+    auto it = index.find(directory);
+    if (it != index.end()) {
+        if (same_version((*it->second)->info, info)) {
+            entries.splice(entries.begin(), entries, it->second);
+            return *it->second;
+        }
+        used -= footprint(**it->second);
+        entries.erase(it->second);
+        index.erase(it);
+    }
+    std::shared_ptr<const listing> result = scan(directory, info);
+    if (result == nullptr) {
+        return nullptr;
+    }
+    // A directory changed within the last second may change again without
+    // its mtime moving, so only settled directories are remembered.
+    size_t size = footprint(*result);
+    if (size <= capacity && info.st_mtime + 1 < time(nullptr)) {
+        used += size;
+        entries.push_front(result);
+        index[directory] = entries.begin();
+        evict();
+    }
+    return result;
+}
+
+void listing_cache::evict() {
+    while (used > capacity && entries.size()) {
+        used -= footprint(*entries.back());
+        index.erase(entries.back()->directory);
+        entries.pop_back();
+    }
+}
+
+static void html_escape(std::string &out, std::string_view s) {
+    for (char c : s) {
+        switch (c) {
+        case '&':
+            out += "&amp;";
+            break;
+        case '<':
+            out += "&lt;";
+            break;
+        case '>':
+            out += "&gt;";
+            break;
+        case '"':
+            out += "&quot;";
+            break;
+        default:
+            out += c;
+        }
+    }
+}
+
+static void json_escape(std::string &out, std::string_view s) {
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if ((unsigned char) c < 0x20) {
+            char code[8];
+            snprintf(code, sizeof(code), "\\u%04x", c);
+            out += code;
+        } else {
+            out += c;
+        }
+    }
+}
+
+static bool query_value(
+    std::string_view query,
+    std::string_view key,
+    std::string &value
+) {
+    while (query.size()) {
+        size_t ampersand = query.find('&');
+        std::string_view pair = query.substr(0, ampersand);
+        query.remove_prefix(
+            ampersand == std::string_view::npos ? query.size() : ampersand + 1
+        );
+        size_t equals = pair.find('=');
+        if (pair.substr(0, equals) == key) {
+            value.clear();
+            if (equals != std::string_view::npos) {
+                url_decode(pair.substr(equals + 1), value);
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool parse_page(std::string_view query, page &view) {
+    view.format = FORMAT::HTML;
+    view.offset = 0;
+    view.limit = 0;
+    std::string value;
+    if (query_value(query, "format", value)) {
+        if (value == "json") {
+            view.format = FORMAT::JSON;
+        } else if (value != "html") {
+            return false;
+        }
+    }
+    if (query_value(query, "offset", value) &&
+        !from_string(value, &view.offset)) {
+        return false;
+    }
+    if (query_value(query, "limit", value) &&
+        !from_string(value, &view.limit)) {
+        return false;
+    }
+    return true;
+}
+
+static std::string page_link(const page &view, size_t offset) {
+    return
+        "?offset=" + std::to_string(offset) +
+        "&amp;limit=" + std::to_string(view.limit);
+}
+
+static void render_head(
+    std::string &out,
+    const listing_cache::listing &entries,
+    const page &view
+) {
+    if (view.format == FORMAT::JSON) {
+        out += "{\"directory\":\"/";
+        if (entries.directory != "./") {
+            json_escape(out, entries.directory);
+        }
+        out +=
+            "\",\"total\":" + std::to_string(entries.items.size()) +
+            ",\"offset\":" + std::to_string(view.first) +
+            ",\"entries\":[";
+        return;
+    }
+    out += HTML_HEAD;
+    out +=
+        "    <body>\n"
+        "        <h1>Directory listing</h1>\n"
+        "        <ul>\n";
+}
+
+static void render_item(
+    std::string &out,
+    const listing_cache::listing &entries,
+    const page &view,
+    size_t i
+) {
+    std::string_view name = entries.name(i);
+    bool is_directory = entries.items[i].directory;
+    if (view.format == FORMAT::JSON) {
+        if (i != view.first) {
+            out += ',';
+        }
+        out += "{\"name\":\"";
+        json_escape(out, name);
+        out += is_directory ?
+            "\",\"type\":\"directory\"}" : "\",\"type\":\"file\"}";
+        return;
+    }
+    const char *slash = is_directory ? "/" : "";
+    out +=
+        "            <li>\n"
+        "                <a href=\"";
+    append_url_encoded(out, name);
+    out += slash;
+    out += "\">";
+    html_escape(out, name);
+    out += slash;
+    out +=
+        "</a>\n"
+        "            </li>\n";
+}
+
+static void render_tail(
+    std::string &out,
+    const listing_cache::listing &entries,
+    const page &view
+) {
+    if (view.format == FORMAT::JSON) {
+        out += "]}\n";
+        return;
+    }
+    out += "        </ul>\n";
+    if (view.limit && (view.first || view.last != entries.items.size())) {
+        out += "        <p>\n";
+        if (view.first) {
+            out +=
+                "            <a href=\"" +
+                page_link(view, view.first - std::min(view.first, view.limit)) +
+                "\">Previous</a>\n";
+        }
+        if (view.last != entries.items.size()) {
+            out +=
+                "            <a href=\"" + page_link(view, view.last) +
+                "\">Next</a>\n";
+        }
+        out += "        </p>\n";
+    }
+    out +=
+        "    </body>\n"
+        "</html>\n";
+}
+
+class listing_stream : public body_stream {
+public:
+    listing_stream(
+        std::shared_ptr<const listing_cache::listing> entries,
+        const page &view,
+        std::string head,
+        bool chunked
+    ) :
+        entries(std::move(entries)),
+        view(view),
+        head(std::move(head)),
+        next(view.first),
+        chunked(chunked) {
+    }
+
+    int descriptor() const override {
+        return -1;
+    }
+
+    STREAM produce(std::string &out) override {
+        std::string piece;
+        if (head.size()) {
+            out = std::move(head);
+            head.clear();
+            render_head(piece, *entries, view);
+        }
+        while (next != view.last && piece.size() < PIECE_SIZE) {
+            render_item(piece, *entries, view, next++);
+        }
+        bool done = next == view.last;
+        if (done) {
+            render_tail(piece, *entries, view);
+        }
+        if (chunked) {
+            char length[32];
+            snprintf(length, sizeof(length), "%zx\r\n", piece.size());
+            out += length;
+            out += piece;
+            out += done ? "\r\n0\r\n\r\n" : "\r\n";
+        } else {
+            out += piece;
+        }
+        return done ? STREAM::DONE : STREAM::MORE;
+    }
+
+private:
+    std::shared_ptr<const listing_cache::listing> entries;
+    page view;
+    std::string head;
+    size_t next;
+    bool chunked;
+};
+
+response generate_listing(
+    listing_cache &cache,
+    const std::string &directory,
+    const request &message,
+    bool keep_alive,
+    std::pmr::memory_resource *memory
+) {
+    struct stat info;
+    if (access(directory.c_str(), R_OK) || stat(directory.c_str(), &info)) {
+        return generate_error(403, "", keep_alive);
+    }
+    page view;
+    if (!parse_page(message.query, view)) {
+        return generate_error(400, "", keep_alive);
+    }
+    std::pmr::string record = validators(info, memory);
+    if (is_fresh(info, message.if_none_match, message.if_modified_since)) {
+        return not_modified(record, keep_alive);
+    }
+    std::shared_ptr<const listing_cache::listing> entries =
+        cache.get(directory, info);
+    if (entries == nullptr) {
+        return generate_error(403, "", keep_alive);
+    }
+    size_t total = entries->items.size();
+    view.first = std::min(view.offset, total);
+    view.last = view.limit ?
+        view.first + std::min(view.limit, total - view.first) : total;
+    std::string_view type =
+        view.format == FORMAT::JSON ? "application/json" : "text/html";
+    if (view.last - view.first <= INLINE_ITEMS) {
+        // The body is rendered straight into the response buffer and the
+        // header, whose length depends on it, is put in front afterwards.
+        response answer;
+        render_head(answer.data, *entries, view);
+        for (size_t i = view.first; i != view.last; ++i) {
+            render_item(answer.data, *entries, view, i);
+        }
+        render_tail(answer.data, *entries, view);
+        std::pmr::string head(memory);
+        append_header(head, 200, record, type, answer.data.size(), keep_alive);
+        answer.data.insert(0, head);
+        return answer;
+    }
+    bool chunked = message.version == "HTTP/1.1";
+    response answer;
+    answer.close = !keep_alive || !chunked;
+    std::pmr::string fields(memory);
+    fields += "Content-Type: ";
+    fields += type;
+    fields += '\n';
+    fields += record;
+    if (chunked) {
+        fields += "Transfer-Encoding: chunked\n";
+    }
+    answer.stream.reset(new listing_stream(
+        entries,
+        view,
+        status_header("200 OK", fields, !answer.close),
+        chunked
+    ));
+    return answer;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+extern "C" {
+#include <sys/stat.h>
+}
+
+#include "answer_generator.hpp"
+
+struct request;
+
+class listing_cache {
+public:
+    struct item {
+        size_t start;
+        size_t length;
+        bool directory;
+    };
+
+    struct listing {
+        std::string directory;
+        struct stat info;
+        std::string names;
+        std::vector<item> items;
+
+        std::string_view name(size_t i) const;
+    };
+
+    explicit listing_cache(size_t capacity);
+    listing_cache(const listing_cache &) = delete;
+    listing_cache &operator=(const listing_cache &) = delete;
+
+    std::shared_ptr<const listing> get(
+        const std::string &directory,
+        const struct stat &info
+    );
+
+private:
+    void evict();
+
+    size_t capacity;
+    size_t used;
+    std::list<std::shared_ptr<const listing>> entries;
+    std::unordered_map<
+        std::string,
+        std::list<std::shared_ptr<const listing>>::iterator
+    > index;
+};
+
+response generate_listing(
+    listing_cache &cache,
+    const std::string &directory,
+    const request &message,
+    bool keep_alive,
+    std::pmr::memory_resource *memory
+);
@@ -0,0 +1,318 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <thread>
+
+extern "C" {
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <unistd.h>
+}
+
+#include "common.hpp"
+#include "logger.hpp"
+
+static constexpr size_t RING_SIZE = 4096;
+static constexpr size_t MAX_RINGS = 256;
+static constexpr size_t BATCH = 128;
+static constexpr int FLUSH_INTERVAL = 100;
+static constexpr int STOP_TIMEOUT = 1000;
+static constexpr size_t PREFIX_SIZE = 80;
+static constexpr size_t SUFFIX_SIZE = 64;
+
+// Single producer (one worker thread), single consumer (the log writer).
+class access_ring {
+public:
+    access_ring() :
+        head(0),
+        tail(0),
+        dropped(0) {
+    }
+
+    // Returns true when the ring has just become half full and the writer
+    // should be woken before its regular flush interval.
+    bool push(const access_record &record) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        size_t h = head.load(std::memory_order_acquire);
+        if (t - h == RING_SIZE) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        slots[t % RING_SIZE] = record;
+        tail.store(t + 1, std::memory_order_release);
+        return t - h + 1 == RING_SIZE / 2;
+    }
+
+    size_t pop(access_record *out, size_t limit) {
+        size_t h = head.load(std::memory_order_relaxed);
+        size_t t = tail.load(std::memory_order_acquire);
+        size_t count = std::min(t - h, limit);
+        for (size_t i = 0; i != count; ++i) {
+            out[i] = slots[(h + i) % RING_SIZE];
+        }
+        head.store(h + count, std::memory_order_release);
+        return count;
+    }
+
+    uint64_t take_dropped() {
+        return dropped.exchange(0, std::memory_order_relaxed);
+    }
+
+private:
+    alignas(64) std::atomic<size_t> head;
+    alignas(64) std::atomic<size_t> tail;
+    std::atomic<uint64_t> dropped;
+    access_record slots[RING_SIZE];
+};
+
+static int log_fd = -1;
+static char log_path[PATH_MAX];
+static int wake_fd = -1;
+static int done_fd = -1;
+static bool threaded = false;
+static std::atomic<bool> stopping(false);
+static std::mutex rings_mutex;
+static access_ring *rings[MAX_RINGS];
+static std::atomic<size_t> ring_count(0);
+static std::atomic<uint64_t> dropped_total(0);
+static thread_local access_ring *local_ring = nullptr;
+static thread_local bool attached = false;
+
+access_record::access_record() :
+    time(0),
+    started(0),
+    queued(0),
+    duration(0),
+    status(0),
+    bytes(0),
+    length(0) {
+    address.s_addr = 0;
+}
+
+static size_t format_prefix(char *out, const access_record &record) {
+    char client[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &record.address, client, sizeof(client));
+    struct tm parts;
+    gmtime_r(&record.time, &parts);
+    char date[32];
+    strftime(date, sizeof(date), "%d/%b/%Y:%H:%M:%S +0000", &parts);
+    int size = snprintf(out, PREFIX_SIZE, "%s - - [%s] \"", client, date);
+    return std::min((size_t) size, PREFIX_SIZE - 1);
+}
+
+static size_t format_suffix(char *out, const access_record &record) {
+    int size = snprintf(
+        out,
+        SUFFIX_SIZE,
+        "\" %d %llu %lld\n",
+        record.status,
+        (unsigned long long) record.bytes,
+        (long long) record.duration
+    );
+    return std::min((size_t) size, SUFFIX_SIZE - 1);
+}
+
+static void write_all(struct iovec *parts, int count) {
+    while (count) {
+        ssize_t bytes = writev(log_fd, parts, std::min(count, IOV_MAX));
+        if (bytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Error: writev() failed: %d\n", errno);
+            return;
+        }
+        while (count && (size_t) bytes >= parts->iov_len) {
+            bytes -= parts->iov_len;
+            ++parts;
+            --count;
+        }
+        if (count) {
+            parts->iov_base = (char *) parts->iov_base + bytes;
+            parts->iov_len -= bytes;
+        }
+    }
+}
+
+static void flush(const access_record *batch, size_t count) {
+    static char prefixes[BATCH][PREFIX_SIZE];
+    static char suffixes[BATCH][SUFFIX_SIZE];
+    static struct iovec parts[3 * BATCH];
+    for (size_t i = 0; i != count; ++i) {
+        parts[3 * i].iov_base = prefixes[i];
+        parts[3 * i].iov_len = format_prefix(prefixes[i], batch[i]);
+        parts[3 * i + 1].iov_base = (void *) batch[i].line;
+        parts[3 * i + 1].iov_len = batch[i].length;
+        parts[3 * i + 2].iov_base = suffixes[i];
+        parts[3 * i + 2].iov_len = format_suffix(suffixes[i], batch[i]);
+    }
+    write_all(parts, 3 * count);
+}
+
+static void write_direct(const access_record &record) {
+    char buffer[PREFIX_SIZE + access_record::LINE_LIMIT + SUFFIX_SIZE];
+    size_t size = format_prefix(buffer, record);
+    memcpy(buffer + size, record.line, record.length);
+    size += record.length;
+    size += format_suffix(buffer + size, record);
+    struct iovec part = {buffer, size};
+    write_all(&part, 1);
+}
+
+// A failed write means the counter is at its maximum, with a wakeup
+// pending anyway.
+static void notify(int fd) {
+    uint64_t one = 1;
+    if (write(fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+        fprintf(stderr, "Error: write() failed: %d\n", errno);
+    }
+}
+
+static void drain() {
+    static access_record batch[BATCH];
+    size_t start = 0;
+    for (;;) {
+        struct pollfd wake = {wake_fd, POLLIN, 0};
+        if (poll(&wake, 1, FLUSH_INTERVAL) == 1) {
+            uint64_t value;
+            if (read(wake_fd, &value, sizeof(value)) == -1 &&
+                errno != EAGAIN) {
+                fprintf(stderr, "Error: read() failed: %d\n", errno);
+            }
+        }
+        bool last = stopping.load(std::memory_order_acquire);
+        size_t total = ring_count.load(std::memory_order_acquire);
+        for (;;) {
+            size_t count = 0;
+            for (size_t i = 0; i != total && count != BATCH; ++i) {
+                access_ring *ring = rings[(start + i) % total];
+                count += ring->pop(batch + count, BATCH - count);
+            }
+            if (total) {
+                start = (start + 1) % total;
+            }
+            if (count == 0) {
+                break;
+            }
+            flush(batch, count);
+        }
+        uint64_t lost = 0;
+        for (size_t i = 0; i != total; ++i) {
+            lost += rings[i]->take_dropped();
+        }
+        if (lost) {
+            dropped_total.fetch_add(lost, std::memory_order_relaxed);
+            fprintf(
+                stderr,
+                "Warning: access log dropped %llu records\n",
+                (unsigned long long) lost
+            );
+        }
+        if (last) {
+            notify(done_fd);
+            return;
+        }
+    }
+}
+
+static access_ring *attach() {
+    std::lock_guard<std::mutex> lock(rings_mutex);
+    size_t count = ring_count.load(std::memory_order_relaxed);
+    if (count == MAX_RINGS) {
+        return nullptr;
+    }
+    rings[count] = new access_ring;
+    ring_count.store(count + 1, std::memory_order_release);
+    return rings[count];
+}
+
+bool open_access_log(const std::string &path) {
+    if (path.size() >= sizeof(log_path)) {
+        return false;
+    }
+    int fd = open(
+        path.c_str(),
+        O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+        0644
+    );
+    if (fd == -1) {
+        return false;
+    }
+    if (log_fd != -1) {
+        close(log_fd);
+    }
+    log_fd = fd;
+    strcpy(log_path, path.c_str());
+    return true;
+}
+
+// Called from the SIGHUP handler, so only async-signal-safe calls are used:
+// the new file replaces the old one under the same descriptor number.
+void reopen_access_log() {
+    int saved = errno;
+    int fd = open(log_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (fd != -1) {
+        dup3(fd, log_fd, O_CLOEXEC);
+        close(fd);
+    }
+    errno = saved;
+}
+
+void start_access_log() {
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd == -1 || done_fd == -1) {
+        fprintf(stderr, "Error: eventfd() failed: %d\n", errno);
+        return;
+    }
+    threaded = true;
+    // Signals are left to the other threads, so stop_access_log() never
+    // runs on the writer and waits for itself.
+    sigset_t all, saved;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &saved);
+    std::thread(drain).detach();
+    pthread_sigmask(SIG_SETMASK, &saved, nullptr);
+}
+
+void log_access(const access_record &record) {
+    if (threaded) {
+        if (!attached) {
+            local_ring = attach();
+            attached = true;
+        }
+        if (local_ring != nullptr) {
+            if (local_ring->push(record)) {
+                notify(wake_fd);
+            }
+            return;
+        }
+    }
+    write_direct(record);
+}
+
+// Called from the handler of SIGTERM and SIGINT before exit(): the writer
+// is woken to write out what the rings hold, which it does before it looks
+// at stopping, and the handler waits for that a limited time.
+void stop_access_log() {
+    if (!threaded) {
+        return;
+    }
+    stopping.store(true, std::memory_order_release);
+    notify(wake_fd);
+    struct pollfd done = {done_fd, POLLIN, 0};
+    while (poll(&done, 1, STOP_TIMEOUT) == -1 && errno == EINTR) {
+    }
+}
+
+uint64_t access_log_dropped() {
+    return dropped_total.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <string>
+
+extern "C" {
+#include <netinet/in.h>
+}
+
+struct access_record {
+    static constexpr size_t LINE_LIMIT = 256;
+
+    access_record();
+
+    time_t time;
+    struct in_addr address;
+    int64_t started;
+    int64_t queued;
+    int64_t duration;
+    int status;
+    uint64_t bytes;
+    size_t length;
+    char line[LINE_LIMIT];
+};
+
+bool open_access_log(const std::string &path);
+void reopen_access_log();
+void start_access_log();
+void log_access(const access_record &record);
+// Writes out the records still waiting in the rings; async-signal-safe.
+void stop_access_log();
+uint64_t access_log_dropped();
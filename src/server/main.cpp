@@ -2,7 +2,9 @@
 #include <csignal>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <string>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
@@ -12,94 +14,123 @@ extern "C" {
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <unistd.h>
 }
 
 #include "common.hpp"
-#include "query_parser.hpp"
-#include "answer_generator.hpp"
+#include "admission.hpp"
+#include "cgi.hpp"
 #include "config_reader.hpp"
+#include "fastcgi.hpp"
+#include "logger.hpp"
+#include "metrics.hpp"
+#include "uring.hpp"
+#include "worker.hpp"
 
-static int listen_socket;
+static int listen_socket = -1;
+// Clients of the children of the fork engine, by pid.
+static std::unordered_map<pid_t, struct in_addr> children;
 
 static void termination_handler(int signal) {
     fprintf(stderr, "\nServer stopped (signal %d)\n", signal);
-    close(listen_socket);
+    if (listen_socket != -1) {
+        close(listen_socket);
+    }
+    stop_fastcgi();
+    stop_access_log();
     exit(0);
 }
 
+static void rotation_handler(int) {
+    reopen_access_log();
+}
+
+// Only there to interrupt accept(), so that children are collected soon.
+static void child_handler(int) {
+}
+
+// Gives back the connections of the children that are gone, whether they
+// exited or were killed. They stay zombies until then, so their pids
+// can't belong to other children yet.
+static void collect_children() {
+    int saved = errno;
+    for (;;) {
+        pid_t pid = waitpid(-1, nullptr, WNOHANG);
+        if (pid <= 0) {
+            errno = saved;
+            return;
+        }
+        auto found = children.find(pid);
+        if (found != children.end()) {
+            release(found->second);
+            children.erase(found);
+        }
+    }
+}
+
 static void process_connection(
     int connection_socket,
-    struct sockaddr_in *client_address,
-    uint16_t port,
-    FILE *log,
-    const std::string &chroot
+    struct sockaddr_in *client_address
 ) {
-    if (fork() == 0) {
-        std::string buffer;
-        buffer.resize(BUFFER_SIZE);
-        std::string message;
-        if (connection_socket == -1) {
+    collect_children();
+    if (connection_socket == -1) {
+        if (errno != EINTR && errno != ECONNABORTED) {
             fprintf(stderr, "Error: accept() failed: %d\n", errno);
-        } else {
-            ssize_t bytes = read(connection_socket, &buffer[0], BUFFER_SIZE);
-            if (bytes == -1) {
-                message = generate_error(404, "");
-            } else if (bytes == BUFFER_SIZE) {
-                message = generate_error(431, "");
-            } else {
-                buffer.resize(bytes);
-                std::string method, version, resource, query;
-                std::string first = buffer.substr(0, buffer.find('\n'));
-                time_t now = time(nullptr);
-                fprintf(
-                    log,
-                    "%s%s\n%s\n",
-                    ctime(&now),
-                    inet_ntoa(client_address->sin_addr),
-                    first.c_str()
-                );
-                fflush(log);
-                if (!parse_method(first, method, version, resource, query)) {
-                    message = generate_error(400, "");
-                } else {
-                    if (resource == "") {
-                        message = generate_listing("./");
-                    } else if (file_type(resource) == STAT::REGULAR) {
-                        message = from_file(resource, port, query, chroot);
-                    } else if (file_type(resource) == STAT::DIRECTORY) {
-                        if (resource[resource.size() - 1] != '/') {
-                            message = generate_error(
-                                301,
-                                "Location: /" + resource + "/\n"
-                            );
-                        } else {
-                            message = generate_listing(resource);
-                        }
-                    } else {
-                        message = generate_error( 404, "");
-                    }
-                }
-            }
-            if (write(
-                connection_socket,
-                message.c_str(),
-                message.size()) == -1
-            ) {
-                fprintf(stderr, "Error: write() failed: %d\n", errno);
-            }
         }
+        return;
+    }
+    int status = admit(client_address->sin_addr);
+    if (status) {
+        refuse(connection_socket, status);
+        return;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        signal(SIGCHLD, SIG_IGN);
+        leave_admission();
         close(listen_socket);
+        serve_connection(connection_socket, *client_address);
         exit(0);
     }
+    if (pid == -1) {
+        fprintf(stderr, "Error: fork() failed: %d\n", errno);
+        release(client_address->sin_addr);
+    } else {
+        children.emplace(pid, client_address->sin_addr);
+    }
+    close(connection_socket);
+}
+
+static int run_forking() {
+    listen_socket = create_listener(settings.port, false);
+    if (listen_socket == -1) {
+        return 1;
+    }
+    // Children are reaped here instead of by the kernel, so that their
+    // connections are given back even if they die.
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = child_handler;
+    action.sa_flags = SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &action, nullptr);
+    fprintf(stderr, "Server started on port %d\n\n", settings.port);
+    for (;;) {
+        struct sockaddr_in client_address;
+        socklen_t client_address_length = sizeof(client_address);
+        int connection_socket = accept4(
+            listen_socket,
+            (struct sockaddr *) &client_address,
+            &client_address_length,
+            SOCK_NONBLOCK | SOCK_CLOEXEC
+        );
+        process_connection(connection_socket, &client_address);
+    }
 }
 
 int main(int argc, char *argv[]) {
-    uint16_t port;
-    std::string chroot;
-    FILE *log = nullptr;
     bool port_set = false, home_set = false, log_set = false;
-    struct sockaddr_in server_address;
+    bool valid = true;
     if (argc != 2) {
         fprintf(stderr, "Error: usage: " PROJECT_NAME " config_file\n");
         return 1;
@@ -108,7 +139,7 @@ int main(int argc, char *argv[]) {
     read_config(argv[1]);
     for (const std::pair<std::string, std::string> &p : config) {
         if (p.first == "port") {
-            if (from_string(p.second, &port)) {
+            if (from_string(p.second, &settings.port)) {
                 port_set = true;
             }
         } else if (p.first == "home") {
@@ -116,56 +147,185 @@ int main(int argc, char *argv[]) {
                 home_set = true;
             }
         } else if (p.first == "log") {
-            log = fopen(p.second.c_str(), "a");
-            if (log != nullptr) {
+            settings.log = p.second;
+            if (open_access_log(settings.log)) {
                 log_set = true;
             }
         } else if (p.first == "chroot") {
-            chroot = p.second;
+            settings.chroot = p.second;
+        } else if (p.first == "engine") {
+            if (p.second == "fork") {
+                settings.engine = ENGINE::FORK;
+            } else if (p.second == "epoll") {
+                settings.engine = ENGINE::EPOLL;
+            } else if (p.second == "uring") {
+                settings.engine = ENGINE::URING;
+            } else {
+                valid = false;
+            }
+        } else if (p.first == "workers") {
+            if (!from_string(p.second, &settings.workers)) {
+                valid = false;
+            }
+        } else if (p.first == "keepalive_timeout") {
+            if (!from_string(p.second, &settings.keepalive_timeout)) {
+                valid = false;
+            }
+        } else if (p.first == "header_timeout") {
+            if (!from_string(p.second, &settings.header_timeout)) {
+                valid = false;
+            }
+        } else if (p.first == "send_timeout") {
+            if (!from_string(p.second, &settings.send_timeout)) {
+                valid = false;
+            }
+        } else if (p.first == "body_timeout") {
+            if (!from_string(p.second, &settings.body_timeout)) {
+                valid = false;
+            }
+        } else if (p.first == "cgi_timeout") {
+            if (!from_string(p.second, &settings.cgi_timeout)) {
+                valid = false;
+            }
+        } else if (p.first == "max_cgi_processes") {
+            if (!from_string(p.second, &settings.max_cgi_processes)) {
+                valid = false;
+            }
+        } else if (p.first == "cgi_cpu_limit") {
+            if (!from_string(p.second, &settings.cgi_cpu_limit)) {
+                valid = false;
+            }
+        } else if (p.first == "cgi_memory_limit") {
+            if (!from_string(p.second, &settings.cgi_memory_limit)) {
+                valid = false;
+            }
+        } else if (p.first == "cgi_cgroup") {
+            settings.cgi_cgroup = p.second;
+        } else if (p.first == "keepalive_requests") {
+            if (!from_string(p.second, &settings.keepalive_requests)) {
+                valid = false;
+            }
+        } else if (p.first == "max_request_line") {
+            if (!from_string(p.second, &settings.max_request_line)) {
+                valid = false;
+            }
+        } else if (p.first == "max_header_size") {
+            if (!from_string(p.second, &settings.max_header_size)) {
+                valid = false;
+            }
+        } else if (p.first == "max_body_size") {
+            if (!from_string(p.second, &settings.max_body_size)) {
+                valid = false;
+            }
+        } else if (p.first == "fastcgi") {
+            if (!add_fastcgi(p.second)) {
+                valid = false;
+            }
+        } else if (p.first == "mime") {
+            if (!add_mime_type(p.second)) {
+                valid = false;
+            }
+        } else if (p.first == "fastcgi_sockets") {
+            settings.fastcgi_sockets = p.second;
+        } else if (p.first == "cache_size") {
+            if (!from_string(p.second, &settings.cache_size)) {
+                valid = false;
+            }
+        } else if (p.first == "cache_file_size") {
+            if (!from_string(p.second, &settings.cache_file_size)) {
+                valid = false;
+            }
+        } else if (p.first == "metrics_port") {
+            if (!from_string(p.second, &settings.metrics_port)) {
+                valid = false;
+            }
+        } else if (p.first == "open_file_cache") {
+            if (!from_string(p.second, &settings.open_file_cache)) {
+                valid = false;
+            }
+        } else if (p.first == "listing_cache_size") {
+            if (!from_string(p.second, &settings.listing_cache_size)) {
+                valid = false;
+            }
+        } else if (p.first == "gzip_static") {
+            if (!from_string(p.second, &settings.gzip_static)) {
+                valid = false;
+            }
+        } else if (p.first == "gzip_cache_size") {
+            if (!from_string(p.second, &settings.gzip_cache_size)) {
+                valid = false;
+            }
+        } else if (p.first == "gzip_file_size") {
+            if (!from_string(p.second, &settings.gzip_file_size)) {
+                valid = false;
+            }
+        } else if (p.first == "http2") {
+            if (!from_string(p.second, &settings.http2)) {
+                valid = false;
+            }
+        } else if (p.first == "http2_streams") {
+            if (!from_string(p.second, &settings.http2_streams) ||
+                settings.http2_streams == 0) {
+                valid = false;
+            }
+        } else if (p.first == "backlog") {
+            if (!from_string(p.second, &settings.backlog)) {
+                valid = false;
+            }
+        } else if (p.first == "defer_accept") {
+            if (!from_string(p.second, &settings.defer_accept)) {
+                valid = false;
+            }
+        } else if (p.first == "max_connections") {
+            if (!from_string(p.second, &settings.max_connections)) {
+                valid = false;
+            }
+        } else if (p.first == "max_client_connections") {
+            if (!from_string(p.second, &settings.max_client_connections)) {
+                valid = false;
+            }
         }
     }
-    if (!port_set || !home_set || !log_set) {
+    if (!port_set || !home_set || !log_set || !valid) {
         fprintf(stderr, "Error: config file invalid\n");
         return 1;
     }
-    listen_socket = socket(AF_INET, SOCK_STREAM, 0);
-    int value = 1;
-    setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &value, sizeof(value));
-    if (listen_socket == -1) {
-        fprintf(stderr, "Error: socket() failed: %d\n", errno);
-        return 1;
-    }
-    server_address.sin_family = AF_INET;
-    server_address.sin_port = htons(port);
-    server_address.sin_addr.s_addr = htonl(INADDR_ANY);
-    if (bind(
-            listen_socket,
-            (struct sockaddr *) &server_address,
-            sizeof(server_address)
-        ) == -1
-    ) {
-        fprintf(stderr, "Error: bind() failed: %d\n", errno);
+    if (settings.chroot.size() && fastcgi_spawns()) {
+        fprintf(stderr, "Error: FastCGI applications can't be spawned with "
+            "chroot, give the sockets of running ones instead\n");
         return 1;
     }
-    listen(listen_socket, 1);
-    fprintf(stderr, "Server started on port %d\n\n", port);
     signal(SIGINT, termination_handler);
     signal(SIGTERM, termination_handler);
     signal(SIGCHLD, SIG_IGN);
-    for (;;) {
-        struct sockaddr_in client_address;
-        socklen_t client_address_length = sizeof(client_address);
-        int connection_socket = accept(
-            listen_socket,
-            (struct sockaddr *) &client_address,
-            &client_address_length
-        );
-        process_connection(
-            connection_socket,
-            &client_address,
-            port,
-            log,
-            chroot
-        );
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGHUP, rotation_handler);
+    if (!init_admission(
+            settings.max_connections,
+            settings.max_client_connections
+        )
+    ) {
+        return 1;
+    }
+    if (!init_cgi_limits()) {
+        return 1;
+    }
+    if (settings.chroot.size() && !start_sandbox(settings.chroot)) {
+        return 1;
+    }
+    if (!start_fastcgi(settings.fastcgi_sockets)) {
+        return 1;
+    }
+    if (settings.metrics_port &&
+        (!init_metrics() || !start_metrics(settings.metrics_port))) {
+        return 1;
+    }
+    if (settings.engine == ENGINE::FORK) {
+        return run_forking();
+    }
+    if (settings.engine == ENGINE::URING && !uring_supported()) {
+        fprintf(stderr, "Warning: io_uring is not available, using epoll\n");
+        settings.engine = ENGINE::EPOLL;
     }
+    return run_workers(settings.workers) ? 0 : 1;
 }
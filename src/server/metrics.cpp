@@ -0,0 +1,357 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <new>
+#include <thread>
+
+extern "C" {
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+}
+
+#include "common.hpp"
+#include "answer_generator.hpp"
+#include "logger.hpp"
+#include "metrics.hpp"
+
+// Log-linear buckets in the spirit of HdrHistogram: values below
+// SUB_BUCKETS microseconds are exact, above that every power of two is split
+// into SUB_BUCKETS equal parts, which keeps the relative error under 12.5%.
+static constexpr int SUB_BITS = 3;
+static constexpr int SUB_BUCKETS = 1 << SUB_BITS;
+static constexpr int MAX_EXPONENT = 35;
+static constexpr int BUCKETS = (MAX_EXPONENT - SUB_BITS + 2) * SUB_BUCKETS;
+static constexpr int EXPORTED_EXPONENT = 25;
+static constexpr int MIN_STATUS = 100;
+static constexpr int MAX_STATUS = 600;
+static constexpr unsigned MAX_SHARDS = 64;
+
+static const char *const stage_names[] = {
+    "accept",
+    "parse",
+    "lookup",
+    "handler",
+    "send",
+    "cgi_spawn",
+    "cgi_run",
+    "fastcgi"
+};
+
+static_assert(
+    sizeof(stage_names) / sizeof(stage_names[0]) == (size_t) STAGE::COUNT,
+    "every stage needs a name"
+);
+
+struct histogram {
+    std::atomic<uint64_t> counts[BUCKETS];
+    std::atomic<uint64_t> sum;
+};
+
+// Each worker thread (or forked child) writes to its own shard, so the
+// counters are uncontended; the exporter adds the shards up when scraped.
+struct shard {
+    histogram stages[(size_t) STAGE::COUNT];
+    std::atomic<uint64_t> responses[MAX_STATUS - MIN_STATUS];
+    std::atomic<uint64_t> bytes;
+    std::atomic<int64_t> connections;
+    std::atomic<uint64_t> cgi_timeouts;
+};
+
+struct metrics_area {
+    std::atomic<unsigned> claimed;
+    shard shards[MAX_SHARDS];
+};
+
+static metrics_area *area = nullptr;
+static thread_local shard *local = nullptr;
+
+static int bucket(uint64_t value) {
+    if (value < (uint64_t) SUB_BUCKETS) {
+        return value;
+    }
+    int exponent = 63 - __builtin_clzll(value);
+    if (exponent > MAX_EXPONENT) {
+        return BUCKETS - 1;
+    }
+    int sub = (value >> (exponent - SUB_BITS)) & (SUB_BUCKETS - 1);
+    return (exponent - SUB_BITS + 1) * SUB_BUCKETS + sub;
+}
+
+static uint64_t lower_bound(int index) {
+    if (index < SUB_BUCKETS) {
+        return index;
+    }
+    int exponent = index / SUB_BUCKETS + SUB_BITS - 1;
+    uint64_t sub = index % SUB_BUCKETS;
+    return (SUB_BUCKETS + sub) << (exponent - SUB_BITS);
+}
+
+static shard *current() {
+    if (local == nullptr) {
+        unsigned index = area->claimed.fetch_add(1, std::memory_order_relaxed);
+        local = &area->shards[index < MAX_SHARDS ? index : 0];
+    }
+    return local;
+}
+
+bool init_metrics() {
+    // Shared so that the children of the fork engine report into the same
+    // counters as the parent that serves the endpoint.
+    void *memory = mmap(
+        nullptr,
+        sizeof(metrics_area),
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS,
+        -1,
+        0
+    );
+    if (memory == MAP_FAILED) {
+        fprintf(stderr, "Error: mmap() failed: %d\n", errno);
+        return false;
+    }
+    area = new (memory) metrics_area;
+    return true;
+}
+
+void record_stage(STAGE stage, int64_t microseconds) {
+    if (area == nullptr) {
+        return;
+    }
+    histogram &h = current()->stages[(size_t) stage];
+    uint64_t value = microseconds < 0 ? 0 : microseconds;
+    h.counts[bucket(value)].fetch_add(1, std::memory_order_relaxed);
+    h.sum.fetch_add(value, std::memory_order_relaxed);
+}
+
+void count_response(int status, uint64_t bytes) {
+    if (area == nullptr) {
+        return;
+    }
+    shard *s = current();
+    if (status >= MIN_STATUS && status < MAX_STATUS) {
+        s->responses[status - MIN_STATUS].fetch_add(
+            1,
+            std::memory_order_relaxed
+        );
+    }
+    s->bytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void count_connection(int delta) {
+    if (area == nullptr) {
+        return;
+    }
+    current()->connections.fetch_add(delta, std::memory_order_relaxed);
+}
+
+void count_cgi_timeout() {
+    if (area == nullptr) {
+        return;
+    }
+    current()->cgi_timeouts.fetch_add(1, std::memory_order_relaxed);
+}
+
+static void append(std::string &out, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void append(std::string &out, const char *format, ...) {
+    char line[1024];
+    va_list arguments;
+    va_start(arguments, format);
+    int size = vsnprintf(line, sizeof(line), format, arguments);
+    va_end(arguments);
+    if (size > 0) {
+        out.append(line, std::min((size_t) size, sizeof(line) - 1));
+    }
+}
+
+std::string render_metrics() {
+    std::string out;
+    if (area == nullptr) {
+        return out;
+    }
+    unsigned shards = std::min(
+        area->claimed.load(std::memory_order_relaxed),
+        MAX_SHARDS
+    );
+    append(
+        out,
+        "# HELP " PROJECT_NAME "_stage_duration_seconds "
+        "Time spent in each stage of request processing.\n"
+        "# TYPE " PROJECT_NAME "_stage_duration_seconds histogram\n"
+    );
+    for (size_t stage = 0; stage != (size_t) STAGE::COUNT; ++stage) {
+        uint64_t counts[BUCKETS] = {};
+        uint64_t sum = 0;
+        for (unsigned i = 0; i != shards; ++i) {
+            const histogram &h = area->shards[i].stages[stage];
+            for (int b = 0; b != BUCKETS; ++b) {
+                counts[b] += h.counts[b].load(std::memory_order_relaxed);
+            }
+            sum += h.sum.load(std::memory_order_relaxed);
+        }
+        uint64_t cumulative = 0;
+        int b = 0;
+        for (int exponent = 0; exponent <= EXPORTED_EXPONENT; ++exponent) {
+            uint64_t limit = (uint64_t) 1 << exponent;
+            while (b != BUCKETS && lower_bound(b) < limit) {
+                cumulative += counts[b++];
+            }
+            append(
+                out,
+                PROJECT_NAME "_stage_duration_seconds_bucket"
+                "{stage=\"%s\",le=\"%.9g\"} %llu\n",
+                stage_names[stage],
+                limit / 1e6,
+                (unsigned long long) cumulative
+            );
+        }
+        while (b != BUCKETS) {
+            cumulative += counts[b++];
+        }
+        append(
+            out,
+            PROJECT_NAME "_stage_duration_seconds_bucket"
+            "{stage=\"%s\",le=\"+Inf\"} %llu\n"
+            PROJECT_NAME "_stage_duration_seconds_sum{stage=\"%s\"} %.6f\n"
+            PROJECT_NAME "_stage_duration_seconds_count{stage=\"%s\"} %llu\n",
+            stage_names[stage],
+            (unsigned long long) cumulative,
+            stage_names[stage],
+            sum / 1e6,
+            stage_names[stage],
+            (unsigned long long) cumulative
+        );
+    }
+    append(
+        out,
+        "# HELP " PROJECT_NAME "_responses_total "
+        "Responses sent, by status code.\n"
+        "# TYPE " PROJECT_NAME "_responses_total counter\n"
+    );
+    for (int status = MIN_STATUS; status != MAX_STATUS; ++status) {
+        uint64_t count = 0;
+        for (unsigned i = 0; i != shards; ++i) {
+            count += area->shards[i].responses[status - MIN_STATUS].load(
+                std::memory_order_relaxed
+            );
+        }
+        if (count) {
+            append(
+                out,
+                PROJECT_NAME "_responses_total{code=\"%d\"} %llu\n",
+                status,
+                (unsigned long long) count
+            );
+        }
+    }
+    uint64_t bytes = 0, cgi_timeouts = 0;
+    int64_t connections = 0;
+    for (unsigned i = 0; i != shards; ++i) {
+        const shard &s = area->shards[i];
+        bytes += s.bytes.load(std::memory_order_relaxed);
+        connections += s.connections.load(std::memory_order_relaxed);
+        cgi_timeouts += s.cgi_timeouts.load(std::memory_order_relaxed);
+    }
+    append(
+        out,
+        "# HELP " PROJECT_NAME "_sent_bytes_total "
+        "Bytes written to client sockets.\n"
+        "# TYPE " PROJECT_NAME "_sent_bytes_total counter\n"
+        PROJECT_NAME "_sent_bytes_total %llu\n"
+        "# HELP " PROJECT_NAME "_connections_active "
+        "Client connections currently open.\n"
+        "# TYPE " PROJECT_NAME "_connections_active gauge\n"
+        PROJECT_NAME "_connections_active %lld\n",
+        (unsigned long long) bytes,
+        (long long) connections
+    );
+    append(
+        out,
+        "# HELP " PROJECT_NAME "_cgi_timeouts_total "
+        "CGI and FastCGI requests killed after cgi_timeout.\n"
+        "# TYPE " PROJECT_NAME "_cgi_timeouts_total counter\n"
+        PROJECT_NAME "_cgi_timeouts_total %llu\n"
+        "# HELP " PROJECT_NAME "_access_log_dropped_total "
+        "Access log records dropped because the logger fell behind.\n"
+        "# TYPE " PROJECT_NAME "_access_log_dropped_total counter\n"
+        PROJECT_NAME "_access_log_dropped_total %llu\n",
+        (unsigned long long) cgi_timeouts,
+        (unsigned long long) access_log_dropped()
+    );
+    return out;
+}
+
+static void serve_metrics(int listen_socket) {
+    for (;;) {
+        int client = accept4(listen_socket, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client == -1) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                fprintf(stderr, "Error: accept() failed: %d\n", errno);
+            }
+            continue;
+        }
+        struct timeval timeout = {1, 0};
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        char buffer[BUFFER_SIZE];
+        if (read(client, buffer, sizeof(buffer)) > 0) {
+            std::string body = render_metrics();
+            std::string answer = header(
+                200,
+                "",
+                "text/plain; version=0.0.4",
+                body.size(),
+                false
+            ) + body;
+            size_t sent = 0;
+            while (sent != answer.size()) {
+                ssize_t bytes = send(
+                    client,
+                    answer.data() + sent,
+                    answer.size() - sent,
+                    MSG_NOSIGNAL
+                );
+                if (bytes <= 0) {
+                    break;
+                }
+                sent += bytes;
+            }
+        }
+        close(client);
+    }
+}
+
+bool start_metrics(uint16_t port) {
+    int listen_socket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_socket == -1) {
+        fprintf(stderr, "Error: socket() failed: %d\n", errno);
+        return false;
+    }
+    int value = 1;
+    setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &value, sizeof(value));
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(
+            listen_socket,
+            (struct sockaddr *) &address,
+            sizeof(address)
+        ) == -1 ||
+        listen(listen_socket, 16) == -1
+    ) {
+        fprintf(stderr, "Error: bind() failed: %d\n", errno);
+        close(listen_socket);
+        return false;
+    }
+    std::thread(serve_metrics, listen_socket).detach();
+    return true;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+enum class STAGE {
+    ACCEPT,
+    PARSE,
+    LOOKUP,
+    HANDLER,
+    SEND,
+    CGI_SPAWN,
+    CGI_RUN,
+    FASTCGI,
+    COUNT
+};
+
+bool init_metrics();
+bool start_metrics(uint16_t port);
+void record_stage(STAGE stage, int64_t microseconds);
+void count_response(int status, uint64_t bytes);
+void count_connection(int delta);
+void count_cgi_timeout();
+std::string render_metrics();
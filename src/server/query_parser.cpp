@@ -1,62 +1,336 @@
+#include <cstdint>
 #include <vector>
 
+extern "C" {
+#include <strings.h>
+}
+
 #include "common.hpp"
-#include "url_encoder.hpp"
+#include "simd.hpp"
 #include "query_parser.hpp"
 
-static std::vector<std::string> split(const std::string &str) {
-    std::vector<std::string> parts;
-    size_t start = 0, finish, size = str.size();
-    for (;;) {
-        while (start != str.size() && isspace(str[start])) {
-            ++start;
+static constexpr bool is_token(char c) {
+    if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') ||
+        (c >= 'A' && c <= 'Z')) {
+        return true;
+    }
+    switch (c) {
+    case '!': case '#': case '$': case '%': case '&': case '\'': case '*':
+    case '+': case '-': case '.': case '^': case '_': case '`': case '|':
+    case '~':
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool is_token(std::string_view s) {
+    if (s.empty()) {
+        return false;
+    }
+    for (char c : s) {
+        if (!is_token(c)) {
+            return false;
         }
-        if (start == size) {
+    }
+    return true;
+}
+
+static bool equal_nocase(std::string_view a, std::string_view b) {
+    return a.size() == b.size() && !strncasecmp(a.data(), b.data(), a.size());
+}
+
+static bool has_token(std::string_view list, std::string_view token) {
+    while (list.size()) {
+        size_t comma = list.find(',');
+        std::string_view item = list.substr(0, comma);
+        size_t first = item.find_first_not_of(" \t");
+        size_t last = item.find_last_not_of(" \t");
+        if (first != std::string_view::npos &&
+            equal_nocase(item.substr(first, last - first + 1), token)) {
+            return true;
+        }
+        if (comma == std::string_view::npos) {
             break;
         }
-        finish = start;
-        while (finish != str.size() && !isspace(str[finish])) {
-            ++finish;
+        list.remove_prefix(comma + 1);
+    }
+    return false;
+}
+
+static const struct {
+    std::string_view name;
+    std::string_view request::*field;
+} known_headers[] = {
+    {"Host", &request::host},
+    {"Connection", &request::connection},
+    {"Accept-Encoding", &request::accept_encoding},
+    {"Range", &request::range},
+    {"If-Range", &request::if_range},
+    {"If-None-Match", &request::if_none_match},
+    {"If-Modified-Since", &request::if_modified_since},
+    {"Content-Length", &request::content_length},
+    {"Content-Type", &request::content_type},
+    {"Transfer-Encoding", &request::transfer_encoding},
+    {"Upgrade", &request::upgrade},
+    {"Expect", &request::expect}
+};
+
+void index_headers(request &message) {
+    for (size_t i = 0; i != message.header_count; ++i) {
+        for (const auto &known : known_headers) {
+            if (equal_nocase(message.headers[i].name, known.name)) {
+                message.*known.field = message.headers[i].value;
+            }
         }
-        parts.push_back(str.substr(start, finish - start));
-        start = finish;
     }
-    return parts;
 }
 
-bool parse_method(
-    const std::string &input,
-    std::string &method,
-    std::string &version,
-    std::string &resource,
-    std::string &query
-) {
-    std::vector<std::string> parts = split(input);
-    if (parts.size() != 3) {
+std::string_view request::find(std::string_view name) const {
+    for (size_t i = 0; i != header_count; ++i) {
+        if (equal_nocase(headers[i].name, name)) {
+            return headers[i].value;
+        }
+    }
+    return std::string_view();
+}
+
+bool request::keep_alive() const {
+    if (has_token(connection, "close")) {
         return false;
     }
-    method = parts[0];
-    if (method != "GET" && method != "POST") {
+    if (version == "HTTP/1.0") {
+        return has_token(connection, "keep-alive");
+    }
+    return true;
+}
+
+bool request::has_body() const {
+    return transfer_encoding.size() ||
+        (content_length.size() && content_length != "0");
+}
+
+bool request::upgrades_to_h2c() const {
+    return has_token(upgrade, "h2c") && has_token(connection, "upgrade") &&
+        has_token(connection, "http2-settings") &&
+        find("HTTP2-Settings").size();
+}
+
+bool request::expects_continue() const {
+    return version == "HTTP/1.1" && equal_nocase(expect, "100-continue");
+}
+
+// Whether the parameters of a coding say q=0, which refuses it.
+static bool refused(std::string_view parameters) {
+    size_t first = parameters.find_first_not_of(" \t");
+    if (first == std::string_view::npos) {
         return false;
     }
-    size_t question_mark = parts[1].find('?');
-    resource = url_decode(parts[1].substr(1, question_mark - 1));
-    if (question_mark != std::string::npos) {
-        query = parts[1].substr(
-            question_mark + 1,
-            parts[1].size() - question_mark - 1
-        );
-    } else {
-        query = "";
-    }
-    if (parts[2] == "HTTP/1.1") {
-        version = "1.1";
-    } else {
+    parameters = parameters.substr(first);
+    parameters = parameters.substr(0, parameters.find_last_not_of(" \t") + 1);
+    if (parameters.size() < 3 || (parameters[0] | 0x20) != 'q' ||
+        parameters[1] != '=' || parameters[2] != '0') {
         return false;
     }
+    std::string_view rest = parameters.substr(3);
+    return rest.empty() ||
+        (rest[0] == '.' && rest.find_first_not_of('0', 1) ==
+            std::string_view::npos);
+}
+
+// gzip goes unless it is refused, or not named and * is not accepted.
+bool request::accepts_gzip() const {
+    std::string_view list = accept_encoding;
+    bool any = false;
+    while (list.size()) {
+        size_t comma = list.find(',');
+        std::string_view item = list.substr(0, comma);
+        size_t semicolon = item.find(';');
+        std::string_view coding = item.substr(0, semicolon);
+        size_t first = coding.find_first_not_of(" \t");
+        size_t last = coding.find_last_not_of(" \t");
+        if (first != std::string_view::npos) {
+            coding = coding.substr(first, last - first + 1);
+            bool accepted = semicolon == std::string_view::npos ||
+                !refused(item.substr(semicolon + 1));
+            if (equal_nocase(coding, "gzip") ||
+                equal_nocase(coding, "x-gzip")) {
+                return accepted;
+            }
+            if (coding == "*") {
+                any = accepted;
+            }
+        }
+        if (comma == std::string_view::npos) {
+            break;
+        }
+        list.remove_prefix(comma + 1);
+    }
+    return any;
+}
+
+request_parser::request_parser(size_t line_limit, size_t header_limit) :
+    line_limit(line_limit),
+    header_limit(header_limit) {
+    reset();
+}
+
+void request_parser::reset() {
+    stage = STAGE::REQUEST_LINE;
+    line_start = 0;
+    scanned = 0;
+    base = nullptr;
+    parsed = request();
+    parsed.header_count = 0;
+    parsed.length = 0;
+    parsed.error = 0;
+}
+
+const request &request_parser::result() const {
+    return parsed;
+}
+
+PARSE request_parser::fail(int code) {
+    parsed.error = code;
+    return PARSE::ERROR;
+}
+
+void request_parser::rebase(const char *data) {
+    if (data == base) {
+        return;
+    }
+    std::string_view *views[] = {
+        &parsed.line,
+        &parsed.method,
+        &parsed.target,
+        &parsed.path,
+        &parsed.query,
+        &parsed.version
+    };
+    auto move = [this, data](std::string_view &view) {
+        if (view.data() != nullptr) {
+            view = std::string_view(
+                data + ((uintptr_t) view.data() - (uintptr_t) base),
+                view.size()
+            );
+        }
+    };
+    for (std::string_view *view : views) {
+        move(*view);
+    }
+    for (size_t i = 0; i != parsed.header_count; ++i) {
+        move(parsed.headers[i].name);
+        move(parsed.headers[i].value);
+    }
+    base = data;
+}
+
+PARSE request_parser::feed(std::string_view buffer) {
+    rebase(buffer.data());
+    for (;;) {
+        size_t end = buffer.find('\n', scanned);
+        if (end == std::string_view::npos) {
+            scanned = buffer.size();
+            if (stage == STAGE::REQUEST_LINE &&
+                buffer.size() - line_start > line_limit) {
+                return fail(414);
+            }
+            if (buffer.size() > header_limit) {
+                return fail(431);
+            }
+            return PARSE::INCOMPLETE;
+        }
+        size_t next = end + 1;
+        if (next > header_limit) {
+            return fail(stage == STAGE::REQUEST_LINE ? 414 : 431);
+        }
+        if (end > line_start && buffer[end - 1] == '\r') {
+            --end;
+        }
+        std::string_view line = buffer.substr(line_start, end - line_start);
+        if (stage == STAGE::REQUEST_LINE) {
+            if (line.size()) {
+                if (line.size() > line_limit) {
+                    return fail(414);
+                }
+                if (!parse_request_line(line)) {
+                    return fail(400);
+                }
+                stage = STAGE::HEADERS;
+            }
+        } else if (line.empty()) {
+            parsed.length = next;
+            index_headers(parsed);
+            return PARSE::DONE;
+        } else if (!parse_header(line)) {
+            return fail(parsed.error ? parsed.error : 400);
+        }
+        line_start = scanned = next;
+    }
+}
+
+bool request_parser::parse_request_line(std::string_view line) {
+    size_t first = line.find(' ');
+    size_t second = line.find(' ', first + 1);
+    if (first == std::string_view::npos || second == std::string_view::npos ||
+        line.find(' ', second + 1) != std::string_view::npos) {
+        return false;
+    }
+    parsed.line = line;
+    parsed.method = line.substr(0, first);
+    parsed.target = line.substr(first + 1, second - first - 1);
+    parsed.version = line.substr(second + 1);
+    if (!is_token(parsed.method) || parsed.target.empty() ||
+        parsed.target[0] != '/') {
+        return false;
+    }
+    if (parsed.version != "HTTP/1.1" && parsed.version != "HTTP/1.0") {
+        return false;
+    }
+    size_t question_mark = parsed.target.find('?');
+    parsed.path = parsed.target.substr(1, question_mark - 1);
+    if (question_mark != std::string_view::npos) {
+        parsed.query = parsed.target.substr(question_mark + 1);
+    }
+    return true;
+}
+
+bool request_parser::parse_header(std::string_view line) {
+    if (parsed.header_count == request::MAX_HEADERS) {
+        parsed.error = 431;
+        return false;
+    }
+    size_t colon = line.find(':');
+    if (colon == std::string_view::npos ||
+        !is_token(line.substr(0, colon))) {
+        return false;
+    }
+    std::string_view value = line.substr(colon + 1);
+    size_t first = value.find_first_not_of(" \t");
+    size_t last = value.find_last_not_of(" \t");
+    header_field &field = parsed.headers[parsed.header_count++];
+    field.name = line.substr(0, colon);
+    field.value = first == std::string_view::npos ?
+        std::string_view() : value.substr(first, last - first + 1);
     return true;
 }
 
+static std::vector<std::string> split(const std::string &str) {
+    const text_kernels &scan = kernels();
+    std::vector<std::string> parts;
+    size_t start = 0, size = str.size();
+    for (;;) {
+        start += scan.span_space(str.data() + start, size - start);
+        if (start == size) {
+            break;
+        }
+        size_t length = scan.span_word(str.data() + start, size - start);
+        parts.push_back(str.substr(start, length));
+        start += length;
+    }
+    return parts;
+}
+
 bool parse_field(const std::string &input, std::string &a, std::string &b) {
     std::vector<std::string> parts = split(input);
     if (parts.size() >= 2 && parts[0][parts[0].size() - 1] == ':') {
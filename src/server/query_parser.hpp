@@ -1,13 +1,86 @@
 #pragma once
 
+#include <cstddef>
 #include <string>
+#include <string_view>
 
-bool parse_method(
-    const std::string &input,
-    std::string &method,
-    std::string &version,
-    std::string &resource,
-    std::string &query
-);
+enum class PARSE {
+    INCOMPLETE,
+    DONE,
+    ERROR
+};
+
+struct header_field {
+    std::string_view name;
+    std::string_view value;
+};
+
+struct request {
+    static constexpr size_t MAX_HEADERS = 64;
+
+    std::string_view line;
+    std::string_view method;
+    std::string_view target;
+    std::string_view path;
+    std::string_view query;
+    std::string_view version;
+
+    std::string_view host;
+    std::string_view connection;
+    std::string_view accept_encoding;
+    std::string_view range;
+    std::string_view if_range;
+    std::string_view if_none_match;
+    std::string_view if_modified_since;
+    std::string_view content_length;
+    std::string_view content_type;
+    std::string_view transfer_encoding;
+    std::string_view upgrade;
+    std::string_view expect;
+
+    header_field headers[MAX_HEADERS];
+    size_t header_count;
+    size_t length;
+    int error;
+
+    std::string_view find(std::string_view name) const;
+    bool keep_alive() const;
+    bool has_body() const;
+    // Upgrade: h2c with the HTTP2-Settings it needs (RFC 7540, 3.2).
+    bool upgrades_to_h2c() const;
+    bool expects_continue() const;
+    bool accepts_gzip() const;
+};
+
+// Sets the views of the headers the server looks at from headers[].
+void index_headers(request &message);
+
+class request_parser {
+public:
+    request_parser(size_t line_limit, size_t header_limit);
+
+    PARSE feed(std::string_view buffer);
+    const request &result() const;
+    void reset();
+
+private:
+    enum class STAGE {
+        REQUEST_LINE,
+        HEADERS
+    };
+
+    void rebase(const char *data);
+    bool parse_request_line(std::string_view line);
+    bool parse_header(std::string_view line);
+    PARSE fail(int code);
+
+    size_t line_limit;
+    size_t header_limit;
+    STAGE stage;
+    size_t line_start;
+    size_t scanned;
+    const char *base;
+    request parsed;
+};
 
 bool parse_field(const std::string &input, std::string &a, std::string &b);
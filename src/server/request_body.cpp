@@ -0,0 +1,241 @@
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstdio>
+
+extern "C" {
+#include <fcntl.h>
+#include <strings.h>
+#include <unistd.h>
+}
+
+#include "common.hpp"
+#include "config_reader.hpp"
+#include "query_parser.hpp"
+#include "request_body.hpp"
+
+static bool equal_nocase(std::string_view a, std::string_view b) {
+    return a.size() == b.size() && !strncasecmp(a.data(), b.data(), a.size());
+}
+
+static bool parse_number(std::string_view text, uint64_t &n, int base) {
+    const char *end = text.data() + text.size();
+    auto [last, error] = std::from_chars(text.data(), end, n, base);
+    return text.size() && error == std::errc() && last == end;
+}
+
+int body_framing(const request &message, int64_t &length) {
+    length = 0;
+    // The parser keeps the last of repeated headers; one that is repeated
+    // with another value could make a proxy in front see another request.
+    if (message.find("Transfer-Encoding") != message.transfer_encoding ||
+        message.find("Content-Length") != message.content_length) {
+        return 400;
+    }
+    if (message.transfer_encoding.size()) {
+        if (message.content_length.size()) {
+            return 400;
+        }
+        if (!equal_nocase(message.transfer_encoding, "chunked")) {
+            return 501;
+        }
+        length = -1;
+        return 0;
+    }
+    if (message.content_length.empty()) {
+        return 0;
+    }
+    uint64_t size;
+    if (!parse_number(message.content_length, size, 10) ||
+        size > (uint64_t) INT64_MAX) {
+        return 400;
+    }
+    if (settings.max_body_size && size > settings.max_body_size) {
+        return 413;
+    }
+    length = size;
+    return 0;
+}
+
+body_reader::body_reader() :
+    state(STATE::IDLE),
+    chunked(false),
+    dropping(false),
+    output(-1),
+    remaining(0),
+    total(0) {
+}
+
+body_reader::~body_reader() {
+    stop();
+}
+
+void body_reader::start(int64_t length, int sink) {
+    stop();
+    output = sink;
+    dropping = sink == -1;
+    chunked = length == -1;
+    remaining = chunked ? 0 : length;
+    total = 0;
+    state = chunked ? STATE::SIZE : STATE::DATA;
+    if (!chunked && length == 0) {
+        state = STATE::DONE;
+    }
+}
+
+void body_reader::stop() {
+    if (output != -1) {
+        close(output);
+        output = -1;
+    }
+    state = STATE::IDLE;
+}
+
+bool body_reader::active() const {
+    return state != STATE::IDLE;
+}
+
+bool body_reader::done() const {
+    return state == STATE::DONE;
+}
+
+int body_reader::sink() const {
+    return output;
+}
+
+bool body_reader::framing() const {
+    return state == STATE::SIZE || state == STATE::DATA_END ||
+        state == STATE::TRAILER;
+}
+
+void body_reader::next_part() {
+    state = chunked ? STATE::DATA_END : STATE::DONE;
+}
+
+// Returns how much was taken, 0 if the pipe is full. Once the script has
+// closed its input the rest of the body is dropped.
+ssize_t body_reader::deliver(const char *data, size_t size) {
+    if (dropping) {
+        return size;
+    }
+    for (;;) {
+        ssize_t bytes = write(output, data, size);
+        if (bytes >= 0) {
+            return bytes;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        }
+        if (errno == EPIPE) {
+            dropping = true;
+            return size;
+        }
+        fprintf(stderr, "Error: write() failed: %d\n", errno);
+        return -1;
+    }
+}
+
+BODY body_reader::feed(std::string_view data, size_t &used) {
+    used = 0;
+    while (state != STATE::DONE) {
+        if (state == STATE::DATA) {
+            if (used == data.size()) {
+                return BODY::MORE;
+            }
+            size_t size = std::min<uint64_t>(remaining, data.size() - used);
+            ssize_t written = deliver(data.data() + used, size);
+            if (written == -1) {
+                return BODY::FAILED;
+            }
+            if (written == 0) {
+                return BODY::AGAIN;
+            }
+            used += written;
+            remaining -= written;
+            if (remaining == 0) {
+                next_part();
+            }
+            continue;
+        }
+        size_t newline = data.find('\n', used);
+        if (newline == std::string_view::npos) {
+            return data.size() - used > MAX_LINE ? BODY::FAILED : BODY::MORE;
+        }
+        std::string_view line = data.substr(used, newline - used);
+        used = newline + 1;
+        if (line.size() && line.back() == '\r') {
+            line.remove_suffix(1);
+        }
+        if (state == STATE::SIZE) {
+            // Chunk extensions are allowed and ignored.
+            line = line.substr(0, line.find(';'));
+            line = line.substr(0, line.find_last_not_of(" \t") + 1);
+            uint64_t size;
+            if (!parse_number(line, size, 16)) {
+                return BODY::FAILED;
+            }
+            if (settings.max_body_size &&
+                size > settings.max_body_size - total) {
+                return BODY::FAILED;
+            }
+            total += size;
+            remaining = size;
+            state = size ? STATE::DATA : STATE::TRAILER;
+        } else if (state == STATE::DATA_END) {
+            if (line.size()) {
+                return BODY::FAILED;
+            }
+            state = STATE::SIZE;
+        } else if (line.empty()) {
+            state = STATE::DONE;
+        }
+    }
+    return BODY::DONE;
+}
+
+BODY body_reader::pump(int socket) {
+    size_t size = std::min<uint64_t>(remaining, SPLICE_SIZE);
+    ssize_t bytes;
+    if (dropping) {
+        char buffer[BUFFER_SIZE];
+        bytes = read(socket, buffer, std::min(size, sizeof(buffer)));
+    } else {
+        bytes = splice(
+            socket,
+            nullptr,
+            output,
+            nullptr,
+            size,
+            SPLICE_F_MOVE | SPLICE_F_NONBLOCK
+        );
+    }
+    if (bytes == -1) {
+        if (errno == EINTR) {
+            return BODY::MORE;
+        }
+        // Either the socket is empty or the pipe is full; the connection
+        // waits for both.
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return BODY::AGAIN;
+        }
+        if (errno == EPIPE) {
+            dropping = true;
+            return BODY::MORE;
+        }
+        if (errno != ECONNRESET) {
+            fprintf(stderr, "Error: splice() failed: %d\n", errno);
+        }
+        return BODY::FAILED;
+    }
+    if (bytes == 0) {
+        return BODY::FAILED;
+    }
+    remaining -= bytes;
+    if (remaining == 0) {
+        next_part();
+    }
+    return state == STATE::DONE ? BODY::DONE : BODY::MORE;
+}
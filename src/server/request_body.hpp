@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+extern "C" {
+#include <sys/types.h>
+}
+
+struct request;
+
+enum class BODY {
+    MORE,
+    AGAIN,
+    DONE,
+    FAILED
+};
+
+// Checks how the body of message is framed. Returns 0 and sets length to
+// the size of the body (-1 if it is chunked), or the status to refuse the
+// request with.
+int body_framing(const request &message, int64_t &length);
+
+// Passes a request body on to a descriptor, the standard input of a script,
+// or drops it when nothing takes it or the reader has gone. Bytes that came
+// together with the header are written from the buffer and the rest is
+// spliced straight from the socket, so an upload is never kept in memory
+// and a script that reads slowly holds the client back.
+class body_reader {
+public:
+    body_reader();
+    ~body_reader();
+    body_reader(const body_reader &) = delete;
+    body_reader &operator=(const body_reader &) = delete;
+
+    // Takes over sink (-1 to drop the body); length is as from body_framing.
+    void start(int64_t length, int sink);
+    // Closes the sink, the reader is free for the next body.
+    void stop();
+    bool active() const;
+    bool done() const;
+    int sink() const;
+    // The next bytes are chunk framing, which has to be read into a buffer
+    // and given to feed().
+    bool framing() const;
+    // Takes body bytes from the start of data; used is set to how many.
+    BODY feed(std::string_view data, size_t &used);
+    // Moves body bytes from the socket, once feed() has nothing left.
+    BODY pump(int socket);
+
+private:
+    enum class STATE {
+        IDLE,
+        SIZE,
+        DATA,
+        DATA_END,
+        TRAILER,
+        DONE
+    };
+
+    ssize_t deliver(const char *data, size_t size);
+    void next_part();
+
+    static constexpr size_t MAX_LINE = 4096;
+    static constexpr size_t SPLICE_SIZE = 64 << 10;
+
+    STATE state;
+    bool chunked;
+    bool dropping;
+    int output;
+    uint64_t remaining;
+    uint64_t total;
+};
@@ -0,0 +1,474 @@
+#include <cstdint>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "simd.hpp"
+
+#define TARGET_AVX2 __attribute__((target("avx2")))
+
+static constexpr char HEX_DIGITS[] = "0123456789ABCDEF";
+
+struct byte_table {
+    constexpr byte_table(bool hex) : value() {
+        for (int c = 0; c != 256; ++c) {
+            if (hex) {
+                value[c] =
+                    c >= '0' && c <= '9' ? c - '0' :
+                    c >= 'A' && c <= 'F' ? c - 'A' + 10 :
+                    c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+            } else {
+                value[c] =
+                    (c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') ||
+                    (c >= 'a' && c <= 'z') || c == '-' || c == '_' ||
+                    c == '.' || c == '~' || c == '/';
+            }
+        }
+    }
+
+    int8_t operator[](char c) const {
+        return value[(uint8_t) c];
+    }
+
+    int8_t value[256];
+};
+
+static constexpr byte_table HEX_VALUES(true);
+static constexpr byte_table UNRESERVED(false);
+
+static bool is_space(char c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+// Decodes the escape at in[0] == '%'; left counts the bytes from in onwards.
+static bool decode_escape(const char *in, size_t left, char *out) {
+    if (left < 3) {
+        return false;
+    }
+    int high = HEX_VALUES[in[1]], low = HEX_VALUES[in[2]];
+    if ((high | low) < 0) {
+        return false;
+    }
+    *out = high << 4 | low;
+    return true;
+}
+
+static char *encode_byte(char c, char *out) {
+    out[0] = '%';
+    out[1] = HEX_DIGITS[(uint8_t) c >> 4];
+    out[2] = HEX_DIGITS[c & 15];
+    return out + 3;
+}
+
+static ptrdiff_t decode_tail(
+    const char *in,
+    size_t n,
+    size_t i,
+    char *start,
+    char *out
+) {
+    for (; i != n; ++i) {
+        if (in[i] != '%') {
+            *out++ = in[i];
+            continue;
+        }
+        if (!decode_escape(in + i, n - i, out++)) {
+            return -1;
+        }
+        i += 2;
+    }
+    return out - start;
+}
+
+static size_t encode_tail(
+    const char *in,
+    size_t n,
+    size_t i,
+    char *start,
+    char *out
+) {
+    for (; i != n; ++i) {
+        if (UNRESERVED[in[i]]) {
+            *out++ = in[i];
+        } else {
+            out = encode_byte(in[i], out);
+        }
+    }
+    return out - start;
+}
+
+static ptrdiff_t decode_scalar(const char *in, size_t n, char *out) {
+    return decode_tail(in, n, 0, out, out);
+}
+
+static size_t encode_scalar(const char *in, size_t n, char *out) {
+    return encode_tail(in, n, 0, out, out);
+}
+
+static size_t span_space_scalar(const char *s, size_t n) {
+    size_t i = 0;
+    while (i != n && is_space(s[i])) {
+        ++i;
+    }
+    return i;
+}
+
+static size_t span_word_scalar(const char *s, size_t n) {
+    size_t i = 0;
+    while (i != n && !is_space(s[i])) {
+        ++i;
+    }
+    return i;
+}
+
+#if defined(__x86_64__)
+
+// The vector loops store whole blocks to out before looking at them: the
+// decoded text never runs ahead of the input and the encoded text has room
+// for three bytes per input byte, so the stores stay inside the buffer.
+
+static inline __m128i unreserved_sse2(__m128i c) {
+    __m128i digit = _mm_and_si128(
+        _mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+        _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1))
+    );
+    __m128i lower = _mm_or_si128(c, _mm_set1_epi8(0x20));
+    __m128i alpha = _mm_and_si128(
+        _mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+        _mm_cmplt_epi8(lower, _mm_set1_epi8('z' + 1))
+    );
+    __m128i mark = _mm_or_si128(
+        _mm_or_si128(
+            _mm_cmpeq_epi8(c, _mm_set1_epi8('-')),
+            _mm_cmpeq_epi8(c, _mm_set1_epi8('_'))
+        ),
+        _mm_or_si128(
+            _mm_or_si128(
+                _mm_cmpeq_epi8(c, _mm_set1_epi8('.')),
+                _mm_cmpeq_epi8(c, _mm_set1_epi8('~'))
+            ),
+            _mm_cmpeq_epi8(c, _mm_set1_epi8('/'))
+        )
+    );
+    return _mm_or_si128(_mm_or_si128(digit, alpha), mark);
+}
+
+static inline __m128i space_sse2(__m128i c) {
+    return _mm_or_si128(
+        _mm_cmpeq_epi8(c, _mm_set1_epi8(' ')),
+        _mm_and_si128(
+            _mm_cmpgt_epi8(c, _mm_set1_epi8('\t' - 1)),
+            _mm_cmplt_epi8(c, _mm_set1_epi8('\r' + 1))
+        )
+    );
+}
+
+static ptrdiff_t decode_sse2(const char *in, size_t n, char *out) {
+    char *start = out;
+    size_t i = 0;
+    const __m128i percent = _mm_set1_epi8('%');
+    while (i + 16 <= n) {
+        __m128i block = _mm_loadu_si128((const __m128i *) (in + i));
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, percent));
+        _mm_storeu_si128((__m128i *) out, block);
+        if (mask == 0) {
+            i += 16;
+            out += 16;
+            continue;
+        }
+        unsigned plain = __builtin_ctz(mask);
+        i += plain;
+        out += plain;
+        if (!decode_escape(in + i, n - i, out++)) {
+            return -1;
+        }
+        i += 3;
+    }
+    return decode_tail(in, n, i, start, out);
+}
+
+static size_t encode_sse2(const char *in, size_t n, char *out) {
+    char *start = out;
+    size_t i = 0;
+    while (i + 16 <= n) {
+        __m128i block = _mm_loadu_si128((const __m128i *) (in + i));
+        unsigned mask = _mm_movemask_epi8(unreserved_sse2(block)) ^ 0xFFFF;
+        _mm_storeu_si128((__m128i *) out, block);
+        if (mask == 0) {
+            i += 16;
+            out += 16;
+            continue;
+        }
+        unsigned plain = __builtin_ctz(mask);
+        out = encode_byte(in[i + plain], out + plain);
+        i += plain + 1;
+    }
+    return encode_tail(in, n, i, start, out);
+}
+
+static size_t span_space_sse2(const char *s, size_t n) {
+    size_t i = 0;
+    while (i + 16 <= n) {
+        __m128i block = _mm_loadu_si128((const __m128i *) (s + i));
+        unsigned mask = _mm_movemask_epi8(space_sse2(block)) ^ 0xFFFF;
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+        i += 16;
+    }
+    return i + span_space_scalar(s + i, n - i);
+}
+
+static size_t span_word_sse2(const char *s, size_t n) {
+    size_t i = 0;
+    while (i + 16 <= n) {
+        __m128i block = _mm_loadu_si128((const __m128i *) (s + i));
+        unsigned mask = _mm_movemask_epi8(space_sse2(block));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+        i += 16;
+    }
+    return i + span_word_scalar(s + i, n - i);
+}
+
+TARGET_AVX2
+static inline __m256i unreserved_avx2(__m256i c) {
+    __m256i digit = _mm256_and_si256(
+        _mm256_cmpgt_epi8(c, _mm256_set1_epi8('0' - 1)),
+        _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), c)
+    );
+    __m256i lower = _mm256_or_si256(c, _mm256_set1_epi8(0x20));
+    __m256i alpha = _mm256_and_si256(
+        _mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)),
+        _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), lower)
+    );
+    __m256i mark = _mm256_or_si256(
+        _mm256_or_si256(
+            _mm256_cmpeq_epi8(c, _mm256_set1_epi8('-')),
+            _mm256_cmpeq_epi8(c, _mm256_set1_epi8('_'))
+        ),
+        _mm256_or_si256(
+            _mm256_or_si256(
+                _mm256_cmpeq_epi8(c, _mm256_set1_epi8('.')),
+                _mm256_cmpeq_epi8(c, _mm256_set1_epi8('~'))
+            ),
+            _mm256_cmpeq_epi8(c, _mm256_set1_epi8('/'))
+        )
+    );
+    return _mm256_or_si256(_mm256_or_si256(digit, alpha), mark);
+}
+
+TARGET_AVX2
+static inline __m256i space_avx2(__m256i c) {
+    return _mm256_or_si256(
+        _mm256_cmpeq_epi8(c, _mm256_set1_epi8(' ')),
+        _mm256_and_si256(
+            _mm256_cmpgt_epi8(c, _mm256_set1_epi8('\t' - 1)),
+            _mm256_cmpgt_epi8(_mm256_set1_epi8('\r' + 1), c)
+        )
+    );
+}
+
+// Non-ASCII names are escaped byte by byte, so runs like %D0%BE%D1%82 are
+// common. Five escapes fit in 16 bytes: they are validated and converted
+// together, and the ten nibbles are gathered into five bytes with shuffles.
+TARGET_AVX2
+static inline bool decode_run_avx2(const char *in, char *out) {
+    __m128i block = _mm_loadu_si128((const __m128i *) in);
+    unsigned percent =
+        _mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8('%')));
+    if ((percent & 0x1249) != 0x1249) {
+        return false;
+    }
+    __m128i digit = _mm_sub_epi8(block, _mm_set1_epi8('0'));
+    __m128i is_digit =
+        _mm_cmpeq_epi8(_mm_min_epu8(digit, _mm_set1_epi8(9)), digit);
+    __m128i letter = _mm_sub_epi8(
+        _mm_or_si128(block, _mm_set1_epi8(0x20)),
+        _mm_set1_epi8('a')
+    );
+    __m128i is_letter =
+        _mm_cmpeq_epi8(_mm_min_epu8(letter, _mm_set1_epi8(5)), letter);
+    unsigned valid = _mm_movemask_epi8(_mm_or_si128(is_digit, is_letter));
+    if ((valid & 0x6DB6) != 0x6DB6) {
+        return false;
+    }
+    __m128i value = _mm_or_si128(
+        _mm_and_si128(digit, is_digit),
+        _mm_and_si128(_mm_add_epi8(letter, _mm_set1_epi8(10)), is_letter)
+    );
+    __m128i high = _mm_shuffle_epi8(value, _mm_setr_epi8(
+        1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+    ));
+    __m128i low = _mm_shuffle_epi8(value, _mm_setr_epi8(
+        2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+    ));
+    _mm_storeu_si128(
+        (__m128i *) out,
+        _mm_or_si128(_mm_slli_epi16(high, 4), low)
+    );
+    return true;
+}
+
+// The reverse: five bytes that all need escaping become fifteen.
+TARGET_AVX2
+static inline void encode_run_avx2(const char *in, char *out) {
+    __m128i block = _mm_loadu_si128((const __m128i *) in);
+    __m128i digits = _mm_loadu_si128((const __m128i *) HEX_DIGITS);
+    __m128i nibbles = _mm_set1_epi8(15);
+    __m128i high = _mm_shuffle_epi8(
+        digits,
+        _mm_and_si128(_mm_srli_epi16(block, 4), nibbles)
+    );
+    __m128i low = _mm_shuffle_epi8(digits, _mm_and_si128(block, nibbles));
+    __m128i result = _mm_or_si128(
+        _mm_or_si128(
+            _mm_shuffle_epi8(high, _mm_setr_epi8(
+                -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1
+            )),
+            _mm_shuffle_epi8(low, _mm_setr_epi8(
+                -1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1
+            ))
+        ),
+        _mm_setr_epi8(
+            '%', 0, 0, '%', 0, 0, '%', 0, 0, '%', 0, 0, '%', 0, 0, 0
+        )
+    );
+    _mm_storeu_si128((__m128i *) out, result);
+}
+
+TARGET_AVX2
+static ptrdiff_t decode_avx2(const char *in, size_t n, char *out) {
+    char *start = out;
+    size_t i = 0;
+    const __m256i percent = _mm256_set1_epi8('%');
+    while (i + 32 <= n) {
+        __m256i block = _mm256_loadu_si256((const __m256i *) (in + i));
+        unsigned mask =
+            _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, percent));
+        _mm256_storeu_si256((__m256i *) out, block);
+        if (mask == 0) {
+            i += 32;
+            out += 32;
+            continue;
+        }
+        unsigned plain = __builtin_ctz(mask);
+        i += plain;
+        out += plain;
+        while (i + 16 <= n && decode_run_avx2(in + i, out)) {
+            i += 15;
+            out += 5;
+        }
+        if (i != n && in[i] == '%') {
+            if (!decode_escape(in + i, n - i, out++)) {
+                return -1;
+            }
+            i += 3;
+        }
+    }
+    return decode_tail(in, n, i, start, out);
+}
+
+TARGET_AVX2
+static size_t encode_avx2(const char *in, size_t n, char *out) {
+    char *start = out;
+    size_t i = 0;
+    while (i + 32 <= n) {
+        __m256i block = _mm256_loadu_si256((const __m256i *) (in + i));
+        unsigned mask = ~_mm256_movemask_epi8(unreserved_avx2(block));
+        _mm256_storeu_si256((__m256i *) out, block);
+        if (mask == 0) {
+            i += 32;
+            out += 32;
+            continue;
+        }
+        unsigned plain = __builtin_ctz(mask);
+        i += plain;
+        out += plain;
+        mask >>= plain;
+        if ((mask & 31) == 31) {
+            encode_run_avx2(in + i, out);
+            i += 5;
+            out += 15;
+        } else {
+            out = encode_byte(in[i++], out);
+        }
+    }
+    return encode_tail(in, n, i, start, out);
+}
+
+TARGET_AVX2
+static size_t span_space_avx2(const char *s, size_t n) {
+    size_t i = 0;
+    while (i + 32 <= n) {
+        __m256i block = _mm256_loadu_si256((const __m256i *) (s + i));
+        unsigned mask = ~_mm256_movemask_epi8(space_avx2(block));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+        i += 32;
+    }
+    return i + span_space_sse2(s + i, n - i);
+}
+
+TARGET_AVX2
+static size_t span_word_avx2(const char *s, size_t n) {
+    size_t i = 0;
+    while (i + 32 <= n) {
+        __m256i block = _mm256_loadu_si256((const __m256i *) (s + i));
+        unsigned mask = _mm256_movemask_epi8(space_avx2(block));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+        i += 32;
+    }
+    return i + span_word_sse2(s + i, n - i);
+}
+
+#endif
+
+static const text_kernels IMPLEMENTATIONS[] = {
+    {decode_scalar, encode_scalar, span_space_scalar, span_word_scalar},
+#if defined(__x86_64__)
+    {decode_sse2, encode_sse2, span_space_sse2, span_word_sse2},
+    {decode_avx2, encode_avx2, span_space_avx2, span_word_avx2}
+#endif
+};
+
+bool isa_supported(ISA isa) {
+    switch (isa) {
+    case ISA::SCALAR:
+        return true;
+#if defined(__x86_64__)
+    case ISA::SSE2:
+        return true;
+    case ISA::AVX2:
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return false;
+    }
+}
+
+const char *isa_name(ISA isa) {
+    switch (isa) {
+    case ISA::SSE2:
+        return "sse2";
+    case ISA::AVX2:
+        return "avx2";
+    default:
+        return "scalar";
+    }
+}
+
+const text_kernels &kernels(ISA isa) {
+    return IMPLEMENTATIONS[isa_supported(isa) ? (int) isa : 0];
+}
+
+const text_kernels &kernels() {
+    static const text_kernels &best =
+        kernels(isa_supported(ISA::AVX2) ? ISA::AVX2 : ISA::SSE2);
+    return best;
+}
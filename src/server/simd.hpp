@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstddef>
+
+enum class ISA {
+    SCALAR,
+    SSE2,
+    AVX2
+};
+
+// Byte scanning kernels used on every request. Each instruction set has its
+// own implementation with the same results; the best one the processor
+// supports is chosen once at startup.
+struct text_kernels {
+    // Decodes percent-escapes from in into out, which has room for n bytes.
+    // Returns the decoded length or -1 on a truncated or non-hex escape.
+    ptrdiff_t (*decode)(const char *in, size_t n, char *out);
+    // Escapes all bytes except unreserved characters and '/' into out,
+    // which has room for 3n bytes. Returns the encoded length.
+    size_t (*encode)(const char *in, size_t n, char *out);
+    // Length of the leading run of whitespace (as in the C locale isspace).
+    size_t (*span_space)(const char *s, size_t n);
+    // Length of the leading run of non-whitespace.
+    size_t (*span_word)(const char *s, size_t n);
+};
+
+bool isa_supported(ISA isa);
+const char *isa_name(ISA isa);
+const text_kernels &kernels(ISA isa);
+const text_kernels &kernels();
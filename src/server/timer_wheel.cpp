@@ -0,0 +1,166 @@
+#include <algorithm>
+#include <climits>
+
+#include "timer_wheel.hpp"
+
+static void link_before(timer_link *position, timer_link *item) {
+    item->next = position;
+    item->previous = position->previous;
+    position->previous->next = item;
+    position->previous = item;
+}
+
+static void unlink(timer_link *item) {
+    item->previous->next = item->next;
+    item->next->previous = item->previous;
+    item->next = item->previous = item;
+}
+
+// Moves all items of list to the empty list into.
+static void take(timer_link *list, timer_link *into) {
+    if (list->next == list) {
+        return;
+    }
+    into->next = list->next;
+    into->previous = list->previous;
+    into->next->previous = into;
+    into->previous->next = into;
+    list->next = list->previous = list;
+}
+
+timer::timer() :
+    wheel(nullptr),
+    tick(0) {
+    next = previous = this;
+}
+
+timer::~timer() {
+    cancel();
+}
+
+bool timer::armed() const {
+    return wheel != nullptr;
+}
+
+void timer::cancel() {
+    if (wheel != nullptr) {
+        wheel->remove(*this);
+    }
+}
+
+timer_wheel::timer_wheel(int64_t now) :
+    current(now / RESOLUTION),
+    count(0) {
+    for (auto &level : slots) {
+        for (timer_link &slot : level) {
+            slot.next = slot.previous = &slot;
+        }
+    }
+}
+
+timer_wheel::~timer_wheel() {
+    for (auto &level : slots) {
+        for (timer_link &slot : level) {
+            while (slot.next != &slot) {
+                remove(*static_cast<timer *>(slot.next));
+            }
+        }
+    }
+}
+
+void timer_wheel::arm(timer &t, int64_t deadline) {
+    uint64_t tick = (std::max<int64_t>(deadline, 0) + RESOLUTION - 1) /
+        RESOLUTION;
+    if (t.wheel == this && t.tick == tick) {
+        return;
+    }
+    t.cancel();
+    t.wheel = this;
+    t.tick = tick;
+    ++count;
+    place(t);
+}
+
+void timer_wheel::remove(timer &t) {
+    unlink(&t);
+    t.wheel = nullptr;
+    --count;
+}
+
+void timer_wheel::place(timer &t) {
+    uint64_t tick = std::max(t.tick, current);
+    uint64_t delta = tick - current;
+    int level = 0;
+    while (level + 1 != LEVELS &&
+        delta >> ((level + 1) * SLOT_BITS) != 0) {
+        ++level;
+    }
+    // Past the span of the top level the timer waits in its last slot and
+    // is placed again when that slot comes round.
+    if (delta >> (LEVELS * SLOT_BITS) != 0) {
+        tick = current + (1ull << (LEVELS * SLOT_BITS)) - 1;
+    }
+    timer_link *slot = &slots[level][(tick >> (level * SLOT_BITS)) & MASK];
+    link_before(slot, &t);
+}
+
+// Called when the lowest level starts a new revolution: the next slot of
+// each level above, up to the first one that does not wrap as well, is
+// spread over the levels below.
+void timer_wheel::cascade() {
+    for (int level = 1; level != LEVELS; ++level) {
+        uint64_t index = (current >> (level * SLOT_BITS)) & MASK;
+        timer_link moved;
+        moved.next = moved.previous = &moved;
+        take(&slots[level][index], &moved);
+        while (moved.next != &moved) {
+            timer_link *item = moved.next;
+            unlink(item);
+            place(*static_cast<timer *>(item));
+        }
+        if (index != 0) {
+            break;
+        }
+    }
+}
+
+void timer_wheel::advance(int64_t now) {
+    uint64_t target = now / RESOLUTION;
+    while (current <= target) {
+        if ((current & MASK) == 0) {
+            cascade();
+        }
+        timer_link due;
+        due.next = due.previous = &due;
+        take(&slots[0][current & MASK], &due);
+        ++current;
+        // Timers armed again from expired() land in later slots; the ones
+        // still in due may be cancelled by it, which unlinks them.
+        while (due.next != &due) {
+            timer *t = static_cast<timer *>(due.next);
+            remove(*t);
+            t->expired();
+        }
+    }
+}
+
+int timer_wheel::timeout(int64_t now) const {
+    if (count == 0) {
+        return -1;
+    }
+    // Only the lowest level is searched; beyond it the wheel wakes up at
+    // the start of its next revolution to cascade.
+    uint64_t tick = current;
+    if ((tick & MASK) != 0) {
+        uint64_t end = (current | MASK) + 1;
+        while (tick != end) {
+            const timer_link &slot = slots[0][tick & MASK];
+            if (slot.next != &slot) {
+                break;
+            }
+            ++tick;
+        }
+    }
+    int64_t wait = (int64_t) tick * RESOLUTION - now;
+    return (int) std::clamp<int64_t>(wait, 0, INT_MAX);
+}
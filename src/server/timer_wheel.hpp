@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+class timer_wheel;
+
+struct timer_link {
+    timer_link *next;
+    timer_link *previous;
+};
+
+// A deadline kept by a timer_wheel; expired() is called once it has passed.
+// The timer is taken out of the wheel before the call and may be armed
+// again from it.
+class timer : private timer_link {
+public:
+    timer();
+    virtual ~timer();
+    timer(const timer &) = delete;
+    timer &operator=(const timer &) = delete;
+
+    virtual void expired() = 0;
+    bool armed() const;
+    void cancel();
+
+private:
+    friend class timer_wheel;
+
+    timer_wheel *wheel;
+    uint64_t tick;
+};
+
+// Hierarchical timing wheel: LEVELS rings of SLOTS lists, each level
+// SLOTS times coarser than the one below. A timer goes to the level whose
+// span covers its deadline and moves down as the deadline comes closer, so
+// arming and cancelling are O(1) and each timer is touched at most LEVELS
+// times however many there are. Deadlines are rounded up to RESOLUTION.
+class timer_wheel {
+public:
+    explicit timer_wheel(int64_t now);
+    ~timer_wheel();
+    timer_wheel(const timer_wheel &) = delete;
+    timer_wheel &operator=(const timer_wheel &) = delete;
+
+    // Times are monotonic_ms() values.
+    void arm(timer &t, int64_t deadline);
+    void advance(int64_t now);
+    // Milliseconds until advance() has something to do, -1 if nothing is
+    // armed.
+    int timeout(int64_t now) const;
+
+    static constexpr int64_t RESOLUTION = 8;
+
+private:
+    friend class timer;
+
+    static constexpr int SLOT_BITS = 6;
+    static constexpr uint64_t SLOTS = 1 << SLOT_BITS;
+    static constexpr uint64_t MASK = SLOTS - 1;
+    static constexpr int LEVELS = 4;
+
+    void place(timer &t);
+    void cascade();
+    void remove(timer &t);
+
+    timer_link slots[LEVELS][SLOTS];
+    uint64_t current;
+    size_t count;
+};
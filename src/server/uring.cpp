@@ -0,0 +1,319 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+extern "C" {
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+}
+
+#include "uring.hpp"
+
+static constexpr uint8_t REQUIRED_OPS[] = {
+    IORING_OP_POLL_ADD,
+    IORING_OP_POLL_REMOVE,
+    IORING_OP_ACCEPT,
+    IORING_OP_RECV,
+    IORING_OP_SENDMSG,
+    IORING_OP_ASYNC_CANCEL,
+    IORING_OP_FILES_UPDATE
+};
+
+static constexpr unsigned REQUIRED_FEATURES =
+    IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+
+static int register_resource(
+    int fd,
+    unsigned opcode,
+    const void *argument,
+    unsigned count
+) {
+    return syscall(__NR_io_uring_register, fd, opcode, argument, count);
+}
+
+static bool supports_required_ops(int fd) {
+    static constexpr unsigned MAX_OPS = 256;
+    union {
+        char buffer[
+            sizeof(struct io_uring_probe) +
+            MAX_OPS * sizeof(struct io_uring_probe_op)
+        ];
+        struct io_uring_probe probe;
+    } result;
+    memset(&result, 0, sizeof(result));
+    if (register_resource(fd, IORING_REGISTER_PROBE, &result, MAX_OPS) == -1) {
+        return false;
+    }
+    for (uint8_t op : REQUIRED_OPS) {
+        if (op >= result.probe.ops_len ||
+            !(result.probe.ops[op].flags & IO_URING_OP_SUPPORTED)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+uring::uring() :
+    fd(-1),
+    rings(MAP_FAILED),
+    rings_size(0),
+    entries(nullptr),
+    entries_size(0),
+    sq_head(nullptr),
+    sq_tail(nullptr),
+    sq_mask(0),
+    sq_entries(0),
+    tail(0),
+    cq_head(nullptr),
+    cq_tail(nullptr),
+    cq_mask(0),
+    completions(nullptr),
+    provided(nullptr),
+    provided_size(0),
+    memory(nullptr),
+    buffer_size(0),
+    buffer_count(0),
+    file_count(0) {
+}
+
+uring::~uring() {
+    // Closing the ring cancels what is still running before the memory it
+    // may be using goes away.
+    if (fd != -1) {
+        close(fd);
+    }
+    if (memory != nullptr) {
+        munmap(memory, buffer_count * buffer_size);
+    }
+    if (provided != nullptr) {
+        munmap(provided, provided_size);
+    }
+    if (entries != nullptr) {
+        munmap(entries, entries_size);
+    }
+    if (rings != MAP_FAILED) {
+        munmap(rings, rings_size);
+    }
+}
+
+bool uring::init(unsigned count) {
+    struct io_uring_params params;
+    // Completions are only run when the loop waits for them, instead of
+    // interrupting it; the flag is from 6.1, single issuer from 6.0.
+    unsigned flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL |
+        IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    for (;;) {
+        memset(&params, 0, sizeof(params));
+        params.flags = flags;
+        params.cq_entries = count * 4;
+        fd = syscall(__NR_io_uring_setup, count, &params);
+        if (fd != -1 || errno != EINVAL ||
+            !(flags & IORING_SETUP_DEFER_TASKRUN)) {
+            break;
+        }
+        flags &= ~IORING_SETUP_DEFER_TASKRUN;
+    }
+    if (fd == -1) {
+        return false;
+    }
+    if ((params.features & REQUIRED_FEATURES) != REQUIRED_FEATURES ||
+        !supports_required_ops(fd)) {
+        return false;
+    }
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size =
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    rings_size = sq_size > cq_size ? sq_size : cq_size;
+    rings = mmap(
+        nullptr,
+        rings_size,
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE,
+        fd,
+        IORING_OFF_SQ_RING
+    );
+    if (rings == MAP_FAILED) {
+        fprintf(stderr, "Error: mmap() failed: %d\n", errno);
+        return false;
+    }
+    entries_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    void *mapped = mmap(
+        nullptr,
+        entries_size,
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE,
+        fd,
+        IORING_OFF_SQES
+    );
+    if (mapped == MAP_FAILED) {
+        fprintf(stderr, "Error: mmap() failed: %d\n", errno);
+        return false;
+    }
+    entries = (struct io_uring_sqe *) mapped;
+    char *base = (char *) rings;
+    sq_head = (unsigned *) (base + params.sq_off.head);
+    sq_tail = (unsigned *) (base + params.sq_off.tail);
+    sq_mask = *(unsigned *) (base + params.sq_off.ring_mask);
+    sq_entries = params.sq_entries;
+    tail = *sq_tail;
+    unsigned *array = (unsigned *) (base + params.sq_off.array);
+    for (unsigned i = 0; i != sq_entries; ++i) {
+        array[i] = i;
+    }
+    cq_head = (unsigned *) (base + params.cq_off.head);
+    cq_tail = (unsigned *) (base + params.cq_off.tail);
+    cq_mask = *(unsigned *) (base + params.cq_off.ring_mask);
+    completions = (struct io_uring_cqe *) (base + params.cq_off.cqes);
+    return true;
+}
+
+struct io_uring_sqe *uring::prepare() {
+    while (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == sq_entries) {
+        __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+        enter(sq_entries, 0, 0);
+    }
+    struct io_uring_sqe *entry = &entries[tail & sq_mask];
+    ++tail;
+    memset(entry, 0, sizeof(*entry));
+    return entry;
+}
+
+void uring::submit(int timeout) {
+    __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+    unsigned submitted = tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    enter(submitted, timeout != 0, timeout);
+}
+
+void uring::enter(unsigned submitted, unsigned wait, int timeout) {
+    struct __kernel_timespec limit;
+    struct io_uring_getevents_arg argument;
+    memset(&argument, 0, sizeof(argument));
+    if (timeout >= 0) {
+        limit.tv_sec = timeout / 1000;
+        limit.tv_nsec = timeout % 1000 * 1000000ll;
+        argument.ts = (uintptr_t) &limit;
+    }
+    int result = syscall(
+        __NR_io_uring_enter,
+        fd,
+        submitted,
+        wait,
+        IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+        &argument,
+        sizeof(argument)
+    );
+    if (result == -1 && errno != EINTR && errno != ETIME &&
+        errno != EAGAIN && errno != EBUSY) {
+        fprintf(stderr, "Error: io_uring_enter() failed: %d\n", errno);
+    }
+}
+
+const struct io_uring_cqe *uring::next() {
+    unsigned head = *cq_head;
+    if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+        return nullptr;
+    }
+    return &completions[head & cq_mask];
+}
+
+void uring::seen() {
+    __atomic_store_n(cq_head, *cq_head + 1, __ATOMIC_RELEASE);
+}
+
+// count has to be a power of two. The buffers go to group 0.
+bool uring::provide_buffers(unsigned count, size_t size) {
+    provided_size = count * sizeof(struct io_uring_buf);
+    void *ring = mmap(
+        nullptr,
+        provided_size,
+        PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS,
+        -1,
+        0
+    );
+    if (ring == MAP_FAILED) {
+        fprintf(stderr, "Error: mmap() failed: %d\n", errno);
+        return false;
+    }
+    provided = (struct io_uring_buf_ring *) ring;
+    void *space = mmap(
+        nullptr,
+        count * size,
+        PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS,
+        -1,
+        0
+    );
+    if (space == MAP_FAILED) {
+        fprintf(stderr, "Error: mmap() failed: %d\n", errno);
+        return false;
+    }
+    memory = (char *) space;
+    buffer_size = size;
+    buffer_count = count;
+    struct io_uring_buf_reg registration;
+    memset(&registration, 0, sizeof(registration));
+    registration.ring_addr = (uintptr_t) provided;
+    registration.ring_entries = count;
+    registration.bgid = 0;
+    if (register_resource(
+            fd,
+            IORING_REGISTER_PBUF_RING,
+            &registration,
+            1
+        ) == -1
+    ) {
+        fprintf(stderr, "Error: io_uring_register() failed: %d\n", errno);
+        return false;
+    }
+    for (unsigned id = 0; id != count; ++id) {
+        recycle(id);
+    }
+    return true;
+}
+
+const char *uring::buffer(unsigned id) const {
+    return memory + id * buffer_size;
+}
+
+// The entries are indexed from the start of the ring, where the tail takes
+// the place of a reserved field of the first; bufs[] of the header is not
+// there in C++, which gives its empty placeholder a size.
+void uring::recycle(unsigned id) {
+    uint16_t next = provided->tail;
+    struct io_uring_buf *ring = (struct io_uring_buf *) provided;
+    struct io_uring_buf &entry = ring[next & (buffer_count - 1)];
+    entry.addr = (uintptr_t) (memory + id * buffer_size);
+    entry.len = buffer_size;
+    entry.bid = id;
+    __atomic_store_n(&provided->tail, (uint16_t) (next + 1), __ATOMIC_RELEASE);
+}
+
+bool uring::register_files(unsigned count) {
+    struct io_uring_rsrc_register table;
+    memset(&table, 0, sizeof(table));
+    table.nr = count;
+    table.flags = IORING_RSRC_REGISTER_SPARSE;
+    if (register_resource(
+            fd,
+            IORING_REGISTER_FILES2,
+            &table,
+            sizeof(table)
+        ) == -1
+    ) {
+        fprintf(stderr, "Error: io_uring_register() failed: %d\n", errno);
+        return false;
+    }
+    file_count = count;
+    return true;
+}
+
+unsigned uring::files() const {
+    return file_count;
+}
+
+bool uring_supported() {
+    uring probe;
+    return probe.init(8);
+}
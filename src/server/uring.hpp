@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+extern "C" {
+#include <linux/io_uring.h>
+}
+
+// An io_uring instance set up with the raw system calls, the C library has
+// no wrappers for them. Besides the two queues it holds a ring of provided
+// buffers that receives pick from, and a table of registered descriptors.
+// It belongs to one thread: the kernel only runs completions when that
+// thread asks for them in submit().
+class uring {
+public:
+    uring();
+    ~uring();
+    uring(const uring &) = delete;
+    uring &operator=(const uring &) = delete;
+
+    // Fails if the kernel has no io_uring, has it disabled or lacks
+    // something the server needs (it takes 6.0 or newer).
+    bool init(unsigned count);
+    // A cleared submission entry, queued with the next submit().
+    struct io_uring_sqe *prepare();
+    // Submits what has been prepared and waits up to timeout ms (-1 for no
+    // limit, 0 not at all) for a completion.
+    void submit(int timeout);
+    // The oldest completion not yet seen, nullptr if there is none.
+    const struct io_uring_cqe *next();
+    void seen();
+
+    bool provide_buffers(unsigned count, size_t size);
+    const char *buffer(unsigned id) const;
+    // Gives the buffer back to the kernel once its data has been used.
+    void recycle(unsigned id);
+    // A table of count empty slots for descriptors.
+    bool register_files(unsigned count);
+    unsigned files() const;
+
+private:
+    void enter(unsigned submitted, unsigned wait, int timeout);
+
+    int fd;
+    void *rings;
+    size_t rings_size;
+    struct io_uring_sqe *entries;
+    size_t entries_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned tail;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *completions;
+    struct io_uring_buf_ring *provided;
+    size_t provided_size;
+    char *memory;
+    size_t buffer_size;
+    unsigned buffer_count;
+    unsigned file_count;
+};
+
+// Whether a ring with everything the server uses can be set up here.
+bool uring_supported();
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 
-std::string url_encode(const std::string &s);
-std::string url_decode(const std::string &s);
+std::string url_encode(std::string_view s);
+void append_url_encoded(std::string &out, std::string_view s);
+bool url_decode(std::string_view s, std::string &out);
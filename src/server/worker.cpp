@@ -0,0 +1,258 @@
+#include <cerrno>
+#include <cstdio>
+#include <thread>
+
+extern "C" {
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+}
+
+#include "common.hpp"
+#include "admission.hpp"
+#include "config_reader.hpp"
+#include "logger.hpp"
+#include "metrics.hpp"
+#include "worker.hpp"
+
+worker::listener::listener(int socket, worker &owner) :
+    socket(socket),
+    owner(owner) {
+}
+
+// The listening socket is level-triggered, so connections left over after
+// one batch are picked up on the next turn of the loop, after the events
+// of the connections already open.
+void worker::listener::handle(uint32_t) {
+    for (int i = 0; i != ACCEPT_BATCH; ++i) {
+        struct sockaddr_in client_address;
+        socklen_t client_address_length = sizeof(client_address);
+        int64_t started = monotonic_us();
+        int connection_socket = accept4(
+            socket,
+            (struct sockaddr *) &client_address,
+            &client_address_length,
+            SOCK_NONBLOCK | SOCK_CLOEXEC
+        );
+        if (connection_socket == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                fprintf(stderr, "Error: accept() failed: %d\n", errno);
+            }
+            return;
+        }
+        record_stage(STAGE::ACCEPT, monotonic_us() - started);
+        take(connection_socket, client_address);
+    }
+}
+
+// With io_uring a multishot accept hands the connections over one by one.
+void worker::listener::accepted(int connection_socket) {
+    if (connection_socket < 0) {
+        if (connection_socket != -ECONNABORTED &&
+            connection_socket != -EINTR) {
+            fprintf(stderr, "Error: accept() failed: %d\n", -connection_socket);
+        }
+        return;
+    }
+    struct sockaddr_in client_address;
+    socklen_t client_address_length = sizeof(client_address);
+    if (getpeername(
+            connection_socket,
+            (struct sockaddr *) &client_address,
+            &client_address_length
+        ) == -1
+    ) {
+        close(connection_socket);
+        return;
+    }
+    take(connection_socket, client_address);
+}
+
+void worker::listener::take(
+    int connection_socket,
+    const struct sockaddr_in &address
+) {
+    int status = admit(address.sin_addr);
+    if (status) {
+        refuse(connection_socket, status);
+        return;
+    }
+    owner.adopt(connection_socket, address);
+}
+
+worker::worker(int listen_socket) :
+    events(settings.engine == ENGINE::URING),
+    deadlines(monotonic_ms()),
+    files(new file_cache(
+        events,
+        listen_socket == -1 ? 0 : settings.cache_size,
+        settings.cache_file_size,
+        listen_socket == -1 ? 0 : settings.open_file_cache,
+        listen_socket == -1 ? 0 : settings.gzip_cache_size
+    )),
+    directories(new listing_cache(
+        listen_socket == -1 ? 0 : settings.listing_cache_size
+    )),
+    listen_socket(listen_socket) {
+    if (listen_socket != -1) {
+        acceptor.reset(new listener(listen_socket, *this));
+        if (events.completions()) {
+            events.accept(listen_socket, acceptor.get());
+        } else {
+            events.add(listen_socket, EPOLLIN, acceptor.get());
+        }
+    }
+}
+
+worker::~worker() {
+    if (listen_socket != -1) {
+        close(listen_socket);
+    }
+}
+
+event_loop &worker::loop() {
+    return events;
+}
+
+timer_wheel &worker::timers() {
+    return deadlines;
+}
+
+file_cache &worker::cache() {
+    return *files;
+}
+
+listing_cache &worker::listings() {
+    return *directories;
+}
+
+void worker::adopt(int socket, const struct sockaddr_in &address) {
+    connections[socket].reset(new connection(socket, address, *this));
+}
+
+void worker::retire(connection *c) {
+    retired.push_back(c->descriptor());
+}
+
+// A connection still waiting for the completions of its socket operations
+// is kept until they have come.
+void worker::collect() {
+    size_t kept = 0;
+    for (int socket : retired) {
+        auto found = connections.find(socket);
+        if (found->second->busy()) {
+            retired[kept++] = socket;
+        } else {
+            connections.erase(found);
+        }
+    }
+    retired.resize(kept);
+}
+
+void worker::run() {
+    for (;;) {
+        events.run_once(deadlines.timeout(monotonic_ms()));
+        deadlines.advance(monotonic_ms());
+        collect();
+        if (listen_socket == -1 && connections.empty()) {
+            return;
+        }
+    }
+}
+
+int create_listener(uint16_t port, bool reuse_port) {
+    int flags = SOCK_STREAM | SOCK_CLOEXEC;
+    if (reuse_port) {
+        flags |= SOCK_NONBLOCK;
+    }
+    int listen_socket = socket(AF_INET, flags, 0);
+    if (listen_socket == -1) {
+        fprintf(stderr, "Error: socket() failed: %d\n", errno);
+        return -1;
+    }
+    int value = 1;
+    setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &value, sizeof(value));
+    if (reuse_port) {
+        setsockopt(
+            listen_socket,
+            SOL_SOCKET,
+            SO_REUSEPORT,
+            &value,
+            sizeof(value)
+        );
+    }
+    struct sockaddr_in server_address;
+    server_address.sin_family = AF_INET;
+    server_address.sin_port = htons(port);
+    server_address.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(
+            listen_socket,
+            (struct sockaddr *) &server_address,
+            sizeof(server_address)
+        ) == -1
+    ) {
+        fprintf(stderr, "Error: bind() failed: %d\n", errno);
+        close(listen_socket);
+        return -1;
+    }
+    // Connections are only handed over once the request has arrived.
+    if (settings.defer_accept) {
+        setsockopt(
+            listen_socket,
+            IPPROTO_TCP,
+            TCP_DEFER_ACCEPT,
+            &settings.defer_accept,
+            sizeof(settings.defer_accept)
+        );
+    }
+    if (listen(listen_socket, settings.backlog) == -1) {
+        fprintf(stderr, "Error: listen() failed: %d\n", errno);
+        close(listen_socket);
+        return -1;
+    }
+    return listen_socket;
+}
+
+bool run_workers(unsigned count) {
+    if (count == 0) {
+        count = std::thread::hardware_concurrency();
+    }
+    if (count == 0) {
+        count = 1;
+    }
+    std::vector<int> sockets;
+    for (unsigned i = 0; i != count; ++i) {
+        int listen_socket = create_listener(settings.port, true);
+        if (listen_socket == -1) {
+            for (int socket : sockets) {
+                close(socket);
+            }
+            return false;
+        }
+        sockets.push_back(listen_socket);
+    }
+    start_access_log();
+    fprintf(stderr, "Server started on port %d\n\n", settings.port);
+    std::vector<std::thread> threads;
+    for (int listen_socket : sockets) {
+        threads.emplace_back([listen_socket] {
+            worker w(listen_socket);
+            w.run();
+        });
+    }
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+    return true;
+}
+
+void serve_connection(int socket, const struct sockaddr_in &address) {
+    worker w(-1);
+    w.adopt(socket, address);
+    w.run();
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+extern "C" {
+#include <netinet/in.h>
+}
+
+#include "event_loop.hpp"
+#include "timer_wheel.hpp"
+#include "connection.hpp"
+#include "file_cache.hpp"
+#include "listing.hpp"
+
+class worker {
+public:
+    explicit worker(int listen_socket);
+    ~worker();
+    worker(const worker &) = delete;
+    worker &operator=(const worker &) = delete;
+
+    event_loop &loop();
+    timer_wheel &timers();
+    file_cache &cache();
+    listing_cache &listings();
+    void adopt(int socket, const struct sockaddr_in &address);
+    void retire(connection *c);
+    void run();
+
+private:
+    class listener : public event_handler {
+    public:
+        listener(int socket, worker &owner);
+        void handle(uint32_t events) override;
+        void accepted(int connection_socket) override;
+
+    private:
+        void take(int connection_socket, const struct sockaddr_in &address);
+
+        int socket;
+        worker &owner;
+    };
+
+    void collect();
+
+    static constexpr int ACCEPT_BATCH = 64;
+
+    event_loop events;
+    timer_wheel deadlines;
+    std::unique_ptr<file_cache> files;
+    std::unique_ptr<listing_cache> directories;
+    int listen_socket;
+    std::unique_ptr<listener> acceptor;
+    std::unordered_map<int, std::unique_ptr<connection>> connections;
+    std::vector<int> retired;
+};
+
+int create_listener(uint16_t port, bool reuse_port);
+bool run_workers(unsigned count);
+void serve_connection(int socket, const struct sockaddr_in &address);